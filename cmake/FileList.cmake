@@ -1,7 +1,9 @@
 set(ALLEGRO_LEGACY_SRC_FILES
         src/allegro.c
+        src/async.c
         src/blit.c
         src/bmp.c
+        src/chacha20.c
         src/clip3d.c
         src/clip3df.c
         src/colblend.c
@@ -34,6 +36,7 @@ set(ALLEGRO_LEGACY_SRC_FILES
         src/keyboard.c
         src/lbm.c
         src/libc.c
+        src/lz4.c
         src/lzss.c
         src/math.c
         src/math3d.c
@@ -118,6 +121,7 @@ set(ALLEGRO_LEGACY_SRC_A5_FILES
         src/a5/a5_midi_driver.c
         src/a5/a5_system.c
         src/a5/a5_system_driver.c
+        src/a5/a5_thread.c
         )
 
 set(ALLEGRO_LEGACY_SRC_MIDIA5_FILES
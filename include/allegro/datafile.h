@@ -32,6 +32,8 @@ struct RGB;
 #define DAT_ID(a,b,c,d)    AL_ID(a,b,c,d)
 
 #define DAT_MAGIC          DAT_ID('A','L','L','.')
+#define DAT_MAGIC_LZ4      DAT_ID('A','L','L','4')   /* has LZ4 objects */
+#define DAT_MAGIC_SEEK     DAT_ID('A','L','L','S')   /* has an offset table */
 #define DAT_FILE           DAT_ID('F','I','L','E')
 #define DAT_DATA           DAT_ID('D','A','T','A')
 #define DAT_FONT           DAT_ID('F','O','N','T')
@@ -46,6 +48,7 @@ struct RGB;
 #define DAT_PALETTE        DAT_ID('P','A','L',' ')
 #define DAT_PROPERTY       DAT_ID('p','r','o','p')
 #define DAT_NAME           DAT_ID('N','A','M','E')
+#define DAT_NAME_INDEX     DAT_ID('N','I','D','X')   /* hashes of the names */
 #define DAT_END            -1
 
 
@@ -72,8 +75,18 @@ typedef struct DATAFILE_INDEX
 } DATAFILE_INDEX;
 
 
+typedef struct ASYNC_LOAD ASYNC_LOAD;
+
+#define ASYNC_QUEUED       0
+#define ASYNC_LOADING      1
+#define ASYNC_DONE         2
+#define ASYNC_FAILED       3
+#define ASYNC_CANCELLED    4
+
+
 AL_LEGACY_FUNC(DATAFILE *, load_datafile, (AL_CONST char *filename));
 AL_LEGACY_FUNC(DATAFILE *, load_datafile_callback, (AL_CONST char *filename, AL_LEGACY_METHOD(void, callback, (DATAFILE *))));
+AL_LEGACY_FUNC(DATAFILE *, load_datafile_parallel, (AL_CONST char *filename, int threads, AL_LEGACY_METHOD(void, callback, (DATAFILE *))));
 AL_LEGACY_FUNC(DATAFILE_INDEX *, create_datafile_index, (AL_CONST char *filename));
 AL_LEGACY_FUNC(void, unload_datafile, (DATAFILE *dat));
 AL_LEGACY_FUNC(void, destroy_datafile_index, (DATAFILE_INDEX *index));
@@ -82,7 +95,19 @@ AL_LEGACY_FUNC(DATAFILE *, load_datafile_object, (AL_CONST char *filename, AL_CO
 AL_LEGACY_FUNC(DATAFILE *, load_datafile_object_indexed, (AL_CONST DATAFILE_INDEX *index, int item));
 AL_LEGACY_FUNC(void, unload_datafile_object, (DATAFILE *dat));
 
+AL_LEGACY_FUNC(ASYNC_LOAD *, load_datafile_object_async, (AL_CONST char *filename, AL_CONST char *objectname, int priority, AL_LEGACY_METHOD(void, callback, (ASYNC_LOAD *request, void *arg)), void *arg));
+AL_LEGACY_FUNC(ASYNC_LOAD *, load_bitmap_async, (AL_CONST char *filename, int priority, AL_LEGACY_METHOD(void, callback, (ASYNC_LOAD *request, void *arg)), void *arg));
+AL_LEGACY_FUNC(ASYNC_LOAD *, load_sample_async, (AL_CONST char *filename, int priority, AL_LEGACY_METHOD(void, callback, (ASYNC_LOAD *request, void *arg)), void *arg));
+AL_LEGACY_FUNC(int, poll_async_loads, (void));
+AL_LEGACY_FUNC(int, get_async_load_state, (ASYNC_LOAD *request));
+AL_LEGACY_FUNC(void *, get_async_load_data, (ASYNC_LOAD *request, struct RGB *pal));
+AL_LEGACY_FUNC(void, set_async_load_priority, (ASYNC_LOAD *request, int priority));
+AL_LEGACY_FUNC(int, cancel_async_load, (ASYNC_LOAD *request));
+AL_LEGACY_FUNC(void, destroy_async_load, (ASYNC_LOAD *request));
+
 AL_LEGACY_FUNC(DATAFILE *, find_datafile_object, (AL_CONST DATAFILE *dat, AL_CONST char *objectname));
+AL_LEGACY_FUNC(int, create_datafile_name_index, (DATAFILE *dat));
+AL_LEGACY_FUNC(void, destroy_datafile_name_index, (DATAFILE *dat));
 AL_LEGACY_FUNC(AL_CONST char *, get_datafile_property, (AL_CONST DATAFILE *dat, int type));
 AL_LEGACY_FUNC(void, register_datafile_object, (int id_, AL_LEGACY_METHOD(void *, load, (struct PACKFILE *f, long size)), AL_LEGACY_METHOD(void, destroy, (void *data))));
 
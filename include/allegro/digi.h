@@ -144,6 +144,8 @@ AL_LEGACY_FUNC(SAMPLE *, load_wav, (AL_CONST char *filename));
 AL_LEGACY_FUNC(SAMPLE *, load_wav_pf, (struct PACKFILE *f));
 AL_LEGACY_FUNC(SAMPLE *, load_voc, (AL_CONST char *filename));
 AL_LEGACY_FUNC(SAMPLE *, load_voc_pf, (struct PACKFILE *f));
+AL_LEGACY_FUNC(void, set_lazy_sample_loading, (int enable, long budget));
+AL_LEGACY_FUNC(long, get_lazy_sample_memory, (void));
 AL_LEGACY_FUNC(int, save_sample, (AL_CONST char *filename, SAMPLE *spl));
 AL_LEGACY_FUNC(SAMPLE *, create_sample, (int bits, int stereo, int freq, int len));
 AL_LEGACY_FUNC(void, destroy_sample, (SAMPLE *spl));
@@ -191,6 +193,9 @@ AL_LEGACY_FUNC(void, voice_set_echo, (int voice, int strength, int delay));
 AL_LEGACY_FUNC(void, voice_set_tremolo, (int voice, int rate, int depth));
 AL_LEGACY_FUNC(void, voice_set_vibrato, (int voice, int rate, int depth));
 
+AL_LEGACY_FUNC(int, voice_get_bus, (int voice));
+AL_LEGACY_FUNC(void, voice_set_bus, (int voice, int bus));
+
 #define SOUND_INPUT_MIC    1
 #define SOUND_INPUT_LINE   2
 #define SOUND_INPUT_CD     3
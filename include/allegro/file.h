@@ -70,11 +70,18 @@ AL_LEGACY_FUNC(void, al_findclose, (struct al_ffblk *info));
 #define F_READ_PACKED   "rp"
 #define F_WRITE_PACKED  "wp"
 #define F_WRITE_NOPACK  "w!"
+#define F_WRITE_LZ4     "w4"
 
 #define F_BUF_SIZE      4096           /* 4K buffer for caching data */
 #define F_PACK_MAGIC    0x736C6821L    /* magic number for packed files */
 #define F_NOPACK_MAGIC  0x736C682EL    /* magic number for autodetect */
 #define F_EXE_MAGIC     0x736C682BL    /* magic number for appended data */
+#define F_LZ4_MAGIC     0x736C6834L    /* magic number for LZ4 packed files */
+
+#define F_PACK_LZ4      2              /* pack_fopen_chunk() using LZ4 */
+
+#define F_CRYPT_XOR       0            /* packfile_crypt() modes */
+#define F_CRYPT_CHACHA20  1
 
 #define PACKFILE_FLAG_WRITE      1     /* the file is being written */
 #define PACKFILE_FLAG_PACK       2     /* data is compressed */
@@ -83,6 +90,15 @@ AL_LEGACY_FUNC(void, al_findclose, (struct al_ffblk *info));
 #define PACKFILE_FLAG_ERROR      16    /* an error has occurred */
 #define PACKFILE_FLAG_OLD_CRYPT  32    /* backward compatibility mode */
 #define PACKFILE_FLAG_EXEDAT     64    /* reading from our executable */
+#define PACKFILE_FLAG_LZ4        128   /* packed with LZ4 rather than LZSS */
+#define PACKFILE_FLAG_CHACHA20   256   /* encrypted with ChaCha20 */
+#define PACKFILE_FLAG_DAT_FILE   512   /* chunk holds a nested datafile */
+#define PACKFILE_FLAG_LZ4_CHUNKS 1024  /* file may hold LZ4 chunks */
+
+#define PACKFILE_TRACE_OPEN         0  /* set_packfile_trace_callback() events */
+#define PACKFILE_TRACE_CLOSE        1
+#define PACKFILE_TRACE_OPEN_CHUNK   2
+#define PACKFILE_TRACE_CLOSE_CHUNK  3
 
 
 typedef struct PACKFILE_VTABLE PACKFILE_VTABLE;
@@ -90,6 +106,20 @@ typedef struct PACKFILE PACKFILE;
 
 struct LZSS_PACK_DATA;
 struct LZSS_UNPACK_DATA;
+struct LZ4_PACK_DATA;
+struct LZ4_UNPACK_DATA;
+struct CHACHA20_DATA;
+
+
+typedef struct PACKFILE_STATS             /* see pack_get_stats() */
+{
+   uint64_t bytes_read;                /* read from the disk or a mapping */
+   uint64_t refills;                   /* times a buffer was refilled */
+   uint64_t seeks;                     /* seeks that moved the file position */
+   uint64_t unpacked;                  /* bytes decompressed */
+   double unpack_time;                 /* seconds spent decompressing */
+   double syscall_time;                /* seconds spent in system calls */
+} PACKFILE_STATS;
 
 
 struct _al_normal_packfile_details
@@ -98,14 +128,23 @@ struct _al_normal_packfile_details
    int flags;                          /* PACKFILE_FLAG_* constants */
    unsigned char *buf_pos;             /* position in buffer */
    int buf_size;                       /* number of bytes in the buffer */
+   int buf_max;                        /* how many bytes the buffer holds */
    long todo;                          /* number of bytes still on the disk */
    struct PACKFILE *parent;            /* nested, parent file */
    struct LZSS_PACK_DATA *pack_data;   /* for LZSS compression */
    struct LZSS_UNPACK_DATA *unpack_data; /* for LZSS decompression */
+   struct LZ4_PACK_DATA *lz4_pack_data; /* for LZ4 compression */
+   struct LZ4_UNPACK_DATA *lz4_unpack_data; /* for LZ4 decompression */
    char *filename;                     /* name of the file */
    char *passdata;                     /* encryption key data */
    char *passpos;                      /* current key position */
-   unsigned char buf[F_BUF_SIZE];      /* the actual data buffer */
+   struct CHACHA20_DATA *cipher;       /* for ChaCha20 encryption */
+   unsigned char *map;                 /* memory mapped file contents */
+   long map_size;                      /* size of the mapping */
+   char *trace_name;                   /* name given to the trace callback */
+   PACKFILE_STATS stats;               /* I/O counters for this layer */
+   unsigned char *buf;                 /* the actual data buffer */
+   unsigned char small_buf[F_BUF_SIZE]; /* ...unless a bigger one is set */
 };
 
 
@@ -144,6 +183,10 @@ AL_LEGACY_FUNC(void, set_filename_encoding, (int encoding));
 AL_LEGACY_FUNC(int, get_filename_encoding, (void));
 
 AL_LEGACY_FUNC(void, packfile_password, (AL_CONST char *password));
+AL_LEGACY_FUNC(void, packfile_crypt, (int mode));
+AL_LEGACY_FUNC(void, set_packfile_trace_callback, (AL_LEGACY_METHOD(void, callback, (int event, PACKFILE *f, AL_CONST char *name))));
+AL_LEGACY_FUNC(void, get_packfile_stats, (PACKFILE_STATS *stats));
+AL_LEGACY_FUNC(void, reset_packfile_stats, (void));
 AL_LEGACY_FUNC(PACKFILE *, pack_fopen, (AL_CONST char *filename, AL_CONST char *mode));
 AL_LEGACY_FUNC(PACKFILE *, pack_fopen_vtable, (AL_CONST PACKFILE_VTABLE *vtable, void *userdata));
 AL_LEGACY_FUNC(int, pack_fclose, (PACKFILE *f));
@@ -163,11 +206,14 @@ AL_LEGACY_FUNC(long, pack_mgetl, (PACKFILE *f));
 AL_LEGACY_FUNC(int, pack_mputw, (int w, PACKFILE *f));
 AL_LEGACY_FUNC(long, pack_mputl, (long l, PACKFILE *f));
 AL_LEGACY_FUNC(long, pack_fread, (void *p, long n, PACKFILE *f));
+AL_LEGACY_FUNC(AL_CONST void *, pack_fread_mapped, (PACKFILE *f, long n));
 AL_LEGACY_FUNC(long, pack_fwrite, (AL_CONST void *p, long n, PACKFILE *f));
 AL_LEGACY_FUNC(int, pack_ungetc, (int c, PACKFILE *f));
 AL_LEGACY_FUNC(char *, pack_fgets, (char *p, int max, PACKFILE *f));
 AL_LEGACY_FUNC(int, pack_fputs, (AL_CONST char *p, PACKFILE *f));
 AL_LEGACY_FUNC(void *, pack_get_userdata, (PACKFILE *f));
+AL_LEGACY_FUNC(int, pack_set_buffer_size, (PACKFILE *f, int size));
+AL_LEGACY_FUNC(void, pack_get_stats, (PACKFILE *f, PACKFILE_STATS *stats));
 
 
 
@@ -125,14 +125,56 @@ AL_LEGACY_FUNC(void, _al_detect_filename_encoding, (void));
 AL_LEGACY_FUNC(long, _al_file_size, (AL_CONST char *filename));
 
 
+/* threads for spreading work over processors, independent of the system driver */
+AL_LEGACY_FUNC(void *, _al_create_thread, (AL_LEGACY_METHOD(void, proc, (void *arg)), void *arg));
+AL_LEGACY_FUNC(void, _al_join_thread, (void *handle));
+AL_LEGACY_FUNC(void *, _al_create_mutex, (void));
+AL_LEGACY_FUNC(void, _al_destroy_mutex, (void *handle));
+AL_LEGACY_FUNC(void, _al_lock_mutex, (void *handle));
+AL_LEGACY_FUNC(void, _al_unlock_mutex, (void *handle));
+AL_LEGACY_FUNC(void *, _al_create_cond, (void));
+AL_LEGACY_FUNC(void, _al_destroy_cond, (void *handle));
+AL_LEGACY_FUNC(void, _al_wait_cond, (void *handle, void *mutex));
+AL_LEGACY_FUNC(void, _al_broadcast_cond, (void *handle));
+AL_LEGACY_FUNC(int, _al_get_cpu_count, (void));
+
+
 /* packfile stuff */
 AL_LEGACY_VAR(int, _packfile_filesize);
 AL_LEGACY_VAR(int, _packfile_datasize);
 AL_LEGACY_VAR(int, _packfile_type);
 AL_LEGACY_FUNC(PACKFILE *, _pack_fdopen, (int fd, AL_CONST char *mode));
+AL_LEGACY_FUNC(PACKFILE *, _pack_fopen_memory_chunk, (AL_CONST void *data, int filesize, int datasize, int lz4));
+AL_LEGACY_FUNC(PACKFILE *, _pack_fopen_named_chunk, (PACKFILE *f, AL_CONST char *name));
+AL_LEGACY_FUNC(void, _init_packfile_stats, (void));
 
 AL_LEGACY_FUNC(int, _al_lzss_incomplete_state, (AL_CONST LZSS_UNPACK_DATA *dat));
 
+typedef struct LZ4_PACK_DATA LZ4_PACK_DATA;
+typedef struct LZ4_UNPACK_DATA LZ4_UNPACK_DATA;
+
+AL_LEGACY_FUNC(LZ4_PACK_DATA *, _al_create_lz4_pack_data, (void));
+AL_LEGACY_FUNC(void, _al_free_lz4_pack_data, (LZ4_PACK_DATA *dat));
+AL_LEGACY_FUNC(int, _al_lz4_write, (PACKFILE *file, LZ4_PACK_DATA *dat, int size, AL_CONST unsigned char *buf));
+
+AL_LEGACY_FUNC(LZ4_UNPACK_DATA *, _al_create_lz4_unpack_data, (void));
+AL_LEGACY_FUNC(void, _al_free_lz4_unpack_data, (LZ4_UNPACK_DATA *dat));
+AL_LEGACY_FUNC(int, _al_lz4_read, (PACKFILE *file, LZ4_UNPACK_DATA *dat, int s, unsigned char *buf));
+AL_LEGACY_FUNC(int, _al_lz4_incomplete_state, (AL_CONST LZ4_UNPACK_DATA *dat));
+
+AL_LEGACY_FUNC(void, _al_xor_bytes, (unsigned char *buf, AL_CONST unsigned char *key, long size));
+
+typedef struct CHACHA20_DATA CHACHA20_DATA;
+
+#define CHACHA20_NONCE_SIZE   12
+
+AL_LEGACY_FUNC(CHACHA20_DATA *, _al_create_chacha20_data, (AL_CONST char *password));
+AL_LEGACY_FUNC(void, _al_free_chacha20_data, (CHACHA20_DATA *dat));
+AL_LEGACY_FUNC(void, _al_rewind_chacha20, (CHACHA20_DATA *dat));
+AL_LEGACY_FUNC(void, _al_make_chacha20_nonce, (CHACHA20_DATA *dat, unsigned char *nonce));
+AL_LEGACY_FUNC(void, _al_set_chacha20_nonce, (CHACHA20_DATA *dat, AL_CONST unsigned char *nonce, long pos));
+AL_LEGACY_FUNC(void, _al_chacha20_crypt, (CHACHA20_DATA *dat, unsigned char *buf, long size));
+
 
 /* config stuff */
 void _reload_config(void);
@@ -1086,8 +1128,64 @@ AL_LEGACY_VAR(int, _sound_input_installed);
 AL_LEGACY_FUNC(int, _midi_allocate_voice, (int min, int max));
 
 AL_LEGACY_VAR(volatile long, _midi_tick);
+AL_LEGACY_FUNCPTR(void, _midi_flush_output, (void));
+
+
+AL_LEGACY_VAR(int, _midi_keep_tracks);
+
+AL_LEGACY_FUNC(int, _midi_read_tracks, (MIDI *midi, PACKFILE *f, int num_tracks, int smf));
+
+
+/* a decoded MIDI message */
+typedef struct MIDI_EVENT
+{
+   AL_CONST unsigned char *data;       /* sysex or meta-event payload */
+   int length;                         /* length of the payload */
+   unsigned char status;               /* status byte, 0xFF for meta-events */
+   unsigned char byte1;                /* first data byte, or meta-event type */
+   unsigned char byte2;                /* second data byte */
+} MIDI_EVENT;
+
+
+/* channel state snapshots taken every MIDI_CHECKPOINT_EVENTS events, so
+ * that seeking only has to replay a short run of the file
+ */
+#define MIDI_CHECKPOINT_EVENTS   512
+
+typedef struct MIDI_CHECKPOINT
+{
+   unsigned long tick;                 /* time of the last event replayed */
+   long timers;                        /* the same, in timer ticks */
+   long offset;                        /* where the next event starts */
+   int speed;                          /* timer ticks per MIDI tick */
+   unsigned char patch[16];
+   unsigned char volume[16];
+   unsigned char pan[16];
+   unsigned short pitch_bend[16];
+} MIDI_CHECKPOINT;
+
+
+/* a MIDI file flattened into a single, time sorted stream of events. Each
+ * one is stored as the number of MIDI ticks since the one before, in the
+ * variable length format of MIDI files, followed by the message itself
+ * with its status byte always present.
+ */
+typedef struct MIDI_TIMELINE
+{
+   long num_events;
+   long num_checkpoints;
+   unsigned long last_tick;            /* time of the last event, in MIDI ticks */
+   long length;                        /* the same, in timer ticks */
+   long size;                          /* size of this block, in bytes */
+   long data_size;                     /* size of the event stream */
+   unsigned char *data;
+   MIDI_CHECKPOINT *checkpoint;
+} MIDI_TIMELINE;
+
 
 AL_LEGACY_FUNC(int, _digmid_find_patches, (char *dir, int dir_size, char *file, int size_of_file));
+AL_LEGACY_FUNC(int, _digmid_precache_patches, (AL_CONST char *patches, AL_CONST char *drums));
+AL_LEGACY_FUNC(void, _digmid_trim_patches, (void));
 
 #define VIRTUAL_VOICES  256
 
@@ -1119,6 +1217,9 @@ typedef struct          /* a physical (as used by hardware) soundcard voice */
 
 AL_LEGACY_ARRAY(PHYS_VOICE, _phys_voice);
 
+AL_LEGACY_FUNC(void, _init_lazy_samples, (void));
+AL_LEGACY_FUNC(void, _init_sample_streams, (void));
+
 
 #define MIXER_DEF_SFX               8
 #define MIXER_MAX_SFX               64
@@ -1148,6 +1249,13 @@ AL_LEGACY_FUNC(void, _mixer_stop_pan_sweep, (int voice));
 AL_LEGACY_FUNC(void, _mixer_set_echo, (int voice, int strength, int delay));
 AL_LEGACY_FUNC(void, _mixer_set_tremolo, (int voice, int rate, int depth));
 AL_LEGACY_FUNC(void, _mixer_set_vibrato, (int voice, int rate, int depth));
+AL_LEGACY_FUNC(void, _mixer_set_bus, (int voice, int bus));
+AL_LEGACY_FUNC(int,  _mixer_get_bus, (int voice));
+AL_LEGACY_FUNC(void, _mixer_set_sequencer, (int (*proc)(int samples)));
+AL_LEGACY_FUNC(void, _mixer_lock, (void));
+AL_LEGACY_FUNC(void, _mixer_unlock, (void));
+AL_LEGACY_FUNC(void, _mixer_hold, (int hold));
+AL_LEGACY_FUNC(void, _mixer_render, (void *buf, int issigned, int first, int num));
 
 AL_LEGACY_FUNC(void, _dummy_noop1, (int p));
 AL_LEGACY_FUNC(void, _dummy_noop2, (int p1, int p2));
@@ -1185,6 +1293,11 @@ AL_LEGACY_FUNC(void, _dummy_key_on, (int inst, int note, int bend, int vol, int
 
 /* datafile object loading functions */
 AL_LEGACY_FUNC(void, _unload_datafile_object, (DATAFILE *dat));
+AL_LEGACY_FUNC(unsigned long, _datafile_name_hash, (AL_CONST char *name));
+AL_LEGACY_FUNC(DATAFILE_INDEX *, _create_datafile_index, (AL_CONST char *filename, int *objects));
+AL_LEGACY_FUNC(void, _init_name_indexes, (void));
+AL_LEGACY_FUNC(int, _skip_datafile_offsets, (PACKFILE *f));
+AL_LEGACY_FUNC(void, _allow_lz4_chunks, (PACKFILE *f, int magic));
 
 
 /* information about a datafile object */
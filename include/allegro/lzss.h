@@ -32,6 +32,7 @@ typedef struct LZSS_UNPACK_DATA LZSS_UNPACK_DATA;
 AL_LEGACY_FUNC(LZSS_PACK_DATA *, create_lzss_pack_data, (void));
 AL_LEGACY_FUNC(void, free_lzss_pack_data, (LZSS_PACK_DATA *dat));
 AL_LEGACY_FUNC(int, lzss_write, (PACKFILE *file, LZSS_PACK_DATA *dat, int size, unsigned char *buf, int last));
+AL_LEGACY_FUNC(void, set_lzss_pack_threads, (int threads));
 
 AL_LEGACY_FUNC(LZSS_UNPACK_DATA *, create_lzss_unpack_data, (void));
 AL_LEGACY_FUNC(void, free_lzss_unpack_data, (LZSS_UNPACK_DATA *dat));
@@ -24,6 +24,9 @@
 #ifdef __cplusplus
    extern "C" {
 #endif
+
+struct PACKFILE;
+struct SAMPLE;
                                        /* Theoretical maximums: */
 #define MIDI_VOICES           64       /* actual drivers may not be */
 #define MIDI_TRACKS           32       /* able to handle this many */
@@ -37,10 +40,53 @@ typedef struct MIDI                    /* a midi file */
       unsigned char *data;             /* MIDI message stream */
       int len;                         /* length of the track data */
    } track[MIDI_TRACKS];
+   struct MIDI_TIMELINE *timeline;     /* merged event list, built on load */
 } MIDI;
 
 
 
+typedef struct MIDI_VOICE_STATS        /* voice allocation statistics */
+{
+   long notes;                         /* notes that were given a voice */
+   long steals;                        /* notes cut off to free a voice */
+   long cap_steals;                    /* ...because of a polyphony limit */
+   long dropped;                       /* notes that didn't get a voice */
+   long channel_steals[16];            /* steals, by channel of the victim */
+   int active;                         /* voices playing notes right now */
+   int peak;                           /* most voices playing at once */
+} MIDI_VOICE_STATS;
+
+
+
+#define MIDI_JITTER_BINS   12          /* up to 128ms, then the rest */
+
+typedef struct MIDI_TAP_EVENT          /* one event seen by the MIDI tap */
+{
+   double scheduled;                   /* when it should have gone out */
+   double dispatched;                  /* when it did go out */
+   int driver;                         /* ID of the MIDI driver */
+   unsigned char status;               /* the MIDI message */
+   unsigned char byte1;
+   unsigned char byte2;
+} MIDI_TAP_EVENT;
+
+
+
+typedef struct MIDI_JITTER_STATS       /* dispatch timing statistics */
+{
+   int driver;                         /* ID of the MIDI driver */
+   long count;                         /* events dispatched */
+   double mean;                        /* average lateness, in seconds */
+   double max;                         /* worst error either way */
+   long histogram[MIDI_JITTER_BINS];   /* error < 2^n/8 ms, by bin n */
+} MIDI_JITTER_STATS;
+
+
+
+typedef struct MIDI_PLAYER MIDI_PLAYER;   /* plays a midi file, opaque */
+
+
+
 #define MIDI_AUTODETECT       -1
 #define MIDI_NONE             0
 #define MIDI_DIGMID           AL_ID('D','I','G','I')
@@ -123,9 +169,36 @@ AL_LEGACY_FUNC(void, stop_midi, (void));
 AL_LEGACY_FUNC(void, midi_pause, (void));
 AL_LEGACY_FUNC(void, midi_resume, (void));
 AL_LEGACY_FUNC(int, midi_seek, (int target));
+AL_LEGACY_FUNC(int, set_midi_sample_accurate, (int enable));
+AL_LEGACY_FUNC(int, get_midi_sample_accurate, (void));
+AL_LEGACY_FUNC(int, set_midi_channel_polyphony, (int channel, int voices));
+AL_LEGACY_FUNC(int, set_midi_channel_priority, (int channel, int priority));
+AL_LEGACY_FUNC(void, get_midi_voice_stats, (MIDI_VOICE_STATS *stats));
+AL_LEGACY_FUNC(void, reset_midi_voice_stats, (void));
+AL_LEGACY_FUNC(int, install_midi_tap, (int size));
+AL_LEGACY_FUNC(void, remove_midi_tap, (void));
+AL_LEGACY_FUNC(int, read_midi_tap, (MIDI_TAP_EVENT *events, int max));
+AL_LEGACY_FUNC(int, get_midi_jitter_stats, (int driver, MIDI_JITTER_STATS *stats));
+AL_LEGACY_FUNC(void, reset_midi_jitter_stats, (void));
+AL_LEGACY_FUNC(MIDI_PLAYER *, create_midi_player, (void));
+AL_LEGACY_FUNC(void, destroy_midi_player, (MIDI_PLAYER *player));
+AL_LEGACY_FUNC(int, midi_player_play, (MIDI_PLAYER *player, MIDI *midi, int loop));
+AL_LEGACY_FUNC(void, midi_player_stop, (MIDI_PLAYER *player));
+AL_LEGACY_FUNC(void, midi_player_pause, (MIDI_PLAYER *player));
+AL_LEGACY_FUNC(void, midi_player_resume, (MIDI_PLAYER *player));
+AL_LEGACY_FUNC(int, midi_player_seek, (MIDI_PLAYER *player, int target));
+AL_LEGACY_FUNC(void, midi_player_set_loop, (MIDI_PLAYER *player, int loop_start, int loop_end));
+AL_LEGACY_FUNC(int, midi_player_set_volume, (MIDI_PLAYER *player, int volume));
+AL_LEGACY_FUNC(int, midi_player_set_tempo, (MIDI_PLAYER *player, int percent));
+AL_LEGACY_FUNC(int, midi_player_map_channel, (MIDI_PLAYER *player, int channel, int output));
+AL_LEGACY_FUNC(long, midi_player_get_pos, (MIDI_PLAYER *player));
+AL_LEGACY_FUNC(long, midi_player_get_time, (MIDI_PLAYER *player));
+AL_LEGACY_FUNC(struct SAMPLE *, render_midi, (MIDI *midi, int tail));
+AL_LEGACY_FUNC(int, render_midi_wav_pf, (MIDI *midi, int tail, struct PACKFILE *f));
 AL_LEGACY_FUNC(int, get_midi_length, (MIDI *midi));
 AL_LEGACY_FUNC(void, midi_out, (unsigned char *data, int length));
 AL_LEGACY_FUNC(int, load_midi_patches, (void));
+AL_LEGACY_FUNC(int, precache_midi_patches, (MIDI *midi));
 
 AL_LEGACY_FUNCPTR(void, midi_msg_callback, (int msg, int byte1, int byte2));
 AL_LEGACY_FUNCPTR(void, midi_meta_callback, (int type, AL_CONST unsigned char *data, int length));
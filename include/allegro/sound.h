@@ -51,6 +51,17 @@ AL_LEGACY_FUNC(int, get_mixer_channels, (void));
 AL_LEGACY_FUNC(int, get_mixer_voices, (void));
 AL_LEGACY_FUNC(int, get_mixer_buffer_length, (void));
 
+#define MIXER_MAX_BUSES    8
+
+AL_LEGACY_FUNC(int, create_mixer_bus, (AL_CONST char *name));
+AL_LEGACY_FUNC(void, destroy_mixer_bus, (int bus));
+AL_LEGACY_FUNC(int, find_mixer_bus, (AL_CONST char *name));
+AL_LEGACY_FUNC(void, set_mixer_bus_volume, (int bus, int volume));
+AL_LEGACY_FUNC(void, ramp_mixer_bus_volume, (int bus, int tyme, int endvol));
+AL_LEGACY_FUNC(int, get_mixer_bus_volume, (int bus));
+AL_LEGACY_FUNC(void, set_mixer_bus_lowpass, (int bus, int cutoff));
+AL_LEGACY_FUNC(void, set_mixer_bus_reverb, (int bus, int wet, int room));
+
 #ifdef __cplusplus
    }
 #endif
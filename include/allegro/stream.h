@@ -26,6 +26,7 @@
 #endif
 
 struct SAMPLE;
+struct PACKFILE;
 
 typedef struct AUDIOSTREAM
 {
@@ -43,6 +44,53 @@ AL_LEGACY_FUNC(void, stop_audio_stream, (AUDIOSTREAM *stream));
 AL_LEGACY_FUNC(void *, get_audio_stream_buffer, (AUDIOSTREAM *stream));
 AL_LEGACY_FUNC(void, free_audio_stream_buffer, (AUDIOSTREAM *stream));
 
+
+typedef struct SAMPLE_STREAM_VTABLE
+{
+   AL_LEGACY_METHOD(void *, open, (struct PACKFILE *f, int *bits, int *stereo, int *freq));
+   AL_LEGACY_METHOD(long, read, (void *data, void *buf, long len));
+   AL_LEGACY_METHOD(int, seek, (void *data, long pos));
+   AL_LEGACY_METHOD(void, close, (void *data));
+} SAMPLE_STREAM_VTABLE;
+
+typedef struct SAMPLE_STREAM
+{
+   AUDIOSTREAM *stream;                /* the stream we are feeding */
+   AL_CONST SAMPLE_STREAM_VTABLE *vtable; /* the decoder */
+   void *data;                         /* decoder state */
+   struct PACKFILE *f;                 /* the file being decoded */
+   char *filename;                     /* for reopening, or NULL */
+   int bits;                           /* decoded sample format */
+   int stereo;
+   int freq;
+   int len;                            /* buffer length in frames */
+   int loop;                           /* restart at end of file? */
+   long pos;                           /* frames handed to the stream */
+   long decode_pos;                    /* next frame from the decoder */
+   long seek_to;                       /* pending seek, or -1 */
+   int eof;                            /* decoder has run dry */
+   int done;                           /* everything has been played */
+   int silent;                         /* silent buffers queued after eof */
+   unsigned char *ahead;               /* read-ahead ring */
+   long *ahead_pos;                    /* end frame of each ring slot */
+   int ahead_count;                    /* number of ring slots */
+   int ahead_head;                     /* oldest decoded slot */
+   int ahead_fill;                     /* number of decoded slots */
+   void *mutex;                        /* guards against the decode timer */
+   int busy;                           /* decode timer callbacks running */
+   struct SAMPLE_STREAM *next;         /* list of playing streams */
+} SAMPLE_STREAM;
+
+AL_LEGACY_FUNC(void, register_sample_stream_type, (AL_CONST char *ext, AL_CONST SAMPLE_STREAM_VTABLE *vtable));
+AL_LEGACY_FUNC(SAMPLE_STREAM *, play_sample_stream, (AL_CONST char *filename, int len, int vol, int pan, int loop));
+AL_LEGACY_FUNC(SAMPLE_STREAM *, play_sample_stream_pf, (struct PACKFILE *f, AL_CONST SAMPLE_STREAM_VTABLE *vtable, int len, int vol, int pan, int loop));
+AL_LEGACY_FUNC(void, stop_sample_stream, (SAMPLE_STREAM *s));
+AL_LEGACY_FUNC(void, seek_sample_stream, (SAMPLE_STREAM *s, long pos));
+AL_LEGACY_FUNC(long, sample_stream_position, (SAMPLE_STREAM *s));
+AL_LEGACY_FUNC(int, sample_stream_done, (SAMPLE_STREAM *s));
+
+AL_LEGACY_VAR(AL_CONST SAMPLE_STREAM_VTABLE, sample_stream_wav);
+
 #ifdef __cplusplus
    }
 #endif
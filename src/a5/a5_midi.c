@@ -24,6 +24,12 @@
 static MIDIA5_OUTPUT_HANDLE * a5_midi_output_handle = NULL;
 static int a5_midi_output_volume;
 
+/* raw MIDI bytes are collected into whole messages, which are queued and
+   then sent in one batch at the end of each MIDI player tick */
+static unsigned char a5_midi_message[3];
+static int a5_midi_message_size = 0;
+static int a5_midi_message_pos = 0;
+
 static int a5_midi_detect(int input)
 {
     if(input)
@@ -62,6 +68,14 @@ static int get_midi_device(void)
 	return 0;
 }
 
+static void a5_midi_flush(void)
+{
+    if(a5_midi_output_handle)
+    {
+        midia5_flush_output(a5_midi_output_handle);
+    }
+}
+
 static int a5_midi_init(int input, int voices)
 {
     int midi_device;
@@ -78,6 +92,12 @@ static int a5_midi_init(int input, int voices)
             a5_midi_output_handle = midia5_create_output_handle(midi_device);
             if(a5_midi_output_handle)
             {
+                char tmp1[64], tmp2[64];
+                int latency = get_config_int(uconvert_ascii("sound", tmp1), uconvert_ascii("midi_latency", tmp2), 0);
+
+                midia5_set_output_latency(a5_midi_output_handle, latency / 1000.0);
+                a5_midi_message_size = 0;
+                _midi_flush_output = a5_midi_flush;
                 return 0;
             }
         }
@@ -89,6 +109,7 @@ static void a5_midi_exit(int input)
 {
     if(!input)
     {
+        _midi_flush_output = NULL;
         if(a5_midi_output_handle)
         {
             midia5_destroy_output_handle(a5_midi_output_handle);
@@ -110,7 +131,28 @@ static int a5_midi_get_mixer_volume(void)
 
 static void a5_raw_midi(int data)
 {
-    midia5_send_data(a5_midi_output_handle, data);
+    /* message lengths by status nibble, system messages aren't passed on */
+    static const int message_size[8] = { 3, 3, 3, 3, 2, 2, 3, 0 };
+
+    if(data & 0x80)
+    {
+        a5_midi_message[0] = data;
+        a5_midi_message_size = message_size[(data >> 4) & 0x07];
+        a5_midi_message_pos = 1;
+        return;
+    }
+    if(a5_midi_message_size == 0)
+    {
+        return;
+    }
+    a5_midi_message[a5_midi_message_pos++] = data;
+    if(a5_midi_message_pos == a5_midi_message_size)
+    {
+        midia5_queue_message(a5_midi_output_handle, a5_midi_message, a5_midi_message_size, al_get_time());
+
+        /* keep the status byte around for running status */
+        a5_midi_message_pos = 1;
+    }
 }
 
 MIDI_DRIVER midi_allegro_5 =
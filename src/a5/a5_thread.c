@@ -0,0 +1,129 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      Threads, mutexes and condition variables for the portable code.
+ *
+ *      These don't depend on the system driver, so they also work under
+ *      SYSTEM_NONE, eg. in the datafile tools.
+ *
+ *      See readme.txt for copyright information.
+ */
+
+#include "allegro.h"
+#include "allegro/internal/aintern.h"
+#include "allegro/platform/ala5.h"
+
+typedef struct
+{
+
+    ALLEGRO_THREAD * thread;
+    void (*proc)(void * arg);
+    void * arg;
+
+} _A5_THREAD_DATA;
+
+static void * a5_thread_proc(ALLEGRO_THREAD * thread, void * data)
+{
+    _A5_THREAD_DATA * thread_data = data;
+
+    thread_data->proc(thread_data->arg);
+    return NULL;
+}
+
+/* _al_create_thread:
+ *  Starts a thread running proc(arg). Returns a handle for
+ *  _al_join_thread(), or NULL on failure.
+ */
+void * _al_create_thread(void (*proc)(void * arg), void * arg)
+{
+    _A5_THREAD_DATA * thread_data;
+
+    thread_data = malloc(sizeof(_A5_THREAD_DATA));
+    if(!thread_data)
+    {
+        return NULL;
+    }
+    thread_data->proc = proc;
+    thread_data->arg = arg;
+    thread_data->thread = al_create_thread(a5_thread_proc, thread_data);
+    if(!thread_data->thread)
+    {
+        free(thread_data);
+        return NULL;
+    }
+    al_start_thread(thread_data->thread);
+
+    return thread_data;
+}
+
+/* _al_join_thread:
+ *  Waits for a thread to return from its proc, and frees it.
+ */
+void _al_join_thread(void * handle)
+{
+    _A5_THREAD_DATA * thread_data = handle;
+
+    al_join_thread(thread_data->thread, NULL);
+    al_destroy_thread(thread_data->thread);
+    free(thread_data);
+}
+
+/* The mutexes aren't recursive, unlike the system driver ones, so that
+ * they can be waited on with a condition variable.
+ */
+void * _al_create_mutex(void)
+{
+    return al_create_mutex();
+}
+
+void _al_destroy_mutex(void * handle)
+{
+    al_destroy_mutex(handle);
+}
+
+void _al_lock_mutex(void * handle)
+{
+    al_lock_mutex(handle);
+}
+
+void _al_unlock_mutex(void * handle)
+{
+    al_unlock_mutex(handle);
+}
+
+void * _al_create_cond(void)
+{
+    return al_create_cond();
+}
+
+void _al_destroy_cond(void * handle)
+{
+    al_destroy_cond(handle);
+}
+
+void _al_wait_cond(void * handle, void * mutex)
+{
+    al_wait_cond(handle, mutex);
+}
+
+void _al_broadcast_cond(void * handle)
+{
+    al_broadcast_cond(handle);
+}
+
+/* _al_get_cpu_count:
+ *  Returns the number of processors, or 1 if it can't be found out.
+ */
+int _al_get_cpu_count(void)
+{
+    int count = al_get_cpu_count();
+
+    return (count > 0) ? count : 1;
+}
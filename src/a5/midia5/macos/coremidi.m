@@ -121,6 +121,19 @@ void _midia5_platform_send_data(MIDIA5_OUTPUT_HANDLE * hp, int data)
     }
 }
 
+/* the software synth plays everything it is given at the start of its next
+   render, so the batch goes straight in */
+void _midia5_platform_send_messages(MIDIA5_OUTPUT_HANDLE * hp, const MIDIA5_MESSAGE * message, int count)
+{
+    MIDIA5_COREMIDI_DATA * cm_data = (MIDIA5_COREMIDI_DATA *)hp->platform_data;
+    int i;
+
+    for(i = 0; i < count; i++)
+    {
+        MusicDeviceMIDIEvent(cm_data->synth_unit, message[i].data[0], message[i].size > 1 ? message[i].data[1] : 0, message[i].size > 2 ? message[i].data[2] : 0, 0);
+    }
+}
+
 void _midia5_platform_reset_output_device(MIDIA5_OUTPUT_HANDLE * hp)
 {
     MIDIA5_COREMIDI_DATA * cm_data = (MIDIA5_COREMIDI_DATA *)hp->platform_data;
@@ -5,6 +5,7 @@ const char * _midia5_get_platform_output_device_name(int device);
 void * _midia5_init_output_platform_data(MIDIA5_OUTPUT_HANDLE * hp, int device);
 void _midia5_free_output_platform_data(MIDIA5_OUTPUT_HANDLE * hp);
 void _midia5_platform_send_data(MIDIA5_OUTPUT_HANDLE * hp, int data);
+void _midia5_platform_send_messages(MIDIA5_OUTPUT_HANDLE * hp, const MIDIA5_MESSAGE * message, int count);
 void _midia5_platform_reset_output_device(MIDIA5_OUTPUT_HANDLE * hp);
 bool _midia5_platform_set_output_gain(MIDIA5_OUTPUT_HANDLE * hp, float gain);
 
@@ -25,6 +26,9 @@ MIDIA5_OUTPUT_HANDLE * midia5_create_output_handle(int device)
 	hp = malloc(sizeof(MIDIA5_OUTPUT_HANDLE));
 	if(hp)
 	{
+		hp->queue_start = 0;
+		hp->queue_count = 0;
+		hp->latency = 0.0;
 		hp->platform_data = _midia5_init_output_platform_data(hp, device);
 		return hp;
 	}
@@ -33,17 +37,73 @@ MIDIA5_OUTPUT_HANDLE * midia5_create_output_handle(int device)
 
 void midia5_destroy_output_handle(MIDIA5_OUTPUT_HANDLE * hp)
 {
+	midia5_flush_output(hp);
 	_midia5_free_output_platform_data(hp);
 	free(hp);
 }
 
 void midia5_send_data(MIDIA5_OUTPUT_HANDLE * hp, int data)
 {
+	/* anything queued has to go out first to keep the order */
+	if(hp->queue_count > 0)
+	{
+		midia5_flush_output(hp);
+	}
 	_midia5_platform_send_data(hp, data);
 }
 
+/* add a complete message to the queue, to be handed to the platform along
+   with everything else queued the next time the output is flushed */
+void midia5_queue_message(MIDIA5_OUTPUT_HANDLE * hp, const unsigned char * data, int size, double time)
+{
+	MIDIA5_MESSAGE * message;
+	int i;
+
+	if(size < 1 || size > 3)
+	{
+		return;
+	}
+	if(hp->queue_count >= MIDIA5_QUEUE_SIZE)
+	{
+		midia5_flush_output(hp);
+	}
+	message = &hp->queue[(hp->queue_start + hp->queue_count) % MIDIA5_QUEUE_SIZE];
+	message->time = time + hp->latency;
+	message->size = size;
+	for(i = 0; i < size; i++)
+	{
+		message->data[i] = data[i];
+	}
+	hp->queue_count++;
+}
+
+void midia5_flush_output(MIDIA5_OUTPUT_HANDLE * hp)
+{
+	int count;
+
+	while(hp->queue_count > 0)
+	{
+		/* the queued messages wrap around at most once */
+		count = MIDIA5_QUEUE_SIZE - hp->queue_start;
+		if(count > hp->queue_count)
+		{
+			count = hp->queue_count;
+		}
+		_midia5_platform_send_messages(hp, &hp->queue[hp->queue_start], count);
+		hp->queue_start = (hp->queue_start + count) % MIDIA5_QUEUE_SIZE;
+		hp->queue_count -= count;
+	}
+	hp->queue_start = 0;
+}
+
+void midia5_set_output_latency(MIDIA5_OUTPUT_HANDLE * hp, double latency)
+{
+	hp->latency = latency > 0.0 ? latency : 0.0;
+}
+
 void midia5_reset_output_device(MIDIA5_OUTPUT_HANDLE * hp)
 {
+	midia5_flush_output(hp);
 	_midia5_platform_reset_output_device(hp);
 }
 
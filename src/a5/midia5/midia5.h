@@ -3,6 +3,20 @@
 
 #include <allegro5/allegro5.h>
 
+/* number of messages that can be queued between flushes */
+#define MIDIA5_QUEUE_SIZE 512
+
+/* a complete channel message, stamped with the al_get_time() it is meant
+   to be heard at */
+typedef struct
+{
+
+	double time;
+	int size;
+	unsigned char data[3];
+
+} MIDIA5_MESSAGE;
+
 typedef struct
 {
 
@@ -10,6 +24,14 @@ typedef struct
 	float gain;
 	void * platform_data;
 
+	/* messages waiting for the next flush */
+	MIDIA5_MESSAGE queue[MIDIA5_QUEUE_SIZE];
+	int queue_start;
+	int queue_count;
+
+	/* how far behind their time stamps queued messages are played */
+	double latency;
+
 } MIDIA5_OUTPUT_HANDLE;
 
 int midia5_get_output_device_count(void);
@@ -19,6 +41,9 @@ MIDIA5_OUTPUT_HANDLE * midia5_create_output_handle(int device);
 void midia5_destroy_output_handle(MIDIA5_OUTPUT_HANDLE * hp);
 
 void midia5_send_data(MIDIA5_OUTPUT_HANDLE * hp, int data);
+void midia5_queue_message(MIDIA5_OUTPUT_HANDLE * hp, const unsigned char * data, int size, double time);
+void midia5_flush_output(MIDIA5_OUTPUT_HANDLE * hp);
+void midia5_set_output_latency(MIDIA5_OUTPUT_HANDLE * hp, double latency);
 void midia5_reset_output_device(MIDIA5_OUTPUT_HANDLE * hp);
 bool midia5_set_output_gain(MIDIA5_OUTPUT_HANDLE * hp, float gain);
 
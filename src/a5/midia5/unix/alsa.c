@@ -12,6 +12,11 @@ typedef struct
 	snd_seq_addr_t addr;
 	int port;
 
+	/* queue that batched messages are scheduled on, and the al_get_time()
+	   at which it was started */
+	int queue;
+	double queue_start_time;
+
 	/* MIDI command data */
 	int command_step;
 	int command_type;
@@ -134,6 +139,13 @@ void * _midia5_init_output_platform_data(MIDIA5_OUTPUT_HANDLE * hp, int device)
 			printf("Failed to open MIDI device!\n");
 			return NULL;
 		}
+		cm_data->queue = snd_seq_alloc_queue(cm_data->sequencer);
+		if(cm_data->queue >= 0)
+		{
+			snd_seq_start_queue(cm_data->sequencer, cm_data->queue, NULL);
+			snd_seq_drain_output(cm_data->sequencer);
+		}
+		cm_data->queue_start_time = al_get_time();
 	}
 	return cm_data;
 }
@@ -142,6 +154,13 @@ void _midia5_free_output_platform_data(MIDIA5_OUTPUT_HANDLE * hp)
 {
 	MIDIA5_ALSA_DATA * cm_data = (MIDIA5_ALSA_DATA *)hp->platform_data;
 
+	if(cm_data->queue >= 0)
+	{
+		/* let whatever is still scheduled play out */
+		snd_seq_drain_output(cm_data->sequencer);
+		snd_seq_sync_output_queue(cm_data->sequencer);
+		snd_seq_free_queue(cm_data->sequencer, cm_data->queue);
+	}
 	snd_seq_disconnect_from(cm_data->sequencer, 0, cm_data->addr.client, cm_data->addr.port);
 	snd_seq_delete_simple_port(cm_data->sequencer, cm_data->port);
 	snd_seq_close(cm_data->sequencer);
@@ -153,10 +172,69 @@ static int get_alsa_pitch_bend_value(int d1, int d2)
 	return ((d1 & 127) | ((d2 & 127) << 7)) - 0x2000;
 }
 
+/* fill in an ALSA event for a complete channel message, returns false for
+   messages we don't pass on */
+static bool set_alsa_event(snd_seq_event_t * ev, int type, int channel, int d1, int d2)
+{
+	snd_seq_ev_clear(ev);
+	switch(type)
+	{
+		case 0x80:
+		{
+			snd_seq_ev_set_noteoff(ev, channel, d1, d2);
+			return true;
+		}
+		case 0x90:
+		{
+			snd_seq_ev_set_noteon(ev, channel, d1, d2);
+			return true;
+		}
+		case 0xA0:
+		{
+			snd_seq_ev_set_keypress(ev, channel, d1, d2);
+			return true;
+		}
+		case 0xB0:
+		{
+			snd_seq_ev_set_controller(ev, channel, d1, d2);
+			return true;
+		}
+		case 0xC0:
+		{
+			snd_seq_ev_set_pgmchange(ev, channel, d1);
+			return true;
+		}
+		case 0xD0:
+		{
+			snd_seq_ev_set_chanpress(ev, channel, d1);
+			return true;
+		}
+		case 0xE0:
+		{
+			snd_seq_ev_set_pitchbend(ev, channel, get_alsa_pitch_bend_value(d1, d2));
+			return true;
+		}
+	}
+	return false;
+}
+
+static void send_alsa_event_direct(MIDIA5_ALSA_DATA * cm_data)
+{
+	snd_seq_event_t ev;
+
+	if(set_alsa_event(&ev, cm_data->command_type, cm_data->command_channel, cm_data->command_data[0], cm_data->command_data[1]))
+	{
+		snd_seq_ev_set_direct(&ev);
+		ev.dest = cm_data->addr;
+		snd_seq_event_output_direct(cm_data->sequencer, &ev);
+		snd_seq_drain_output(cm_data->sequencer);
+	}
+	cm_data->command_step = 0;
+}
+
 void _midia5_platform_send_data(MIDIA5_OUTPUT_HANDLE * hp, int data)
 {
 	MIDIA5_ALSA_DATA * cm_data = (MIDIA5_ALSA_DATA *)hp->platform_data;
-	snd_seq_event_t ev;
 
 	switch(cm_data->command_step)
 	{
@@ -195,25 +273,9 @@ void _midia5_platform_send_data(MIDIA5_OUTPUT_HANDLE * hp, int data)
 					break;
 				}
 				case 0xC0:
-				{
-					snd_seq_ev_clear(&ev);
-					snd_seq_ev_set_pgmchange(&ev, cm_data->command_channel, cm_data->command_data[0]);
-					snd_seq_ev_set_direct(&ev);
-					ev.dest = cm_data->addr;
-					snd_seq_event_output_direct(cm_data->sequencer, &ev);
-					snd_seq_drain_output(cm_data->sequencer);
-					cm_data->command_step = 0;
-					break;
-				}
 				case 0xD0:
 				{
-					snd_seq_ev_clear(&ev);
-					snd_seq_ev_set_chanpress(&ev, cm_data->command_channel, cm_data->command_data[0]);
-					snd_seq_ev_set_direct(&ev);
-					ev.dest = cm_data->addr;
-					snd_seq_event_output_direct(cm_data->sequencer, &ev);
-					snd_seq_drain_output(cm_data->sequencer);
-					cm_data->command_step = 0;
+					send_alsa_event_direct(cm_data);
 					break;
 				}
 			}
@@ -222,82 +284,70 @@ void _midia5_platform_send_data(MIDIA5_OUTPUT_HANDLE * hp, int data)
 		case 2:
 		{
 			cm_data->command_data[1] = data;
-			switch(cm_data->command_type)
+			send_alsa_event_direct(cm_data);
+			break;
+		}
+	}
+}
+
+/* schedule a batch of messages on our queue at their time stamps, and hand
+   them to the sequencer in one go */
+void _midia5_platform_send_messages(MIDIA5_OUTPUT_HANDLE * hp, const MIDIA5_MESSAGE * message, int count)
+{
+	MIDIA5_ALSA_DATA * cm_data = (MIDIA5_ALSA_DATA *)hp->platform_data;
+	snd_seq_event_t ev;
+	snd_seq_real_time_t rt;
+	double t;
+	int i;
+
+	for(i = 0; i < count; i++)
+	{
+		if(!set_alsa_event(&ev, message[i].data[0] & 0xF0, message[i].data[0] & 0x0F, message[i].size > 1 ? message[i].data[1] : 0, message[i].size > 2 ? message[i].data[2] : 0))
+		{
+			continue;
+		}
+		snd_seq_ev_set_source(&ev, cm_data->port);
+		ev.dest = cm_data->addr;
+		if(cm_data->queue >= 0)
+		{
+			/* anything already due is scheduled for the queue's start,
+			   which the sequencer delivers straight away */
+			t = message[i].time - cm_data->queue_start_time;
+			if(t < 0.0)
 			{
-				case 0x80:
-				{
-					snd_seq_ev_clear(&ev);
-					snd_seq_ev_set_noteoff(&ev, cm_data->command_channel, cm_data->command_data[0], cm_data->command_data[1]);
-					snd_seq_ev_set_direct(&ev);
-					ev.dest = cm_data->addr;
-					snd_seq_event_output_direct(cm_data->sequencer, &ev);
-					snd_seq_drain_output(cm_data->sequencer);
-					cm_data->command_step = 0;
-					break;
-				}
-				case 0x90:
-				{
-					snd_seq_ev_clear(&ev);
-					snd_seq_ev_set_noteon(&ev, cm_data->command_channel, cm_data->command_data[0], cm_data->command_data[1]);
-					snd_seq_ev_set_direct(&ev);
-					ev.dest = cm_data->addr;
-					snd_seq_event_output_direct(cm_data->sequencer, &ev);
-					snd_seq_drain_output(cm_data->sequencer);
-					cm_data->command_step = 0;
-					break;
-				}
-				case 0xA0:
-				{
-					snd_seq_ev_clear(&ev);
-					snd_seq_ev_set_keypress(&ev, cm_data->command_channel, cm_data->command_data[0], cm_data->command_data[1]);
-					snd_seq_ev_set_direct(&ev);
-					ev.dest = cm_data->addr;
-					snd_seq_event_output_direct(cm_data->sequencer, &ev);
-					snd_seq_drain_output(cm_data->sequencer);
-					cm_data->command_step = 0;
-					break;
-				}
-				case 0xB0:
-				{
-					snd_seq_ev_clear(&ev);
-					snd_seq_ev_set_controller(&ev, cm_data->command_channel, cm_data->command_data[0], cm_data->command_data[1]);
-					snd_seq_ev_set_direct(&ev);
-					ev.dest = cm_data->addr;
-					snd_seq_event_output_direct(cm_data->sequencer, &ev);
-					snd_seq_drain_output(cm_data->sequencer);
-					cm_data->command_step = 0;
-					break;
-				}
-				case 0xE0:
-				{
-					snd_seq_ev_clear(&ev);
-					snd_seq_ev_set_pitchbend(&ev, cm_data->command_channel, get_alsa_pitch_bend_value(cm_data->command_data[0], cm_data->command_data[1]));
-					snd_seq_ev_set_direct(&ev);
-					ev.dest = cm_data->addr;
-					snd_seq_event_output_direct(cm_data->sequencer, &ev);
-					snd_seq_drain_output(cm_data->sequencer);
-					cm_data->command_step = 0;
-					break;
-				}
+				t = 0.0;
 			}
-			break;
+			rt.tv_sec = (unsigned int)t;
+			rt.tv_nsec = (unsigned int)((t - rt.tv_sec) * 1000000000.0);
+			snd_seq_ev_schedule_real(&ev, cm_data->queue, 0, &rt);
+		}
+		else
+		{
+			snd_seq_ev_set_direct(&ev);
 		}
+		snd_seq_event_output(cm_data->sequencer, &ev);
 	}
+	snd_seq_drain_output(cm_data->sequencer);
 }
 
 void _midia5_platform_reset_output_device(MIDIA5_OUTPUT_HANDLE * hp)
 {
+	unsigned char message[3];
 	int i, j;
 
-	for(i = 0; i < 0xF; i++)
+	/* queue the note offs with a time stamp that is already due, so they
+	   go out as a few batches instead of one drain per note */
+	for(i = 0; i < 16; i++)
 	{
 		for(j = 0; j < 128; j++)
 		{
-			midia5_send_data(hp, 0x80 | i);
-			midia5_send_data(hp, j);
-			midia5_send_data(hp, 127);
+			message[0] = 0x80 | i;
+			message[1] = j;
+			message[2] = 127;
+			midia5_queue_message(hp, message, 3, 0.0);
 		}
 	}
+	midia5_flush_output(hp);
 }
 
 bool _midia5_platform_set_output_gain(MIDIA5_OUTPUT_HANDLE * hp, float gain)
@@ -70,6 +70,24 @@ void _midia5_platform_send_data(MIDIA5_OUTPUT_HANDLE * hp, int data)
 	}
 }
 
+/* midiOutShortMsg() has no way to schedule, so the batch goes out now */
+void _midia5_platform_send_messages(MIDIA5_OUTPUT_HANDLE * hp, const MIDIA5_MESSAGE * message, int count)
+{
+	MIDIA5_PLATFORM_DATA * cm_data = (MIDIA5_PLATFORM_DATA *)hp->platform_data;
+	DWORD msg;
+	int i, j;
+
+	for(i = 0; i < count; i++)
+	{
+		msg = 0;
+		for(j = 0; j < message[i].size; j++)
+		{
+			msg |= ((DWORD)message[i].data[j]) << (j * 8);
+		}
+		midiOutShortMsg(cm_data->output_device, msg);
+	}
+}
+
 void _midia5_platform_reset_output_device(MIDIA5_OUTPUT_HANDLE * hp)
 {
 	MIDIA5_PLATFORM_DATA * cm_data = (MIDIA5_PLATFORM_DATA *)hp->platform_data;
@@ -347,6 +347,12 @@ static int _install_allegro(int system_id, int *errno_ptr, int (*atexit_ptr)(voi
    LOCK_VARIABLE(_current_palette);
    LOCK_VARIABLE(os_type);
 
+   /* locks for the state that loading, timer and mixer threads share */
+   _init_lazy_samples();
+   _init_sample_streams();
+   _init_name_indexes();
+   _init_packfile_stats();
+
    /* nasty stuff to set up the config system before the system driver */
    system_driver = _system_driver_list[0].driver;
 
@@ -0,0 +1,578 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      Asynchronous loading of datafile objects, bitmaps and samples.
+ *
+ *      Requests wait in a queue ordered by priority until the worker
+ *      thread gets to them. There is only the one, since the loaders share
+ *      state such as the palette that bitmaps are converted with. Finished
+ *      requests go on a completion queue, and their callbacks are made from
+ *      whichever thread calls poll_async_loads(). Without threads,
+ *      poll_async_loads() does the loading itself, one request per call.
+ *
+ *      See readme.txt for copyright information.
+ */
+
+
+#include "allegro.h"
+#include "allegro/internal/aintern.h"
+
+
+
+#define LOAD_OBJECT          0
+#define LOAD_BITMAP          1
+#define LOAD_SAMPLE          2
+
+
+struct ASYNC_LOAD
+{
+   int kind;                           /* LOAD_OBJECT, LOAD_BITMAP, ... */
+   char *filename;
+   char *objectname;                   /* only for LOAD_OBJECT */
+   int priority;
+   int state;                          /* ASYNC_QUEUED, ASYNC_LOADING, ... */
+   int cancel;                         /* set while loading to drop the result */
+   int orphan;                         /* set while loading if destroyed */
+   int collected;                      /* dat has been handed to the user */
+   void *dat;
+   PALETTE pal;
+   void (*callback)(ASYNC_LOAD *request, void *arg);
+   void *arg;
+   struct ASYNC_LOAD *next;            /* in whichever list it is on */
+};
+
+
+static void *async_thread = NULL;
+static int async_installed = FALSE;
+static int async_quit = FALSE;
+
+static void *async_mutex = NULL;       /* protects everything below */
+static void *async_cond = NULL;        /* broadcast when the queue changes */
+
+static ASYNC_LOAD *async_queue = NULL;       /* waiting, by priority */
+static ASYNC_LOAD *async_done = NULL;        /* finished, not yet polled */
+static ASYNC_LOAD *async_done_last = NULL;
+static ASYNC_LOAD *async_polled = NULL;      /* finished and polled */
+
+
+
+/* unlink_request:
+ *  Removes a request from one of the lists, returning TRUE if it was on it.
+ */
+static int unlink_request(ASYNC_LOAD **list, ASYNC_LOAD *request)
+{
+   ASYNC_LOAD *prev = NULL;
+   ASYNC_LOAD *iter;
+
+   for (iter = *list; iter; prev = iter, iter = iter->next) {
+      if (iter == request) {
+	 if (prev)
+	    prev->next = iter->next;
+	 else
+	    *list = iter->next;
+
+	 if ((list == &async_done) && (async_done_last == request))
+	    async_done_last = prev;
+
+	 request->next = NULL;
+	 return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+
+
+/* queue_request:
+ *  Puts a request in the waiting queue, after any with the same or a
+ *  higher priority.
+ */
+static void queue_request(ASYNC_LOAD *request)
+{
+   ASYNC_LOAD **pos = &async_queue;
+
+   while ((*pos) && ((*pos)->priority >= request->priority))
+      pos = &(*pos)->next;
+
+   request->next = *pos;
+   *pos = request;
+}
+
+
+
+/* complete_request:
+ *  Puts a request on the end of the completion queue.
+ */
+static void complete_request(ASYNC_LOAD *request)
+{
+   request->next = NULL;
+
+   if (async_done_last)
+      async_done_last->next = request;
+   else
+      async_done = request;
+
+   async_done_last = request;
+}
+
+
+
+/* destroy_data:
+ *  Frees whatever a request has loaded.
+ */
+static void destroy_data(ASYNC_LOAD *request)
+{
+   if (!request->dat)
+      return;
+
+   switch (request->kind) {
+
+      case LOAD_OBJECT:
+	 unload_datafile_object(request->dat);
+	 break;
+
+      case LOAD_BITMAP:
+	 destroy_bitmap(request->dat);
+	 break;
+
+      case LOAD_SAMPLE:
+	 destroy_sample(request->dat);
+	 break;
+   }
+
+   request->dat = NULL;
+}
+
+
+
+/* free_request:
+ *  Frees a request, and its data unless the user has taken it.
+ */
+static void free_request(ASYNC_LOAD *request)
+{
+   if (!request->collected)
+      destroy_data(request);
+
+   if (request->filename)
+      _AL_FREE(request->filename);
+
+   if (request->objectname)
+      _AL_FREE(request->objectname);
+
+   _AL_FREE(request);
+}
+
+
+
+/* run_request:
+ *  Loads the next request from the queue, and moves it to the completion
+ *  queue. Called with the mutex locked, which is released while loading.
+ */
+static void run_request(void)
+{
+   ASYNC_LOAD *request = async_queue;
+   void *dat = NULL;
+
+   async_queue = request->next;
+   request->next = NULL;
+   request->state = ASYNC_LOADING;
+
+   _al_unlock_mutex(async_mutex);
+
+   switch (request->kind) {
+
+      case LOAD_OBJECT:
+	 dat = load_datafile_object(request->filename, request->objectname);
+	 break;
+
+      case LOAD_BITMAP:
+	 dat = load_bitmap(request->filename, request->pal);
+	 break;
+
+      case LOAD_SAMPLE:
+	 dat = load_sample(request->filename);
+	 break;
+   }
+
+   _al_lock_mutex(async_mutex);
+
+   request->dat = dat;
+
+   if (request->orphan) {
+      free_request(request);
+      return;
+   }
+
+   if (request->cancel) {
+      destroy_data(request);
+      request->state = ASYNC_CANCELLED;
+   }
+   else
+      request->state = (dat) ? ASYNC_DONE : ASYNC_FAILED;
+
+   complete_request(request);
+}
+
+
+
+/* async_worker:
+ *  Thread function for the worker, which loads requests until told to quit.
+ */
+static void async_worker(void *arg)
+{
+   (void)arg;
+
+   _al_lock_mutex(async_mutex);
+
+   for (;;) {
+      while ((!async_queue) && (!async_quit))
+	 _al_wait_cond(async_cond, async_mutex);
+
+      if (async_quit)
+	 break;
+
+      run_request();
+   }
+
+   _al_unlock_mutex(async_mutex);
+}
+
+
+
+/* free_list:
+ *  Frees all the requests on a list.
+ */
+static void free_list(ASYNC_LOAD **list)
+{
+   ASYNC_LOAD *next;
+
+   while (*list) {
+      next = (*list)->next;
+      free_request(*list);
+      *list = next;
+   }
+}
+
+
+
+/* shutdown_async_loads:
+ *  Called by allegro_exit() to wait for the worker to finish what it is
+ *  loading, and free all the requests.
+ */
+static void shutdown_async_loads(void)
+{
+   _al_lock_mutex(async_mutex);
+   async_quit = TRUE;
+   _al_broadcast_cond(async_cond);
+   _al_unlock_mutex(async_mutex);
+
+   if (async_thread)
+      _al_join_thread(async_thread);
+
+   free_list(&async_queue);
+   free_list(&async_done);
+   free_list(&async_polled);
+   async_done_last = NULL;
+
+   _al_destroy_cond(async_cond);
+   _al_destroy_mutex(async_mutex);
+   async_cond = NULL;
+   async_mutex = NULL;
+
+   async_thread = NULL;
+   async_quit = FALSE;
+   async_installed = FALSE;
+
+   _remove_exit_func(shutdown_async_loads);
+}
+
+
+
+/* install_async_loads:
+ *  Starts the worker when the first request is made. If no thread can be
+ *  started, the loading happens in poll_async_loads(). Returns zero on
+ *  success.
+ */
+static int install_async_loads(void)
+{
+   if (async_installed)
+      return 0;
+
+   async_mutex = _al_create_mutex();
+   async_cond = _al_create_cond();
+
+   if ((!async_mutex) || (!async_cond)) {
+      if (async_cond)
+	 _al_destroy_cond(async_cond);
+      if (async_mutex)
+	 _al_destroy_mutex(async_mutex);
+      async_cond = NULL;
+      async_mutex = NULL;
+      *allegro_errno = ENOMEM;
+      return -1;
+   }
+
+   async_thread = _al_create_thread(async_worker, NULL);
+
+   async_installed = TRUE;
+   _add_exit_func(shutdown_async_loads, "shutdown_async_loads");
+
+   return 0;
+}
+
+
+
+/* add_request:
+ *  Helper for the functions that make requests.
+ */
+static ASYNC_LOAD *add_request(int kind, AL_CONST char *filename, AL_CONST char *objectname, int priority, void (*callback)(ASYNC_LOAD *request, void *arg), void *arg)
+{
+   ASYNC_LOAD *request;
+
+   if (install_async_loads() != 0)
+      return NULL;
+
+   request = _AL_MALLOC(sizeof(ASYNC_LOAD));
+   if (!request) {
+      *allegro_errno = ENOMEM;
+      return NULL;
+   }
+
+   memset(request, 0, sizeof(ASYNC_LOAD));
+
+   request->kind = kind;
+   request->priority = priority;
+   request->state = ASYNC_QUEUED;
+   request->callback = callback;
+   request->arg = arg;
+
+   request->filename = _al_ustrdup(filename);
+   if (objectname)
+      request->objectname = _al_ustrdup(objectname);
+
+   if ((!request->filename) || ((objectname) && (!request->objectname))) {
+      free_request(request);
+      *allegro_errno = ENOMEM;
+      return NULL;
+   }
+
+   _al_lock_mutex(async_mutex);
+   queue_request(request);
+   _al_broadcast_cond(async_cond);
+   _al_unlock_mutex(async_mutex);
+
+   return request;
+}
+
+
+
+/* load_datafile_object_async:
+ *  Asks for an object of a datafile to be loaded with load_datafile_object()
+ *  in the background. Returns a request, or NULL on error.
+ */
+ASYNC_LOAD *load_datafile_object_async(AL_CONST char *filename, AL_CONST char *objectname, int priority, void (*callback)(ASYNC_LOAD *request, void *arg), void *arg)
+{
+   ASSERT(filename);
+   ASSERT(objectname);
+
+   return add_request(LOAD_OBJECT, filename, objectname, priority, callback, arg);
+}
+
+
+
+/* load_bitmap_async:
+ *  Asks for an image file to be loaded with load_bitmap() in the
+ *  background. Returns a request, or NULL on error.
+ */
+ASYNC_LOAD *load_bitmap_async(AL_CONST char *filename, int priority, void (*callback)(ASYNC_LOAD *request, void *arg), void *arg)
+{
+   ASSERT(filename);
+
+   return add_request(LOAD_BITMAP, filename, NULL, priority, callback, arg);
+}
+
+
+
+/* load_sample_async:
+ *  Asks for a sample file to be loaded with load_sample() in the
+ *  background. Returns a request, or NULL on error.
+ */
+ASYNC_LOAD *load_sample_async(AL_CONST char *filename, int priority, void (*callback)(ASYNC_LOAD *request, void *arg), void *arg)
+{
+   ASSERT(filename);
+
+   return add_request(LOAD_SAMPLE, filename, NULL, priority, callback, arg);
+}
+
+
+
+/* poll_async_loads:
+ *  Makes the callbacks for the requests that have finished since the last
+ *  call, in the order they finished. Returns how many there were.
+ */
+int poll_async_loads(void)
+{
+   ASYNC_LOAD *request;
+   int count = 0;
+
+   if (!async_installed)
+      return 0;
+
+   _al_lock_mutex(async_mutex);
+
+   /* with no worker, we are the worker */
+   if ((!async_thread) && (async_queue))
+      run_request();
+
+   while (async_done) {
+      request = async_done;
+      async_done = request->next;
+      if (!async_done)
+	 async_done_last = NULL;
+
+      request->next = async_polled;
+      async_polled = request;
+
+      count++;
+
+      if (request->callback) {
+	 _al_unlock_mutex(async_mutex);
+	 request->callback(request, request->arg);
+	 _al_lock_mutex(async_mutex);
+      }
+   }
+
+   _al_unlock_mutex(async_mutex);
+
+   return count;
+}
+
+
+
+/* get_async_load_state:
+ *  Returns ASYNC_QUEUED, ASYNC_LOADING, ASYNC_DONE, ASYNC_FAILED or
+ *  ASYNC_CANCELLED.
+ */
+int get_async_load_state(ASYNC_LOAD *request)
+{
+   int state;
+   ASSERT(request);
+
+   _al_lock_mutex(async_mutex);
+   state = request->state;
+   _al_unlock_mutex(async_mutex);
+
+   return state;
+}
+
+
+
+/* get_async_load_data:
+ *  Returns what a finished request has loaded, or NULL if it hasn't loaded
+ *  anything (yet). From then on it is up to the caller to free it. If pal
+ *  is not NULL, the palette of a bitmap is copied into it.
+ */
+void *get_async_load_data(ASYNC_LOAD *request, RGB *pal)
+{
+   void *dat = NULL;
+   ASSERT(request);
+
+   _al_lock_mutex(async_mutex);
+
+   if (request->state == ASYNC_DONE) {
+      dat = request->dat;
+      request->collected = TRUE;
+
+      if ((pal) && (request->kind == LOAD_BITMAP))
+	 memcpy(pal, request->pal, sizeof(PALETTE));
+   }
+
+   _al_unlock_mutex(async_mutex);
+
+   return dat;
+}
+
+
+
+/* set_async_load_priority:
+ *  Changes the priority of a request, which only makes a difference while
+ *  it is waiting to be loaded.
+ */
+void set_async_load_priority(ASYNC_LOAD *request, int priority)
+{
+   ASSERT(request);
+
+   _al_lock_mutex(async_mutex);
+
+   request->priority = priority;
+
+   if ((request->state == ASYNC_QUEUED) && (unlink_request(&async_queue, request)))
+      queue_request(request);
+
+   _al_unlock_mutex(async_mutex);
+}
+
+
+
+/* cancel_async_load:
+ *  Cancels a request that hasn't finished. It still goes through the
+ *  completion queue, with the state ASYNC_CANCELLED. Returns zero on
+ *  success, or -1 if the request had already finished.
+ */
+int cancel_async_load(ASYNC_LOAD *request)
+{
+   int ret = 0;
+   ASSERT(request);
+
+   _al_lock_mutex(async_mutex);
+
+   if (request->state == ASYNC_QUEUED) {
+      unlink_request(&async_queue, request);
+      request->state = ASYNC_CANCELLED;
+      complete_request(request);
+   }
+   else if (request->state == ASYNC_LOADING)
+      request->cancel = TRUE;
+   else
+      ret = -1;
+
+   _al_unlock_mutex(async_mutex);
+
+   return ret;
+}
+
+
+
+/* destroy_async_load:
+ *  Frees a request, cancelling it if it hasn't finished. Whatever it loaded
+ *  is freed too, unless it has been returned by get_async_load_data().
+ */
+void destroy_async_load(ASYNC_LOAD *request)
+{
+   if (!request)
+      return;
+
+   _al_lock_mutex(async_mutex);
+
+   if (request->state == ASYNC_LOADING) {
+      /* the worker will free it when it is done */
+      request->orphan = TRUE;
+   }
+   else {
+      if (!unlink_request(&async_queue, request))
+	 if (!unlink_request(&async_done, request))
+	    unlink_request(&async_polled, request);
+
+      free_request(request);
+   }
+
+   _al_unlock_mutex(async_mutex);
+}
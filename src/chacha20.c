@@ -0,0 +1,266 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      ChaCha20 stream cipher for encrypted packfiles.
+ *
+ *      See readme.txt for copyright information.
+ */
+
+
+#include <string.h>
+#include <time.h>
+
+#include "allegro.h"
+#include "allegro/internal/aintern.h"
+
+
+/*
+   ChaCha20 is Daniel J. Bernstein's stream cipher, as described in RFC
+   8439. A 64 byte block of key stream is made by running twenty rounds of
+   additions, xors and rotations over the 256 bit key, a block counter and
+   a nonce, so any position in the stream can be reached directly.
+
+   The key is made by feeding the password through the block function 32
+   bytes at a time. Files with a packfile header store a random nonce
+   straight after their magic number, and the key stream from there on is
+   made with it, so that no two files share one. The magic number and the
+   nonce itself are encrypted with a fixed nonce, as are plain files that
+   have no header to keep a nonce in: those still give the same key stream
+   for the same password.
+*/
+
+
+#define ROTL(x, n)   (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define QUARTER_ROUND(a, b, c, d)                                    \
+   a += b;  d ^= a;  d = ROTL(d, 16);                                \
+   c += d;  b ^= c;  b = ROTL(b, 12);                                \
+   a += b;  d ^= a;  d = ROTL(d, 8);                                 \
+   c += d;  b ^= c;  b = ROTL(b, 7);
+
+
+struct CHACHA20_DATA
+{
+   uint32_t key[8];
+   uint32_t nonce[3];                  /* the nonce of the file */
+   long nonce_pos;                     /* where it takes over, or -1 */
+   long pos;                           /* position in the key stream */
+   long block_pos;                     /* where block starts, or -1 */
+   int block_nonce;                    /* was block made with the nonce? */
+   unsigned char block[64];            /* the current block of key stream */
+};
+
+
+static AL_CONST uint32_t fixed_nonce[3] =
+{
+   0x656C6C41, 0x206F7267, 0x656C6966  /* "Allegro file" */
+};
+
+
+
+/* chacha20_block:
+ *  Makes the 64 byte block of key stream with the given counter and nonce.
+ */
+static void chacha20_block(AL_CONST uint32_t *key, uint32_t counter, AL_CONST uint32_t *nonce, unsigned char *out)
+{
+   uint32_t in[16], x[16];
+   int i;
+
+   in[0] = 0x61707865;                 /* "expand 32-byte k" */
+   in[1] = 0x3320646E;
+   in[2] = 0x79622D32;
+   in[3] = 0x6B206574;
+
+   for (i=0; i<8; i++)
+      in[4+i] = key[i];
+
+   in[12] = counter;
+   in[13] = nonce[0];
+   in[14] = nonce[1];
+   in[15] = nonce[2];
+
+   for (i=0; i<16; i++)
+      x[i] = in[i];
+
+   for (i=0; i<10; i++) {
+      QUARTER_ROUND(x[0], x[4], x[8],  x[12]);
+      QUARTER_ROUND(x[1], x[5], x[9],  x[13]);
+      QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+      QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+      QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+      QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+      QUARTER_ROUND(x[2], x[7], x[8],  x[13]);
+      QUARTER_ROUND(x[3], x[4], x[9],  x[14]);
+   }
+
+   for (i=0; i<16; i++) {
+      x[i] += in[i];
+      out[i*4]   = x[i];
+      out[i*4+1] = x[i] >> 8;
+      out[i*4+2] = x[i] >> 16;
+      out[i*4+3] = x[i] >> 24;
+   }
+}
+
+
+
+/* _al_create_chacha20_data:
+ *  Creates a CHACHA20_DATA structure, with the key made from the password
+ *  and the key stream at its start.
+ */
+CHACHA20_DATA *_al_create_chacha20_data(AL_CONST char *password)
+{
+   CHACHA20_DATA *dat;
+   unsigned char out[64];
+   int len = strlen(password);
+   int i, j;
+
+   if ((dat = _AL_MALLOC_ATOMIC(sizeof(CHACHA20_DATA))) == NULL) {
+      *allegro_errno = ENOMEM;
+      return NULL;
+   }
+
+   for (i=0; i<8; i++)
+      dat->key[i] = 0;
+
+   /* each 32 bytes of the password are mixed into the key, and the block
+      function is run over it, with the length of the password as the
+      counter so that trailing zeros still count */
+   i = 0;
+   do {
+      for (j=0; (j<32) && (i+j<len); j++)
+	 dat->key[j/4] ^= (uint32_t)(unsigned char)password[i+j] << ((j&3) * 8);
+
+      chacha20_block(dat->key, len, fixed_nonce, out);
+
+      for (j=0; j<8; j++)
+	 dat->key[j] = (out[j*4] | (out[j*4+1] << 8) | (out[j*4+2] << 16) | ((uint32_t)out[j*4+3] << 24)) ^
+		       (out[32+j*4] | (out[33+j*4] << 8) | (out[34+j*4] << 16) | ((uint32_t)out[35+j*4] << 24));
+
+      i += 32;
+   } while (i < len);
+
+   dat->nonce_pos = -1;
+
+   _al_rewind_chacha20(dat);
+
+   return dat;
+}
+
+
+
+/* _al_free_chacha20_data:
+ *  Frees a CHACHA20_DATA structure.
+ */
+void _al_free_chacha20_data(CHACHA20_DATA *dat)
+{
+   ASSERT(dat);
+   _AL_FREE(dat);
+}
+
+
+
+/* _al_rewind_chacha20:
+ *  Goes back to the start of the key stream.
+ */
+void _al_rewind_chacha20(CHACHA20_DATA *dat)
+{
+   dat->pos = 0;
+   dat->block_pos = -1;
+}
+
+
+
+/* _al_make_chacha20_nonce:
+ *  Makes a nonce for a new file. There is no portable source of random
+ *  numbers, so the wall clock, the timer, the address of the cipher and a
+ *  count of the nonces made so far are hashed with the block function:
+ *  the count keeps them apart within a run, and the clocks between runs.
+ */
+void _al_make_chacha20_nonce(CHACHA20_DATA *dat, unsigned char *nonce)
+{
+   static uint32_t count = 0;
+   uint32_t seed[8], in[3];
+   unsigned char out[64];
+   double t = al_get_time();
+   time_t now = time(NULL);
+   int i;
+
+   memcpy(seed, dat->key, sizeof(seed));
+   seed[0] ^= (uint32_t)now;
+   seed[1] ^= (uint32_t)((uint64_t)now >> 32);
+   seed[2] ^= (uint32_t)(uintptr_t)dat;
+   seed[3] ^= (uint32_t)((uint64_t)(uintptr_t)dat >> 32);
+
+   in[0] = ++count;
+   in[1] = (uint32_t)(t * 1000000.0);
+   in[2] = (uint32_t)clock();
+
+   chacha20_block(seed, 0, in, out);
+
+   for (i=0; i<CHACHA20_NONCE_SIZE; i++)
+      nonce[i] = out[i];
+}
+
+
+
+/* _al_set_chacha20_nonce:
+ *  Makes the key stream from position pos onwards with the given nonce,
+ *  instead of the fixed one.
+ */
+void _al_set_chacha20_nonce(CHACHA20_DATA *dat, AL_CONST unsigned char *nonce, long pos)
+{
+   int i;
+
+   for (i=0; i<3; i++)
+      dat->nonce[i] = nonce[i*4] | (nonce[i*4+1] << 8) | (nonce[i*4+2] << 16) | ((uint32_t)nonce[i*4+3] << 24);
+
+   dat->nonce_pos = pos;
+   dat->block_pos = -1;
+}
+
+
+
+/* _al_chacha20_crypt:
+ *  Encrypts or decrypts size bytes of buf in place, moving on through the
+ *  key stream. If buf is NULL, the key stream is just skipped over.
+ */
+void _al_chacha20_crypt(CHACHA20_DATA *dat, unsigned char *buf, long size)
+{
+   long start, n;
+   int use_nonce;
+
+   if (!buf) {
+      dat->pos += size;
+      return;
+   }
+
+   while (size > 0) {
+      use_nonce = ((dat->nonce_pos >= 0) && (dat->pos >= dat->nonce_pos));
+
+      start = dat->pos & ~63L;
+      if ((dat->block_pos != start) || (dat->block_nonce != use_nonce)) {
+	 chacha20_block(dat->key, (uint32_t)(start >> 6), use_nonce ? dat->nonce : fixed_nonce, dat->block);
+	 dat->block_pos = start;
+	 dat->block_nonce = use_nonce;
+      }
+
+      n = MIN(size, 64 - (dat->pos - start));
+
+      /* don't run on past where the nonce of the file takes over */
+      if ((!use_nonce) && (dat->nonce_pos >= 0))
+	 n = MIN(n, dat->nonce_pos - dat->pos);
+      _al_xor_bytes(buf, dat->block + (dat->pos - start), n);
+
+      dat->pos += n;
+      buf += n;
+      size -= n;
+   }
+}
@@ -19,6 +19,7 @@
 
 
 #include <string.h>
+#include <limits.h>
 
 #include "allegro.h"
 #include "allegro/internal/aintern.h"
@@ -100,13 +101,48 @@ static void *read_block(PACKFILE *f, int size, int alloc_size)
 
 
 
+/* read_pixels:
+ *  Returns a pointer to the next size bytes of pixel data in a file. If
+ *  the file is memory mapped this points into the mapping, otherwise the
+ *  data is read into *buf, which is allocated on first use and must be
+ *  freed by the caller. Every call sharing a buffer must use the same
+ *  size. Returns NULL if there is not enough memory.
+ */
+static AL_CONST unsigned char *read_pixels(PACKFILE *f, unsigned char **buf, int size)
+{
+   AL_CONST unsigned char *p;
+   long n;
+
+   p = pack_fread_mapped(f, size);
+   if (p)
+      return p;
+
+   if (!*buf) {
+      *buf = _AL_MALLOC_ATOMIC(size);
+      if (!*buf) {
+	 *allegro_errno = ENOMEM;
+	 return NULL;
+      }
+   }
+
+   n = pack_fread(*buf, size, f);
+   if (n < size)
+      memset(*buf + n, 0, size - n);
+
+   return *buf;
+}
+
+
+
 /* read_bitmap:
  *  Reads a bitmap from a file, allocating memory to store it.
  */
 static BITMAP *read_bitmap(PACKFILE *f, int bits, int allowconv)
 {
-   int x, y, w, h, c, r, g, b, a;
+   int x, y, w, h, c, r, g, b;
    int destbits, rgba;
+   AL_CONST unsigned char *src;
+   unsigned char *buf = NULL;
    unsigned short *p16;
    uint32_t *p32;
    BITMAP *bmp;
@@ -146,31 +182,21 @@ static BITMAP *read_bitmap(PACKFILE *f, int bits, int allowconv)
 	 break;
 
       case 15:
-	 /* 15bit hicolor */
-	 for (y=0; y<h; y++) {
-	    p16 = (uint16_t *)bmp->line[y];
-
-	    for (x=0; x<w; x++) {
-	       c = pack_igetw(f);
-	       r = _rgb_scale_5[(c >> 11) & 0x1F]; /* stored as 16 bit */
-	       g = _rgb_scale_6[(c >> 5) & 0x3F];
-	       b = _rgb_scale_5[c & 0x1F];
-	       p16[x] = makecol15(r, g, b);
-	    }
-	 }
-	 break;
-
       case 16:
-	 /* 16bit hicolor */
+	 /* hicolor, always stored as 16 bit */
 	 for (y=0; y<h; y++) {
+	    src = read_pixels(f, &buf, w*2);
+	    if (!src)
+	       goto Error;
+
 	    p16 = (uint16_t *)bmp->line[y];
 
 	    for (x=0; x<w; x++) {
-	       c = pack_igetw(f);
+	       c = src[x*2] | (src[x*2+1] << 8);
 	       r = _rgb_scale_5[(c >> 11) & 0x1F];
 	       g = _rgb_scale_6[(c >> 5) & 0x3F];
 	       b = _rgb_scale_5[c & 0x1F];
-	       p16[x] = makecol16(r, g, b);
+	       p16[x] = makecol_depth(bits, r, g, b);
 	    }
 	 }
 	 break;
@@ -178,16 +204,14 @@ static BITMAP *read_bitmap(PACKFILE *f, int bits, int allowconv)
       case 24:
 	 /* 24bit truecolor */
 	 for (y=0; y<h; y++) {
-	    for (x=0; x<w; x++) {
-	       r = pack_getc(f);
-	       g = pack_getc(f);
-	       b = pack_getc(f);
-
-	       if (rgba)
-		  pack_getc(f);
+	    src = read_pixels(f, &buf, w * (rgba ? 4 : 3));
+	    if (!src)
+	       goto Error;
 
-	       c = makecol24(r, g, b);
+	    for (x=0; x<w; x++) {
+	       c = makecol24(src[0], src[1], src[2]);
 	       WRITE3BYTES(bmp->line[y] + (x * 3), c);
+	       src += (rgba ? 4 : 3);
 	    }
 	 }
 	 break;
@@ -195,25 +219,30 @@ static BITMAP *read_bitmap(PACKFILE *f, int bits, int allowconv)
       case 32:
 	 /* 32bit rgba */
 	 for (y=0; y<h; y++) {
+	    src = read_pixels(f, &buf, w * (rgba ? 4 : 3));
+	    if (!src)
+	       goto Error;
+
 	    p32 = (uint32_t *)bmp->line[y];
 
 	    for (x=0; x<w; x++) {
-	       r = pack_getc(f);
-	       g = pack_getc(f);
-	       b = pack_getc(f);
-
-	       if (rgba)
-		  a = pack_getc(f);
-	       else
-		  a = 0;
-
-	       p32[x] = makeacol32(r, g, b, a);
+	       if (rgba) {
+		  p32[x] = makeacol32(src[0], src[1], src[2], src[3]);
+		  src += 4;
+	       }
+	       else {
+		  p32[x] = makeacol32(src[0], src[1], src[2], 0);
+		  src += 3;
+	       }
 	    }
 	 }
 	 break;
 
    }
 
+   if (buf)
+      _AL_FREE(buf);
+
    if (bits != destbits) {
       BITMAP *tmp = bmp;
       bmp = create_bitmap_ex(destbits, w, h);
@@ -226,6 +255,12 @@ static BITMAP *read_bitmap(PACKFILE *f, int bits, int allowconv)
    }
 
    return bmp;
+
+ Error:
+   if (buf)
+      _AL_FREE(buf);
+   destroy_bitmap(bmp);
+   return NULL;
 }
 
 
@@ -644,26 +679,15 @@ static MIDI *read_midi(PACKFILE *f)
       m->track[c].data = NULL;
    }
 
+   m->timeline = NULL;
    m->divisions = pack_mgetw(f);
 
-   for (c=0; c<MIDI_TRACKS; c++) {
-      m->track[c].len = pack_mgetl(f);
-      if (m->track[c].len > 0) {
-	 m->track[c].data = read_block(f, m->track[c].len, 0);
-	 if (!m->track[c].data) {
-	    unload_midi(m);
-	    return NULL;
-	 }
-      }
+   if (_midi_read_tracks(m, f, MIDI_TRACKS, FALSE) != 0) {
+      unload_midi(m);
+      return NULL;
    }
 
-   LOCK_DATA(m, sizeof(MIDI));
-
-   for (c=0; c<MIDI_TRACKS; c++) {
-      if (m->track[c].data) {
-	 LOCK_DATA(m->track[c].data, m->track[c].len);
-      }
-   }
+   lock_midi(m);
 
    return m;
 }
@@ -1141,6 +1165,11 @@ static void unload_midi(MIDI *m)
 	 }
       }
 
+      if (m->timeline) {
+	 UNLOCK_DATA(m->timeline, m->timeline->size);
+	 _AL_FREE(m->timeline);
+      }
+
       UNLOCK_DATA(m, sizeof(MIDI));
       _AL_FREE(m);
    }
@@ -1148,17 +1177,35 @@ static void unload_midi(MIDI *m)
 
 
 
+/* property_name:
+ *  Returns the name from a list of properties, or NULL if there is none.
+ */
+static AL_CONST char *property_name(AL_CONST DATAFILE_PROPERTY *list)
+{
+   if (list) {
+      for (; list->type != DAT_END; list++) {
+	 if (list->type == DAT_NAME)
+	    return list->dat;
+      }
+   }
+
+   return NULL;
+}
+
+
+
 /* load_object:
- *  Helper to load an object from a datafile and store it in 'obj'.
+ *  Helper to load an object from a datafile and store it in 'obj'. The
+ *  properties read before it give its name to the packfile trace.
  *  Returns 0 on success and -1 on failure.
  */
-static int load_object(DATAFILE *obj, PACKFILE *f, int type)
+static int load_object(DATAFILE *obj, PACKFILE *f, int type, AL_CONST DATAFILE_PROPERTY *list)
 {
    PACKFILE *ff;
    int d, i;
 
    /* load actual data */
-   ff = pack_fopen_chunk(f, FALSE);
+   ff = _pack_fopen_named_chunk(f, property_name(list));
 
    if (ff) {
       d = ff->normal.todo;
@@ -1233,6 +1280,42 @@ int _load_property(DATAFILE_PROPERTY *prop, PACKFILE *f)
 
 
 
+/* _skip_datafile_offsets:
+ *  Helper to skip the table of object offsets that follows a DAT_MAGIC_SEEK
+ *  header, leaving the file at the object count. Returns 0 on success and
+ *  -1 on failure.
+ */
+int _skip_datafile_offsets(PACKFILE *f)
+{
+   int count;
+
+   count = pack_mgetl(f);
+   if ((count < 0) || (count > INT_MAX/4)) {
+      *allegro_errno = EINVAL;
+      return -1;
+   }
+
+   if ((pack_fseek(f, count*4) != 0) || (pack_feof(f)))
+      return -1;
+
+   return 0;
+}
+
+
+
+/* _allow_lz4_chunks:
+ *  Marks f as holding LZ4 chunks if the datafile magic it starts with says
+ *  it may. Older versions of Allegro refuse these files by their magic, so
+ *  LZ4 chunks are refused anywhere else.
+ */
+void _allow_lz4_chunks(PACKFILE *f, int magic)
+{
+   if ((magic == DAT_MAGIC_LZ4) || (magic == DAT_MAGIC_SEEK))
+      f->normal.flags |= PACKFILE_FLAG_LZ4_CHUNKS;
+}
+
+
+
 /* _add_property:
  *  Helper to add a new property to a property list. Returns 0 on
  *  success or -1 on failure.
@@ -1290,6 +1373,272 @@ void _destroy_property_list(DATAFILE_PROPERTY *list)
 
 
 
+/* Name indexes, for find_datafile_object(). There is no room for one in
+ * the DATAFILE array itself, so they are kept in a table keyed on the
+ * address of the array, and dropped by unload_datafile(). Background
+ * loaders add to the table too, so it has a lock.
+ */
+
+typedef struct NAME_INDEX
+{
+   AL_CONST DATAFILE *dat;             /* the array this indexes */
+   int count;                          /* number of objects in it */
+   int mask;                           /* number of buckets, minus one */
+   unsigned long *hash;                /* hash of each object name */
+   int *bucket;                        /* first object in each bucket */
+   int *next;                          /* next object in the same bucket */
+   struct NAME_INDEX *link;            /* next index in the same table slot */
+} NAME_INDEX;
+
+
+#define NAME_INDEX_SLOTS      256
+
+#define NAME_INDEX_SLOT(dat)  (((uintptr_t)(dat) / sizeof(DATAFILE)) % NAME_INDEX_SLOTS)
+
+static NAME_INDEX *name_index_table[NAME_INDEX_SLOTS];
+static int name_index_count = 0;
+static void *name_index_mutex = NULL;
+
+
+
+/* lock_name_indexes:
+ *  Locks the table of name indexes.
+ */
+static INLINE void lock_name_indexes(void)
+{
+   if (name_index_mutex)
+      _al_lock_mutex(name_index_mutex);
+}
+
+
+
+/* unlock_name_indexes:
+ *  Unlocks the table of name indexes.
+ */
+static INLINE void unlock_name_indexes(void)
+{
+   if (name_index_mutex)
+      _al_unlock_mutex(name_index_mutex);
+}
+
+
+
+/* exit_name_indexes:
+ *  Destroys the lock of the name index table when Allegro shuts down.
+ */
+static void exit_name_indexes(void)
+{
+   _al_destroy_mutex(name_index_mutex);
+   name_index_mutex = NULL;
+
+   _remove_exit_func(exit_name_indexes);
+}
+
+
+
+/* _init_name_indexes:
+ *  Creates the lock of the name index table. Called by allegro_init(),
+ *  before any loading thread can get at it.
+ */
+void _init_name_indexes(void)
+{
+   if (name_index_mutex)
+      return;
+
+   name_index_mutex = _al_create_mutex();
+   if (name_index_mutex)
+      _add_exit_func(exit_name_indexes, "exit_name_indexes");
+}
+
+
+
+/* _datafile_name_hash:
+ *  Case insensitive hash of an object name, as stored in DAT_NAME_INDEX
+ *  objects. It works on the character codes, so the value doesn't depend
+ *  on the current text encoding format.
+ */
+unsigned long _datafile_name_hash(AL_CONST char *name)
+{
+   unsigned long hash = 2166136261UL;
+   int c;
+
+   while ((c = ugetxc(&name)) != 0)
+      hash = ((hash ^ (unsigned long)utolower(c)) * 16777619UL) & 0xFFFFFFFFUL;
+
+   return hash;
+}
+
+
+
+/* find_name_index:
+ *  Returns the name index of a DATAFILE array, or NULL if it has none.
+ *  Called with the table locked.
+ */
+static NAME_INDEX *find_name_index(AL_CONST DATAFILE *dat)
+{
+   NAME_INDEX *index;
+
+   if (!name_index_count)
+      return NULL;
+
+   for (index = name_index_table[NAME_INDEX_SLOT(dat)]; index; index = index->link) {
+      if (index->dat == dat)
+	 return index;
+   }
+
+   return NULL;
+}
+
+
+
+/* unlink_name_index:
+ *  Takes the name index of a DATAFILE array out of the table, returning it
+ *  for the caller to free, or NULL if it has none. Called with the table
+ *  locked.
+ */
+static NAME_INDEX *unlink_name_index(AL_CONST DATAFILE *dat)
+{
+   NAME_INDEX **link;
+   NAME_INDEX *index;
+
+   if (!name_index_count)
+      return NULL;
+
+   for (link = &name_index_table[NAME_INDEX_SLOT(dat)]; *link; link = &(*link)->link) {
+      if ((*link)->dat == dat) {
+	 index = *link;
+	 *link = index->link;
+	 name_index_count--;
+	 return index;
+      }
+   }
+
+   return NULL;
+}
+
+
+
+/* remove_name_index:
+ *  Destroys the name index of a DATAFILE array, if it has one.
+ */
+static void remove_name_index(AL_CONST DATAFILE *dat)
+{
+   NAME_INDEX *index;
+
+   lock_name_indexes();
+   index = unlink_name_index(dat);
+   unlock_name_indexes();
+
+   if (index)
+      _AL_FREE(index);
+}
+
+
+
+/* attach_name_index:
+ *  Builds a name index for a DATAFILE array of count objects, given the
+ *  hashes of their names, replacing any it had. Returns 0 on success and
+ *  -1 on failure.
+ */
+static int attach_name_index(AL_CONST DATAFILE *dat, int count, AL_CONST unsigned long *hash)
+{
+   NAME_INDEX *index, *old;
+   int size, slot, i;
+
+   size = 8;
+   while (size < count)
+      size <<= 1;
+
+   index = _AL_MALLOC(sizeof(NAME_INDEX) + sizeof(unsigned long)*count + sizeof(int)*(size+count));
+   if (!index) {
+      *allegro_errno = ENOMEM;
+      return -1;
+   }
+
+   index->dat = dat;
+   index->count = count;
+   index->mask = size-1;
+   index->hash = (unsigned long *)(index+1);
+   index->bucket = (int *)(index->hash + count);
+   index->next = index->bucket + size;
+
+   for (i=0; i<size; i++)
+      index->bucket[i] = -1;
+
+   /* chain backwards, so that the first of two equal names is found */
+   for (i=count-1; i>=0; i--) {
+      index->hash[i] = hash[i];
+      slot = hash[i] & index->mask;
+      index->next[i] = index->bucket[slot];
+      index->bucket[slot] = i;
+   }
+
+   lock_name_indexes();
+
+   old = unlink_name_index(dat);
+
+   slot = NAME_INDEX_SLOT(dat);
+   index->link = name_index_table[slot];
+   name_index_table[slot] = index;
+   name_index_count++;
+
+   unlock_name_indexes();
+
+   if (old)
+      _AL_FREE(old);
+
+   return 0;
+}
+
+
+
+/* attach_stored_name_index:
+ *  Attaches the name index read from a DAT_NAME_INDEX object, provided it
+ *  covers every object. The hashes are used as they are: one that is out
+ *  of date, because a tool changed the file without updating the index,
+ *  only makes find_datafile_object() fall back to searching the names.
+ */
+static void attach_stored_name_index(AL_CONST DATAFILE *dat, int count, unsigned long *hash, int hash_count)
+{
+   if (hash_count == count)
+      attach_name_index(dat, count, hash);
+}
+
+
+
+/* read_name_hashes:
+ *  Reads the contents of a DAT_NAME_INDEX object. Returns the hashes and
+ *  stores how many there are in count, or returns NULL if the object is
+ *  damaged or there isn't enough memory, since the index is optional.
+ */
+static unsigned long *read_name_hashes(PACKFILE *f, int *count)
+{
+   PACKFILE *ff;
+   unsigned long *hash = NULL;
+   int i;
+
+   ff = pack_fopen_chunk(f, FALSE);
+   if (!ff)
+      return NULL;
+
+   *count = pack_mgetl(ff);
+
+   if ((*count >= 0) && (*count <= ff->normal.todo/4)) {
+      hash = _AL_MALLOC_ATOMIC(sizeof(unsigned long) * MAX(*count, 1));
+
+      if (hash) {
+	 for (i=0; i<*count; i++)
+	    hash[i] = (unsigned long)pack_mgetl(ff) & 0xFFFFFFFFUL;
+      }
+   }
+
+   pack_fclose_chunk(ff);
+
+   return hash;
+}
+
+
+
 /* load_file_object:
  *  Loads a datafile object.
  */
@@ -1297,7 +1646,8 @@ static void *load_file_object(PACKFILE *f, long size)
 {
    DATAFILE *dat;
    DATAFILE_PROPERTY prop, *list;
-   int count, c, type, failed;
+   unsigned long *hash;
+   int count, c, type, failed, hash_count;
 
    count = pack_mgetl(f);
 
@@ -1308,6 +1658,8 @@ static void *load_file_object(PACKFILE *f, long size)
    }
 
    list = NULL;
+   hash = NULL;
+   hash_count = 0;
    failed = FALSE;
 
    /* search the packfile for properties or objects */
@@ -1320,8 +1672,15 @@ static void *load_file_object(PACKFILE *f, long size)
 	    break;
 	 }
       }
+      else if (type == DAT_NAME_INDEX) {
+	 /* not an object, but the hashes of the names of the others */
+	 if (hash)
+	    _AL_FREE(hash);
+	 hash = read_name_hashes(f, &hash_count);
+	 count--;
+      }
       else {
-	 if (load_object(&dat[c], f, type) != 0) {
+	 if (load_object(&dat[c], f, type, list) != 0) {
 	    failed = TRUE;
 	    break;
 	 }
@@ -1345,10 +1704,15 @@ static void *load_file_object(PACKFILE *f, long size)
    if (list)
       _destroy_property_list(list);
 
+   if (hash) {
+      if (!failed)
+	 attach_stored_name_index(dat, c, hash, hash_count);
+      _AL_FREE(hash);
+   }
+
    /* gracefully handle failure */
    if (failed) {
       unload_datafile(dat);
-      _AL_FREE(dat);
       dat = NULL;
    }
 
@@ -1385,14 +1749,20 @@ DATAFILE *load_datafile_callback(AL_CONST char *filename, void (*callback)(DATAF
       return NULL;
 
    if ((f->normal.flags & PACKFILE_FLAG_CHUNK) && (!(f->normal.flags & PACKFILE_FLAG_EXEDAT)))
-      type = (_packfile_type == DAT_FILE) ? DAT_MAGIC : 0;
-   else
+      type = (f->normal.flags & PACKFILE_FLAG_DAT_FILE) ? DAT_MAGIC : 0;
+   else {
       type = pack_mgetl(f);
+      _allow_lz4_chunks(f, type);
+   }
+
+   /* the offset table is only of use to create_datafile_index() */
+   if ((type == DAT_MAGIC_SEEK) && (_skip_datafile_offsets(f) == 0))
+      type = DAT_MAGIC;
 
    if (type == V1_DAT_MAGIC) {
       dat = read_old_datafile(f, callback);
    }
-   else if (type == DAT_MAGIC) {
+   else if ((type == DAT_MAGIC) || (type == DAT_MAGIC_LZ4)) {
       datafile_callback = callback;
       dat = load_file_object(f, 0);
       datafile_callback = NULL;
@@ -1406,64 +1776,607 @@ DATAFILE *load_datafile_callback(AL_CONST char *filename, void (*callback)(DATAF
 
 
 
-/* create_datafile_index
- *  Reads offsets of all objects inside datafile.
- *  On error, sets errno and returns NULL.
+/* Parallel loading: the calling thread reads the datafile from start to
+ * end, and hands the chunk of each object, still compressed, to a pool of
+ * worker threads which unpack it and build the object. Nested datafiles are
+ * walked on the calling thread, which also loads objects whose loader isn't
+ * one of ours, since those may not be safe to call from other threads.
+ * Every object gets a job in file order, and the callback is made from the
+ * calling thread as each job is reached in that order, so it sees the same
+ * sequence as with load_datafile_callback().
  */
-DATAFILE_INDEX *create_datafile_index(AL_CONST char *filename)
-{
-   PACKFILE *f;
-   DATAFILE_INDEX *index;
-   long pos = 4;
-   int type, count, skip, i;
 
-   ASSERT(filename);
+#define PARALLEL_MAX_THREADS  64
+#define PARALLEL_BACKLOG      (8*1024*1024)
 
-   f = pack_fopen(filename, F_READ_PACKED);
-   if (!f)
-      return NULL;
+#define JOB_QUEUED            0
+#define JOB_RUNNING           1
+#define JOB_DONE              2
 
-   if ((f->normal.flags & PACKFILE_FLAG_CHUNK) && (!(f->normal.flags & PACKFILE_FLAG_EXEDAT)))
-      type = (_packfile_type == DAT_FILE) ? DAT_MAGIC : 0;
-   else {
-      type = pack_mgetl(f);   pos += 4;
-   }
 
-   /* only support V2 datafile format */
-   if (type != DAT_MAGIC)
-      return NULL;
+typedef struct PARALLEL_JOB
+{
+   DATAFILE *obj;                      /* where the object goes */
+   void *(*load)(PACKFILE *f, long size);
+   AL_CONST unsigned char *raw;        /* chunk contents, after the sizes */
+   unsigned char *raw_copy;            /* raw, if we had to allocate it */
+   int filesize;                       /* sizes from the chunk header */
+   int datasize;
+   int lz4;                            /* may the chunk be LZ4 packed? */
+   int state;                          /* JOB_QUEUED, JOB_RUNNING or JOB_DONE */
+   struct PARALLEL_JOB *next;
+} PARALLEL_JOB;
+
+
+typedef struct PARALLEL_LOAD
+{
+   void *thread[PARALLEL_MAX_THREADS];
+   int threads;
+   void (*callback)(DATAFILE *);
+   void *mutex;                        /* protects everything below */
+   void *cond;                         /* broadcast when anything changes */
+   PARALLEL_JOB *first;                /* all the jobs, in file order */
+   PARALLEL_JOB *last;
+   PARALLEL_JOB *queue;                /* where workers look for a job */
+   PARALLEL_JOB *report;               /* next job for the callback */
+   long backlog;                       /* bytes queued but not decoded */
+   int failed;
+   int quit;
+} PARALLEL_LOAD;
+
+
+
+/* parallel_worker:
+ *  Thread function for the workers, which decode queued jobs until told
+ *  to quit. Once something has failed, jobs are only marked as done.
+ */
+static void parallel_worker(void *arg)
+{
+   PARALLEL_LOAD *load = arg;
+   PARALLEL_JOB *job;
+   PACKFILE *ff;
 
-   count = pack_mgetl(f);     pos += 4;
+   _al_lock_mutex(load->mutex);
 
-   index = _AL_MALLOC(sizeof(DATAFILE_INDEX));
-   if (!index) {
-      pack_fclose(f);
-      *allegro_errno = ENOMEM;
-      return NULL;
-   }
+   for (;;) {
+      while ((load->queue) && (load->queue->state != JOB_QUEUED))
+	 load->queue = load->queue->next;
 
-   index->filename = _al_ustrdup(filename);
-   if (!index->filename) {
-      pack_fclose(f);
-      _AL_FREE(index);
-      *allegro_errno = ENOMEM;
-      return NULL;
-   }
+      job = load->queue;
 
-   index->offset = _AL_MALLOC(sizeof(long) * count);
-   if (!index->offset) {
-      pack_fclose(f);
-      _AL_FREE(index->filename);
-      _AL_FREE(index);
-      *allegro_errno = ENOMEM;
-      return NULL;
-   }
+      if (!job) {
+	 if (load->quit)
+	    break;
+	 _al_wait_cond(load->cond, load->mutex);
+	 continue;
+      }
 
-   for (i = 0; i < count; ++i) {
-      index->offset[i] = pos;
+      job->state = JOB_RUNNING;
+
+      if (!load->failed) {
+	 _al_unlock_mutex(load->mutex);
+
+	 ff = _pack_fopen_memory_chunk(job->raw, job->filesize, job->datasize, job->lz4);
+	 if (ff) {
+	    job->obj->size = ff->normal.todo;
+	    job->obj->dat = job->load(ff, job->obj->size);
+	    pack_fclose(pack_fclose_chunk(ff));
+	 }
+
+	 _al_lock_mutex(load->mutex);
+      }
+
+      if (job->raw_copy) {
+	 _AL_FREE(job->raw_copy);
+	 job->raw_copy = NULL;
+      }
+
+      job->state = JOB_DONE;
+      load->backlog -= ABS(job->filesize);
+      _al_broadcast_cond(load->cond);
+   }
+
+   _al_unlock_mutex(load->mutex);
+}
+
+
+
+/* wait_parallel_load:
+ *  Waits until no more than backlog bytes are left to decode, making the
+ *  callback for each finished object that is next in file order. An object
+ *  that failed to load stops any further callbacks.
+ */
+static void wait_parallel_load(PARALLEL_LOAD *load, long backlog)
+{
+   PARALLEL_JOB *job;
+
+   _al_lock_mutex(load->mutex);
+
+   for (;;) {
+      while ((load->report) && (load->report->state == JOB_DONE)) {
+	 job = load->report;
+	 load->report = job->next;
+
+	 if (!job->obj->dat)
+	    load->failed = TRUE;
+
+	 if ((load->callback) && (!load->failed)) {
+	    _al_unlock_mutex(load->mutex);
+	    load->callback(job->obj);
+	    _al_lock_mutex(load->mutex);
+	 }
+      }
+
+      if (load->backlog <= backlog)
+	 break;
+
+      _al_wait_cond(load->cond, load->mutex);
+   }
+
+   _al_unlock_mutex(load->mutex);
+}
+
+
+
+/* add_parallel_job:
+ *  Adds a job to the end of the list, waking the workers if it needs
+ *  decoding.
+ */
+static void add_parallel_job(PARALLEL_LOAD *load, PARALLEL_JOB *job)
+{
+   job->next = NULL;
+
+   _al_lock_mutex(load->mutex);
+
+   if (load->last)
+      load->last->next = job;
+   else
+      load->first = job;
+
+   load->last = job;
+
+   if (!load->queue)
+      load->queue = job;
+
+   if (!load->report)
+      load->report = job;
+
+   if (job->state == JOB_QUEUED) {
+      load->backlog += ABS(job->filesize);
+      _al_broadcast_cond(load->cond);
+   }
+
+   _al_unlock_mutex(load->mutex);
+
+   wait_parallel_load(load, PARALLEL_BACKLOG);
+}
+
+
+
+/* fail_parallel_load:
+ *  Records that the calling thread couldn't load something.
+ */
+static void fail_parallel_load(PARALLEL_LOAD *load)
+{
+   _al_lock_mutex(load->mutex);
+   load->failed = TRUE;
+   _al_unlock_mutex(load->mutex);
+}
+
+
+
+/* is_parallel_loader:
+ *  Checks whether a loader can be run on a worker thread.
+ */
+static int is_parallel_loader(void *(*load)(PACKFILE *f, long size))
+{
+   return ((load == load_data_object) ||
+	   (load == load_font_object) ||
+	   (load == load_sample_object) ||
+	   (load == load_midi_object) ||
+	   (load == load_bitmap_object) ||
+	   (load == load_rle_sprite_object));
+}
+
+
+
+static DATAFILE *read_parallel_file(PARALLEL_LOAD *load, PACKFILE *f);
+
+
+
+/* read_parallel_object:
+ *  Reads an object of the given type from f into obj, either queueing its
+ *  chunk for the workers or loading it straight away. Returns 0 on success
+ *  and -1 on failure.
+ */
+static int read_parallel_object(PARALLEL_LOAD *load, DATAFILE *obj, PACKFILE *f, int type)
+{
+   void *(*loader)(PACKFILE *f, long size);
+   PARALLEL_JOB *job;
+   PACKFILE *ff;
+   long n;
+   int i, ret;
+
+   obj->type = type;
+   obj->dat = NULL;
+   obj->size = 0;
+
+   /* look for a load function */
+   loader = load_data_object;
+
+   for (i=0; i<MAX_DATAFILE_TYPES; i++) {
+      if (_datafile_type[i].type == type) {
+	 loader = _datafile_type[i].load;
+	 break;
+      }
+   }
+
+   /* the free slots match the DAT_END from reading past a truncated file */
+   if (!loader)
+      return -1;
+
+   job = _AL_MALLOC(sizeof(PARALLEL_JOB));
+   if (!job) {
+      *allegro_errno = ENOMEM;
+      return -1;
+   }
+
+   job->obj = obj;
+   job->load = loader;
+   job->raw = NULL;
+   job->raw_copy = NULL;
+   job->filesize = 0;
+   job->datasize = 0;
+   job->lz4 = (f->normal.flags & PACKFILE_FLAG_LZ4_CHUNKS);
+   job->state = JOB_DONE;
+
+   if (loader == load_file_object) {
+      /* nested datafile, whose objects get their jobs before this one */
+      ff = _pack_fopen_named_chunk(f, property_name(obj->prop));
+      if (!ff) {
+	 _AL_FREE(job);
+	 return -1;
+      }
+
+      obj->size = ff->normal.todo;
+      obj->dat = read_parallel_file(load, ff);
+      pack_fclose_chunk(ff);
+   }
+   else if (is_parallel_loader(loader)) {
+      /* copy the chunk out, unless it can be used from the mapping */
+      job->filesize = pack_mgetl(f);
+      job->datasize = pack_mgetl(f);
+      n = ABS(job->filesize);
+
+      job->raw = pack_fread_mapped(f, n);
+
+      if (!job->raw) {
+	 job->raw_copy = _AL_MALLOC_ATOMIC(MAX(n, 1));
+	 if (!job->raw_copy) {
+	    *allegro_errno = ENOMEM;
+	    _AL_FREE(job);
+	    return -1;
+	 }
+
+	 if (pack_fread(job->raw_copy, n, f) != n) {
+	    _AL_FREE(job->raw_copy);
+	    _AL_FREE(job);
+	    return -1;
+	 }
+
+	 job->raw = job->raw_copy;
+      }
+
+      job->state = JOB_QUEUED;
+   }
+   else {
+      load_object(obj, f, type, obj->prop);
+   }
+
+   /* a worker may have the job as soon as it is added */
+   ret = ((job->state == JOB_QUEUED) || (obj->dat)) ? 0 : -1;
+
+   add_parallel_job(load, job);
+
+   return ret;
+}
+
+
+
+/* read_parallel_file:
+ *  Reads a datafile object like load_file_object() does, but through
+ *  read_parallel_object(). The array is returned even if something fails,
+ *  so that whatever was loaded can be freed once the workers have stopped.
+ */
+static DATAFILE *read_parallel_file(PARALLEL_LOAD *load, PACKFILE *f)
+{
+   DATAFILE *dat;
+   DATAFILE_PROPERTY prop, *list;
+   unsigned long *hash;
+   int count, c, type, hash_count;
+
+   count = pack_mgetl(f);
+
+   dat = _AL_MALLOC(sizeof(DATAFILE)*(count+1));
+   if (!dat) {
+      *allegro_errno = ENOMEM;
+      fail_parallel_load(load);
+      return NULL;
+   }
+
+   dat[0].type = DAT_END;
+   dat[0].dat = NULL;
+
+   list = NULL;
+   hash = NULL;
+   hash_count = 0;
+
+   /* search the packfile for properties or objects */
+   for (c=0; c<count;) {
+      type = pack_mgetl(f);
+
+      if (type == DAT_PROPERTY) {
+	 if ((_load_property(&prop, f) != 0) || (_add_property(&list, &prop) != 0)) {
+	    fail_parallel_load(load);
+	    break;
+	 }
+      }
+      else if (type == DAT_NAME_INDEX) {
+	 if (hash)
+	    _AL_FREE(hash);
+	 hash = read_name_hashes(f, &hash_count);
+	 count--;
+      }
+      else {
+	 /* move the end-of-array marker first, for a partial unload */
+	 dat[c+1].type = DAT_END;
+	 dat[c+1].dat = NULL;
+
+	 dat[c].prop = list;
+	 list = NULL;
+
+	 if (read_parallel_object(load, dat+c, f, type) != 0) {
+	    fail_parallel_load(load);
+	    break;
+	 }
+
+	 c++;
+
+	 if (load->failed)
+	    break;
+      }
+   }
+
+   /* destroy the property list if not assigned to an object */
+   if (list)
+      _destroy_property_list(list);
+
+   if (hash) {
+      if (!load->failed)
+	 attach_stored_name_index(dat, c, hash, hash_count);
+      _AL_FREE(hash);
+   }
+
+   return dat;
+}
+
+
+
+/* start_parallel_load:
+ *  Starts the worker threads. Returns zero if none could be started.
+ */
+static int start_parallel_load(PARALLEL_LOAD *load, int threads, void (*callback)(DATAFILE *))
+{
+   memset(load, 0, sizeof(PARALLEL_LOAD));
+
+   load->callback = callback;
+   load->mutex = _al_create_mutex();
+   load->cond = _al_create_cond();
+
+   if ((load->mutex) && (load->cond)) {
+      if (threads <= 0)
+	 threads = _al_get_cpu_count();
+
+      threads = MIN(threads, PARALLEL_MAX_THREADS);
+
+      while (load->threads < threads) {
+	 load->thread[load->threads] = _al_create_thread(parallel_worker, load);
+	 if (!load->thread[load->threads])
+	    break;
+	 load->threads++;
+      }
+   }
+
+   if (load->threads > 0)
+      return TRUE;
+
+   if (load->cond)
+      _al_destroy_cond(load->cond);
+
+   if (load->mutex)
+      _al_destroy_mutex(load->mutex);
+
+   return FALSE;
+}
+
+
+
+/* finish_parallel_load:
+ *  Waits for the workers to finish and stops them. Returns dat, or frees
+ *  it and returns NULL if anything failed to load.
+ */
+static DATAFILE *finish_parallel_load(PARALLEL_LOAD *load, DATAFILE *dat)
+{
+   PARALLEL_JOB *job;
+   int i;
+
+   wait_parallel_load(load, 0);
+
+   _al_lock_mutex(load->mutex);
+   load->quit = TRUE;
+   _al_broadcast_cond(load->cond);
+   _al_unlock_mutex(load->mutex);
+
+   for (i=0; i<load->threads; i++)
+      _al_join_thread(load->thread[i]);
+
+   while (load->first) {
+      job = load->first;
+      load->first = job->next;
+      _AL_FREE(job);
+   }
+
+   _al_destroy_cond(load->cond);
+   _al_destroy_mutex(load->mutex);
+
+   if ((load->failed) || (!dat)) {
+      unload_datafile(dat);
+      dat = NULL;
+   }
+
+   return dat;
+}
+
+
+
+/* load_datafile_parallel:
+ *  Loads an entire data file into memory like load_datafile_callback(),
+ *  decoding the objects on the given number of worker threads. If threads
+ *  is zero or less, one is started per processor. On error, sets errno
+ *  and returns NULL.
+ */
+DATAFILE *load_datafile_parallel(AL_CONST char *filename, int threads, void (*callback)(DATAFILE *))
+{
+   PARALLEL_LOAD load;
+   PACKFILE *f;
+   DATAFILE *dat;
+   int type;
+   ASSERT(filename);
+
+   f = pack_fopen(filename, F_READ_PACKED);
+   if (!f)
+      return NULL;
+
+   if ((f->normal.flags & PACKFILE_FLAG_CHUNK) && (!(f->normal.flags & PACKFILE_FLAG_EXEDAT)))
+      type = (f->normal.flags & PACKFILE_FLAG_DAT_FILE) ? DAT_MAGIC : 0;
+   else {
+      type = pack_mgetl(f);
+      _allow_lz4_chunks(f, type);
+   }
+
+   if ((type == DAT_MAGIC_SEEK) && (_skip_datafile_offsets(f) == 0))
+      type = DAT_MAGIC;
+
+   if (type == V1_DAT_MAGIC) {
+      dat = read_old_datafile(f, callback);
+   }
+   else if ((type == DAT_MAGIC) || (type == DAT_MAGIC_LZ4)) {
+      if ((!(f->normal.flags & PACKFILE_FLAG_OLD_CRYPT)) && (start_parallel_load(&load, threads, callback))) {
+	 dat = read_parallel_file(&load, f);
+	 dat = finish_parallel_load(&load, dat);
+      }
+      else {
+	 /* old style encryption carries state from one chunk to the next,
+	  * and without any workers there is nothing to gain anyway
+	  */
+	 datafile_callback = callback;
+	 dat = load_file_object(f, 0);
+	 datafile_callback = NULL;
+      }
+   }
+   else
+      dat = NULL;
+
+   pack_fclose(f);
+   return dat;
+}
+
+
+
+/* _create_datafile_index:
+ *  Reads offsets of all objects inside datafile, from the table at the
+ *  start of the file if it has one, or else by skipping from one object
+ *  to the next, and stores how many there are in objects. The name index
+ *  isn't an object, so it is left out, as the loaders do. On error, sets
+ *  errno and returns NULL.
+ */
+DATAFILE_INDEX *_create_datafile_index(AL_CONST char *filename, int *objects)
+{
+   PACKFILE *f;
+   DATAFILE_INDEX *index;
+   long pos = 4;
+   long start;
+   int type, count, skip, i, n;
+
+   ASSERT(filename);
+   ASSERT(objects);
+
+   f = pack_fopen(filename, F_READ_PACKED);
+   if (!f)
+      return NULL;
+
+   if ((f->normal.flags & PACKFILE_FLAG_CHUNK) && (!(f->normal.flags & PACKFILE_FLAG_EXEDAT)))
+      type = (f->normal.flags & PACKFILE_FLAG_DAT_FILE) ? DAT_MAGIC : 0;
+   else {
+      type = pack_mgetl(f);   pos += 4;
+   }
+
+   /* only support V2 datafile format */
+   if ((type != DAT_MAGIC) && (type != DAT_MAGIC_LZ4) && (type != DAT_MAGIC_SEEK)) {
+      pack_fclose(f);
+      return NULL;
+   }
+
+   count = pack_mgetl(f);     pos += 4;
+
+   index = _AL_MALLOC(sizeof(DATAFILE_INDEX));
+   if (!index) {
+      pack_fclose(f);
+      *allegro_errno = ENOMEM;
+      return NULL;
+   }
+
+   index->filename = _al_ustrdup(filename);
+   if (!index->filename) {
+      pack_fclose(f);
+      _AL_FREE(index);
+      *allegro_errno = ENOMEM;
+      return NULL;
+   }
+
+   index->offset = _AL_MALLOC(sizeof(long) * count);
+   if (!index->offset) {
+      pack_fclose(f);
+      _AL_FREE(index->filename);
+      _AL_FREE(index);
+      *allegro_errno = ENOMEM;
+      return NULL;
+   }
+
+   if (type == DAT_MAGIC_SEEK) {
+      /* offsets are stored relative to the object count after the table,
+       * which counts the name index as well if there is one
+       */
+      for (i = 0; i < count; ++i)
+	 index->offset[i] = pos + count*4 + pack_mgetl(f);
+
+      if (pack_mgetl(f) < count) {
+	 pack_fclose(f);
+	 destroy_datafile_index(index);
+	 *allegro_errno = EINVAL;
+	 return NULL;
+      }
+
+      pack_fclose(f);
+      *objects = count;
+      return index;
+   }
+
+   for (i = 0, n = 0; i < count; ++i) {
+      start = pos;
 
       /* Skip properties */
-      while (pos += 4, pack_mgetl(f) == DAT_PROPERTY) {
+      while (pos += 4, (type = pack_mgetl(f)) == DAT_PROPERTY) {
 
          /* Skip property name */
          pack_fseek(f, 4);       pos += 4;
@@ -1473,17 +2386,34 @@ DATAFILE_INDEX *create_datafile_index(AL_CONST char *filename)
          pack_fseek(f, skip);    pos += skip;
       }
 
-      /* Skip rest of object */
-      skip = pack_mgetl(f) + 4;  pos += 4;
+      /* Skip rest of object, LZ4 chunks store negative sizes */
+      skip = pack_mgetl(f);      pos += 4;
+      skip = ABS(skip) + 4;
       pack_fseek(f, skip);       pos += skip;
 
+      if (type != DAT_NAME_INDEX)
+	 index->offset[n++] = start;
    }
    pack_fclose(f);
+   *objects = n;
    return index;
 }
 
 
 
+/* create_datafile_index
+ *  Reads offsets of all objects inside datafile. On error, sets errno and
+ *  returns NULL.
+ */
+DATAFILE_INDEX *create_datafile_index(AL_CONST char *filename)
+{
+   int objects;
+
+   return _create_datafile_index(filename, &objects);
+}
+
+
+
 /* load_datafile_object:
  *  Loads a single object from a datafile.
  */
@@ -1530,12 +2460,17 @@ DATAFILE *load_datafile_object(AL_CONST char *filename, AL_CONST char *objectnam
       return NULL;
 
    if ((f->normal.flags & PACKFILE_FLAG_CHUNK) && (!(f->normal.flags & PACKFILE_FLAG_EXEDAT)))
-      type = (_packfile_type == DAT_FILE) ? DAT_MAGIC : 0;
-   else
+      type = (f->normal.flags & PACKFILE_FLAG_DAT_FILE) ? DAT_MAGIC : 0;
+   else {
       type = pack_mgetl(f);
+      _allow_lz4_chunks(f, type);
+   }
+
+   if ((type == DAT_MAGIC_SEEK) && (_skip_datafile_offsets(f) == 0))
+      type = DAT_MAGIC;
 
    /* only support V2 datafile format */
-   if (type != DAT_MAGIC) {
+   if ((type != DAT_MAGIC) && (type != DAT_MAGIC_LZ4)) {
       pack_fclose(f);
       return NULL;
    }
@@ -1566,7 +2501,7 @@ DATAFILE *load_datafile_object(AL_CONST char *filename, AL_CONST char *objectnam
 	       break;
 	    }
 
-	    if (load_object(dat, f, type) != 0) {
+	    if (load_object(dat, f, type, list) != 0) {
 	       _AL_FREE(dat);
 	       dat = NULL;
 	       break;
@@ -1579,9 +2514,9 @@ DATAFILE *load_datafile_object(AL_CONST char *filename, AL_CONST char *objectnam
 	    break;
 	 }
 	 else {
-	    /* skip an unwanted object */
+	    /* skip an unwanted object, LZ4 chunks store negative sizes */
 	    size = pack_mgetl(f);
-	    pack_fseek(f, size+4);  /* '4' for the chunk size */
+	    pack_fseek(f, ABS(size)+4);  /* '4' for the chunk size */
 
 	    /* destroy the property list */
 	    if (list) {
@@ -1629,7 +2564,13 @@ DATAFILE *load_datafile_object_indexed(AL_CONST DATAFILE_INDEX *index, int item)
    }
 
    /* pack_fopen will read first 4 bytes for us */
-   pack_fseek(f, index->offset[item] - 4);
+   if ((f->normal.flags & PACKFILE_FLAG_CHUNK) && (!(f->normal.flags & PACKFILE_FLAG_EXEDAT)))
+      pack_fseek(f, index->offset[item] - 4);
+   else {
+      /* the datafile magic says whether the objects may be LZ4 packed */
+      _allow_lz4_chunks(f, pack_mgetl(f));
+      pack_fseek(f, index->offset[item] - 8);
+   }
 
    do
       type = pack_mgetl(f);
@@ -1637,7 +2578,7 @@ DATAFILE *load_datafile_object_indexed(AL_CONST DATAFILE_INDEX *index, int item)
                                   _add_property(&list, &prop) == 0);
 
 
-   if (load_object(dat, f, type) != 0) {
+   if (load_object(dat, f, type, list) != 0) {
       pack_fclose(f);
       _AL_FREE(dat);
       _destroy_property_list(list);
@@ -1692,6 +2633,8 @@ void unload_datafile(DATAFILE *dat)
    int i;
 
    if (dat) {
+      remove_name_index(dat);
+
       for (i=0; dat[i].type != DAT_END; i++)
 	 _unload_datafile_object(dat+i);
 
@@ -1734,6 +2677,8 @@ void unload_datafile_object(DATAFILE *dat)
 DATAFILE *find_datafile_object(AL_CONST DATAFILE *dat, AL_CONST char *objectname)
 {
    char name[512];
+   NAME_INDEX *index;
+   unsigned long hash;
    int recurse = FALSE;
    int pos, c;
    ASSERT(dat);
@@ -1753,21 +2698,103 @@ DATAFILE *find_datafile_object(AL_CONST DATAFILE *dat, AL_CONST char *objectname
    usetc(name+pos, 0);
 
    /* search for the requested object */
-   for (pos=0; dat[pos].type != DAT_END; pos++) {
-      if (ustricmp(name, get_datafile_property(dat+pos, DAT_NAME)) == 0) {
-	 if (recurse) {
-	    if (dat[pos].type == DAT_FILE)
-	       return find_datafile_object(dat[pos].dat, objectname);
-	    else
-	       return NULL;
-	 }
-	 else
-	    return (DATAFILE*)dat+pos;
+   pos = -1;
+
+   lock_name_indexes();
+
+   index = find_name_index(dat);
+
+   if (index) {
+      hash = _datafile_name_hash(name);
+
+      for (pos = index->bucket[hash & index->mask]; pos >= 0; pos = index->next[pos]) {
+	 if ((index->hash[pos] == hash) && (ustricmp(name, get_datafile_property(dat+pos, DAT_NAME)) == 0))
+	    break;
       }
    }
 
+   unlock_name_indexes();
+
+   /* an index can miss a name that was changed after it was built */
+   if (pos < 0) {
+      for (pos=0; dat[pos].type != DAT_END; pos++) {
+	 if (ustricmp(name, get_datafile_property(dat+pos, DAT_NAME)) == 0)
+	    break;
+      }
+
+      if (dat[pos].type == DAT_END)
+	 pos = -1;
+   }
+
    /* oh dear, the object isn't there... */
-   return NULL; 
+   if (pos < 0)
+      return NULL;
+
+   if (recurse) {
+      if (dat[pos].type == DAT_FILE)
+	 return find_datafile_object(dat[pos].dat, objectname);
+      else
+	 return NULL;
+   }
+
+   return (DATAFILE*)dat+pos;
+}
+
+
+
+/* create_datafile_name_index:
+ *  Builds hash indexes of the object names in a datafile and any datafiles
+ *  nested in it, to speed up find_datafile_object(). Returns 0 on success
+ *  and -1 on failure.
+ */
+int create_datafile_name_index(DATAFILE *dat)
+{
+   unsigned long *hash;
+   int count, ret, i;
+   ASSERT(dat);
+
+   ret = 0;
+
+   for (count=0; dat[count].type != DAT_END; count++) {
+      if ((dat[count].type == DAT_FILE) && (dat[count].dat)) {
+	 if (create_datafile_name_index(dat[count].dat) != 0)
+	    ret = -1;
+      }
+   }
+
+   hash = _AL_MALLOC_ATOMIC(sizeof(unsigned long) * MAX(count, 1));
+   if (!hash) {
+      *allegro_errno = ENOMEM;
+      return -1;
+   }
+
+   for (i=0; i<count; i++)
+      hash[i] = _datafile_name_hash(get_datafile_property(dat+i, DAT_NAME));
+
+   if (attach_name_index(dat, count, hash) != 0)
+      ret = -1;
+
+   _AL_FREE(hash);
+
+   return ret;
+}
+
+
+
+/* destroy_datafile_name_index:
+ *  Drops the name indexes of a datafile and any datafiles nested in it.
+ */
+void destroy_datafile_name_index(DATAFILE *dat)
+{
+   int i;
+   ASSERT(dat);
+
+   for (i=0; dat[i].type != DAT_END; i++) {
+      if ((dat[i].type == DAT_FILE) && (dat[i].dat))
+	 destroy_datafile_name_index(dat[i].dat);
+   }
+
+   remove_name_index(dat);
 }
 
 
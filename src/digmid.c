@@ -63,6 +63,9 @@ MIDI_DRIVER midi_digmid =
 
 #define MAX_LAYERS   64
 
+/* which drum the patch for instrument slot i is loaded as */
+#define PATCH_DRUM(i)   (((i) > 127) ? ((i) - 127) : 0)
+
 
 typedef struct PATCH_EXTRA          /* additional data for a Gravis PATCH */
 {
@@ -85,13 +88,104 @@ typedef struct PATCH                /* Gravis PATCH structure */
    SAMPLE *sample[MAX_LAYERS];      /* the waveform data */
    PATCH_EXTRA *extra[MAX_LAYERS];  /* additional waveform information */
    int master_vol;                  /* overall volume level */
+   char *name;                      /* file it was loaded from */
+   int drum;                        /* drum it was loaded for, or zero */
+   int refs;                        /* how many instruments use it */
+   long size;                       /* bytes of waveform data */
+   unsigned long used;              /* when it was last asked for */
+   struct PATCH *next;              /* next patch in the cache */
 } PATCH;
 
 
+/* SoundFont 2 generators that we know how to map onto a PATCH */
+#define SF2_START_OFFSET         0
+#define SF2_END_OFFSET           1
+#define SF2_LOOP_START_OFFSET    2
+#define SF2_LOOP_END_OFFSET      3
+#define SF2_START_COARSE         4
+#define SF2_END_COARSE           12
+#define SF2_PAN                  17
+#define SF2_HOLD_VOL_ENV         35
+#define SF2_DECAY_VOL_ENV        36
+#define SF2_SUSTAIN_VOL_ENV      37
+#define SF2_RELEASE_VOL_ENV      38
+#define SF2_INSTRUMENT           41
+#define SF2_KEY_RANGE            43
+#define SF2_VEL_RANGE            44
+#define SF2_LOOP_START_COARSE    45
+#define SF2_LOOP_END_COARSE      50
+#define SF2_COARSE_TUNE          51
+#define SF2_FINE_TUNE            52
+#define SF2_SAMPLE_ID            53
+#define SF2_SAMPLE_MODES         54
+#define SF2_SCALE_TUNING         56
+#define SF2_ROOT_KEY             58
+#define SF2_GENERATORS           61
+
+/* there are no velocity layers here, so zones are picked for this one */
+#define SF2_VELOCITY             100
+
+
+typedef struct SF2_GEN              /* a generator from a pgen or igen */
+{
+   int oper;
+   int amount;
+} SF2_GEN;
+
+
+typedef struct SF2_PRESET           /* a preset header from the phdr */
+{
+   int program;
+   int bank;
+   int bag;                         /* its first zone */
+} SF2_PRESET;
+
+
+typedef struct SF2_SAMPLE           /* a sample header from the shdr */
+{
+   long start;                      /* in sample points */
+   long end;
+   long loop_start;
+   long loop_end;
+   int freq;
+   int pitch;                       /* the MIDI key it was recorded at */
+   int correction;                  /* tuning error, in cents */
+   int type;
+} SF2_SAMPLE;
+
+
+typedef struct SF2_FONT             /* the parts of a SoundFont we use */
+{
+   long data_pos;                   /* file offset of the 16 bit waveforms */
+   long data_len;                   /* how many sample points they hold */
+   int num_presets;
+   SF2_PRESET *preset;
+   int num_pbags;
+   int *pbag;                       /* first generator of each preset zone */
+   int num_pgens;
+   SF2_GEN *pgen;
+   int num_insts;
+   int *inst;                       /* first zone of each instrument */
+   int num_ibags;
+   int *ibag;                       /* first generator of each zone */
+   int num_igens;
+   SF2_GEN *igen;
+   int num_samples;
+   SF2_SAMPLE *sample;
+} SF2_FONT;
+
+
 /* our instruments */
 static PATCH *patch[256];
 
 
+/* every patch we have loaded, used or not, most recently loaded first */
+static PATCH *patch_cache = NULL;
+static long patch_cache_size = 0;
+static long patch_cache_budget = -1;
+static unsigned long patch_cache_clock = 0;
+
+
 /* frequency table (generated by digmid_init) */
 static long ftbl[130]; 
 
@@ -125,6 +219,9 @@ static void destroy_patch(PATCH *pat)
 	 _AL_FREE(pat->extra[i]);
       }
 
+      if (pat->name)
+	 _AL_FREE(pat->name);
+
       UNLOCK_DATA(pat, sizeof(PATCH));
       _AL_FREE(pat);
    }
@@ -132,6 +229,117 @@ static void destroy_patch(PATCH *pat)
 
 
 
+/* find_cached_patch:
+ *  Looks for a patch that has already been loaded from the given file for
+ *  the given drum (or zero for an instrument).
+ */
+static PATCH *find_cached_patch(AL_CONST char *name, int drum)
+{
+   PATCH *p;
+
+   for (p=patch_cache; p; p=p->next)
+      if ((p->drum == drum) && (ustricmp(p->name, name) == 0))
+	 return p;
+
+   return NULL;
+}
+
+
+
+/* trim_patch_cache:
+ *  Destroys the least recently used patches that no instrument refers to,
+ *  until the cache fits in the given number of bytes (or nothing unused
+ *  is left).
+ */
+static void trim_patch_cache(long budget)
+{
+   PATCH *p, *lru, **link, **lru_link;
+   int i, j;
+
+   while ((budget >= 0) && (patch_cache_size > budget)) {
+      lru = NULL;
+      lru_link = NULL;
+
+      for (link=&patch_cache; (p = *link); link=&p->next) {
+	 if ((p->refs == 0) && ((!lru) || (p->used < lru->used))) {
+	    lru = p;
+	    lru_link = link;
+	 }
+      }
+
+      if (!lru)
+	 break;
+
+      /* voices still dying away mustn't look at it any more */
+      for (i=0; i<MIDI_VOICES; i++) {
+	 for (j=0; j<lru->samples; j++) {
+	    if (digmid_voice[i].e == lru->extra[j]) {
+	       digmid_voice[i].s = NULL;
+	       digmid_voice[i].e = NULL;
+	    }
+	 }
+      }
+
+      *lru_link = lru->next;
+      patch_cache_size -= lru->size;
+      destroy_patch(lru);
+   }
+}
+
+
+
+/* destroy_patch_cache:
+ *  Frees every cached patch when Allegro shuts down.
+ */
+static void destroy_patch_cache(void)
+{
+   trim_patch_cache(0);
+   _remove_exit_func(destroy_patch_cache);
+}
+
+
+
+/* cache_patch:
+ *  Adds a freshly loaded patch to the cache, returning it, or NULL if
+ *  there isn't enough memory (in which case the patch is destroyed).
+ */
+static PATCH *cache_patch(PATCH *p, AL_CONST char *name)
+{
+   p->name = _al_ustrdup(name);
+   if (!p->name) {
+      destroy_patch(p);
+      return NULL;
+   }
+
+   p->used = ++patch_cache_clock;
+   p->next = patch_cache;
+   patch_cache = p;
+   patch_cache_size += p->size;
+
+   return p;
+}
+
+
+
+/* use_patch:
+ *  Makes instrument i play the given patch, or nothing if it is NULL, and
+ *  drops whatever it used to play.
+ */
+static void use_patch(int i, PATCH *p)
+{
+   if (p) {
+      p->refs++;
+      p->used = ++patch_cache_clock;
+   }
+
+   if (patch[i])
+      patch[i]->refs--;
+
+   patch[i] = p;
+}
+
+
+
 /* scale64:
  *  Evalulates a*b/c using 64 bit arithmetic. This is used in an interrupt
  *  context, so we have to do it ourselves rather than relying on compiler
@@ -225,6 +433,13 @@ static PATCH *load_patch(PACKFILE *f, int drum)
       goto getout;
    }
 
+   p->name = NULL;
+   p->drum = drum;
+   p->refs = 0;
+   p->size = 0;
+   p->used = 0;
+   p->next = NULL;
+
    pack_fread(buf, 65, f);                         /* description */
    p->master_vol = pack_igetw(f);                  /* volume */
 
@@ -397,6 +612,7 @@ static PATCH *load_patch(PACKFILE *f, int drum)
       p->sample[i]->param = 0;
 
       p->sample[i]->data = _AL_MALLOC_ATOMIC(p->sample[i]->len*((p->sample[i]->bits==8) ? 1 : sizeof(short)));
+      p->size += p->sample[i]->len*((p->sample[i]->bits==8) ? 1 : sizeof(short));
       if (!p->sample[i]->data) {
 	 _AL_FREE(p->sample[i]);
 	 _AL_FREE(p->extra[i]);
@@ -448,6 +664,669 @@ static PATCH *load_patch(PACKFILE *f, int drum)
 
 
 
+/* destroy_sf2_font:
+ *  Frees the preset tables of a SoundFont.
+ */
+static void destroy_sf2_font(SF2_FONT *sf)
+{
+   if (sf) {
+      _AL_FREE(sf->preset);
+      _AL_FREE(sf->pbag);
+      _AL_FREE(sf->pgen);
+      _AL_FREE(sf->inst);
+      _AL_FREE(sf->ibag);
+      _AL_FREE(sf->igen);
+      _AL_FREE(sf->sample);
+      _AL_FREE(sf);
+   }
+}
+
+
+
+/* read_sf2_bags:
+ *  Reads a pbag or ibag chunk, or the bag indices of an inst chunk (which
+ *  come after a 20 byte name), into an array of indices.
+ */
+static int *read_sf2_bags(PACKFILE *f, int count, int skip, int rec_size)
+{
+   char buf[32];
+   int *bag;
+   int i;
+
+   bag = _AL_MALLOC_ATOMIC(MAX(count, 1) * sizeof(int));
+   if (!bag)
+      return NULL;
+
+   for (i=0; i<count; i++) {
+      pack_fread(buf, skip, f);
+      bag[i] = pack_igetw(f);
+      pack_fread(buf, rec_size-skip-2, f);
+   }
+
+   return bag;
+}
+
+
+
+/* read_sf2_gens:
+ *  Reads a pgen or igen chunk.
+ */
+static SF2_GEN *read_sf2_gens(PACKFILE *f, int count)
+{
+   SF2_GEN *gen;
+   int i;
+
+   gen = _AL_MALLOC_ATOMIC(MAX(count, 1) * sizeof(SF2_GEN));
+   if (!gen)
+      return NULL;
+
+   for (i=0; i<count; i++) {
+      gen[i].oper = pack_igetw(f);
+      gen[i].amount = (short)pack_igetw(f);
+   }
+
+   return gen;
+}
+
+
+
+/* read_sf2_chunk:
+ *  Reads one of the chunks from the pdta list of a SoundFont, returning the
+ *  number of bytes used, or -1 if there isn't enough memory.
+ */
+static long read_sf2_chunk(PACKFILE *f, SF2_FONT *sf, int id, long size)
+{
+   char buf[32];
+   int i, n;
+
+   if (id == DAT_ID('p','h','d','r')) {
+      n = size / 38;
+      sf->preset = _AL_MALLOC_ATOMIC(MAX(n, 1) * sizeof(SF2_PRESET));
+      if (!sf->preset)
+	 return -1;
+
+      for (i=0; i<n; i++) {
+	 pack_fread(buf, 20, f);                   /* name */
+	 sf->preset[i].program = pack_igetw(f);
+	 sf->preset[i].bank = pack_igetw(f);
+	 sf->preset[i].bag = pack_igetw(f);
+	 pack_fread(buf, 12, f);                   /* library, genre, morph */
+      }
+
+      sf->num_presets = n;
+      return n * 38;
+   }
+   else if ((id == DAT_ID('p','b','a','g')) || (id == DAT_ID('i','b','a','g'))) {
+      n = size / 4;
+      if (id == DAT_ID('p','b','a','g')) {
+	 sf->pbag = read_sf2_bags(f, n, 0, 4);
+	 sf->num_pbags = n;
+	 return (sf->pbag) ? n * 4 : -1;
+      }
+      else {
+	 sf->ibag = read_sf2_bags(f, n, 0, 4);
+	 sf->num_ibags = n;
+	 return (sf->ibag) ? n * 4 : -1;
+      }
+   }
+   else if (id == DAT_ID('i','n','s','t')) {
+      n = size / 22;
+      sf->inst = read_sf2_bags(f, n, 20, 22);
+      sf->num_insts = n;
+      return (sf->inst) ? n * 22 : -1;
+   }
+   else if (id == DAT_ID('p','g','e','n')) {
+      n = size / 4;
+      sf->pgen = read_sf2_gens(f, n);
+      sf->num_pgens = n;
+      return (sf->pgen) ? n * 4 : -1;
+   }
+   else if (id == DAT_ID('i','g','e','n')) {
+      n = size / 4;
+      sf->igen = read_sf2_gens(f, n);
+      sf->num_igens = n;
+      return (sf->igen) ? n * 4 : -1;
+   }
+   else if (id == DAT_ID('s','h','d','r')) {
+      n = size / 46;
+      sf->sample = _AL_MALLOC_ATOMIC(MAX(n, 1) * sizeof(SF2_SAMPLE));
+      if (!sf->sample)
+	 return -1;
+
+      for (i=0; i<n; i++) {
+	 pack_fread(buf, 20, f);                   /* name */
+	 sf->sample[i].start = pack_igetl(f);
+	 sf->sample[i].end = pack_igetl(f);
+	 sf->sample[i].loop_start = pack_igetl(f);
+	 sf->sample[i].loop_end = pack_igetl(f);
+	 sf->sample[i].freq = pack_igetl(f);
+	 sf->sample[i].pitch = pack_getc(f);
+	 sf->sample[i].correction = (signed char)pack_getc(f);
+	 pack_igetw(f);                            /* linked sample */
+	 sf->sample[i].type = pack_igetw(f);
+      }
+
+      sf->num_samples = n;
+      return n * 46;
+   }
+
+   return 0;
+}
+
+
+
+/* load_sf2_font:
+ *  Reads the preset, instrument and sample tables of a SoundFont, and
+ *  notes where its waveforms are without reading them.
+ */
+static SF2_FONT *load_sf2_font(AL_CONST char *filename)
+{
+   PACKFILE *f;
+   SF2_FONT *sf;
+   long pos, size, len, used;
+   int id, type;
+
+   f = pack_fopen(filename, F_READ);
+   if (!f)
+      return NULL;
+
+   id = pack_mgetl(f);
+   pack_igetl(f);                                  /* file size */
+   type = pack_mgetl(f);
+
+   if ((id != DAT_ID('R','I','F','F')) || (type != DAT_ID('s','f','b','k'))) {
+      pack_fclose(f);
+      *allegro_errno = EINVAL;
+      return NULL;
+   }
+
+   sf = _AL_MALLOC(sizeof(SF2_FONT));
+   if (!sf) {
+      pack_fclose(f);
+      *allegro_errno = ENOMEM;
+      return NULL;
+   }
+
+   memset(sf, 0, sizeof(SF2_FONT));
+   pos = 12;
+
+   while (!pack_feof(f)) {
+      id = pack_mgetl(f);
+      size = pack_igetl(f);
+      pos += 8;
+
+      if ((pack_feof(f)) || (size < 0))
+	 break;
+
+      if (id != DAT_ID('L','I','S','T')) {
+	 /* chunks are padded to an even length */
+	 pack_fseek(f, (size+1) & ~1);
+	 pos += (size+1) & ~1;
+	 continue;
+      }
+
+      type = pack_mgetl(f);
+      pos += 4;
+      size -= 4;
+
+      while ((size >= 8) && (!pack_feof(f))) {
+	 id = pack_mgetl(f);
+	 len = pack_igetl(f);
+	 pos += 8;
+	 size -= 8;
+
+	 if ((len < 0) || (len > size))
+	    break;
+
+	 used = 0;
+
+	 if ((type == DAT_ID('s','d','t','a')) && (id == DAT_ID('s','m','p','l'))) {
+	    sf->data_pos = pos;
+	    sf->data_len = len / 2;
+	 }
+	 else if (type == DAT_ID('p','d','t','a')) {
+	    used = read_sf2_chunk(f, sf, id, len);
+	    if (used < 0) {
+	       pack_fclose(f);
+	       destroy_sf2_font(sf);
+	       *allegro_errno = ENOMEM;
+	       return NULL;
+	    }
+	 }
+
+	 len = (len+1) & ~1;
+	 pack_fseek(f, len - used);
+	 pos += len;
+	 size -= len;
+      }
+   }
+
+   pack_fclose(f);
+
+   /* each table ends with a terminal record */
+   if ((sf->num_presets < 2) || (sf->num_pbags < 1) || (!sf->pgen) ||
+       (sf->num_insts < 2) || (sf->num_ibags < 1) || (!sf->igen) ||
+       (sf->num_samples < 2) || (sf->data_len <= 0)) {
+      destroy_sf2_font(sf);
+      *allegro_errno = EINVAL;
+      return NULL;
+   }
+
+   return sf;
+}
+
+
+
+/* find_sf2_preset:
+ *  Looks for the preset to use for a GM program, or the drum kit if the
+ *  program is negative. Returns its index, or -1 if there is none.
+ */
+static int find_sf2_preset(SF2_FONT *sf, int program)
+{
+   int bank = (program < 0) ? 128 : 0;
+   int best = -1;
+   int i;
+
+   program = MAX(program, 0);
+
+   for (i=0; i<sf->num_presets-1; i++) {
+      if (sf->preset[i].program != program)
+	 continue;
+
+      if (sf->preset[i].bank == bank)
+	 return i;
+
+      /* settle for a variation from another bank */
+      if ((best < 0) && ((bank == 128) == (sf->preset[i].bank == 128)))
+	 best = i;
+   }
+
+   return best;
+}
+
+
+
+/* set_sf2_gens:
+ *  Applies the generators of a zone on top of the values in gen.
+ */
+static void set_sf2_gens(int *gen, AL_CONST SF2_GEN *g, int first, int last)
+{
+   for (; first<last; first++)
+      if ((g[first].oper >= 0) && (g[first].oper < SF2_GENERATORS))
+	 gen[g[first].oper] = g[first].amount;
+}
+
+
+
+/* sf2_ms:
+ *  Converts an envelope time in timecents into milliseconds.
+ */
+static int sf2_ms(int timecents)
+{
+   return (int)(1000.0 * pow(2.0, MAX(timecents, -12000) / 1200.0));
+}
+
+
+
+/* read_sf2_waves:
+ *  Reads the 16 bit waveforms of all the layers of a patch, from the file
+ *  offsets in pos, converting them to Allegro's unsigned format. Packfiles
+ *  only seek forwards, so the layers are read in the order their data is
+ *  stored, and the file only has to be opened once. Returns zero on
+ *  success, or non-zero on error.
+ */
+static int read_sf2_waves(PATCH *p, AL_CONST char *filename, AL_CONST long *pos)
+{
+   int order[MAX_LAYERS];
+   PACKFILE *f = NULL;
+   SAMPLE *s, *prev;
+   unsigned char *src;
+   unsigned short *dst;
+   long at = 0;
+   long i, len;
+   int n, j, k;
+
+   /* sort the layers by where their data is */
+   for (n=0; n<p->samples; n++) {
+      for (j=n; (j > 0) && (pos[order[j-1]] > pos[n]); j--)
+	 order[j] = order[j-1];
+      order[j] = n;
+   }
+
+   for (k=0; k<p->samples; k++) {
+      n = order[k];
+      s = p->sample[n];
+      len = s->len;
+
+      /* zones often share a waveform */
+      if (k > 0) {
+	 prev = p->sample[order[k-1]];
+	 if ((pos[n] == pos[order[k-1]]) && (s->len == prev->len)) {
+	    memcpy(s->data, prev->data, len * sizeof(short));
+	    continue;
+	 }
+      }
+
+      /* overlapping ones mean going back, which needs the file again */
+      if ((f) && (pos[n] < at)) {
+	 pack_fclose(f);
+	 f = NULL;
+      }
+
+      if (!f) {
+	 f = pack_fopen(filename, F_READ);
+	 if (!f)
+	    return -1;
+	 at = 0;
+      }
+
+      if ((pack_fseek(f, pos[n] - at) != 0) || (pack_fread(s->data, len*2, f) < len*2)) {
+	 pack_fclose(f);
+	 return -1;
+      }
+
+      at = pos[n] + len*2;
+
+      src = s->data;
+      dst = s->data;
+
+      for (i=0; i<len; i++)
+	 dst[i] = (src[i*2] | (src[i*2+1] << 8)) ^ 0x8000;
+   }
+
+   pack_fclose(f);
+   return 0;
+}
+
+
+
+/* add_sf2_layer:
+ *  Turns one instrument zone into a layer of the patch. The waveform is
+ *  read afterwards, from the file offset stored in pos, so that notes never
+ *  have to wait for the file. Returns zero on success, or non-zero on error.
+ */
+static int add_sf2_layer(PATCH *p, SF2_FONT *sf, long *pos, int *gen, int low, int high, int drum_key)
+{
+   SF2_SAMPLE *sh;
+   PATCH_EXTRA *e;
+   SAMPLE *s;
+   long start, end, loop_start, loop_end;
+   double freq;
+   int loop, root, tune, atten;
+
+   if ((gen[SF2_SAMPLE_ID] < 0) || (gen[SF2_SAMPLE_ID] >= sf->num_samples-1) ||
+       (p->samples >= MAX_LAYERS))
+      return 0;
+
+   sh = sf->sample + gen[SF2_SAMPLE_ID];
+
+   /* samples in ROM are not in the file */
+   if (sh->type & 0x8000)
+      return 0;
+
+   start = sh->start + gen[SF2_START_OFFSET] + gen[SF2_START_COARSE] * 32768L;
+   end = sh->end + gen[SF2_END_OFFSET] + gen[SF2_END_COARSE] * 32768L;
+   loop_start = sh->loop_start + gen[SF2_LOOP_START_OFFSET] + gen[SF2_LOOP_START_COARSE] * 32768L;
+   loop_end = sh->loop_end + gen[SF2_LOOP_END_OFFSET] + gen[SF2_LOOP_END_COARSE] * 32768L;
+
+   if ((start < 0) || (end > sf->data_len) || (start >= end) || (sh->freq <= 0))
+      return 0;
+
+   loop = (((gen[SF2_SAMPLE_MODES] & 3) == 1) || ((gen[SF2_SAMPLE_MODES] & 3) == 3)) &&
+	  (loop_start >= start) && (loop_end <= end) && (loop_start < loop_end);
+
+   e = _AL_MALLOC_ATOMIC(sizeof(PATCH_EXTRA));
+   if (!e) {
+      *allegro_errno = ENOMEM;
+      return -1;
+   }
+
+   s = create_sample(16, FALSE, sh->freq, end - start);
+   if (!s) {
+      _AL_FREE(e);
+      return -1;
+   }
+
+   pos[p->samples] = sf->data_pos + start*2;
+
+   if (loop) {
+      s->loop_start = loop_start - start;
+      s->loop_end = loop_end - start;
+      e->play_mode = PLAYMODE_LOOP;
+   }
+   else
+      e->play_mode = 0;
+
+   root = (gen[SF2_ROOT_KEY] >= 0) ? gen[SF2_ROOT_KEY] : sh->pitch;
+   if ((root < 0) || (root > 127))
+      root = 60;
+
+   tune = gen[SF2_COARSE_TUNE] * 100 + gen[SF2_FINE_TUNE] + sh->correction;
+
+   e->pan = CLAMP(0, (gen[SF2_PAN] + 500) * 255 / 1000, 255);
+
+   /* the SoundFont envelope falls in decibels, ours ramps linearly */
+   atten = CLAMP(0, gen[SF2_SUSTAIN_VOL_ENV], 960);
+   e->sustain_level = (int)(255.0 * pow(10.0, -atten / 200.0));
+   e->decay_time = sf2_ms(gen[SF2_HOLD_VOL_ENV]) + sf2_ms(gen[SF2_DECAY_VOL_ENV]) * atten / 960;
+   e->release_time = sf2_ms(gen[SF2_RELEASE_VOL_ENV]);
+
+   if (e->sustain_level < 4)
+      e->sustain_level = 0;
+
+   if (e->release_time < 10)
+      e->release_time = 0;
+
+   if ((e->sustain_level == 0) && (e->decay_time == 0))
+      e->sustain_level = 255;
+
+   /* only unpitched zones can be done with the GUS style key scaling */
+   e->scale_freq = 60;
+   e->scale_factor = (gen[SF2_SCALE_TUNING] == 0) ? 0 : 1024;
+
+   if (drum_key >= 0) {
+      /* drums use a fixed frequency, and are never released */
+      freq = sh->freq * pow(2.0, ((drum_key - root) * gen[SF2_SCALE_TUNING] + tune) / 1200.0);
+      while (freq >= (1<<19)-1)
+	 freq /= 2;
+
+      s->freq = (int)freq;
+      e->low_note = 0;
+      e->high_note = INT_MAX;
+      e->base_note = ftbl[drum_key];
+
+      if (e->sustain_level > 0) {
+	 s->loop_start = 0;
+	 s->loop_end = s->len;
+	 e->play_mode = 0;
+      }
+   }
+   else {
+      e->low_note = ftbl[low];
+      e->high_note = ftbl[high];
+      e->base_note = (int)(ftbl[root] / pow(2.0, tune / 1200.0));
+   }
+
+   lock_sample(s);
+   LOCK_DATA(e, sizeof(PATCH_EXTRA));
+
+   p->sample[p->samples] = s;
+   p->extra[p->samples] = e;
+   p->samples++;
+
+   p->size += sizeof(SAMPLE) + sizeof(PATCH_EXTRA) + s->len * sizeof(short);
+
+   return 0;
+}
+
+
+
+/* load_sf2_patch:
+ *  Builds a patch for instrument slot i from the matching SoundFont preset,
+ *  with one layer for each instrument zone that a note at SF2_VELOCITY
+ *  could play (or just the zones for one key, for a drum).
+ */
+static PATCH *load_sf2_patch(SF2_FONT *sf, AL_CONST char *filename, int i)
+{
+   int pglobal[SF2_GENERATORS], pzone[SF2_GENERATORS];
+   int iglobal[SF2_GENERATORS], izone[SF2_GENERATORS];
+   int drum_key = (i > 127) ? (i - 128) : -1;
+   int preset, inst, pz, iz, pz_end, iz_end, g;
+   int low, high, vlow, vhigh;
+   long pos[MAX_LAYERS];
+   PATCH *p;
+
+   p = _AL_MALLOC(sizeof(PATCH));
+   if (!p) {
+      *allegro_errno = ENOMEM;
+      return NULL;
+   }
+
+   p->samples = 0;
+   p->master_vol = 64;
+   p->name = NULL;
+   p->drum = PATCH_DRUM(i);
+   p->refs = 0;
+   p->size = sizeof(PATCH);
+   p->used = 0;
+   p->next = NULL;
+
+   LOCK_DATA(p, sizeof(PATCH));
+
+   preset = find_sf2_preset(sf, (drum_key >= 0) ? -1 : i);
+   if (preset < 0)
+      return p;
+
+   /* preset level generators are offsets, apart from the ranges */
+   memset(pglobal, 0, sizeof(pglobal));
+   pglobal[SF2_KEY_RANGE] = pglobal[SF2_VEL_RANGE] = 127 << 8;
+   pglobal[SF2_INSTRUMENT] = -1;
+
+   pz = sf->preset[preset].bag;
+   pz_end = MIN(sf->preset[preset+1].bag, sf->num_pbags-1);
+
+   for (; pz<pz_end; pz++) {
+      memcpy(pzone, pglobal, sizeof(pzone));
+      set_sf2_gens(pzone, sf->pgen, sf->pbag[pz], MIN(sf->pbag[pz+1], sf->num_pgens));
+
+      inst = pzone[SF2_INSTRUMENT];
+
+      if ((inst < 0) || (inst >= sf->num_insts-1)) {
+	 /* the first zone can hold defaults for the others */
+	 if (pz == sf->preset[preset].bag)
+	    memcpy(pglobal, pzone, sizeof(pglobal));
+	 continue;
+      }
+
+      memset(iglobal, 0, sizeof(iglobal));
+      iglobal[SF2_KEY_RANGE] = iglobal[SF2_VEL_RANGE] = 127 << 8;
+      iglobal[SF2_HOLD_VOL_ENV] = iglobal[SF2_DECAY_VOL_ENV] = -12000;
+      iglobal[SF2_RELEASE_VOL_ENV] = -12000;
+      iglobal[SF2_SCALE_TUNING] = 100;
+      iglobal[SF2_ROOT_KEY] = iglobal[SF2_SAMPLE_ID] = -1;
+
+      iz = sf->inst[inst];
+      iz_end = MIN(sf->inst[inst+1], sf->num_ibags-1);
+
+      for (; iz<iz_end; iz++) {
+	 memcpy(izone, iglobal, sizeof(izone));
+	 set_sf2_gens(izone, sf->igen, sf->ibag[iz], MIN(sf->ibag[iz+1], sf->num_igens));
+
+	 if (izone[SF2_SAMPLE_ID] < 0) {
+	    if (iz == sf->inst[inst])
+	       memcpy(iglobal, izone, sizeof(iglobal));
+	    continue;
+	 }
+
+	 /* the zone plays where both its own and the preset ranges cover */
+	 low = MAX(izone[SF2_KEY_RANGE] & 0xFF, pzone[SF2_KEY_RANGE] & 0xFF);
+	 high = MIN((izone[SF2_KEY_RANGE] >> 8) & 0xFF, (pzone[SF2_KEY_RANGE] >> 8) & 0xFF);
+	 vlow = MAX(izone[SF2_VEL_RANGE] & 0xFF, pzone[SF2_VEL_RANGE] & 0xFF);
+	 vhigh = MIN((izone[SF2_VEL_RANGE] >> 8) & 0xFF, (pzone[SF2_VEL_RANGE] >> 8) & 0xFF);
+
+	 high = MIN(high, 127);
+
+	 if ((low > high) || (SF2_VELOCITY < vlow) || (SF2_VELOCITY > vhigh))
+	    continue;
+
+	 if ((drum_key >= 0) && ((drum_key < low) || (drum_key > high)))
+	    continue;
+
+	 for (g=0; g<SF2_GENERATORS; g++) {
+	    if ((g == SF2_PAN) || (g == SF2_COARSE_TUNE) || (g == SF2_FINE_TUNE) ||
+		(g == SF2_SCALE_TUNING) || ((g >= SF2_HOLD_VOL_ENV) && (g <= SF2_RELEASE_VOL_ENV)))
+	       izone[g] += pzone[g];
+	 }
+
+	 if (add_sf2_layer(p, sf, pos, izone, low, high, drum_key) != 0) {
+	    destroy_patch(p);
+	    return NULL;
+	 }
+      }
+   }
+
+   if (read_sf2_waves(p, filename, pos) != 0) {
+      destroy_patch(p);
+      return NULL;
+   }
+
+   return p;
+}
+
+
+
+/* load_sf2_set:
+ *  The SoundFont version of load_patch_set(). Presets come from bank 0, or
+ *  bank 128 for the drums, and only those the song uses are read in.
+ */
+static int load_sf2_set(AL_CONST char *font, AL_CONST char *patches, AL_CONST char *drums, int assign)
+{
+   SF2_FONT *sf = NULL;
+   char name[1024], tmp[16];
+   PATCH *pat;
+   int i;
+
+   for (i=0; i<256; i++) {
+      if (!((i < 128) ? patches[i] : drums[i-128])) {
+	 /* release the instruments this song doesn't use */
+	 if ((assign) && (patch[i]))
+	    use_patch(i, NULL);
+	 continue;
+      }
+
+      uszprintf(name, sizeof(name), uconvert_ascii("%s#%d", tmp), font, i);
+      pat = find_cached_patch(name, PATCH_DRUM(i));
+
+      if (!pat) {
+	 if (!sf) {
+	    sf = load_sf2_font(font);
+	    if (!sf)
+	       return -1;
+	 }
+
+	 pat = load_sf2_patch(sf, font, i);
+	 if (pat)
+	    pat = cache_patch(pat, name);
+      }
+
+      if (pat) {
+	 if (assign)
+	    use_patch(i, pat);
+	 else
+	    pat->used = ++patch_cache_clock;
+      }
+   }
+
+   destroy_sf2_font(sf);
+
+   if (assign)
+      trim_patch_cache(patch_cache_budget);
+
+   return 0;
+}
+
+
+
 /* _digmid_find_patches:
  *  Tries to locate the GUS patch set directory and index file (default.cfg).
  */
@@ -513,13 +1392,49 @@ static int parse_string(char *buf, char *argv[])
 
 
 
-/* digmid_load_patches:
- *  Reads the patches that are required by a particular song.
+/* patch_file_name:
+ *  Works out the name a patch is cached under: the full path of a .pat
+ *  file, or the datafile name followed by the object name.
  */
-static int digmid_load_patches(AL_CONST char *patches, AL_CONST char *drums)
+static void patch_file_name(char *filename, int size, AL_CONST char *dir, AL_CONST char *name)
+{
+   char tmp[16];
+
+   if (ustrchr(dir, '#')) {
+      ustrzcpy(filename, size, dir);
+      if ((ustrlen(filename) > 0) && (ugetat(filename, -1) != '#'))
+	 ustrzcat(filename, size, uconvert_ascii("#", tmp));
+      ustrzcat(filename, size, name);
+      return;
+   }
+
+   if (is_relative_filename(name)) {
+      ustrzcpy(filename, size, dir);
+      ustrzcat(filename, size, name);
+   }
+   else
+      ustrzcpy(filename, size, name);
+
+   if (ugetc(get_extension(filename)) == 0)
+      ustrzcat(filename, size, uconvert_ascii(".pat", tmp));
+}
+
+
+
+/* load_patch_set:
+ *  Makes sure the patches that are required by a particular song are in
+ *  the cache, reading any that aren't from the patch set. If assign is
+ *  set, the instruments are also switched over to the new song, the ones
+ *  it doesn't use are released, and the cache is trimmed: the MIDI player
+ *  passes the patches of every song that is playing and holds its clock
+ *  off while this is done, so no voice loses a patch that it is using.
+ *  Otherwise the patches are only loaded, which is safe while the player
+ *  is running since it never looks at the cache itself.
+ */
+static int load_patch_set(AL_CONST char *patches, AL_CONST char *drums, int assign)
 {
    PACKFILE *f;
-   char dir[1024], file[1024], buf[1024], filename[1024];
+   char dir[1024], file[1024], buf[1024], filename[1024], dat[1024];
    char todo[256][1024];
    char *argv[16], *p;
    char tmp[128];
@@ -529,11 +1444,18 @@ static int digmid_load_patches(AL_CONST char *patches, AL_CONST char *drums)
    int override_mode = FALSE;
    int drum_start = 0;
    int type, size;
-   int i, j, c;
+   int i, j, c, left, found;
+   PATCH *pat;
 
    if (!_digmid_find_patches(dir, sizeof(dir), file, sizeof(file)))
       return -1;
 
+   if (ustricmp(get_extension(file), uconvert_ascii("sf2", tmp)) == 0) {
+      ustrzcpy(buf, sizeof(buf), dir);
+      ustrzcat(buf, sizeof(buf), file);
+      return load_sf2_set(buf, patches, drums, assign);
+   }
+
    for (i=0; i<256; i++)
       usetc(todo[i], 0);
 
@@ -582,10 +1504,8 @@ static int digmid_load_patches(AL_CONST char *patches, AL_CONST char *drums)
 		  if (drum_mode)
 		     patchnum += drum_start;
 
-		  if (!patch[patchnum]) {
-		     /* need to load this sample */
+		  if ((patchnum >= 0) && (patchnum < 256))
 		     ustrzcpy(todo[patchnum], sizeof(todo[patchnum]), argv[1]);
-		  }
 	       }
 	    }
 	 }
@@ -601,116 +1521,209 @@ static int digmid_load_patches(AL_CONST char *patches, AL_CONST char *drums)
 
    pack_fclose(f);
 
-   if (ustrchr(dir, '#')) {
-      /* read from a datafile */
-      if ((ustrlen(dir) > 1) && (ugetat(dir, -1) == '#'))
-	 usetat(dir, -1, 0);
+   /* release the instruments this song doesn't use */
+   if (assign) {
+      for (i=0; i<256; i++)
+	 if ((patch[i]) && (!ugetc(todo[i])))
+	    use_patch(i, NULL);
+   }
 
-      f = pack_fopen(dir, F_READ_PACKED);
-      if (!f)
-	 return -1;
+   /* take whatever we can from the cache */
+   left = 0;
 
-      if (((ugetc(dir) == '#') && (ustrlen(dir) == 1)) || (!ustrchr(dir, '#'))) {
-	 type = pack_mgetl(f);
-	 if (type != DAT_MAGIC) {
-	    pack_fclose(f);
-	    return -1;
+   for (i=0; i<256; i++) {
+      if (ugetc(todo[i])) {
+	 patch_file_name(filename, sizeof(filename), dir, todo[i]);
+	 pat = find_cached_patch(filename, PATCH_DRUM(i));
+
+	 if (pat) {
+	    if (assign)
+	       use_patch(i, pat);
+	    else
+	       pat->used = ++patch_cache_clock;
+	    usetc(todo[i], 0);
 	 }
+	 else
+	    left++;
       }
+   }
+
+   if ((left) && (ustrchr(dir, '#'))) {
+      /* read from a datafile */
+      ustrzcpy(dat, sizeof(dat), dir);
+      if ((ustrlen(dat) > 1) && (ugetat(dat, -1) == '#'))
+	 usetat(dat, -1, 0);
+
+      /* a file that is mapped to more than one drum needs loading once
+	 for each of them, so we may have to go through it again */
+      do {
+	 f = pack_fopen(dat, F_READ_PACKED);
+	 if (!f)
+	    return -1;
 
-      pack_mgetl(f);
+	 if (((ugetc(dat) == '#') && (ustrlen(dat) == 1)) || (!ustrchr(dat, '#'))) {
+	    type = pack_mgetl(f);
+	    _allow_lz4_chunks(f, type);
+	    if ((type == DAT_MAGIC_SEEK) && (_skip_datafile_offsets(f) == 0))
+	       type = DAT_MAGIC;
+	    if ((type != DAT_MAGIC) && (type != DAT_MAGIC_LZ4)) {
+	       pack_fclose(f);
+	       return -1;
+	    }
+	 }
 
-      usetc(filename, 0);
+	 pack_mgetl(f);
 
-      /* scan through the file */
-      while (!pack_feof(f)) {
-	 type = pack_mgetl(f);
+	 usetc(buf, 0);
+	 found = FALSE;
 
-	 if (type == DAT_PROPERTY) {
+	 /* scan through the file */
+	 while (!pack_feof(f)) {
 	    type = pack_mgetl(f);
-	    size = pack_mgetl(f);
 
-	    if (type == DAT_ID('N','A','M','E')) {
-	       /* store name property */
-	       pack_fread(buf, size, f);
-	       buf[size] = 0;
-	       do_uconvert(buf, U_ASCII, filename, U_CURRENT, sizeof(filename));
-	    }
-	    else {
-	       /* skip other properties */
-	       pack_fseek(f, size);
+	    if (type == DAT_PROPERTY) {
+	       type = pack_mgetl(f);
+	       size = pack_mgetl(f);
+
+	       if (type == DAT_ID('N','A','M','E')) {
+		  /* store name property */
+		  pack_fread(file, MIN(size, (int)sizeof(file)-1), f);
+		  file[MIN(size, (int)sizeof(file)-1)] = 0;
+		  if (size > (int)sizeof(file)-1)
+		     pack_fseek(f, size - ((int)sizeof(file)-1));
+		  do_uconvert(file, U_ASCII, buf, U_CURRENT, sizeof(buf));
+	       }
+	       else {
+		  /* skip other properties */
+		  pack_fseek(f, size);
+	       }
 	    }
-	 }
-	 else if (type == DAT_PATCH) {
-	    /* do we want this patch? */
-	    for (i=0; i<256; i++)
-	       if (ugetc(todo[i]) && (ustricmp(filename, todo[i]) == 0))
-		  break;
-
-	    if (i < 256) {
-	       /* load this patch */
-	       f = pack_fopen_chunk(f, FALSE);
-	       patch[i] = load_patch(f, ((i > 127) ? (i - 127) : 0));
-	       f = pack_fclose_chunk(f);
-
-	       for (j=i+1; j<256; j++) {
-		  /* share multiple copies of the instrument */
-		  if (ustricmp(todo[i], todo[j]) == 0) {
-		     patch[j] = patch[i];
-		     usetc(todo[j], 0);
+	    else if (type == DAT_PATCH) {
+	       /* do we want this patch? */
+	       for (i=0; i<256; i++)
+		  if (ugetc(todo[i]) && (ustricmp(buf, todo[i]) == 0))
+		     break;
+
+	       if (i < 256) {
+		  /* load this patch */
+		  f = pack_fopen_chunk(f, FALSE);
+		  pat = load_patch(f, PATCH_DRUM(i));
+		  f = pack_fclose_chunk(f);
+
+		  patch_file_name(filename, sizeof(filename), dir, todo[i]);
+		  found = TRUE;
+
+		  if (pat)
+		     pat = cache_patch(pat, filename);
+
+		  for (j=i; j<256; j++) {
+		     /* share multiple copies of the instrument */
+		     if ((j == i) || ((ugetc(todo[j])) &&
+				      (ustricmp(todo[i], todo[j]) == 0) &&
+				      (PATCH_DRUM(j) == PATCH_DRUM(i)))) {
+			if ((pat) && (assign))
+			   use_patch(j, pat);
+			if (j > i)
+			   usetc(todo[j], 0);
+		     }
 		  }
-	       }
 
-	       usetc(todo[i], 0);
+		  usetc(todo[i], 0);
+	       }
+	       else {
+		  /* skip unwanted patch */
+		  size = pack_mgetl(f);
+		  pack_fseek(f, ABS(size)+4);
+	       }
 	    }
 	    else {
-	       /* skip unwanted patch */
+	       /* skip unwanted object, LZ4 chunks store negative sizes */
 	       size = pack_mgetl(f);
-	       pack_fseek(f, size+4);
+	       pack_fseek(f, ABS(size)+4);
 	    }
 	 }
-	 else {
-	    /* skip unwanted object */
-	    size = pack_mgetl(f);
-	    pack_fseek(f, size+4);
-	 }
-      }
+
+	 pack_fclose(f);
+
+	 left = 0;
+	 for (i=0; i<256; i++)
+	    if (ugetc(todo[i]))
+	       left++;
+
+      } while ((left) && (found));
    }
-   else {
+   else if (left) {
       /* read from regular disk files */
       for (i=0; i<256; i++) {
 	 if (ugetc(todo[i])) {
-	    if (is_relative_filename(todo[i])) {
-	       ustrzcpy(filename, sizeof(filename), dir);
-	       ustrzcat(filename, sizeof(filename), todo[i]);
-            } else
-	       ustrzcpy(filename, sizeof(filename), todo[i]);
-
-	    if (ugetc(get_extension(filename)) == 0)
-	       ustrzcat(filename, sizeof(filename), uconvert_ascii(".pat", tmp));
-
-	    f = pack_fopen(filename, F_READ);
-	    if (f) {
-	       patch[i] = load_patch(f, ((i > 127) ? (i - 127) : 0));
-	       pack_fclose(f);
+	    patch_file_name(filename, sizeof(filename), dir, todo[i]);
+
+	    /* an earlier instrument may have loaded it already */
+	    pat = find_cached_patch(filename, PATCH_DRUM(i));
+
+	    if (!pat) {
+	       f = pack_fopen(filename, F_READ);
+	       if (f) {
+		  pat = load_patch(f, PATCH_DRUM(i));
+		  pack_fclose(f);
+		  if (pat)
+		     pat = cache_patch(pat, filename);
+	       }
 	    }
 
-	    for (j=i+1; j<256; j++) {
-	       /* share multiple copies of the instrument */
-	       if (ustricmp(todo[i], todo[j]) == 0) {
-		  patch[j] = patch[i];
-		  usetc(todo[j], 0);
-	       }
+	    if (pat) {
+	       if (assign)
+		  use_patch(i, pat);
+	       else
+		  pat->used = ++patch_cache_clock;
 	    }
 	 }
       }
    }
 
+   if (assign)
+      trim_patch_cache(patch_cache_budget);
+
    return 0;
 }
 
 
 
+/* digmid_load_patches:
+ *  Reads the patches that are required by a particular song.
+ */
+static int digmid_load_patches(AL_CONST char *patches, AL_CONST char *drums)
+{
+   return load_patch_set(patches, drums, TRUE);
+}
+
+
+
+/* _digmid_precache_patches:
+ *  Loads the patches that a song will need into the cache, without
+ *  touching the ones that are in use, so that a later play_midi() of that
+ *  song doesn't have to wait for them.
+ */
+int _digmid_precache_patches(AL_CONST char *patches, AL_CONST char *drums)
+{
+   return load_patch_set(patches, drums, FALSE);
+}
+
+
+
+/* _digmid_trim_patches:
+ *  Drops unused patches until the cache fits in its budget again, after
+ *  _digmid_precache_patches() has added to it. This destroys samples that
+ *  voices may still be dying away with, so the MIDI player must not be
+ *  running at the time.
+ */
+void _digmid_trim_patches(void)
+{
+   trim_patch_cache(patch_cache_budget);
+}
+
+
+
 /* digmid_freq:
  *  Helper for converting note numbers to sample frequencies.
  */ 
@@ -761,13 +1774,13 @@ static void digmid_trigger(int inst, int snum, int note, int bend, int vol, int
    PATCH_EXTRA *e;
    SAMPLE *s;
 
+   s = patch[inst]->sample[snum];
+   e = patch[inst]->extra[snum];
+
    voice = _midi_allocate_voice(-1, -1);
    if (voice < 0)
       return;
 
-   s = patch[inst]->sample[snum];
-   e = patch[inst]->extra[snum];
-
    if (inst > 127) {
       pan = e->pan;
       freq = s->freq;
@@ -868,7 +1881,7 @@ static void digmid_key_off(int voice)
 {
    DIGMID_VOICE *info = &digmid_voice[voice - midi_digmid.basevoice];
 
-   if (info->inst > 127) 
+   if ((info->inst > 127) || (!info->e))
       return;
 
    if (info->e->release_time > 0)
@@ -889,7 +1902,7 @@ static void digmid_set_volume(int voice, int vol)
    DIGMID_VOICE *info = &digmid_voice[voice - midi_digmid.basevoice];
    int v;
 
-   if (info->inst > 127) 
+   if ((info->inst > 127) || (!info->e))
       return;
 
    vol *= 2;
@@ -940,7 +1953,7 @@ static void digmid_set_pitch(int voice, int note, int bend)
    DIGMID_VOICE *info = &digmid_voice[voice - midi_digmid.basevoice];
    int freq;
 
-   if (info->inst > 127)
+   if ((info->inst > 127) || (!info->e))
       return;
 
    freq = digmid_freq(info->inst, info->s, info->e, note, bend);
@@ -956,7 +1969,7 @@ static void digmid_set_pan(int voice, int pan)
 {
    DIGMID_VOICE *info = &digmid_voice[voice - midi_digmid.basevoice];
 
-   if (info->inst > 127)
+   if ((info->inst > 127) || (!info->e))
       return;
 
    pan *= 2;
@@ -990,6 +2003,7 @@ static int digmid_detect(int input)
  */
 static int digmid_init(int input, int voices)
 {
+   char tmp1[64], tmp2[64];
    float f;
    int i;
 
@@ -998,6 +2012,12 @@ static int digmid_init(int input, int voices)
    for (i=0; i<256; i++)
       patch[i] = NULL;
 
+   i = get_config_int(uconvert_ascii("sound", tmp1), uconvert_ascii("patch_cache", tmp2), -1);
+   patch_cache_budget = (i >= 0) ? (long)i * 1024 : -1;
+
+   /* this runs after remove_sound(), which is added once we are done */
+   _add_exit_func(destroy_patch_cache, "destroy_patch_cache");
+
    midi_digmid.voices = voices;
 
    /* A10 = 14080.000 hz */
@@ -1032,18 +2052,13 @@ static int digmid_init(int input, int voices)
  */
 static void digmid_exit(int input)
 {
-   int i, j;
+   int i;
 
-   for (i=0; i<256; i++) {
-      if (patch[i]) {
-	 for (j=i+1; j<256; j++) {
-	    if (patch[j] == patch[i])
-	       patch[j] = NULL;
-	 }
-	 destroy_patch(patch[i]);
-	 patch[i] = NULL;
-      }
-   }
+   for (i=0; i<256; i++)
+      use_patch(i, NULL);
+
+   /* without a budget the cache only lives as long as the driver */
+   trim_patch_cache(MAX(patch_cache_budget, 0));
 }
 
 
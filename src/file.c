@@ -39,6 +39,10 @@
    #include <pwd.h>                 /* for tilde expansion */
 #endif
 
+#ifdef ALLEGRO_LEGACY_HAVE_MMAP
+   #include <sys/mman.h>
+#endif
+
 #ifdef ALLEGRO_LEGACY_WINDOWS
    #include "winalleg.h" /* for GetTempPath */
 #endif
@@ -67,6 +71,12 @@
 
 
 static char the_password[256] = EMPTY_STRING;
+static int the_crypt = F_CRYPT_XOR;
+
+static PACKFILE_STATS the_stats;          /* from all the closed files */
+static void *stats_mutex = NULL;
+
+static void (*trace_callback)(int event, PACKFILE *f, AL_CONST char *name) = NULL;
 
 int _packfile_filesize = 0;
 int _packfile_datasize = 0;
@@ -74,7 +84,11 @@ int _packfile_datasize = 0;
 int _packfile_type = 0;
 
 static PACKFILE_VTABLE normal_vtable;
+static PACKFILE_VTABLE mmap_vtable;
 
+static void map_packfile(PACKFILE *f);
+
+static PACKFILE *open_file(AL_CONST char *filename, AL_CONST char *mode);
 static PACKFILE *pack_fopen_special_file(AL_CONST char *filename, AL_CONST char *mode);
 
 static int filename_encoding = U_ASCII;
@@ -1301,7 +1315,7 @@ static PACKFILE *pack_fopen_exe_file(void)
       return NULL;
    }
 
-   f = pack_fopen(exe_name, F_READ);
+   f = open_file(exe_name, F_READ);
    if (!f)
       return NULL;
 
@@ -1320,7 +1334,7 @@ static PACKFILE *pack_fopen_exe_file(void)
 
    /* rewind */
    pack_fclose(f);
-   f = pack_fopen(exe_name, F_READ);
+   f = open_file(exe_name, F_READ);
    if (!f)
       return NULL;
 
@@ -1394,14 +1408,19 @@ static PACKFILE *pack_fopen_datafile_object(PACKFILE *f, AL_CONST char *objname)
 		  break;
 	    }
 	    else {
+	       /* the global is only kept for old code, since several
+		  threads may be doing this at once */
 	       _packfile_type = type;
-	       return pack_fopen_chunk(f, FALSE);
+	       f = pack_fopen_chunk(f, FALSE);
+	       if ((f) && (type == DAT_FILE))
+		  f->normal.flags |= PACKFILE_FLAG_DAT_FILE;
+	       return f;
 	    }
 	 }
 	 else {
-	    /* skip unwanted object */
+	    /* skip unwanted object, LZ4 chunks store negative sizes */
 	    size = pack_mgetl(f);
-	    pack_fseek(f, size+4);
+	    pack_fseek(f, ABS(size)+4);
 	 }
       }
    }
@@ -1423,6 +1442,7 @@ static PACKFILE *pack_fopen_special_file(AL_CONST char *filename, AL_CONST char
    char fname[1024], objname[512], tmp[16];
    PACKFILE *f;
    char *p;
+   long magic;
    int c;
 
    /* special files are read-only */
@@ -1452,11 +1472,17 @@ static PACKFILE *pack_fopen_special_file(AL_CONST char *filename, AL_CONST char
       }
 
       /* open the file */
-      f = pack_fopen(fname, F_READ_PACKED);
+      f = open_file(fname, F_READ_PACKED);
       if (!f)
 	 return NULL;
 
-      if (pack_mgetl(f) != DAT_MAGIC) {
+      magic = pack_mgetl(f);
+      _allow_lz4_chunks(f, magic);
+
+      if ((magic == DAT_MAGIC_SEEK) && (_skip_datafile_offsets(f) == 0))
+	 magic = DAT_MAGIC;
+
+      if ((magic != DAT_MAGIC) && (magic != DAT_MAGIC_LZ4)) {
 	 pack_fclose(f);
 	 *allegro_errno = ENOTDIR;
 	 return NULL;
@@ -1492,48 +1518,183 @@ void packfile_password(AL_CONST char *password)
 
 
 
-/* encrypt_id:
- *  Helper for encrypting magic numbers, using the current password.
+/* packfile_crypt:
+ *  Sets how the password encrypts files opened from now on: by xoring the
+ *  data with the password, or with the ChaCha20 cipher. Files with a
+ *  header are read back whichever way they were written.
+ */
+void packfile_crypt(int mode)
+{
+   ASSERT((mode == F_CRYPT_XOR) || (mode == F_CRYPT_CHACHA20));
+
+   the_crypt = mode;
+}
+
+
+
+/* crypt_id:
+ *  Returns the first four bytes of the key stream of the current password
+ *  in the given mode, the way pack_mgetl() would see them. For the XOR
+ *  mode the password characters are taken as plain chars, which older
+ *  versions let sign extend into the bytes above them: files written that
+ *  way must still be recognised.
  */
-static int32_t encrypt_id(long x, int new_format)
+static uint32_t crypt_id(int mode)
 {
-   int32_t mask = 0;
+   CHACHA20_DATA *cipher;
+   unsigned char b[4] = { 0, 0, 0, 0 };
+   uint32_t id = 0;
    int i, pos;
 
+   if (mode == F_CRYPT_CHACHA20) {
+      if ((cipher = _al_create_chacha20_data(the_password)) != NULL) {
+	 _al_chacha20_crypt(cipher, b, 4);
+	 _al_free_chacha20_data(cipher);
+      }
+
+      return ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+   }
+
+   for (i=0, pos=0; i<4; i++) {
+      id ^= (uint32_t)the_password[pos++] << (24-i*8);
+      if (!the_password[pos])
+	 pos = 0;
+   }
+
+   return id;
+}
+
+
+
+/* encrypt_id_mode:
+ *  Helper for encrypting magic numbers, using the current password in the
+ *  given mode. Files written with ChaCha20 get a different mask, so that
+ *  reading can tell them apart.
+ */
+static long encrypt_id_mode(long x, int new_format, int mode)
+{
+   uint32_t mask = 0;
+   int i;
+
    if (the_password[0]) {
       for (i=0; the_password[i]; i++)
-	 mask ^= ((int32_t)the_password[i] << ((i&3) * 8));
+	 mask ^= ((uint32_t)the_password[i] << ((i&3) * 8));
 
-      for (i=0, pos=0; i<4; i++) {
-	 mask ^= (int32_t)the_password[pos++] << (24-i*8);
-	 if (!the_password[pos])
-	    pos = 0;
-      }
+      mask ^= crypt_id(mode);
 
       if (new_format)
-	 mask ^= 42;
+	 mask ^= (mode == F_CRYPT_CHACHA20) ? 0x2A2A : 42;
+   }
+
+   /* the top bit of the mask can be set, so the result is kept to 32
+    * bits the same way pack_mgetl() reads it
+    */
+   return (long)((uint32_t)x ^ mask);
+}
+
+
+
+/* encrypt_id:
+ *  Helper for encrypting magic numbers, using the current password.
+ */
+static long encrypt_id(long x, int new_format)
+{
+   return encrypt_id_mode(x, new_format, the_crypt);
+}
+
+
+
+/* _al_xor_bytes:
+ *  Xors size bytes of key into buf, a word at a time.
+ */
+void _al_xor_bytes(unsigned char *buf, AL_CONST unsigned char *key, long size)
+{
+   uint64_t a, b;
+
+   while (size >= (long)sizeof(a)) {
+      memcpy(&a, buf, sizeof(a));
+      memcpy(&b, key, sizeof(b));
+      a ^= b;
+      memcpy(buf, &a, sizeof(a));
+      buf += sizeof(a);
+      key += sizeof(a);
+      size -= sizeof(a);
    }
 
-   return x ^ mask;
+   while (size-- > 0)
+      *(buf++) ^= *(key++);
+}
+
+
+
+/* crypt_buffer:
+ *  Encrypts or decrypts raw file data with the password, moving the key
+ *  on. If p is NULL, the key is moved on without doing anything.
+ */
+static void crypt_buffer(PACKFILE *f, unsigned char *p, long n)
+{
+   long len, pos, i;
+
+   if (f->normal.flags & PACKFILE_FLAG_CHACHA20) {
+      _al_chacha20_crypt(f->normal.cipher, p, n);
+      return;
+   }
+
+   len = strlen(f->normal.passdata);
+   pos = f->normal.passpos - f->normal.passdata;
+
+   while (n > 0) {
+      i = MIN(n, len - pos);
+      if (p) {
+	 _al_xor_bytes(p, (unsigned char *)f->normal.passdata + pos, i);
+	 p += i;
+      }
+      n -= i;
+      pos += i;
+      if (pos == len)
+	 pos = 0;
+   }
+
+   f->normal.passpos = f->normal.passdata + pos;
 }
 
 
 
 /* clone_password:
- *  Sets up a local password string for use by this packfile.
+ *  Sets up a local password string for use by this packfile. It holds the
+ *  password repeated to at least a kilobyte, so that it can be xored with
+ *  the data in long runs; that doesn't change where the key wraps around.
  */
 static int clone_password(PACKFILE *f)
 {
+   int len, size;
+
    ASSERT(f);
    ASSERT(f->is_normal_packfile);
 
    if (the_password[0]) {
-      if ((f->normal.passdata = _AL_MALLOC_ATOMIC(strlen(the_password)+1)) == NULL) {
+      len = strlen(the_password);
+      size = ((1024 + len - 1) / len) * len;
+
+      if ((f->normal.passdata = _AL_MALLOC_ATOMIC(size+1)) == NULL) {
 	 *allegro_errno = ENOMEM;
 	 return FALSE;
       }
-      _al_sane_strncpy(f->normal.passdata, the_password, strlen(the_password)+1);
+
+      for (f->normal.passdata[0]=0; (int)strlen(f->normal.passdata) < size; )
+	 strcat(f->normal.passdata, the_password);
+
       f->normal.passpos = f->normal.passdata;
+
+      if (the_crypt == F_CRYPT_CHACHA20) {
+	 if ((f->normal.cipher = _al_create_chacha20_data(the_password)) == NULL) {
+	    _AL_FREE(f->normal.passdata);
+	    f->normal.passdata = NULL;
+	    f->normal.passpos = NULL;
+	    return FALSE;
+	 }
+	 f->normal.flags |= PACKFILE_FLAG_CHACHA20;
+      }
    }
    else {
       f->normal.passpos = NULL;
@@ -1545,6 +1706,265 @@ static int clone_password(PACKFILE *f)
 
 
 
+/* switch_crypt:
+ *  Changes a freshly opened raw file over to the other way of encrypting,
+ *  after its header showed that it was written that way. The first buffer
+ *  has already been decrypted, so it is put back as it was on the disk and
+ *  done again. Returns FALSE if there isn't enough memory.
+ */
+static int switch_crypt(PACKFILE *f, int mode)
+{
+   long n = f->normal.buf_pos - f->normal.buf + MAX(f->normal.buf_size, 0);
+
+   ASSERT(!f->normal.parent);
+
+   if (f->normal.flags & PACKFILE_FLAG_CHACHA20)
+      _al_rewind_chacha20(f->normal.cipher);
+   else
+      f->normal.passpos = f->normal.passdata;
+
+   crypt_buffer(f, f->normal.buf, n);
+
+   if (mode == F_CRYPT_CHACHA20) {
+      if ((f->normal.cipher = _al_create_chacha20_data(the_password)) == NULL)
+	 return FALSE;
+      f->normal.flags |= PACKFILE_FLAG_CHACHA20;
+   }
+   else {
+      _al_free_chacha20_data(f->normal.cipher);
+      f->normal.cipher = NULL;
+      f->normal.flags &= ~PACKFILE_FLAG_CHACHA20;
+      f->normal.passpos = f->normal.passdata;
+   }
+
+   crypt_buffer(f, f->normal.buf, n);
+
+   return TRUE;
+}
+
+
+
+/* write_file_nonce:
+ *  Writes a new nonce straight after the magic number of a raw file that
+ *  is encrypted with ChaCha20, and makes the rest of its key stream with
+ *  it. Returns zero on success.
+ */
+static int write_file_nonce(PACKFILE *f)
+{
+   unsigned char nonce[CHACHA20_NONCE_SIZE];
+
+   if (!(f->normal.flags & PACKFILE_FLAG_CHACHA20))
+      return 0;
+
+   _al_make_chacha20_nonce(f->normal.cipher, nonce);
+
+   if (pack_fwrite(nonce, CHACHA20_NONCE_SIZE, f) < CHACHA20_NONCE_SIZE)
+      return -1;
+
+   /* nothing has been encrypted yet, it is all still in the buffer */
+   _al_set_chacha20_nonce(f->normal.cipher, nonce, 4 + CHACHA20_NONCE_SIZE);
+
+   return 0;
+}
+
+
+
+/* read_file_nonce:
+ *  Reads the nonce that follows the magic number of a freshly opened raw
+ *  file that is encrypted with ChaCha20. The first buffer has already been
+ *  decrypted with the fixed nonce, so the part of it that comes after is
+ *  put back as it was on the disk and done again. Returns zero on success.
+ */
+static int read_file_nonce(PACKFILE *f)
+{
+   unsigned char nonce[CHACHA20_NONCE_SIZE];
+   long n;
+
+   if (!(f->normal.flags & PACKFILE_FLAG_CHACHA20))
+      return 0;
+
+   if (pack_fread(nonce, CHACHA20_NONCE_SIZE, f) < CHACHA20_NONCE_SIZE)
+      return -1;
+
+   ASSERT(!f->normal.parent);
+
+   n = f->normal.buf_pos - f->normal.buf + MAX(f->normal.buf_size, 0);
+
+   _al_rewind_chacha20(f->normal.cipher);
+   crypt_buffer(f, f->normal.buf, n);
+
+   _al_set_chacha20_nonce(f->normal.cipher, nonce, 4 + CHACHA20_NONCE_SIZE);
+
+   _al_rewind_chacha20(f->normal.cipher);
+   crypt_buffer(f, f->normal.buf, n);
+
+   return 0;
+}
+
+
+
+/* sum_stats:
+ *  Adds the counters of src to dest.
+ */
+static void sum_stats(PACKFILE_STATS *dest, AL_CONST PACKFILE_STATS *src)
+{
+   dest->bytes_read += src->bytes_read;
+   dest->refills += src->refills;
+   dest->seeks += src->seeks;
+   dest->unpacked += src->unpacked;
+   dest->unpack_time += src->unpack_time;
+   dest->syscall_time += src->syscall_time;
+}
+
+
+
+/* exit_packfile_stats:
+ *  Destroys the lock of the global I/O counters when Allegro shuts down.
+ */
+static void exit_packfile_stats(void)
+{
+   _al_destroy_mutex(stats_mutex);
+   stats_mutex = NULL;
+
+   _remove_exit_func(exit_packfile_stats);
+}
+
+
+
+/* _init_packfile_stats:
+ *  Creates the lock of the global I/O counters. Called by allegro_init(),
+ *  before the async loader can close files from its worker thread.
+ */
+void _init_packfile_stats(void)
+{
+   if (stats_mutex)
+      return;
+
+   stats_mutex = _al_create_mutex();
+   if (stats_mutex)
+      _add_exit_func(exit_packfile_stats, "exit_packfile_stats");
+}
+
+
+
+/* add_stats:
+ *  Adds the counters of a file that is being freed to the global ones.
+ *  Files can be closed by the loading threads, so this takes the lock.
+ */
+static void add_stats(AL_CONST PACKFILE_STATS *stats)
+{
+   if (stats_mutex)
+      _al_lock_mutex(stats_mutex);
+
+   sum_stats(&the_stats, stats);
+
+   if (stats_mutex)
+      _al_unlock_mutex(stats_mutex);
+}
+
+
+
+/* get_packfile_stats:
+ *  Fills in the I/O counters of all the packfiles closed so far, since
+ *  the start of the program or the last reset_packfile_stats().
+ */
+void get_packfile_stats(PACKFILE_STATS *stats)
+{
+   ASSERT(stats);
+
+   if (stats_mutex)
+      _al_lock_mutex(stats_mutex);
+
+   *stats = the_stats;
+
+   if (stats_mutex)
+      _al_unlock_mutex(stats_mutex);
+}
+
+
+
+/* reset_packfile_stats:
+ *  Sets the global I/O counters back to zero.
+ */
+void reset_packfile_stats(void)
+{
+   if (stats_mutex)
+      _al_lock_mutex(stats_mutex);
+
+   memset(&the_stats, 0, sizeof(PACKFILE_STATS));
+
+   if (stats_mutex)
+      _al_unlock_mutex(stats_mutex);
+}
+
+
+
+/* pack_get_stats:
+ *  Fills in the I/O counters of a file so far. Each layer of a file keeps
+ *  its own, so these are added up through the parents: for a chunk, this
+ *  includes the file it is read from, which is what you want to compare
+ *  before and after reading it. Files with their own vtable have none.
+ */
+void pack_get_stats(PACKFILE *f, PACKFILE_STATS *stats)
+{
+   ASSERT(f);
+   ASSERT(stats);
+
+   memset(stats, 0, sizeof(PACKFILE_STATS));
+
+   while ((f) && (f->is_normal_packfile)) {
+      sum_stats(stats, &f->normal.stats);
+      f = f->normal.parent;
+   }
+}
+
+
+
+/* set_packfile_trace_callback:
+ *  Sets a function to be called when files are opened with pack_fopen()
+ *  or pack_fopen_chunk(), and when they are closed again. Pass NULL to
+ *  turn it off.
+ */
+void set_packfile_trace_callback(void (*callback)(int event, PACKFILE *f, AL_CONST char *name))
+{
+   trace_callback = callback;
+}
+
+
+
+/* trace_chunk_name:
+ *  Returns a new string with the name that a chunk of f is traced by: the
+ *  name of f, with the object name added to the path after the '#', if
+ *  there is one. Returns NULL if f isn't being traced.
+ */
+static char *trace_chunk_name(PACKFILE *f, AL_CONST char *name)
+{
+   char tmp[16];
+   char *s;
+   int size;
+
+   if ((!f->is_normal_packfile) || (!f->normal.trace_name))
+      return NULL;
+
+   if ((!name) || (!ugetc(name)))
+      return _al_ustrdup(f->normal.trace_name);
+
+   size = ustrsizez(f->normal.trace_name) + uwidth_max(U_CURRENT) + ustrsizez(name);
+
+   if ((s = _AL_MALLOC_ATOMIC(size)) == NULL) {
+      *allegro_errno = ENOMEM;
+      return NULL;
+   }
+
+   ustrzcpy(s, size, f->normal.trace_name);
+   ustrzcat(s, size, uconvert_ascii((ustrchr(s, '#')) ? "/" : "#", tmp));
+   ustrzcat(s, size, name);
+
+   return s;
+}
+
+
+
 /* create_packfile:
  *  Helper function for creating a PACKFILE structure.
  */
@@ -1572,16 +1992,25 @@ static PACKFILE *create_packfile(int is_normal_packfile)
       f->userdata = f;
       f->is_normal_packfile = TRUE;
 
+      f->normal.buf = f->normal.small_buf;
       f->normal.buf_pos = f->normal.buf;
       f->normal.flags = 0;
       f->normal.buf_size = 0;
+      f->normal.buf_max = F_BUF_SIZE;
       f->normal.filename = NULL;
       f->normal.passdata = NULL;
       f->normal.passpos = NULL;
+      f->normal.cipher = NULL;
       f->normal.parent = NULL;
       f->normal.pack_data = NULL;
       f->normal.unpack_data = NULL;
+      f->normal.lz4_pack_data = NULL;
+      f->normal.lz4_unpack_data = NULL;
+      f->normal.map = NULL;
+      f->normal.map_size = 0;
+      f->normal.trace_name = NULL;
       f->normal.todo = 0;
+      memset(&f->normal.stats, 0, sizeof(PACKFILE_STATS));
    }
 
    return f;
@@ -1602,8 +2031,19 @@ static void free_packfile(PACKFILE *f)
       if (f->is_normal_packfile) {
 	 ASSERT(!f->normal.pack_data);
 	 ASSERT(!f->normal.unpack_data);
+	 ASSERT(!f->normal.lz4_pack_data);
+	 ASSERT(!f->normal.lz4_unpack_data);
 	 ASSERT(!f->normal.passdata);
 	 ASSERT(!f->normal.passpos);
+	 ASSERT(!f->normal.cipher);
+
+	 if (f->normal.buf != f->normal.small_buf)
+	    _AL_FREE(f->normal.buf);
+
+	 if (f->normal.trace_name)
+	    _AL_FREE(f->normal.trace_name);
+
+	 add_stats(&f->normal.stats);
       }
 
       _AL_FREE(f);
@@ -1626,7 +2066,8 @@ PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
 {
    PACKFILE *f, *f2;
    long header = FALSE;
-   int c;
+   long x;
+   int c, other;
 
    if ((f = create_packfile(TRUE)) == NULL)
       return NULL;
@@ -1638,12 +2079,41 @@ PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
 	 case 'r': case 'R': f->normal.flags &= ~PACKFILE_FLAG_WRITE; break;
 	 case 'w': case 'W': f->normal.flags |= PACKFILE_FLAG_WRITE; break;
 	 case 'p': case 'P': f->normal.flags |= PACKFILE_FLAG_PACK; break;
+	 case '4': f->normal.flags |= PACKFILE_FLAG_PACK | PACKFILE_FLAG_LZ4; break;
 	 case '!': f->normal.flags &= ~PACKFILE_FLAG_PACK; header = TRUE; break;
       }
    }
 
    if (f->normal.flags & PACKFILE_FLAG_WRITE) {
-      if (f->normal.flags & PACKFILE_FLAG_PACK) {
+      if (f->normal.flags & PACKFILE_FLAG_LZ4) {
+	 /* write an LZ4 packed file */
+	 f->normal.lz4_pack_data = _al_create_lz4_pack_data();
+
+	 if (!f->normal.lz4_pack_data) {
+	    free_packfile(f);
+	    return NULL;
+	 }
+
+	 if ((f->normal.parent = _pack_fdopen(fd, F_WRITE)) == NULL) {
+	    _al_free_lz4_pack_data(f->normal.lz4_pack_data);
+	    f->normal.lz4_pack_data = NULL;
+	    free_packfile(f);
+	    return NULL;
+	 }
+
+	 pack_mputl(encrypt_id(F_LZ4_MAGIC, TRUE), f->normal.parent);
+
+	 if (write_file_nonce(f->normal.parent) != 0) {
+	    pack_fclose(f->normal.parent);
+	    _al_free_lz4_pack_data(f->normal.lz4_pack_data);
+	    f->normal.lz4_pack_data = NULL;
+	    free_packfile(f);
+	    return NULL;
+	 }
+
+	 f->normal.todo = 4;
+      }
+      else if (f->normal.flags & PACKFILE_FLAG_PACK) {
 	 /* write a packed file */
 	 f->normal.pack_data = create_lzss_pack_data();
 	 ASSERT(!f->normal.unpack_data);
@@ -1662,6 +2132,14 @@ PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
 
 	 pack_mputl(encrypt_id(F_PACK_MAGIC, TRUE), f->normal.parent);
 
+	 if (write_file_nonce(f->normal.parent) != 0) {
+	    pack_fclose(f->normal.parent);
+	    free_lzss_pack_data(f->normal.pack_data);
+	    f->normal.pack_data = NULL;
+	    free_packfile(f);
+	    return NULL;
+	 }
+
 	 f->normal.todo = 4;
       }
       else {
@@ -1676,11 +2154,19 @@ PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
 
 	 errno = 0;
 
-	 if (header)
+	 if (header) {
 	    pack_mputl(encrypt_id(F_NOPACK_MAGIC, TRUE), f);
+
+	    if (write_file_nonce(f) != 0) {
+	       pack_fclose(f);
+	       return NULL;
+	    }
+	 }
       }
    }
    else {
+      f->normal.flags &= ~PACKFILE_FLAG_LZ4;
+
       if (f->normal.flags & PACKFILE_FLAG_PACK) {
 	 /* read a packed file */
          f->normal.unpack_data = create_lzss_unpack_data();
@@ -1742,10 +2228,61 @@ PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
 	    else
 	       header = encrypt_id(F_NOPACK_MAGIC, TRUE);
 	 }
+	 else if (f->normal.parent->normal.passpos) {
+	    /* was it encrypted the other way? */
+	    other = (the_crypt == F_CRYPT_CHACHA20) ? F_CRYPT_XOR : F_CRYPT_CHACHA20;
+	    x = header ^ crypt_id(the_crypt) ^ crypt_id(other);
+
+	    if ((x == encrypt_id_mode(F_PACK_MAGIC, TRUE, other)) ||
+		(x == encrypt_id_mode(F_LZ4_MAGIC, TRUE, other)) ||
+		(x == encrypt_id_mode(F_NOPACK_MAGIC, TRUE, other)))
+	    {
+	       if (!switch_crypt(f->normal.parent, other)) {
+		  pack_fclose(f->normal.parent);
+		  free_lzss_unpack_data(f->normal.unpack_data);
+		  f->normal.unpack_data = NULL;
+		  free_packfile(f);
+		  return NULL;
+	       }
+
+	       if (x == encrypt_id_mode(F_PACK_MAGIC, TRUE, other))
+		  header = encrypt_id(F_PACK_MAGIC, TRUE);
+	       else if (x == encrypt_id_mode(F_LZ4_MAGIC, TRUE, other))
+		  header = encrypt_id(F_LZ4_MAGIC, TRUE);
+	       else
+		  header = encrypt_id(F_NOPACK_MAGIC, TRUE);
+	    }
+	 }
+
+	 if (((header == encrypt_id(F_PACK_MAGIC, TRUE)) ||
+	      (header == encrypt_id(F_LZ4_MAGIC, TRUE)) ||
+	      (header == encrypt_id(F_NOPACK_MAGIC, TRUE))) &&
+	     (read_file_nonce(f->normal.parent) != 0))
+	 {
+	    pack_fclose(f->normal.parent);
+	    free_lzss_unpack_data(f->normal.unpack_data);
+	    f->normal.unpack_data = NULL;
+	    free_packfile(f);
+	    *allegro_errno = EDOM;
+	    return NULL;
+	 }
 
 	 if (header == encrypt_id(F_PACK_MAGIC, TRUE)) {
 	    f->normal.todo = LONG_MAX;
 	 }
+	 else if (header == encrypt_id(F_LZ4_MAGIC, TRUE)) {
+	    free_lzss_unpack_data(f->normal.unpack_data);
+	    f->normal.unpack_data = NULL;
+
+	    if ((f->normal.lz4_unpack_data = _al_create_lz4_unpack_data()) == NULL) {
+	       pack_fclose(f->normal.parent);
+	       free_packfile(f);
+	       return NULL;
+	    }
+
+	    f->normal.flags |= PACKFILE_FLAG_LZ4;
+	    f->normal.todo = LONG_MAX;
+	 }
 	 else if (header == encrypt_id(F_NOPACK_MAGIC, TRUE)) {
 	    f2 = f->normal.parent;
 	    free_lzss_unpack_data(f->normal.unpack_data);
@@ -1779,6 +2316,9 @@ PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
 	 }
 
          f->normal.hndl = fd;
+
+	 if (!f->normal.passdata)
+	    map_packfile(f);
       }
    }
 
@@ -1809,10 +2349,34 @@ PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
  *  normal file in packed mode will cause errno to be set to EDOM.
  */
 PACKFILE *pack_fopen(AL_CONST char *filename, AL_CONST char *mode)
+{
+   PACKFILE *f;
+   ASSERT(filename);
+
+   f = open_file(filename, mode);
+
+   if ((f) && (trace_callback)) {
+      f->normal.trace_name = _al_ustrdup(filename);
+      if (f->normal.trace_name)
+	 trace_callback(PACKFILE_TRACE_OPEN, f, f->normal.trace_name);
+   }
+
+   return f;
+}
+
+
+
+/* open_file:
+ *  Does the work of pack_fopen(), which is also used to open the files
+ *  that datafile objects and appended data are read from, without them
+ *  being traced.
+ */
+static PACKFILE *open_file(AL_CONST char *filename, AL_CONST char *mode)
 {
    char tmp[1024];
+   PACKFILE *f;
+   double t;
    int fd;
-   ASSERT(filename);
 
    _packfile_type = 0;
 
@@ -1825,6 +2389,8 @@ PACKFILE *pack_fopen(AL_CONST char *filename, AL_CONST char *mode)
    if (!_al_file_isok(filename))
       return NULL;
 
+   t = al_get_time();
+
 #ifndef ALLEGRO_LEGACY_MPW
    if (strpbrk(mode, "wW"))  /* write mode? */
       fd = _al_open(uconvert_tofilename(filename, tmp), O_WRONLY | O_BINARY | O_CREAT | O_TRUNC, OPEN_PERMS);
@@ -1842,7 +2408,13 @@ PACKFILE *pack_fopen(AL_CONST char *filename, AL_CONST char *mode)
       return NULL;
    }
 
-   return _pack_fdopen(fd, mode);
+   t = al_get_time() - t;
+
+   f = _pack_fdopen(fd, mode);
+   if (f)
+      f->normal.stats.syscall_time += t;
+
+   return f;
 }
 
 
@@ -1904,6 +2476,9 @@ int pack_fclose(PACKFILE *f)
    ASSERT(f->vtable);
    ASSERT(f->vtable->pf_fclose);
 
+   if ((f->is_normal_packfile) && (f->normal.trace_name) && (trace_callback))
+      trace_callback(PACKFILE_TRACE_CLOSE, f, f->normal.trace_name);
+
    ret = f->vtable->pf_fclose(f->userdata);
    if (ret != 0)
       *allegro_errno = errno;
@@ -1915,27 +2490,102 @@ int pack_fclose(PACKFILE *f)
 
 
 
-/* pack_fopen_chunk:
- *  Opens a sub-chunk of the specified file, for reading or writing depending
- *  on the type of the file. The returned file pointer describes the sub
- *  chunk, and replaces the original file, which will no longer be valid.
- *  When writing to a chunk file, data is sent to the original file, but
- *  is prefixed with two length counts (32 bit, big-endian). For uncompressed
- *  chunks these will both be set to the length of the data in the chunk.
- *  For compressed chunks, created by setting the pack flag, the first will
- *  contain the raw size of the chunk, and the second will be the negative
- *  size of the uncompressed data. When reading chunks, the pack flag is
- *  ignored, and the compression type is detected from the sign of the
- *  second size value. The file structure used to read chunks checks the
- *  chunk size, and will return EOF if you try to read past the end of
- *  the chunk. If you don't read all of the chunk data, when you call
- *  pack_fclose_chunk(), the parent file will advance past the unused data.
- *  When you have finished reading or writing a chunk, you should call
- *  pack_fclose_chunk() to return to your original file.
+/* open_read_chunk:
+ *  Helper for reading a chunk of f, given the two sizes from its header.
+ *  LZ4 chunks are refused unless lz4 is set or f is marked as holding them.
  */
-PACKFILE *pack_fopen_chunk(PACKFILE *f, int pack)
+static PACKFILE *open_read_chunk(PACKFILE *f, int filesize, int datasize, int lz4)
+{
+   PACKFILE *chunk;
+
+   if (f->normal.flags & PACKFILE_FLAG_LZ4_CHUNKS)
+      lz4 = TRUE;
+
+   /* older versions would unpack these as LZSS, so the file has to say
+    * that it holds them, and anywhere else they can only be corrupt
+    */
+   if ((datasize < 0) && (filesize < 0) && (!lz4)) {
+      *allegro_errno = EDOM;
+      return NULL;
+   }
+
+   if ((chunk = create_packfile(TRUE)) == NULL)
+      return NULL;
+
+   chunk->normal.flags = PACKFILE_FLAG_CHUNK;
+
+   /* so do the chunks nested inside it */
+   if (lz4)
+      chunk->normal.flags |= PACKFILE_FLAG_LZ4_CHUNKS;
+   chunk->normal.parent = f;
+
+   if (f->normal.flags & PACKFILE_FLAG_OLD_CRYPT) {
+      /* backward compatibility mode */
+      if (f->normal.passdata) {
+	 if ((chunk->normal.passdata = _AL_MALLOC_ATOMIC(strlen(f->normal.passdata)+1)) == NULL) {
+	    *allegro_errno = ENOMEM;
+	    _AL_FREE(chunk);
+	    return NULL;
+	 }
+	 _al_sane_strncpy(chunk->normal.passdata, f->normal.passdata, strlen(f->normal.passdata)+1);
+	 chunk->normal.passpos = chunk->normal.passdata + (long)f->normal.passpos - (long)f->normal.passdata;
+	 f->normal.passpos = f->normal.passdata;
+      }
+      chunk->normal.flags |= PACKFILE_FLAG_OLD_CRYPT;
+   }
+
+   if ((datasize < 0) && (filesize < 0)) {
+      /* read an LZ4 packed chunk */
+      chunk->normal.lz4_unpack_data = _al_create_lz4_unpack_data();
+
+      if (!chunk->normal.lz4_unpack_data) {
+	 free_packfile(chunk);
+	 return NULL;
+      }
+
+      chunk->normal.todo = -datasize;
+      chunk->normal.flags |= PACKFILE_FLAG_PACK | PACKFILE_FLAG_LZ4;
+   }
+   else if (datasize < 0) {
+      /* read a packed chunk */
+      chunk->normal.unpack_data = create_lzss_unpack_data();
+      ASSERT(!chunk->normal.pack_data);
+
+      if (!chunk->normal.unpack_data) {
+	 free_packfile(chunk);
+	 return NULL;
+      }
+
+      chunk->normal.todo = -datasize;
+      chunk->normal.flags |= PACKFILE_FLAG_PACK;
+   }
+   else {
+      /* read an uncompressed chunk */
+      chunk->normal.todo = datasize;
+
+      if (f->vtable == &mmap_vtable) {
+	 /* this can be read in place from the parent's mapping */
+	 chunk->vtable = &mmap_vtable;
+	 chunk->normal.todo = MIN(datasize, MAX(f->normal.todo, 0));
+	 chunk->normal.map = f->normal.map + f->normal.map_size - f->normal.todo;
+	 chunk->normal.map_size = chunk->normal.todo;
+	 pack_fseek(f, chunk->normal.todo);
+      }
+   }
+
+   return chunk;
+}
+
+
+
+/* open_chunk:
+ *  Does the work of pack_fopen_chunk(). If f is being traced, the chunk
+ *  is too, with objname added to the object path.
+ */
+static PACKFILE *open_chunk(PACKFILE *f, int pack, AL_CONST char *objname)
 {
    PACKFILE *chunk;
+   int filesize, datasize;
    char tmp[1024];
    char *name;
    ASSERT(f);
@@ -2029,7 +2679,10 @@ PACKFILE *pack_fopen_chunk(PACKFILE *f, int pack)
       }
 
       name = uconvert_ascii(tmp_name, tmp);
-      chunk = _pack_fdopen(tmp_fd, (pack ? F_WRITE_PACKED : F_WRITE_NOPACK));
+      if (pack == F_PACK_LZ4)
+	 chunk = _pack_fdopen(tmp_fd, F_WRITE_LZ4);
+      else
+	 chunk = _pack_fdopen(tmp_fd, (pack ? F_WRITE_PACKED : F_WRITE_NOPACK));
 
       if (chunk) {
          chunk->normal.filename = _al_ustrdup(name);
@@ -2047,49 +2700,88 @@ PACKFILE *pack_fopen_chunk(PACKFILE *f, int pack)
    }
    else {
       /* read a sub-chunk */
-      _packfile_filesize = pack_mgetl(f);
-      _packfile_datasize = pack_mgetl(f);
+      filesize = pack_mgetl(f);
+      datasize = pack_mgetl(f);
 
-      if ((chunk = create_packfile(TRUE)) == NULL)
-         return NULL;
+      chunk = open_read_chunk(f, filesize, datasize, (pack == F_PACK_LZ4));
 
-      chunk->normal.flags = PACKFILE_FLAG_CHUNK;
-      chunk->normal.parent = f;
+      _packfile_filesize = ABS(filesize);
+      _packfile_datasize = ABS(datasize);
+   }
 
-      if (f->normal.flags & PACKFILE_FLAG_OLD_CRYPT) {
-	 /* backward compatibility mode */
-	 if (f->normal.passdata) {
-	    if ((chunk->normal.passdata = _AL_MALLOC_ATOMIC(strlen(f->normal.passdata)+1)) == NULL) {
-	       *allegro_errno = ENOMEM;
-	       _AL_FREE(chunk);
-	       return NULL;
-	    }
-	    _al_sane_strncpy(chunk->normal.passdata, f->normal.passdata, strlen(f->normal.passdata)+1);
-	    chunk->normal.passpos = chunk->normal.passdata + (long)f->normal.passpos - (long)f->normal.passdata;
-	    f->normal.passpos = f->normal.passdata;
-	 }
-	 chunk->normal.flags |= PACKFILE_FLAG_OLD_CRYPT;
-      }
+   if ((chunk) && (trace_callback)) {
+      chunk->normal.trace_name = trace_chunk_name(f, objname);
+      if (chunk->normal.trace_name)
+	 trace_callback(PACKFILE_TRACE_OPEN_CHUNK, chunk, chunk->normal.trace_name);
+   }
 
-      if (_packfile_datasize < 0) {
-	 /* read a packed chunk */
-         chunk->normal.unpack_data = create_lzss_unpack_data();
-	 ASSERT(!chunk->normal.pack_data);
+   return chunk;
+}
 
-	 if (!chunk->normal.unpack_data) {
-            free_packfile(chunk);
-	    return NULL;
-	 }
 
-	 _packfile_datasize = -_packfile_datasize;
-	 chunk->normal.todo = _packfile_datasize;
-	 chunk->normal.flags |= PACKFILE_FLAG_PACK;
-      }
-      else {
-	 /* read an uncompressed chunk */
-	 chunk->normal.todo = _packfile_datasize;
-      }
-   }
+
+/* pack_fopen_chunk:
+ *  Opens a sub-chunk of the specified file, for reading or writing depending
+ *  on the type of the file. The returned file pointer describes the sub
+ *  chunk, and replaces the original file, which will no longer be valid.
+ *  When writing to a chunk file, data is sent to the original file, but
+ *  is prefixed with two length counts (32 bit, big-endian). For uncompressed
+ *  chunks these will both be set to the length of the data in the chunk.
+ *  For compressed chunks, created by setting the pack flag, the first will
+ *  contain the raw size of the chunk, and the second will be the negative
+ *  size of the uncompressed data. F_PACK_LZ4 chunks negate both sizes.
+ *  When reading chunks, the compression type is detected from the signs of
+ *  the sizes, and the pack flag only matters for LZ4 chunks, which are
+ *  refused unless it is F_PACK_LZ4 or the file is marked as holding them.
+ *  The file structure used to read chunks checks the
+ *  chunk size, and will return EOF if you try to read past the end of
+ *  the chunk. If you don't read all of the chunk data, when you call
+ *  pack_fclose_chunk(), the parent file will advance past the unused data.
+ *  When you have finished reading or writing a chunk, you should call
+ *  pack_fclose_chunk() to return to your original file.
+ */
+PACKFILE *pack_fopen_chunk(PACKFILE *f, int pack)
+{
+   return open_chunk(f, pack, NULL);
+}
+
+
+
+/* _pack_fopen_named_chunk:
+ *  Opens a chunk of f for reading like pack_fopen_chunk(), for the object
+ *  called name, which is how it shows up in the trace.
+ */
+PACKFILE *_pack_fopen_named_chunk(PACKFILE *f, AL_CONST char *name)
+{
+   return open_chunk(f, FALSE, name);
+}
+
+
+
+/* _pack_fopen_memory_chunk:
+ *  Opens a chunk for reading from a copy of its data held in memory, given
+ *  the two sizes from its header, so that it can be decoded away from the
+ *  file it came from. Pass lz4 if that file may hold LZ4 chunks. The data
+ *  must stay around until the chunk has been closed with pack_fclose_chunk(),
+ *  followed by pack_fclose() on the returned parent.
+ */
+PACKFILE *_pack_fopen_memory_chunk(AL_CONST void *data, int filesize, int datasize, int lz4)
+{
+   PACKFILE *f, *chunk;
+   ASSERT(data);
+
+   if ((f = create_packfile(TRUE)) == NULL)
+      return NULL;
+
+   f->vtable = &mmap_vtable;
+   f->normal.hndl = -1;
+   f->normal.map = (unsigned char *)data;
+   f->normal.map_size = ABS(filesize);
+   f->normal.todo = ABS(filesize);
+
+   chunk = open_read_chunk(f, filesize, datasize, lz4);
+   if (!chunk)
+      free_packfile(f);
 
    return chunk;
 }
@@ -2107,7 +2799,9 @@ PACKFILE *pack_fclose_chunk(PACKFILE *f)
    PACKFILE *parent;
    PACKFILE *tmp;
    char *name;
-   int header, c;
+   long header;
+   int filesize, datasize;
+   int c;
    ASSERT(f);
 
    /* unsupported */
@@ -2116,6 +2810,17 @@ PACKFILE *pack_fclose_chunk(PACKFILE *f)
       return NULL;
    }
 
+   /* the chunk is done with, even if a written one still has to be
+    * closed as a file below
+    */
+   if (f->normal.trace_name) {
+      if (trace_callback)
+	 trace_callback(PACKFILE_TRACE_CLOSE_CHUNK, f, f->normal.trace_name);
+
+      _AL_FREE(f->normal.trace_name);
+      f->normal.trace_name = NULL;
+   }
+
    parent = f->normal.parent;
    name = f->normal.filename;
 
@@ -2136,7 +2841,11 @@ PACKFILE *pack_fclose_chunk(PACKFILE *f)
          return NULL;
       }
 
-      _packfile_datasize = f->normal.todo + f->normal.buf_size - 4;
+      datasize = f->normal.todo + f->normal.buf_size - 4;
+
+      /* an unpacked chunk has the nonce in its own stream */
+      if (!(f->normal.flags & PACKFILE_FLAG_PACK) && (f->normal.flags & PACKFILE_FLAG_CHACHA20))
+	 datasize -= CHACHA20_NONCE_SIZE;
 
       if (f->normal.flags & PACKFILE_FLAG_PACK) {
 	 parent = parent->normal.parent;
@@ -2158,16 +2867,39 @@ PACKFILE *pack_fclose_chunk(PACKFILE *f)
       if (!tmp)
          return NULL;
 
-      _packfile_filesize = tmp->normal.todo - 4;
+      filesize = tmp->normal.todo - 4;
 
       header = pack_mgetl(tmp);
 
-      pack_mputl(_packfile_filesize, parent);
+      /* the temporary file had a nonce of its own, which the data is
+       * encrypted with again as it goes into the parent
+       */
+      if (tmp->normal.flags & PACKFILE_FLAG_CHACHA20) {
+	 if (read_file_nonce(tmp) != 0) {
+	    pack_fclose(tmp);
+	    *allegro_errno = EDOM;
+	    return NULL;
+	 }
+	 filesize -= CHACHA20_NONCE_SIZE;
+      }
+
+      /* the tools report these after each chunk */
+      _packfile_filesize = filesize;
+      _packfile_datasize = datasize;
 
-      if (header == encrypt_id(F_PACK_MAGIC, TRUE))
-	 pack_mputl(-_packfile_datasize, parent);
-      else
-	 pack_mputl(_packfile_datasize, parent);
+      if (header == encrypt_id(F_LZ4_MAGIC, TRUE)) {
+	 /* both sizes negative mark the LZ4 codec */
+	 pack_mputl(-filesize, parent);
+	 pack_mputl(-datasize, parent);
+      }
+      else {
+	 pack_mputl(filesize, parent);
+
+	 if (header == encrypt_id(F_PACK_MAGIC, TRUE))
+	    pack_mputl(-datasize, parent);
+	 else
+	    pack_mputl(datasize, parent);
+      }
 
       while ((c = pack_getc(tmp)) != EOF)
 	 pack_putc(c, parent);
@@ -2179,6 +2911,9 @@ PACKFILE *pack_fclose_chunk(PACKFILE *f)
    }
    else {
       /* finish reading a chunk */
+      if (f->vtable == &mmap_vtable)
+	 f->normal.todo = 0;  /* the parent has already skipped past it */
+
       while (f->normal.todo > 0)
 	 pack_getc(f);
 
@@ -2187,9 +2922,18 @@ PACKFILE *pack_fclose_chunk(PACKFILE *f)
 	 f->normal.unpack_data = NULL;
       }
 
+      if (f->normal.lz4_unpack_data) {
+	 _al_free_lz4_unpack_data(f->normal.lz4_unpack_data);
+	 f->normal.lz4_unpack_data = NULL;
+      }
+
       if ((f->normal.passpos) && (f->normal.flags & PACKFILE_FLAG_OLD_CRYPT))
 	 parent->normal.passpos = parent->normal.passdata + (long)f->normal.passpos - (long)f->normal.passdata;
 
+      /* the work done for the chunk counts towards the file from now on */
+      sum_stats(&parent->normal.stats, &f->normal.stats);
+      memset(&f->normal.stats, 0, sizeof(PACKFILE_STATS));
+
       free_packfile(f);
    }
 
@@ -2452,6 +3196,34 @@ long pack_fread(void *p, long n, PACKFILE *f)
 
 
 
+/* pack_fread_mapped:
+ *  Returns a pointer to the next n bytes of f, inside the memory mapping
+ *  of the file, and moves past them. Returns NULL without reading anything
+ *  if the file isn't mapped (because it is compressed, encrypted or the
+ *  platform can't do it), or if fewer than n bytes are left. The data
+ *  stays valid until the file is closed.
+ */
+AL_CONST void *pack_fread_mapped(PACKFILE *f, long n)
+{
+   unsigned char *p;
+   ASSERT(f);
+   ASSERT(n >= 0);
+
+   if ((f->vtable != &mmap_vtable) || (n > f->normal.todo))
+      return NULL;
+
+   p = f->normal.map + f->normal.map_size - f->normal.todo;
+
+   f->normal.stats.bytes_read += n;
+   f->normal.todo -= n;
+   if (f->normal.todo <= 0)
+      f->normal.flags |= PACKFILE_FLAG_EOF;
+
+   return p;
+}
+
+
+
 /* pack_fwrite:
  *  Writes n bytes to the file f from memory location p. Returns the number
  *  of items written, which will be less than n if an error occurs. Error
@@ -2625,6 +3397,7 @@ static int normal_ferror(void *_f);
 
 static int normal_refill_buffer(PACKFILE *f);
 static int normal_flush_buffer(PACKFILE *f, int last);
+static long normal_read_fully(PACKFILE *f, unsigned char *p, long n);
 
 
 
@@ -2646,6 +3419,7 @@ static PACKFILE_VTABLE normal_vtable =
 static int normal_fclose(void *_f)
 {
    PACKFILE *f = _f;
+   double t;
    int ret;
 
    if (f->normal.flags & PACKFILE_FLAG_WRITE) {
@@ -2664,9 +3438,11 @@ static int normal_fclose(void *_f)
       ret = pack_fclose(f->normal.parent);
    }
    else {
+      t = al_get_time();
       ret = close(f->normal.hndl);
       if (ret != 0)
 	 *allegro_errno = errno;
+      f->normal.stats.syscall_time += al_get_time() - t;
    }
 
    if (f->normal.pack_data) {
@@ -2679,12 +3455,27 @@ static int normal_fclose(void *_f)
       f->normal.unpack_data = NULL;
    }
 
+   if (f->normal.lz4_pack_data) {
+      _al_free_lz4_pack_data(f->normal.lz4_pack_data);
+      f->normal.lz4_pack_data = NULL;
+   }
+
+   if (f->normal.lz4_unpack_data) {
+      _al_free_lz4_unpack_data(f->normal.lz4_unpack_data);
+      f->normal.lz4_unpack_data = NULL;
+   }
+
    if (f->normal.passdata) {
       _AL_FREE(f->normal.passdata);
       f->normal.passdata = NULL;
       f->normal.passpos = NULL;
    }
 
+   if (f->normal.cipher) {
+      _al_free_chacha20_data(f->normal.cipher);
+      f->normal.cipher = NULL;
+   }
+
    return ret;
 }
 
@@ -2703,9 +3494,14 @@ static int normal_fclose(void *_f)
 static INLINE int normal_no_more_input(PACKFILE *f)
 {
    /* see normal_refill_buffer() to see when lzss_read() is called */
-   if (f->normal.parent && (f->normal.flags & PACKFILE_FLAG_PACK) &&
-       _al_lzss_incomplete_state(f->normal.unpack_data))
-      return 0;
+   if (f->normal.parent && (f->normal.flags & PACKFILE_FLAG_PACK)) {
+      if (f->normal.flags & PACKFILE_FLAG_LZ4) {
+	 if (_al_lz4_incomplete_state(f->normal.lz4_unpack_data))
+	    return 0;
+      }
+      else if (_al_lzss_incomplete_state(f->normal.unpack_data))
+	 return 0;
+   }
 
    return (f->normal.todo <= 0);
 }
@@ -2748,21 +3544,96 @@ static int normal_ungetc(int c, void *_f)
 
 
 
+/* normal_read_direct:
+ *  Reads data that isn't compressed straight into the memory of the
+ *  caller, for reads too big for the buffer to be any help, and decrypts
+ *  it there if need be. The buffer must be empty. Returns the number of
+ *  bytes read.
+ */
+static long normal_read_direct(PACKFILE *f, unsigned char *p, long n)
+{
+   long done;
+
+   n = MIN(n, f->normal.todo);
+
+   if (f->normal.parent) {
+      done = pack_fread(p, n, f->normal.parent);
+      if (f->normal.parent->normal.flags & PACKFILE_FLAG_EOF)
+	 f->normal.todo = 0;
+      if (f->normal.parent->normal.flags & PACKFILE_FLAG_ERROR)
+	 goto Error;
+   }
+   else {
+      done = normal_read_fully(f, p, n);
+      if (done < n)
+	 goto Error;
+
+      if ((f->normal.passpos) && (!(f->normal.flags & PACKFILE_FLAG_OLD_CRYPT)))
+	 crypt_buffer(f, p, done);
+   }
+
+   f->normal.todo -= done;
+
+   /* keep the last byte around so that pack_ungetc() still works */
+   if (done > 0) {
+      f->normal.buf[0] = p[done-1];
+      f->normal.buf_pos = f->normal.buf + 1;
+      f->normal.buf_size = 0;
+   }
+
+   if (normal_no_more_input(f))
+      f->normal.flags |= PACKFILE_FLAG_EOF;
+
+   return done;
+
+ Error:
+   *allegro_errno = EFAULT;
+   f->normal.flags |= PACKFILE_FLAG_ERROR;
+   return MAX(done, 0);
+}
+
+
+
 static long normal_fread(void *p, long n, void *_f)
 {
    PACKFILE *f = _f;
    unsigned char *cp = (unsigned char *)p;
+   long left = n;
    long i;
    int c;
 
-   for (i=0; i<n; i++) {
-      if ((c = normal_getc(f)) == EOF)
+   while (left > 0) {
+      /* copy whatever is already in the buffer */
+      if (f->normal.buf_size > 0) {
+	 i = MIN(left, f->normal.buf_size);
+	 memcpy(cp, f->normal.buf_pos, i);
+	 f->normal.buf_pos += i;
+	 f->normal.buf_size -= i;
+	 cp += i;
+	 left -= i;
+
+	 if ((f->normal.buf_size == 0) && (normal_no_more_input(f)))
+	    f->normal.flags |= PACKFILE_FLAG_EOF;
+	 continue;
+      }
+
+      if ((left >= f->normal.buf_max) &&
+	  (!(f->normal.flags & (PACKFILE_FLAG_PACK | PACKFILE_FLAG_EOF | PACKFILE_FLAG_ERROR))) &&
+	  ((!f->normal.passpos) || (!f->normal.parent))) {
+	 i = normal_read_direct(f, cp, left);
+	 cp += i;
+	 left -= i;
+	 break;
+      }
+
+      if ((c = normal_refill_buffer(f)) == EOF)
 	 break;
 
       *(cp++) = c;
+      left--;
    }
 
-   return i;
+   return n - left;
 }
 
 
@@ -2771,7 +3642,7 @@ static int normal_putc(int c, void *_f)
 {
    PACKFILE *f = _f;
 
-   if (f->normal.buf_size + 1 >= F_BUF_SIZE) {
+   if (f->normal.buf_size + 1 >= f->normal.buf_max) {
       if (normal_flush_buffer(f, FALSE))
 	 return EOF;
    }
@@ -2801,6 +3672,7 @@ static long normal_fwrite(AL_CONST void *p, long n, void *_f)
 static int normal_fseek(void *_f, int offset)
 {
    PACKFILE *f = _f;
+   double t;
    int i;
 
    if (f->normal.flags & PACKFILE_FLAG_WRITE)
@@ -2822,8 +3694,10 @@ static int normal_fseek(void *_f, int offset)
    if (offset > 0) {
       i = MIN(offset, f->normal.todo);
 
-      if ((f->normal.flags & PACKFILE_FLAG_PACK) || (f->normal.passpos)) {
-	 /* for compressed or encrypted files, we just have to read through the data */
+      if ((f->normal.flags & PACKFILE_FLAG_PACK) || ((f->normal.passpos) && (f->normal.parent))) {
+	 /* for compressed files, we just have to read through the data */
+	 f->normal.stats.seeks++;
+
 	 while (i > 0) {
 	    pack_getc(f);
 	    i--;
@@ -2835,8 +3709,14 @@ static int normal_fseek(void *_f, int offset)
 	    pack_fseek(f->normal.parent, i);
 	 }
 	 else {
-	    /* do a real seek */
+	    /* do a real seek, moving the key on to match */
+	    t = al_get_time();
 	    lseek(f->normal.hndl, i, SEEK_CUR);
+	    f->normal.stats.syscall_time += al_get_time() - t;
+	    f->normal.stats.seeks++;
+
+	    if ((f->normal.passpos) && (!(f->normal.flags & PACKFILE_FLAG_OLD_CRYPT)))
+	       crypt_buffer(f, NULL, i);
 	 }
 	 f->normal.todo -= i;
 	 if (normal_no_more_input(f))
@@ -2876,7 +3756,7 @@ static int normal_ferror(void *_f)
  */
 static int normal_refill_buffer(PACKFILE *f)
 {
-   int i, sz, done, offset;
+   double t;
 
    if (f->normal.flags & PACKFILE_FLAG_EOF)
       return EOF;
@@ -2886,46 +3766,48 @@ static int normal_refill_buffer(PACKFILE *f)
       return EOF;
    }
 
+   f->normal.stats.refills++;
+
    if (f->normal.parent) {
-      if (f->normal.flags & PACKFILE_FLAG_PACK) {
-	 f->normal.buf_size = lzss_read(f->normal.parent, f->normal.unpack_data, MIN(F_BUF_SIZE, f->normal.todo), f->normal.buf);
+      if (f->normal.flags & PACKFILE_FLAG_LZ4) {
+	 t = al_get_time();
+	 f->normal.buf_size = _al_lz4_read(f->normal.parent, f->normal.lz4_unpack_data, MIN(f->normal.buf_max, f->normal.todo), f->normal.buf);
+	 if (f->normal.buf_size < 0)
+	    goto Error;
+
+	 f->normal.stats.unpacked += f->normal.buf_size;
+	 f->normal.stats.unpack_time += al_get_time() - t;
+
+	 /* whole blocks are unpacked at once, so the parent can run out
+	  * while the end of the last one is still waiting to be handed out
+	  */
+	 if (f->normal.parent->normal.flags & PACKFILE_FLAG_EOF)
+	    f->normal.todo = MIN(f->normal.todo, f->normal.buf_size + _al_lz4_incomplete_state(f->normal.lz4_unpack_data));
       }
       else {
-	 f->normal.buf_size = pack_fread(f->normal.buf, MIN(F_BUF_SIZE, f->normal.todo), f->normal.parent);
+	 if (f->normal.flags & PACKFILE_FLAG_PACK) {
+	    t = al_get_time();
+	    f->normal.buf_size = lzss_read(f->normal.parent, f->normal.unpack_data, MIN(f->normal.buf_max, f->normal.todo), f->normal.buf);
+	    f->normal.stats.unpacked += MAX(f->normal.buf_size, 0);
+	    f->normal.stats.unpack_time += al_get_time() - t;
+	 }
+	 else
+	    f->normal.buf_size = pack_fread(f->normal.buf, MIN(f->normal.buf_max, f->normal.todo), f->normal.parent);
+
+	 if (f->normal.parent->normal.flags & PACKFILE_FLAG_EOF)
+	    f->normal.todo = 0;
       }
-      if (f->normal.parent->normal.flags & PACKFILE_FLAG_EOF)
-	 f->normal.todo = 0;
       if (f->normal.parent->normal.flags & PACKFILE_FLAG_ERROR)
 	 goto Error;
    }
    else {
-      f->normal.buf_size = MIN(F_BUF_SIZE, f->normal.todo);
-
-      offset = lseek(f->normal.hndl, 0, SEEK_CUR);
-      done = 0;
-
-      errno = 0;
-      sz = read(f->normal.hndl, f->normal.buf, f->normal.buf_size);
-
-      while (sz+done < f->normal.buf_size) {
-	 if ((sz < 0) && ((errno != EINTR) && (errno != EAGAIN)))
-	    goto Error;
-
-	 if (sz > 0)
-	    done += sz;
+      f->normal.buf_size = MIN(f->normal.buf_max, f->normal.todo);
 
-	 lseek(f->normal.hndl, offset+done, SEEK_SET);
-         errno = 0;
-	 sz = read(f->normal.hndl, f->normal.buf+done, f->normal.buf_size-done);
-      }
+      if (normal_read_fully(f, f->normal.buf, f->normal.buf_size) < f->normal.buf_size)
+	 goto Error;
 
-      if ((f->normal.passpos) && (!(f->normal.flags & PACKFILE_FLAG_OLD_CRYPT))) {
-	 for (i=0; i<f->normal.buf_size; i++) {
-	    f->normal.buf[i] ^= *(f->normal.passpos++);
-	    if (!*f->normal.passpos)
-	       f->normal.passpos = f->normal.passdata;
-	 }
-      }
+      if ((f->normal.passpos) && (!(f->normal.flags & PACKFILE_FLAG_OLD_CRYPT)))
+	 crypt_buffer(f, f->normal.buf, f->normal.buf_size);
    }
 
    f->normal.todo -= f->normal.buf_size;
@@ -2948,26 +3830,54 @@ static int normal_refill_buffer(PACKFILE *f)
 
 
 
+/* normal_read_fully:
+ *  Reads n bytes from the file handle of f, retrying after interruptions.
+ *  Returns the number of bytes read, which is only less than n on an error
+ *  or at the end of the file.
+ */
+static long normal_read_fully(PACKFILE *f, unsigned char *p, long n)
+{
+   double t = al_get_time();
+   long done = 0;
+   long sz;
+
+   while (done < n) {
+      errno = 0;
+      sz = read(f->normal.hndl, p+done, n-done);
+
+      if (sz > 0)
+	 done += sz;
+      else if ((sz == 0) || ((errno != EINTR) && (errno != EAGAIN)))
+	 break;
+   }
+
+   f->normal.stats.bytes_read += done;
+   f->normal.stats.syscall_time += al_get_time() - t;
+
+   return done;
+}
+
+
+
 /* normal_flush_buffer:
  *  Flushes a file buffer to the disk. The file must be open in write mode.
  */
 static int normal_flush_buffer(PACKFILE *f, int last)
 {
-   int i, sz, done, offset;
+   int sz, done, offset;
 
    if (f->normal.buf_size > 0) {
-      if (f->normal.flags & PACKFILE_FLAG_PACK) {
+      if (f->normal.flags & PACKFILE_FLAG_LZ4) {
+	 if (_al_lz4_write(f->normal.parent, f->normal.lz4_pack_data, f->normal.buf_size, f->normal.buf))
+	    goto Error;
+      }
+      else if (f->normal.flags & PACKFILE_FLAG_PACK) {
 	 if (lzss_write(f->normal.parent, f->normal.pack_data, f->normal.buf_size, f->normal.buf, last))
 	    goto Error;
       }
       else {
-	 if ((f->normal.passpos) && (!(f->normal.flags & PACKFILE_FLAG_OLD_CRYPT))) {
-	    for (i=0; i<f->normal.buf_size; i++) {
-	       f->normal.buf[i] ^= *(f->normal.passpos++);
-	       if (!*f->normal.passpos)
-		  f->normal.passpos = f->normal.passdata;
-	    }
-	 }
+	 if ((f->normal.passpos) && (!(f->normal.flags & PACKFILE_FLAG_OLD_CRYPT)))
+	    crypt_buffer(f, f->normal.buf, f->normal.buf_size);
 
 	 offset = lseek(f->normal.hndl, 0, SEEK_CUR);
 	 done = 0;
@@ -2999,3 +3909,237 @@ static int normal_flush_buffer(PACKFILE *f, int last)
    f->normal.flags |= PACKFILE_FLAG_ERROR;
    return EOF;
 }
+
+
+
+/* pack_set_buffer_size:
+ *  Changes how many bytes a packfile reads or writes at a time. Returns
+ *  zero on success, or non-zero if the packfile doesn't have a buffer of
+ *  its own or there is no memory for it.
+ */
+int pack_set_buffer_size(PACKFILE *f, int size)
+{
+   unsigned char *buf;
+   ASSERT(f);
+
+   if ((!f->is_normal_packfile) || (size < 1))
+      return -1;
+
+   /* reads from a mapped file don't go through the buffer at all */
+   if (f->vtable == &mmap_vtable)
+      return 0;
+
+   if (f->normal.flags & PACKFILE_FLAG_WRITE) {
+      if (normal_flush_buffer(f, FALSE) != 0)
+	 return -1;
+   }
+
+   /* data that has been read ahead has to move across */
+   size = MAX(size, f->normal.buf_size);
+
+   if (size <= F_BUF_SIZE)
+      buf = f->normal.small_buf;
+   else {
+      buf = _AL_MALLOC_ATOMIC(size);
+      if (!buf) {
+	 *allegro_errno = ENOMEM;
+	 return -1;
+      }
+   }
+
+   if (f->normal.buf_size > 0)
+      memmove(buf, f->normal.buf_pos, f->normal.buf_size);
+
+   if (f->normal.buf != f->normal.small_buf)
+      _AL_FREE(f->normal.buf);
+
+   f->normal.buf = buf;
+   f->normal.buf_pos = buf;
+   f->normal.buf_max = size;
+
+   return 0;
+}
+
+
+
+/* The mmap vtable is used for files opened for reading that aren't
+ * compressed or encrypted, on platforms that can map files into memory.
+ * These are still normal packfiles, so that pack_fopen_chunk() and code
+ * that peeks at the _al_normal_packfile_details keep working, but the
+ * buffer is not used: `todo' counts the bytes left after the current
+ * position in the mapping. Uncompressed chunks of a mapped file use the
+ * same vtable, over the part of the parent's mapping that they cover.
+ */
+
+static int mmap_fclose(void *_f);
+static int mmap_getc(void *_f);
+static int mmap_ungetc(int c, void *_f);
+static long mmap_fread(void *p, long n, void *_f);
+static int mmap_putc(int c, void *_f);
+static long mmap_fwrite(AL_CONST void *p, long n, void *_f);
+static int mmap_fseek(void *_f, int offset);
+
+
+
+static PACKFILE_VTABLE mmap_vtable =
+{
+   mmap_fclose,
+   mmap_getc,
+   mmap_ungetc,
+   mmap_fread,
+   mmap_putc,
+   mmap_fwrite,
+   mmap_fseek,
+   normal_feof,
+   normal_ferror
+};
+
+
+
+/* map_packfile:
+ *  Switches a file that has just been opened for reading over to the mmap
+ *  vtable, if the whole file can be mapped into memory. Otherwise it is
+ *  left to read through its buffer as usual.
+ */
+static void map_packfile(PACKFILE *f)
+{
+#ifdef ALLEGRO_LEGACY_HAVE_MMAP
+   void *map;
+   double t;
+
+   ASSERT(!(f->normal.flags & (PACKFILE_FLAG_WRITE | PACKFILE_FLAG_PACK)));
+
+   if (f->normal.todo <= 0)
+      return;
+
+   t = al_get_time();
+   map = mmap(NULL, f->normal.todo, PROT_READ, MAP_PRIVATE, f->normal.hndl, 0);
+   f->normal.stats.syscall_time += al_get_time() - t;
+
+   if (map == MAP_FAILED)
+      return;
+
+   f->vtable = &mmap_vtable;
+   f->normal.map = map;
+   f->normal.map_size = f->normal.todo;
+#endif
+}
+
+
+
+static INLINE unsigned char *mmap_pos(PACKFILE *f)
+{
+   return f->normal.map + f->normal.map_size - f->normal.todo;
+}
+
+
+
+static int mmap_fclose(void *_f)
+{
+   PACKFILE *f = _f;
+   double t;
+   int ret;
+
+   if (f->normal.parent)
+      return pack_fclose(f->normal.parent);
+
+   /* memory chunks don't own their data */
+   if (f->normal.hndl < 0)
+      return 0;
+
+   t = al_get_time();
+
+#ifdef ALLEGRO_LEGACY_HAVE_MMAP
+   munmap(f->normal.map, f->normal.map_size);
+#endif
+
+   ret = close(f->normal.hndl);
+   if (ret != 0)
+      *allegro_errno = errno;
+
+   f->normal.stats.syscall_time += al_get_time() - t;
+
+   return ret;
+}
+
+
+
+static int mmap_getc(void *_f)
+{
+   PACKFILE *f = _f;
+   int c;
+
+   if (f->normal.todo <= 0) {
+      f->normal.flags |= PACKFILE_FLAG_EOF;
+      return EOF;
+   }
+
+   c = *mmap_pos(f);
+   f->normal.stats.bytes_read++;
+
+   if (--f->normal.todo <= 0)
+      f->normal.flags |= PACKFILE_FLAG_EOF;
+
+   return c;
+}
+
+
+
+static int mmap_ungetc(int c, void *_f)
+{
+   PACKFILE *f = _f;
+   unsigned char *p = mmap_pos(f);
+
+   /* the mapping is read-only, so only the byte just read can go back */
+   if ((p == f->normal.map) || (p[-1] != (unsigned char)c))
+      return EOF;
+
+   f->normal.todo++;
+   f->normal.flags &= ~PACKFILE_FLAG_EOF;
+   return (unsigned char)c;
+}
+
+
+
+static long mmap_fread(void *p, long n, void *_f)
+{
+   PACKFILE *f = _f;
+
+   n = MIN(n, MAX(f->normal.todo, 0));
+   memcpy(p, mmap_pos(f), n);
+   f->normal.stats.bytes_read += n;
+
+   f->normal.todo -= n;
+   if (f->normal.todo <= 0)
+      f->normal.flags |= PACKFILE_FLAG_EOF;
+
+   return n;
+}
+
+
+
+static int mmap_putc(int c, void *_f)
+{
+   return EOF;
+}
+
+
+
+static long mmap_fwrite(AL_CONST void *p, long n, void *_f)
+{
+   return 0;
+}
+
+
+
+static int mmap_fseek(void *_f, int offset)
+{
+   PACKFILE *f = _f;
+
+   f->normal.stats.seeks++;
+   f->normal.todo -= MIN(offset, MAX(f->normal.todo, 0));
+   if (f->normal.todo <= 0)
+      f->normal.flags |= PACKFILE_FLAG_EOF;
+
+   return 0;
+}
@@ -0,0 +1,449 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      LZ4 compression routines.
+ *
+ *      See readme.txt for copyright information.
+ */
+
+
+#include <string.h>
+
+#include "allegro.h"
+#include "allegro/internal/aintern.h"
+
+
+/*
+   This is a byte oriented LZ77 coder that writes the LZ4 block format.
+   It compresses less than LZSS, but has no bit fiddling and copies
+   literals and matches a run at a time, so decompression is much faster.
+
+   Each block is a series of sequences. A sequence starts with a token
+   byte holding the number of literals in the top four bits and the match
+   length minus four in the bottom four. A value of 15 in either half
+   means that more length bytes follow, each added to it until one is not
+   255. Then come the literal bytes, a two byte little-endian offset back
+   into the output, and the extra match length bytes. The last sequence of
+   a block only has literals, which is how the decoder knows it is done.
+
+   The packfile stream is cut into blocks of at most 64k, each preceded
+   by its size as a big-endian 32 bit value. If the top bit of the size is
+   set, the block wouldn't compress and is stored raw. Matches may reach
+   back into the previous 64k of output, even across block boundaries, so
+   small packfile buffers don't cost much compression.
+*/
+
+
+#define WINDOW          65535          /* furthest a match can reach back */
+#define BLOCK           65536          /* most data in one block */
+#define BOUND           (BLOCK + BLOCK/255 + 16)   /* worst case packed size */
+#define HASH_BITS       14
+#define MINMATCH        4              /* shortest match worth coding */
+#define MFLIMIT         12             /* no match starts closer to the end */
+#define LASTLITERALS    5              /* and none runs into the last bytes */
+#define STORED          0x80000000UL   /* block size flag for raw blocks */
+
+
+struct LZ4_PACK_DATA                   /* stuff for doing LZ4 compression */
+{
+   int len;                            /* bytes of history in text */
+   int hash[1 << HASH_BITS];           /* last position of each hash, or -1 */
+   unsigned char text[WINDOW + BLOCK]; /* history followed by the new block */
+   unsigned char out[BOUND];           /* the packed block */
+};
+
+
+struct LZ4_UNPACK_DATA                 /* for reading LZ4 files */
+{
+   int len;                            /* bytes decoded into text */
+   int pos;                            /* bytes of text handed out so far */
+   unsigned char text[WINDOW + BLOCK]; /* history followed by the new block */
+   unsigned char in[BOUND];            /* the packed block */
+};
+
+
+
+/* _al_create_lz4_pack_data:
+ *  Creates an LZ4_PACK_DATA structure.
+ */
+LZ4_PACK_DATA *_al_create_lz4_pack_data(void)
+{
+   LZ4_PACK_DATA *dat;
+   int c;
+
+   if ((dat = _AL_MALLOC_ATOMIC(sizeof(LZ4_PACK_DATA))) == NULL) {
+      *allegro_errno = ENOMEM;
+      return NULL;
+   }
+
+   dat->len = 0;
+
+   for (c=0; c < (1 << HASH_BITS); c++)
+      dat->hash[c] = -1;
+
+   return dat;
+}
+
+
+
+/* _al_free_lz4_pack_data:
+ *  Frees an LZ4_PACK_DATA structure.
+ */
+void _al_free_lz4_pack_data(LZ4_PACK_DATA *dat)
+{
+   ASSERT(dat);
+   _AL_FREE(dat);
+}
+
+
+
+/* read32:
+ *  Fetches four bytes of text for hashing and match checks.
+ */
+static INLINE unsigned int read32(AL_CONST unsigned char *p)
+{
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+
+
+/* hash32:
+ *  Multiplicative hash of four bytes of text.
+ */
+static INLINE int hash32(unsigned int x)
+{
+   return (int)((x * 2654435761U) >> (32 - HASH_BITS));
+}
+
+
+
+/* put_length:
+ *  Writes the extra bytes of a literal or match length that didn't fit in
+ *  the token, returning the new output position.
+ */
+static unsigned char *put_length(unsigned char *op, int len)
+{
+   while (len >= 255) {
+      *(op++) = 255;
+      len -= 255;
+   }
+
+   *(op++) = len;
+   return op;
+}
+
+
+
+/* put_sequence:
+ *  Writes a run of literals followed by a match, or just the literals if
+ *  match_len is zero. Returns the new output position.
+ */
+static unsigned char *put_sequence(unsigned char *op, AL_CONST unsigned char *lit, int lit_len, int offset, int match_len)
+{
+   unsigned char *token = op++;
+   int m = match_len - MINMATCH;
+
+   *token = MIN(lit_len, 15) << 4;
+   if (lit_len >= 15)
+      op = put_length(op, lit_len - 15);
+
+   memcpy(op, lit, lit_len);
+   op += lit_len;
+
+   if (match_len > 0) {
+      *token |= MIN(m, 15);
+      *(op++) = offset & 0xFF;
+      *(op++) = offset >> 8;
+      if (m >= 15)
+	 op = put_length(op, m - 15);
+   }
+
+   return op;
+}
+
+
+
+/* pack_block:
+ *  Compresses the text from start to end into dat->out, looking back into
+ *  the history for matches. Returns the packed size.
+ */
+static int pack_block(LZ4_PACK_DATA *dat, int start, int end)
+{
+   unsigned char *text = dat->text;
+   unsigned char *op = dat->out;
+   int ip = start;
+   int anchor = start;
+   int match_limit = end - LASTLITERALS;
+   int len, ref, h;
+   unsigned int seq;
+
+   while (ip < end - MFLIMIT) {
+      seq = read32(text+ip);
+      h = hash32(seq);
+      ref = dat->hash[h];
+      dat->hash[h] = ip;
+
+      if ((ref < 0) || (ip - ref > WINDOW) || (read32(text+ref) != seq)) {
+	 ip++;
+	 continue;
+      }
+
+      /* grow the match backwards over any pending literals */
+      while ((ip > anchor) && (ref > 0) && (text[ip-1] == text[ref-1])) {
+	 ip--;
+	 ref--;
+      }
+
+      len = MINMATCH;
+      while ((ip+len < match_limit) && (text[ip+len] == text[ref+len]))
+	 len++;
+
+      op = put_sequence(op, text+anchor, ip-anchor, ip-ref, len);
+
+      ip += len;
+      anchor = ip;
+
+      /* remember a position inside the match, it often repeats */
+      if (ip - 2 < end - MFLIMIT)
+	 dat->hash[hash32(read32(text+ip-2))] = ip-2;
+   }
+
+   op = put_sequence(op, text+anchor, end-anchor, 0, 0);
+
+   return op - dat->out;
+}
+
+
+
+/* _al_lz4_write:
+ *  Packs size bytes from buf, writing the blocks to file. Nothing is held
+ *  back between calls, so there is no need to tell it about the last one.
+ *  Returns non-zero on error.
+ */
+int _al_lz4_write(PACKFILE *file, LZ4_PACK_DATA *dat, int size, AL_CONST unsigned char *buf)
+{
+   int c, n, shift, packed;
+
+   while (size > 0) {
+      n = MIN(size, BLOCK);
+
+      /* keep the last 64k as history for the next block */
+      if (dat->len + n > (int)sizeof(dat->text)) {
+	 shift = dat->len - WINDOW;
+	 memmove(dat->text, dat->text+shift, WINDOW);
+	 dat->len = WINDOW;
+
+	 for (c=0; c < (1 << HASH_BITS); c++)
+	    dat->hash[c] = (dat->hash[c] >= shift) ? dat->hash[c] - shift : -1;
+      }
+
+      memcpy(dat->text+dat->len, buf, n);
+      packed = pack_block(dat, dat->len, dat->len+n);
+
+      if (packed < n) {
+	 pack_mputl(packed, file);
+	 pack_fwrite(dat->out, packed, file);
+      }
+      else {
+	 pack_mputl(n | STORED, file);
+	 pack_fwrite(dat->text+dat->len, n, file);
+      }
+
+      if (pack_ferror(file))
+	 return EOF;
+
+      dat->len += n;
+      buf += n;
+      size -= n;
+   }
+
+   return 0;
+}
+
+
+
+/* _al_create_lz4_unpack_data:
+ *  Creates an LZ4_UNPACK_DATA structure.
+ */
+LZ4_UNPACK_DATA *_al_create_lz4_unpack_data(void)
+{
+   LZ4_UNPACK_DATA *dat;
+
+   if ((dat = _AL_MALLOC_ATOMIC(sizeof(LZ4_UNPACK_DATA))) == NULL) {
+      *allegro_errno = ENOMEM;
+      return NULL;
+   }
+
+   dat->len = 0;
+   dat->pos = 0;
+
+   return dat;
+}
+
+
+
+/* _al_free_lz4_unpack_data:
+ *  Frees an LZ4_UNPACK_DATA structure.
+ */
+void _al_free_lz4_unpack_data(LZ4_UNPACK_DATA *dat)
+{
+   ASSERT(dat);
+   _AL_FREE(dat);
+}
+
+
+
+/* get_length:
+ *  Adds the extra length bytes following a token to len. Returns the new
+ *  input position, or -1 if the block ends first.
+ */
+static int get_length(AL_CONST unsigned char *in, int ip, int in_len, int *len)
+{
+   int c;
+
+   do {
+      if (ip >= in_len)
+	 return -1;
+      c = in[ip++];
+      *len += c;
+   } while (c == 255);
+
+   return ip;
+}
+
+
+
+/* unpack_block:
+ *  Decodes in_len bytes of packed data onto the end of dat->text. Returns
+ *  zero on success, or -1 if the data is corrupt.
+ */
+static int unpack_block(LZ4_UNPACK_DATA *dat, int in_len)
+{
+   AL_CONST unsigned char *in = dat->in;
+   unsigned char *text = dat->text;
+   int max = sizeof(dat->text);
+   int ip = 0;
+   int op = dat->len;
+   int token, len, offset;
+
+   for (;;) {
+      if (ip >= in_len)
+	 return -1;
+
+      token = in[ip++];
+
+      /* literals */
+      len = token >> 4;
+      if ((len == 15) && ((ip = get_length(in, ip, in_len, &len)) < 0))
+	 return -1;
+
+      if ((len > in_len - ip) || (len > max - op))
+	 return -1;
+
+      memcpy(text+op, in+ip, len);
+      ip += len;
+      op += len;
+
+      if (ip == in_len)
+	 break;
+
+      /* match */
+      if (ip + 2 > in_len)
+	 return -1;
+
+      offset = in[ip] | (in[ip+1] << 8);
+      ip += 2;
+
+      len = (token & 15) + MINMATCH;
+      if (((token & 15) == 15) && ((ip = get_length(in, ip, in_len, &len)) < 0))
+	 return -1;
+
+      if ((offset == 0) || (offset > op) || (len > max - op))
+	 return -1;
+
+      if (offset >= len) {
+	 memcpy(text+op, text+op-offset, len);
+	 op += len;
+      }
+      else {
+	 /* overlapping copies repeat the last offset bytes */
+	 while (len-- > 0) {
+	    text[op] = text[op-offset];
+	    op++;
+	 }
+      }
+   }
+
+   dat->len = op;
+   return 0;
+}
+
+
+
+/* _al_lz4_read:
+ *  Unpacks up to s bytes from file into buf. Returns the number of bytes
+ *  read, which is only less than s at the end of the file, or -1 if the
+ *  data is corrupt.
+ */
+int _al_lz4_read(PACKFILE *file, LZ4_UNPACK_DATA *dat, int s, unsigned char *buf)
+{
+   unsigned long header;
+   int done = 0;
+   int n;
+
+   while (done < s) {
+      /* hand out what is left of the last block */
+      if (dat->pos < dat->len) {
+	 n = MIN(s - done, dat->len - dat->pos);
+	 memcpy(buf+done, dat->text+dat->pos, n);
+	 dat->pos += n;
+	 done += n;
+	 continue;
+      }
+
+      if (pack_feof(file))
+	 break;
+
+      /* keep the last 64k as history for the next block */
+      if (dat->len > WINDOW) {
+	 memmove(dat->text, dat->text + dat->len - WINDOW, WINDOW);
+	 dat->len = dat->pos = WINDOW;
+      }
+
+      header = (unsigned long)pack_mgetl(file);
+      n = header & ~STORED;
+
+      if ((pack_ferror(file)) || (n <= 0) || (n > BOUND))
+	 return -1;
+
+      if (header & STORED) {
+	 if ((n > BLOCK) || (pack_fread(dat->text+dat->len, n, file) != n))
+	    return -1;
+	 dat->len += n;
+      }
+      else {
+	 if ((pack_fread(dat->in, n, file) != n) || (unpack_block(dat, n) != 0))
+	    return -1;
+      }
+   }
+
+   return done;
+}
+
+
+
+/* _al_lz4_incomplete_state:
+ *  Returns the number of bytes of the last block that haven't been handed
+ *  out yet, so non-zero like _al_lzss_incomplete_state() while it lasts.
+ */
+int _al_lz4_incomplete_state(AL_CONST LZ4_UNPACK_DATA *dat)
+{
+   return dat->len - dat->pos;
+}
@@ -18,6 +18,8 @@
  */
 
 
+#include <string.h>
+
 #include "allegro.h"
 #include "allegro/internal/aintern.h"
 
@@ -39,8 +41,12 @@
    length> pair or an unencoded character, and these flags are stored as
    an eight bit mask every eight items.
 
-   This implementation uses binary trees to speed up the search for the
-   longest match.
+   This implementation keeps hash chains of the three letter strings in
+   the buffer to speed up the search for the longest match. The input is
+   cut into blocks that are searched on separate threads, each looking
+   back into the text before it, and the units of code are put together
+   in order afterwards, so the output can be read back the same way
+   whatever the number of threads.
 
    Original code by Haruhiko Okumura, 4/6/1989.
    12-2-404 Green Heights, 580 Nagasawa, Yokosuka 239, Japan.
@@ -56,21 +62,38 @@
 #define THRESHOLD    2              /* LZ encode string into pos and length
 				       if match size is greater than this */
 
+#define WINDOW       (N - F)        /* furthest a match can reach back */
+#define BLOCK        65536          /* most text packed by one thread */
+#define MAX_THREADS  16
+#define HASH_BITS    13
+#define MAX_CHAIN    64             /* most earlier strings tried per match */
+
+
+typedef struct LZSS_BLOCK           /* one thread's share of the text */
+{
+   AL_CONST unsigned char *text;    /* WINDOW bytes of history, then size
+				       bytes to pack */
+   int size;
+   int ring;                        /* ring buffer position of text[0] */
+   int units;                       /* how many units of code were made */
+   int head[1 << HASH_BITS];        /* last position of each hash, or -1 */
+   int prev[N];                     /* earlier position with the same hash */
+   unsigned char flag[BLOCK];       /* 1 for a letter, 0 for a pair */
+   unsigned char code[BLOCK];       /* the units, one or two bytes each */
+} LZSS_BLOCK;
+
 
 struct LZSS_PACK_DATA               /* stuff for doing LZ compression */
 {
-   int state;                       /* where have we got to in the pack? */
-   int i, c, len, r, s;
-   int last_match_length, code_buf_ptr;
+   int threads;                     /* blocks packed at the same time */
+   int len;                         /* bytes of new text collected */
+   int ring;                        /* ring buffer position of text[0] */
+   int code_buf_ptr;
    unsigned char mask;
-   char code_buf[17];
-   int match_position;
-   int match_length;
-   int lson[N+1];                   /* left children, */
-   int rson[N+257];                 /* right children, */
-   int dad[N+1];                    /* and parents, = binary search trees */
-   unsigned char text_buf[N+F-1];   /* ring buffer, with F-1 extra bytes
-				       for string comparison */
+   unsigned char code_buf[17];
+   LZSS_BLOCK *block[MAX_THREADS];
+   unsigned char *text;             /* WINDOW bytes of history, followed
+				       by up to threads*BLOCK new bytes */
 };
 
 
@@ -87,6 +110,45 @@ struct LZSS_UNPACK_DATA             /* for reading LZ files */
 
 /*** Compression (writing) ***/
 
+static int pack_threads = 1;
+
+
+
+/* set_lzss_pack_threads:
+ *  Sets how many threads later LZSS_PACK_DATA structures pack with. Zero
+ *  means one per processor.
+ */
+void set_lzss_pack_threads(int threads)
+{
+   if (threads <= 0)
+      threads = _al_get_cpu_count();
+
+   pack_threads = MID(1, threads, MAX_THREADS);
+}
+
+
+
+/* lzss_reset:
+ *  Gets ready to start a new stream. The text before it counts as zeros,
+ *  which is what the decoder fills its ring buffer with.
+ */
+static void lzss_reset(LZSS_PACK_DATA *dat)
+{
+   memset(dat->text, 0, WINDOW);
+
+   dat->len = 0;
+   dat->ring = 0;
+   dat->code_buf[0] = 0;
+      /* code_buf[1..16] saves eight units of code, and code_buf[0] works
+	 as eight flags, "1" representing that the unit is an unencoded
+	 letter (1 byte), "0" a position-and-length pair (2 bytes).
+	 Thus, eight units require at most 16 bytes of code. */
+
+   dat->code_buf_ptr = dat->mask = 1;
+}
+
+
+
 /* create_lzss_pack_data:
  *  Creates a PACK_DATA structure.
  */
@@ -95,15 +157,23 @@ LZSS_PACK_DATA *create_lzss_pack_data(void)
    LZSS_PACK_DATA *dat;
    int c;
 
-   if ((dat = _AL_MALLOC_ATOMIC(sizeof(LZSS_PACK_DATA))) == NULL) {
+   if ((dat = _AL_MALLOC(sizeof(LZSS_PACK_DATA))) == NULL) {
       *allegro_errno = ENOMEM;
       return NULL;
    }
 
-   for (c=0; c < N - F; c++)
-      dat->text_buf[c] = 0;
+   dat->threads = pack_threads;
 
-   dat->state = 0;
+   if ((dat->text = _AL_MALLOC_ATOMIC(WINDOW + dat->threads*BLOCK)) == NULL) {
+      _AL_FREE(dat);
+      *allegro_errno = ENOMEM;
+      return NULL;
+   }
+
+   for (c=0; c<MAX_THREADS; c++)
+      dat->block[c] = NULL;
+
+   lzss_reset(dat);
 
    return dat;
 }
@@ -115,309 +185,277 @@ LZSS_PACK_DATA *create_lzss_pack_data(void)
  */
 void free_lzss_pack_data(LZSS_PACK_DATA *dat)
 {
+   int c;
+
    ASSERT(dat);
 
+   for (c=0; c<MAX_THREADS; c++) {
+      if (dat->block[c])
+	 _AL_FREE(dat->block[c]);
+   }
+
+   _AL_FREE(dat->text);
    _AL_FREE(dat);
 }
 
 
 
-/* lzss_inittree:
- *  For i = 0 to N-1, rson[i] and lson[i] will be the right and left 
- *  children of node i. These nodes need not be initialized. Also, dad[i] 
- *  is the parent of node i. These are initialized to N, which stands for 
- *  'not used.' For i = 0 to 255, rson[N+i+1] is the root of the tree for 
- *  strings that begin with character i. These are initialized to N. Note 
- *  there are 256 trees.
+/* lzss_insert:
+ *  Adds the string starting at p to the hash chains, if there are enough
+ *  bytes left to hash.
  */
-static void lzss_inittree(LZSS_PACK_DATA *dat)
+static INLINE void lzss_insert(LZSS_BLOCK *blk, int p, int end)
 {
-   int i;
-
-   for (i=N+1; i<=N+256; i++)
-      dat->rson[i] = N;
+   AL_CONST unsigned char *s = blk->text + p;
+   int h;
 
-   for (i=0; i<N; i++)
-      dat->dad[i] = N;
+   if (p + THRESHOLD < end) {
+      h = (((s[0] << 16) | (s[1] << 8) | s[2]) * 2654435761U) >> (32 - HASH_BITS);
+      blk->prev[p & (N-1)] = blk->head[h];
+      blk->head[h] = p;
+   }
 }
 
 
 
-/* lzss_insertnode:
- *  Inserts a string of length F, text_buf[r..r+F-1], into one of the trees 
- *  (text_buf[r]'th tree) and returns the longest-match position and length 
- *  via match_position and match_length. If match_length = F, then removes 
- *  the old node in favor of the new one, because the old one will be 
- *  deleted sooner. Note r plays double role, as tree node and position in 
- *  the buffer. 
+/* lzss_match:
+ *  Walks the hash chain for the string at p, returning the length of the
+ *  longest earlier match and storing where it starts in pos.
  */
-static void lzss_insertnode(int r, LZSS_PACK_DATA *dat)
+static int lzss_match(LZSS_BLOCK *blk, int p, int end, int *pos)
 {
-   int i, p, cmp;
-   unsigned char *key;
-   unsigned char *text_buf = dat->text_buf;
+   AL_CONST unsigned char *text = blk->text;
+   AL_CONST unsigned char *s = text + p;
+   int max = MIN(F, end - p);
+   int best = THRESHOLD;
+   int chain = MAX_CHAIN;
+   int q, h, i;
 
-   cmp = 1;
-   key = &text_buf[r];
-   p = N + 1 + key[0];
-   dat->rson[r] = dat->lson[r] = N;
-   dat->match_length = 0;
+   if (max <= THRESHOLD)
+      return 0;
 
-   for (;;) {
+   h = (((s[0] << 16) | (s[1] << 8) | s[2]) * 2654435761U) >> (32 - HASH_BITS);
 
-      if (cmp >= 0) {
-	 if (dat->rson[p] != N)
-	    p = dat->rson[p];
-	 else {
-	    dat->rson[p] = r;
-	    dat->dad[r] = p;
-	    return;
-	 }
-      }
-      else {
-	 if (dat->lson[p] != N)
-	    p = dat->lson[p];
-	 else {
-	    dat->lson[p] = r;
-	    dat->dad[r] = p;
-	    return;
-	 }
-      }
+   for (q = blk->head[h]; (q >= 0) && (p - q <= WINDOW) && (chain > 0); q = blk->prev[q & (N-1)], chain--) {
+      if (text[q+best] != s[best])
+	 continue;
 
-      for (i = 1; i < F; i++)
-	 if ((cmp = key[i] - text_buf[p + i]) != 0)
-	    break;
+      for (i=0; (i < max) && (text[q+i] == s[i]); i++)
+	 ;
 
-      if (i > dat->match_length) {
-	 dat->match_position = p;
-	 if ((dat->match_length = i) >= F)
+      if (i > best) {
+	 best = i;
+	 *pos = q;
+	 if (best >= max)
 	    break;
       }
    }
 
-   dat->dad[r] = dat->dad[p];
-   dat->lson[r] = dat->lson[p];
-   dat->rson[r] = dat->rson[p];
-   dat->dad[dat->lson[p]] = r;
-   dat->dad[dat->rson[p]] = r;
-   if (dat->rson[dat->dad[p]] == p)
-      dat->rson[dat->dad[p]] = r;
-   else
-      dat->lson[dat->dad[p]] = r;
-   dat->dad[p] = N;                 /* remove p */
+   return (best > THRESHOLD) ? best : 0;
 }
 
 
 
-/* lzss_deletenode:
- *  Removes a node from a tree.
+/* lzss_pack_block:
+ *  Turns a block of text into units of code, thread procedure style. The
+ *  history is only used to find matches in, so blocks of the same text
+ *  can be packed at the same time, as long as the units are written out
+ *  in order. Matches are lazy: a match is put off by one letter if a
+ *  longer one starts there.
  */
-static void lzss_deletenode(int p, LZSS_PACK_DATA *dat)
+static void lzss_pack_block(void *arg)
 {
-   int q;
-
-   if (dat->dad[p] == N)
-      return;     /* not in tree */
+   LZSS_BLOCK *blk = arg;
+   AL_CONST unsigned char *text = blk->text;
+   unsigned char *flag = blk->flag;
+   unsigned char *code = blk->code;
+   int end = WINDOW + blk->size;
+   int p, len, pos, next_len, next_pos, c;
+
+   for (c=0; c < (1 << HASH_BITS); c++)
+      blk->head[c] = -1;
+
+   for (p=0; p<WINDOW; p++)
+      lzss_insert(blk, p, end);
+
+   len = lzss_match(blk, p, end, &pos);
+
+   while (p < end) {
+      if ((len > 0) && (len < F)) {
+	 lzss_insert(blk, p, end);
+	 next_len = lzss_match(blk, p+1, end, &next_pos);
+
+	 if (next_len > len) {
+	    *(flag++) = 1;
+	    *(code++) = text[p++];
+	    len = next_len;
+	    pos = next_pos;
+	    continue;
+	 }
 
-   if (dat->rson[p] == N)
-      q = dat->lson[p];
-   else
-      if (dat->lson[p] == N)
-	 q = dat->rson[p];
+	 c = 1;
+      }
+      else
+	 c = 0;
+
+      if (len > 0) {
+	 pos = (blk->ring + pos) & (N-1);
+	 *(flag++) = 0;
+	 *(code++) = (unsigned char)pos;
+	 *(code++) = (unsigned char)(((pos >> 4) & 0xF0) | (len - (THRESHOLD + 1)));
+      }
       else {
-	 q = dat->lson[p];
-	 if (dat->rson[q] != N) {
-	    do {
-	       q = dat->rson[q];
-	    } while (dat->rson[q] != N);
-	    dat->rson[dat->dad[q]] = dat->lson[q];
-	    dat->dad[dat->lson[q]] = dat->dad[q];
-	    dat->lson[q] = dat->lson[p];
-	    dat->dad[dat->lson[p]] = q;
-	 }
-	 dat->rson[q] = dat->rson[p];
-	 dat->dad[dat->rson[p]] = q;
+	 len = 1;
+	 *(flag++) = 1;
+	 *(code++) = text[p];
       }
 
-   dat->dad[q] = dat->dad[p];
-   if (dat->rson[dat->dad[p]] == p)
-      dat->rson[dat->dad[p]] = q;
-   else
-      dat->lson[dat->dad[p]] = q;
+      for (; c<len; c++)
+	 lzss_insert(blk, p+c, end);
+
+      p += len;
+
+      if (p < end)
+	 len = lzss_match(blk, p, end, &pos);
+   }
 
-   dat->dad[p] = N;
+   blk->units = flag - blk->flag;
 }
 
 
 
-/* lzss_write:
- *  Packs size bytes from buf, using the pack information contained in dat.
- *  Returns 0 on success.
+/* lzss_flush_code:
+ *  Writes out the units collected in code_buf. Returns non-zero on error.
  */
-int lzss_write(PACKFILE *file, LZSS_PACK_DATA *dat, int size, unsigned char *buf, int last)
+static int lzss_flush_code(PACKFILE *file, LZSS_PACK_DATA *dat)
 {
-   int i = dat->i;
-   int c = dat->c;
-   int len = dat->len;
-   int r = dat->r;
-   int s = dat->s;
-   int last_match_length = dat->last_match_length;
-   int code_buf_ptr = dat->code_buf_ptr;
-   unsigned char mask = dat->mask;
-   int ret = 0;
+   if ((file->is_normal_packfile) && (file->normal.passpos) &&
+       (file->normal.flags & PACKFILE_FLAG_OLD_CRYPT))
+   {
+      dat->code_buf[0] ^= *file->normal.passpos;
+      file->normal.passpos++;
+      if (!*file->normal.passpos)
+	 file->normal.passpos = file->normal.passdata;
+   }
 
-   if (dat->state==2)
-      goto pos2;
-   else
-      if (dat->state==1)
-	 goto pos1;
+   pack_fwrite(dat->code_buf, dat->code_buf_ptr, file);
 
    dat->code_buf[0] = 0;
-      /* code_buf[1..16] saves eight units of code, and code_buf[0] works
-	 as eight flags, "1" representing that the unit is an unencoded
-	 letter (1 byte), "0" a position-and-length pair (2 bytes).
-	 Thus, eight units require at most 16 bytes of code. */
+   dat->code_buf_ptr = dat->mask = 1;
 
-   code_buf_ptr = mask = 1;
+   return pack_ferror(file);
+}
 
-   s = 0;
-   r = N - F;
-   lzss_inittree(dat);
 
-   for (len=0; (len < F) && (size > 0); len++) {
-      dat->text_buf[r+len] = *(buf++);
-      if (--size == 0) {
-	 if (!last) {
-	    dat->state = 1;
-	    goto getout;
+
+/* lzss_pack_text:
+ *  Packs the new text collected in dat, a block per thread, and writes
+ *  the units out in groups of eight with their flags. The end of the text
+ *  becomes the history for the next lot. Returns non-zero on error.
+ */
+static int lzss_pack_text(PACKFILE *file, LZSS_PACK_DATA *dat)
+{
+   void *thread[MAX_THREADS];
+   LZSS_BLOCK *blk;
+   unsigned char *code;
+   int blocks = (dat->len + BLOCK - 1) / BLOCK;
+   int ret = 0;
+   int b, u;
+
+   for (b=0; b<blocks; b++) {
+      if (!dat->block[b]) {
+	 if ((dat->block[b] = _AL_MALLOC(sizeof(LZSS_BLOCK))) == NULL) {
+	    *allegro_errno = ENOMEM;
+	    return EOF;
 	 }
       }
-      pos1:
-	 ; 
-   }
-
-   if (len == 0)
-      goto getout;
 
-   for (i=1; i <= F; i++)
-      lzss_insertnode(r-i,dat);
-	    /* Insert the F strings, each of which begins with one or
-	       more 'space' characters. Note the order in which these
-	       strings are inserted. This way, degenerate trees will be
-	       less likely to occur. */
+      blk = dat->block[b];
+      blk->text = dat->text + b*BLOCK;
+      blk->size = MIN(BLOCK, dat->len - b*BLOCK);
+      blk->ring = (dat->ring + b*BLOCK) & (N-1);
+   }
 
-   lzss_insertnode(r,dat);
-	    /* Finally, insert the whole string just read. match_length
-	       and match_position are set. */
+   /* the first block is done on this thread, and any others that a
+      thread can't be started for */
+   for (b=1; b<blocks; b++) {
+      thread[b] = _al_create_thread(lzss_pack_block, dat->block[b]);
+      if (!thread[b])
+	 lzss_pack_block(dat->block[b]);
+   }
 
-   do {
-      if (dat->match_length > len)
-	 dat->match_length = len;  /* match_length may be long near the end */
+   lzss_pack_block(dat->block[0]);
 
-      if (dat->match_length <= THRESHOLD) {
-	 dat->match_length = 1;  /* not long enough match: send one byte */
-	 dat->code_buf[0] |= mask;    /* 'send one byte' flag */
-	 dat->code_buf[code_buf_ptr++] = dat->text_buf[r]; /* send uncoded */
-      }
-      else {
-	 /* send position and length pair. Note match_length > THRESHOLD */
-	 dat->code_buf[code_buf_ptr++] = (unsigned char) dat->match_position;
-	 dat->code_buf[code_buf_ptr++] = (unsigned char)
-				     (((dat->match_position >> 4) & 0xF0) |
-				      (dat->match_length - (THRESHOLD + 1)));
-      }
+   for (b=1; b<blocks; b++) {
+      if (thread[b])
+	 _al_join_thread(thread[b]);
+   }
 
-      if ((mask <<= 1) == 0) {                  /* shift mask left one bit */
+   for (b=0; (b<blocks) && (!ret); b++) {
+      blk = dat->block[b];
+      code = blk->code;
 
-	 if ((file->is_normal_packfile) && (file->normal.passpos) &&
-	     (file->normal.flags & PACKFILE_FLAG_OLD_CRYPT))
-	 {
-	    dat->code_buf[0] ^= *file->normal.passpos;
-	    file->normal.passpos++;
-	    if (!*file->normal.passpos)
-	       file->normal.passpos = file->normal.passdata;
+      for (u=0; u<blk->units; u++) {
+	 if (blk->flag[u]) {
+	    dat->code_buf[0] |= dat->mask;
+	    dat->code_buf[dat->code_buf_ptr++] = *(code++);
 	 }
-
-	 for (i=0; i<code_buf_ptr; i++)         /* send at most 8 units of */
-	    pack_putc(dat->code_buf[i], file);  /* code together */
-
-	 if (pack_ferror(file)) {
-	    ret = EOF;
-	    goto getout;
+	 else {
+	    dat->code_buf[dat->code_buf_ptr++] = *(code++);
+	    dat->code_buf[dat->code_buf_ptr++] = *(code++);
 	 }
-	 dat->code_buf[0] = 0;
-	 code_buf_ptr = mask = 1;
-      }
 
-      last_match_length = dat->match_length;
-
-      for (i=0; (i < last_match_length) && (size > 0); i++) {
-	 c = *(buf++);
-	 if (--size == 0) {
-	    if (!last) {
-	       dat->state = 2;
-	       goto getout;
+	 if ((dat->mask <<= 1) == 0) {
+	    if (lzss_flush_code(file, dat)) {
+	       ret = EOF;
+	       break;
 	    }
 	 }
-	 pos2:
-	 lzss_deletenode(s,dat);    /* delete old strings and */
-	 dat->text_buf[s] = c;      /* read new bytes */
-	 if (s < F-1)
-	    dat->text_buf[s+N] = c; /* if the position is near the end of
-				       buffer, extend the buffer to make
-				       string comparison easier */
-	 s = (s+1) & (N-1);
-	 r = (r+1) & (N-1);         /* since this is a ring buffer,
-				       increment the position modulo N */
-
-	 lzss_insertnode(r,dat);    /* register the string in
-				       text_buf[r..r+F-1] */
       }
+   }
 
-      while (i++ < last_match_length) {   /* after the end of text, */
-	 lzss_deletenode(s,dat);          /* no need to read, but */
-	 s = (s+1) & (N-1);               /* buffer may not be empty */
-	 r = (r+1) & (N-1);
-	 if (--len)
-	    lzss_insertnode(r,dat); 
-      }
+   memmove(dat->text, dat->text + dat->len, WINDOW);
+   dat->ring = (dat->ring + dat->len) & (N-1);
+   dat->len = 0;
 
-   } while (len > 0);   /* until length of string to be processed is zero */
+   return ret;
+}
 
-   if (code_buf_ptr > 1) {         /* send remaining code */
 
-      if ((file->is_normal_packfile) && (file->normal.passpos) &&
-	  (file->normal.flags & PACKFILE_FLAG_OLD_CRYPT))
-      {
-	 dat->code_buf[0] ^= *file->normal.passpos;
-	 file->normal.passpos++;
-	 if (!*file->normal.passpos)
-	    file->normal.passpos = file->normal.passdata;
-      }
 
-      for (i=0; i<code_buf_ptr; i++) {
-	 pack_putc(dat->code_buf[i], file);
-	 if (pack_ferror(file)) {
-	    ret = EOF;
-	    goto getout;
-	 }
-      }
+/* lzss_write:
+ *  Packs size bytes from buf, using the pack information contained in dat.
+ *  Text is collected until there is a block for each thread, so the units
+ *  of code only reach the file in big lumps, and the rest when last is set.
+ *  Returns 0 on success.
+ */
+int lzss_write(PACKFILE *file, LZSS_PACK_DATA *dat, int size, unsigned char *buf, int last)
+{
+   int n;
+   int ret = 0;
+
+   while ((size > 0) && (!ret)) {
+      n = MIN(size, dat->threads*BLOCK - dat->len);
+      memcpy(dat->text + WINDOW + dat->len, buf, n);
+      dat->len += n;
+      buf += n;
+      size -= n;
+
+      if (dat->len == dat->threads*BLOCK)
+	 ret = lzss_pack_text(file, dat);
    }
 
-   dat->state = 0;
+   if (last) {
+      if ((dat->len > 0) && (!ret))
+	 ret = lzss_pack_text(file, dat);
 
-   getout:
+      if ((dat->code_buf_ptr > 1) && (!ret))
+	 ret = lzss_flush_code(file, dat);
 
-   dat->i = i;
-   dat->c = c;
-   dat->len = len;
-   dat->r = r;
-   dat->s = s;
-   dat->last_match_length = last_match_length;
-   dat->code_buf_ptr = code_buf_ptr;
-   dat->mask = mask;
+      lzss_reset(dat);
+   }
 
-   return ret;
+   return ret ? EOF : 0;
 }
 
 
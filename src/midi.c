@@ -25,6 +25,7 @@
 
 #include "allegro.h"
 #include "allegro/internal/aintern.h"
+#include "a5alleg.h"
 
 
 
@@ -35,12 +36,21 @@
 #define MIDI_TIMER_FREQUENCY 40
 
 
-typedef struct MIDI_TRACK                       /* a track in the MIDI file */
+typedef struct MIDI_READER                      /* a track being read */
 {
-   unsigned char *pos;                          /* position in track data */
-   long timer;                                  /* time until next event */
-   unsigned char running_status;                /* last MIDI event */
-} MIDI_TRACK;
+   PACKFILE *f;                                 /* file to read it from */
+   AL_CONST unsigned char *pos;                 /* or the data in memory */
+   long left;                                   /* bytes left in the track */
+} MIDI_READER;
+
+
+typedef struct MIDI_STREAM                      /* events being compiled */
+{
+   unsigned char *data;                         /* in timeline format */
+   long size;                                   /* bytes used */
+   long max;                                    /* bytes allocated */
+   long num_events;
+} MIDI_STREAM;
 
 
 typedef struct MIDI_CHANNEL                     /* a MIDI channel */
@@ -52,6 +62,9 @@ typedef struct MIDI_CHANNEL                     /* a MIDI channel */
    int new_volume;                              /* cached volume change */
    int new_pitch_bend;                          /* cached pitch bend */
    int note[128][MIDI_LAYERS];                  /* status of each note */
+   int voices;                                  /* voices playing notes */
+   int max_voices;                              /* polyphony limit */
+   int priority;                                /* for voice stealing */
 } MIDI_CHANNEL;
 
 
@@ -61,6 +74,8 @@ typedef struct MIDI_VOICE                       /* a voice on the soundcard */
    int note;                                    /* note (-1 = off) */
    int volume;                                  /* note velocity */
    long time;                                   /* when note was triggered */
+   int prev, next;                              /* links in the free list */
+   int heap_pos;                                /* place in the steal heap */
 } MIDI_VOICE;
 
 
@@ -81,31 +96,66 @@ typedef struct PATCH_TABLE                      /* GM -> external synth */
 } PATCH_TABLE;
 
 
+struct MIDI_PLAYER                              /* a song being played */
+{
+   MIDI *midi;                                  /* the file that is playing */
+   MIDI_TIMELINE *timeline;                     /* events of the file */
+   long cursor;                                 /* next event, in the stream */
+   long event_timer;                            /* time until next event */
+   long timers;                                 /* position in timer ticks */
+   long pos;                                    /* position in beats */
+   long time;                                   /* position in seconds */
+   long pos_counter;                            /* delta for pos */
+   int pos_speed;                               /* MIDI delta -> pos */
+   int speed;                                   /* MIDI delta -> timer */
+   int new_speed;                               /* for tempo change events */
+   int file_speed;                              /* speed, before scaling */
+   int tempo;                                   /* speed scale, in percent */
+   int loop;                                    /* repeat at eof? */
+   long loop_start;                             /* where to loop back to */
+   long loop_end;                               /* loop at this position */
+   int active;                                  /* run by the MIDI clock? */
+   int joining;                                 /* activated since last tick? */
+   int tap_sync;                                /* tap_anchor needs setting? */
+   double tap_anchor;                           /* tap clock at timers = 0 */
+   int volume;                                  /* 0-255 */
+   int channel[16];                             /* output channel, or -1 */
+   int controller_volume[16];                   /* volume set by the file */
+   struct MIDI_PLAYER *next;                    /* list of all players */
+};
+
+
 volatile long midi_pos = -1;                    /* current position in MIDI file */
 volatile long midi_time = 0;                    /* current position in seconds */
-static volatile long midi_timers;               /* current position in allegro-timer-ticks */
-static long midi_pos_counter;                   /* delta for midi_pos */
 
 volatile long _midi_tick = 0;                   /* counter for killing notes */
 
-static void midi_player(void);                  /* core MIDI player routine */
-static void prepare_to_play(MIDI *midi);
-static void midi_lock_mem(void);
+int _midi_keep_tracks = FALSE;                  /* load_midi() keeps raw data? */
 
-static MIDI *midifile = NULL;                   /* the file that is playing */
+void (*_midi_flush_output)(void) = NULL;        /* driver batch flush hook */
 
-static int midi_loop = 0;                       /* repeat at eof? */
+static void midi_player(void);                  /* MIDI player timer routine */
+static void prepare_to_play(MIDI_PLAYER *p, MIDI *midi);
+static int seek_player(MIDI_PLAYER *p, int target);
+static void stop_player(MIDI_PLAYER *p);
+static void flush_midi_output(void);
+static void lock_players(void);
+static void unlock_players(void);
+static MIDI_TIMELINE *compile_midi(MIDI *midi);
+static void midi_lock_mem(void);
+
+static MIDI_PLAYER midi_default_player;         /* used by play_midi() etc */
+static int midi_default_ready = FALSE;
+static MIDI_PLAYER *midi_players = NULL;        /* every player there is */
 
 long midi_loop_start = -1;                      /* where to loop back to */
 long midi_loop_end = -1;                        /* loop at this position */
 
 static int midi_semaphore = 0;                  /* reentrancy flag */
+static void *midi_mutex = NULL;                 /* keeps threads apart */
 static int midi_loaded_patches = FALSE;         /* loaded entire patch set? */
 
 static long midi_timer_speed;                   /* midi_player's timer speed */
-static int midi_pos_speed;                      /* MIDI delta -> midi_pos */
-static int midi_speed;                          /* MIDI delta -> timer */
-static int midi_new_speed;                      /* for tempo change events */
 
 static int old_midi_volume = -1;                /* stored global volume */
 
@@ -113,14 +163,35 @@ static int midi_alloc_channel;                  /* so _midi_allocate_voice */
 static int midi_alloc_note;                     /* knows which note the */
 static int midi_alloc_vol;                      /* sound is associated with */
 
-static MIDI_TRACK midi_track[MIDI_TRACKS];      /* the active tracks */
+static MIDI_DRIVER *midi_alloc_driver = NULL;   /* allocator built for this */
+static int midi_alloc_voices;                   /* many driver voices */
+static int midi_free_first, midi_free_last;     /* free voices, oldest first */
+static int midi_steal_heap[MIDI_VOICES];        /* notes, next victim first */
+static int midi_steal_count;
+static MIDI_VOICE_STATS midi_stats;             /* allocation statistics */
+
 static MIDI_VOICE midi_voice[MIDI_VOICES];      /* synth voice status */
 static MIDI_CHANNEL midi_channel[16];           /* MIDI channel info */
 static WAITING_NOTE midi_waiting[MIDI_VOICES];  /* notes still to be played */
 static PATCH_TABLE patch_table[128];            /* GM -> external synth */
 
-static int midi_seeking;                        /* set during seeks */
-static int midi_looping;                        /* set during loops */
+static int midi_sample_accurate = FALSE;        /* run from the mixer? */
+static int midi_clock_running = FALSE;          /* midi_player scheduled? */
+static long midi_clock_start = 0;               /* timer to start unlocked */
+static int midi_sample_freq;                    /* mixer sample rate */
+static LONG_LONG midi_sample_due;               /* timer ticks * sample rate */
+static LONG_LONG midi_sample_pos;               /* samples the mixer has done */
+
+static int midi_timer_frequency = MIDI_TIMER_FREQUENCY;
+
+#define MIDI_TAP_DRIVERS   8
+
+static MIDI_TAP_EVENT *midi_tap = NULL;         /* recent event timings */
+static int midi_tap_size = 0;
+static volatile int midi_tap_head = 0;          /* where the next one goes */
+static volatile int midi_tap_tail = 0;          /* the oldest one unread */
+static MIDI_JITTER_STATS midi_jitter[MIDI_TAP_DRIVERS];
+static double midi_jitter_sum[MIDI_TAP_DRIVERS];
 
 /* hook functions */
 void (*midi_msg_callback)(int msg, int byte1, int byte2) = NULL;
@@ -145,13 +216,18 @@ void lock_midi(MIDI *midi)
 	 LOCK_DATA(midi->track[c].data, midi->track[c].len);
       }
    }
+
+   if (midi->timeline) {
+      LOCK_DATA(midi->timeline, midi->timeline->size);
+   }
 }
 
 
 
 /* load_midi:
  *  Loads a standard MIDI file, returning a pointer to a MIDI structure,
- *  or NULL on error. 
+ *  or NULL on error. The tracks are turned into events as they are read,
+ *  so the raw track data is never held in memory.
  */
 MIDI *load_midi(AL_CONST char *filename)
 {
@@ -178,6 +254,8 @@ MIDI *load_midi(AL_CONST char *filename)
       midi->track[c].len = 0;
    }
 
+   midi->timeline = NULL;
+
    pack_fread(buf, 4, fp); /* read midi header */
 
    /* Is the midi inside a .rmi file? */
@@ -214,23 +292,11 @@ MIDI *load_midi(AL_CONST char *filename)
    data = pack_mgetw(fp);                    /* beat divisions */
    midi->divisions = ABS(data);
 
-   for (c=0; c<num_tracks; c++) {            /* read each track */
-      pack_fread(buf, 4, fp);                /* read track header */
-      if (memcmp(buf, "MTrk", 4))
-	 goto err;
-
-      data = pack_mgetl(fp);                 /* length of track chunk */
-      midi->track[c].len = data;
-
-      midi->track[c].data = _AL_MALLOC_ATOMIC(data); /* allocate memory */
-      if (!midi->track[c].data)
-	 goto err;
-					     /* finally, read track data */
-      if (pack_fread(midi->track[c].data, data, fp) != data)
-	 goto err;
-   }
+   if (_midi_read_tracks(midi, fp, num_tracks, TRUE) != 0)
+      goto err;
 
    pack_fclose(fp);
+
    lock_midi(midi);
    return midi;
 
@@ -244,16 +310,27 @@ MIDI *load_midi(AL_CONST char *filename)
 
 
 /* destroy_midi:
- *  Frees the memory being used by a MIDI file.
+ *  Frees the memory being used by a MIDI file. Any players that are using
+ *  it are stopped first, with the players locked so that the clock can't
+ *  be in the middle of reading the file when it goes away.
  */
 void destroy_midi(MIDI *midi)
 {
+   MIDI_PLAYER *p;
    int c;
 
-   if (midi == midifile)
-      stop_midi();
-
    if (midi) {
+      lock_players();
+
+      for (p=midi_players; p; p=p->next) {
+	 if (p->midi == midi) {
+	    stop_player(p);
+	    flush_midi_output();
+	 }
+      }
+
+      unlock_players();
+
       for (c=0; c<MIDI_TRACKS; c++) {
 	 if (midi->track[c].data) {
 	    UNLOCK_DATA(midi->track[c].data, midi->track[c].len);
@@ -261,6 +338,11 @@ void destroy_midi(MIDI *midi)
 	 }
       }
 
+      if (midi->timeline) {
+	 UNLOCK_DATA(midi->timeline, midi->timeline->size);
+	 _AL_FREE(midi->timeline);
+      }
+
       UNLOCK_DATA(midi, sizeof(MIDI));
       _AL_FREE(midi);
    }
@@ -273,19 +355,18 @@ void destroy_midi(MIDI *midi)
  *  yet they are compressed in a weird variable length format. This routine 
  *  reads a variable length integer from a MIDI data stream. It returns the 
  *  number read, and alters the data pointer according to the number of
- *  bytes it used.
+ *  bytes it used. It never reads past the end pointer.
  */
-static unsigned long parse_var_len(AL_CONST unsigned char **data)
+static unsigned long parse_var_len(AL_CONST unsigned char **data, AL_CONST unsigned char *end)
 {
-   unsigned long val = **data & 0x7F;
+   unsigned long val = 0;
 
-   while (**data & 0x80) {
-      (*data)++;
-      val <<= 7;
-      val += (**data & 0x7F);
+   while (*data < end) {
+      val = (val << 7) + (**data & 0x7F);
+      if (!(*((*data)++) & 0x80))
+	 break;
    }
 
-   (*data)++;
    return val;
 }
 
@@ -293,1252 +374,3407 @@ END_OF_STATIC_FUNCTION(parse_var_len);
 
 
 
-/* global_volume_fix:
- *  Converts a note volume, adjusting it according to the global 
- *  _midi_volume variable.
+/* read_midi_event:
+ *  Decodes the MIDI event at *pos into ev, following running status, and
+ *  moves *pos past it. Returns zero on success, or non-zero if the data is
+ *  truncated or makes no sense.
  */
-static INLINE int global_volume_fix(int vol)
+static int read_midi_event(AL_CONST unsigned char **pos, AL_CONST unsigned char *end, unsigned char *running_status, MIDI_EVENT *ev)
 {
-   if (_midi_volume >= 0)
-      return (vol * _midi_volume) / 256;
+   AL_CONST unsigned char *p = *pos;
+   unsigned char event;
+   unsigned long l;
 
-   return vol;
+   if (p >= end)
+      return -1;
+
+   event = *p;
+
+   if (event & 0x80) {                          /* regular message */
+      p++;
+      /* no running status for sysex and meta-events! */
+      if ((event != 0xF0) && (event != 0xF7) && (event != 0xFF))
+	 *running_status = event;
+   }
+   else {                                       /* use running status */
+      if (!*running_status)
+	 return -1;
+      event = *running_status;
+   }
+
+   ev->status = event;
+   ev->byte1 = ev->byte2 = 0;
+   ev->data = NULL;
+   ev->length = 0;
+
+   switch (event>>4) {
+
+      case 0x08:                                /* note off */
+      case 0x09:                                /* note on */
+      case 0x0A:                                /* note aftertouch */
+      case 0x0B:                                /* control change */
+      case 0x0E:                                /* pitch bend */
+	 if (end - p < 2)
+	    return -1;
+	 ev->byte1 = p[0] & 0x7F;
+	 ev->byte2 = p[1] & 0x7F;
+	 p += 2;
+	 break;
+
+      case 0x0C:                                /* program change */
+      case 0x0D:                                /* channel aftertouch */
+	 if (end - p < 1)
+	    return -1;
+	 ev->byte1 = p[0] & 0x7F;
+	 p++;
+	 break;
+
+      case 0x0F:                                /* special event */
+	 switch (event) {
+	    case 0xFF:                          /* meta-event */
+	       if (p >= end)
+		  return -1;
+	       ev->byte1 = *(p++);
+	       /* fall through */
+
+	    case 0xF0:                          /* sysex */
+	    case 0xF7:
+	       l = parse_var_len(&p, end);
+	       if (l > (unsigned long)(end - p))
+		  return -1;
+	       ev->data = p;
+	       ev->length = l;
+	       p += l;
+	       break;
+
+	    case 0xF2:                          /* song position */
+	       if (end - p < 2)
+		  return -1;
+	       p += 2;
+	       break;
+
+	    case 0xF3:                          /* song select */
+	       if (end - p < 1)
+		  return -1;
+	       p++;
+	       break;
+
+	    default:
+	       /* the other special events don't have any data bytes,
+		  so we don't need to bother skipping past them */
+	       break;
+	 }
+	 break;
+   }
+
+   *pos = p;
+   return 0;
 }
 
+END_OF_STATIC_FUNCTION(read_midi_event);
 
 
-/* sort_out_volume:
- *  Converts a note volume, adjusting it according to the channel volume
- *  and the global _midi_volume variable.
+
+/* default_pan:
+ *  Returns the pan position a channel gets when its controllers are reset.
  */
-static INLINE int sort_out_volume(int c, int vol)
+static INLINE int default_pan(int channel)
 {
-   return global_volume_fix((vol * midi_channel[c].volume) / 128);
+   switch (channel % 3) {
+      case 0:  return ((channel/3) & 1) ? 60 : 68;
+      case 1:  return 104;
+      default: return 24;
+   }
 }
 
 
 
-/* raw_program_change:
- *  Sends a program change message to a device capable of handling raw
- *  MIDI data, using patch mapping tables. Assumes that midi_driver->raw_midi
- *  isn't NULL, so check before calling it!
+/* tempo_speed:
+ *  Converts the payload of a tempo change meta-event into the number of
+ *  timer ticks per MIDI tick.
  */
-static void raw_program_change(int channel, int patch)
+static INLINE int tempo_speed(AL_CONST unsigned char *data, int divisions)
 {
-   if (channel != 9) {
-      /* bank change #1 */
-      if (patch_table[patch].bank1 >= 0) {
-	 midi_driver->raw_midi(0xB0+channel);
-	 midi_driver->raw_midi(0);
-	 midi_driver->raw_midi(patch_table[patch].bank1);
-      }
-
-      /* bank change #2 */
-      if (patch_table[patch].bank2 >= 0) {
-	 midi_driver->raw_midi(0xB0+channel);
-	 midi_driver->raw_midi(32);
-	 midi_driver->raw_midi(patch_table[patch].bank2);
-      }
-
-      /* program change */
-      midi_driver->raw_midi(0xC0+channel);
-      midi_driver->raw_midi(patch_table[patch].prog);
+   long tempo = data[0] * 0x10000L + data[1] * 0x100 + data[2];
+   int speed = (tempo/1000) * (TIMERS_PER_SECOND/1000);
 
-      /* update volume */
-      midi_driver->raw_midi(0xB0+channel);
-      midi_driver->raw_midi(7);
-      midi_driver->raw_midi(global_volume_fix(midi_channel[channel].volume-1));
-   }
+   return speed / divisions;
 }
 
-END_OF_STATIC_FUNCTION(raw_program_change);
-
 
 
-/* midi_note_off:
- *  Processes a MIDI note-off event.
+/* chase_midi_event:
+ *  Updates a checkpoint with the effect of an event at the given time on
+ *  the channel state and the tempo, without playing anything.
  */
-static void midi_note_off(int channel, int note)
+static void chase_midi_event(MIDI_CHECKPOINT *cp, AL_CONST MIDI_EVENT *ev, unsigned long tick, int divisions)
 {
-   int done = FALSE;
-   int voice, layer;
-   int c;
+   int c = ev->status & 0x0F;
+   int speed;
 
-   /* can we send raw MIDI data? */
-   if (midi_driver->raw_midi) {
-      if (channel != 9)
-	 note += patch_table[midi_channel[channel].patch].pitch;
+   cp->timers += (long)(tick - cp->tick) * cp->speed;
+   cp->tick = tick;
 
-      midi_driver->raw_midi(0x80+channel);
-      midi_driver->raw_midi(note);
-      midi_driver->raw_midi(0);
-      return;
-   }
+   switch (ev->status>>4) {
 
-   /* oh well, have to do it the long way... */
-   for (layer=0; layer<MIDI_LAYERS; layer++) {
-      voice = midi_channel[channel].note[note][layer];
-      if (voice >= 0) {
-	 midi_driver->key_off(voice + midi_driver->basevoice);
-	 midi_voice[voice].note = -1;
-	 midi_voice[voice].time = _midi_tick;
-	 midi_channel[channel].note[note][layer] = -1; 
-	 done = TRUE;
-      }
-   }
+      case 0x0B:                                /* control change */
+	 if (ev->byte1 == 7)
+	    cp->volume[c] = ev->byte2+1;
+	 else if (ev->byte1 == 10)
+	    cp->pan[c] = ev->byte2;
+	 else if (ev->byte1 == 121) {
+	    cp->volume[c] = 128;
+	    cp->pitch_bend[c] = 0x2000;
+	    cp->pan[c] = default_pan(c);
+	 }
+	 break;
 
-   /* if the note isn't playing, it must still be in the waiting room */
-   if (!done) {
-      for (c=0; c<MIDI_VOICES; c++) {
-	 if ((midi_waiting[c].channel == channel) && 
-	     (midi_waiting[c].note == note)) {
-	    midi_waiting[c].note = -1;
-	    break;
+      case 0x0C:                                /* program change */
+	 cp->patch[c] = ev->byte1;
+	 break;
+
+      case 0x0E:                                /* pitch bend */
+	 cp->pitch_bend[c] = ev->byte1 + (ev->byte2<<7);
+	 break;
+
+      case 0x0F:                                /* tempo change? */
+	 if ((ev->status == 0xFF) && (ev->byte1 == 0x51) && (ev->length >= 3)) {
+	    speed = tempo_speed(ev->data, divisions);
+	    if (speed > 0)
+	       cp->speed = speed;
 	 }
-      }
+	 break;
    }
 }
 
-END_OF_STATIC_FUNCTION(midi_note_off);
+END_OF_STATIC_FUNCTION(chase_midi_event);
 
 
 
-/* sort_out_pitch_bend:
- *  MIDI pitch bend range is + or - two semitones. The low-level soundcard
- *  drivers can only handle bends up to +1 semitone. This routine converts
- *  pitch bends from MIDI format to our own format.
+/* reader_getc:
+ *  Reads a byte of the track a MIDI_READER is reading, or returns EOF at
+ *  the end of it.
  */
-static INLINE void sort_out_pitch_bend(int *bend, int *note)
+static INLINE int reader_getc(MIDI_READER *r)
 {
-   if (*bend == 0x2000) {
-      *bend = 0;
-      return;
-   }
+   if (r->left <= 0)
+      return EOF;
 
-   (*bend) -= 0x2000;
+   r->left--;
 
-   while (*bend < 0) {
-      (*note)--;
-      (*bend) += 0x1000;
-   }
+   if (r->f)
+      return pack_getc(r->f);
 
-   while (*bend >= 0x1000) {
-      (*note)++;
-      (*bend) -= 0x1000;
-   }
+   return *(r->pos++);
 }
 
 
 
-/* _midi_allocate_voice:
- *  Allocates a MIDI voice in the range min-max (inclusive). This is 
- *  intended to be called by the key_on() handlers in the MIDI driver, 
- *  and shouldn't be used by any other code.
+/* reader_var_len:
+ *  Reads a variable length number from a track. Returns non-zero if the
+ *  track ends before it does.
  */
-int _midi_allocate_voice(int min, int max)
+static int reader_var_len(MIDI_READER *r, unsigned long *val)
 {
    int c;
-   int layer;
-   int voice = -1;
-   long best_time = LONG_MAX;
 
-   if (min < 0)
-      min = 0;
+   *val = 0;
 
-   if (max < 0)
-      max = midi_driver->voices-1;
+   do {
+      c = reader_getc(r);
+      if (c == EOF)
+	 return -1;
+      *val = (*val << 7) + (c & 0x7F);
+   } while (c & 0x80);
 
-   /* which layer can we use? */
-   for (layer=0; layer<MIDI_LAYERS; layer++)
-      if (midi_channel[midi_alloc_channel].note[midi_alloc_note][layer] < 0)
-	 break; 
+   return 0;
+}
 
-   if (layer >= MIDI_LAYERS)
-      return -1;
 
-   /* find a free voice */
-   for (c=min; c<=max; c++) {
-      if ((midi_voice[c].note < 0) && 
-	  (midi_voice[c].time < best_time) && 
-	  ((c < midi_driver->xmin) || (c > midi_driver->xmax))) {
-	 voice = c;
-	 best_time = midi_voice[c].time;
-      }
-   }
 
-   /* if there are no free voices, kill a note to make room */
-   if (voice < 0) {
-      voice = -1;
-      best_time = LONG_MAX;
-      for (c=min; c<=max; c++) {
-	 if ((midi_voice[c].time < best_time) && 
-	     ((c < midi_driver->xmin) || (c > midi_driver->xmax))) {
-	    voice = c;
-	    best_time = midi_voice[c].time;
-	 }
-      }
-      if (voice >= 0)
-	 midi_note_off(midi_voice[voice].channel, midi_voice[voice].note);
-      else
-	 return -1;
-   }
+/* put_var_len:
+ *  Writes a number in the variable length MIDI format, returning how many
+ *  bytes it took.
+ */
+static int put_var_len(unsigned char *p, unsigned long val)
+{
+   unsigned char buf[5];
+   int n = 0, i;
 
-   /* ok, we got it... */
-   midi_voice[voice].channel = midi_alloc_channel;
-   midi_voice[voice].note = midi_alloc_note;
-   midi_voice[voice].volume = midi_alloc_vol;
-   midi_voice[voice].time = _midi_tick;
-   midi_channel[midi_alloc_channel].note[midi_alloc_note][layer] = voice; 
+   do {
+      buf[n++] = val & 0x7F;
+      val >>= 7;
+   } while ((val) && (n < 5));
 
-   return voice + midi_driver->basevoice;
-}
+   for (i=0; i<n; i++)
+      p[i] = buf[n-1-i] | ((i < n-1) ? 0x80 : 0);
 
-END_OF_FUNCTION(_midi_allocate_voice);
+   return n;
+}
 
 
 
-/* midi_note_on:
- *  Processes a MIDI note-on event. Tries to find a free soundcard voice,
- *  and if it can't either cuts off an existing note, or if 'polite' is
- *  set, just stores the channel, note and volume in the waiting list.
+/* stream_reserve:
+ *  Makes sure there is room for another size bytes at the end of a stream.
+ *  Returns non-zero if there isn't enough memory.
  */
-static void midi_note_on(int channel, int note, int vol, int polite)
+static int stream_reserve(MIDI_STREAM *s, long size)
 {
-   int c, layer, inst, bend, corrected_note;
+   unsigned char *data;
+   long max;
 
-   /* it's easy if the driver can handle raw MIDI data */
-   if (midi_driver->raw_midi) {
-      if (channel != 9)
-	 note += patch_table[midi_channel[channel].patch].pitch;
+   if (s->size + size <= s->max)
+      return 0;
 
-      midi_driver->raw_midi(0x90+channel);
-      midi_driver->raw_midi(note);
-      midi_driver->raw_midi(vol);
-      return;
-   }
+   max = MAX(s->max * 2, s->size + size + 256);
 
-   /* if the note is already on, turn it off */
-   for (layer=0; layer<MIDI_LAYERS; layer++) {
-      if (midi_channel[channel].note[note][layer] >= 0) {
-	 midi_note_off(channel, note);
-	 return;
-      }
-   }
+   data = _AL_REALLOC(s->data, max);
+   if (!data)
+      return -1;
 
-   /* if zero volume and the note isn't playing, we can just ignore it */
-   if (vol == 0)
-      return;
+   s->data = data;
+   s->max = max;
 
-   if (channel != 9) {
-      /* are there any free voices? */
-      for (c=0; c<midi_driver->voices; c++)
-	 if ((midi_voice[c].note < 0) && 
-	     ((c < midi_driver->xmin) || (c > midi_driver->xmax)))
+   return 0;
+}
+
+
+
+/* read_track:
+ *  Reads a track of a MIDI file onto the end of a stream of events, with
+ *  the time of each event relative to the one before in the same track.
+ *  Running status is expanded as it goes, so that every event has its
+ *  status byte. A track that turns out to be corrupt just ends early, and
+ *  whatever is left of it is skipped. Returns non-zero if there isn't
+ *  enough memory.
+ */
+static int read_track(MIDI_READER *r, MIDI_STREAM *s)
+{
+   unsigned char running_status = 0;
+   unsigned char status, *p;
+   unsigned long delta, l;
+   long start;
+   int c, n, i, type;
+
+   while (r->left > 0) {
+      start = s->size;
+      type = -1;
+
+      if (reader_var_len(r, &delta) != 0)
+	 break;
+
+      c = reader_getc(r);
+      if (c == EOF)
+	 break;
+
+      if (c & 0x80) {                           /* regular message */
+	 status = c;
+	 c = -1;
+	 /* no running status for sysex and meta-events! */
+	 if ((status != 0xF0) && (status != 0xF7) && (status != 0xFF))
+	    running_status = status;
+      }
+      else {                                    /* use running status */
+	 if (!running_status)
 	    break;
+	 status = running_status;
+      }
 
-      /* if there are no free voices, remember the note for later */
-      if ((c >= midi_driver->voices) && (polite)) {
-	 for (c=0; c<MIDI_VOICES; c++) {
-	    if (midi_waiting[c].note < 0) {
-	       midi_waiting[c].channel = channel;
-	       midi_waiting[c].note = note;
-	       midi_waiting[c].volume = vol;
-	       break;
+      /* the time, the status, and up to two data bytes or the meta-event
+	 type and payload length */
+      if (stream_reserve(s, 16) != 0)
+	 return -1;
+
+      p = s->data + s->size;
+      p += put_var_len(p, delta);
+      *(p++) = status;
+
+      switch (status>>4) {
+
+	 case 0x08:                             /* note off */
+	 case 0x09:                             /* note on */
+	 case 0x0A:                             /* note aftertouch */
+	 case 0x0B:                             /* control change */
+	 case 0x0C:                             /* program change */
+	 case 0x0D:                             /* channel aftertouch */
+	 case 0x0E:                             /* pitch bend */
+	    n = (((status>>4) == 0x0C) || ((status>>4) == 0x0D)) ? 1 : 2;
+	    for (i=0; i<n; i++) {
+	       if (c < 0)
+		  c = reader_getc(r);
+	       if (c == EOF)
+		  goto corrupt;
+	       *(p++) = c & 0x7F;
+	       c = -1;
 	    }
-	 }
-	 return;
+	    break;
+
+	 case 0x0F:                             /* special event */
+	    switch (status) {
+
+	       case 0xFF:                       /* meta-event */
+		  type = reader_getc(r);
+		  if (type == EOF)
+		     goto corrupt;
+		  *(p++) = type;
+		  /* fall through */
+
+	       case 0xF0:                       /* sysex */
+	       case 0xF7:
+		  if ((reader_var_len(r, &l) != 0) || (l > (unsigned long)r->left))
+		     goto corrupt;
+
+		  p += put_var_len(p, l);
+		  s->size = p - s->data;
+
+		  if (stream_reserve(s, l) != 0)
+		     return -1;
+
+		  p = s->data + s->size;
+		  r->left -= l;
+
+		  if (r->f) {
+		     if (pack_fread(p, l, r->f) != (long)l)
+			goto corrupt;
+		  }
+		  else {
+		     memcpy(p, r->pos, l);
+		     r->pos += l;
+		  }
+
+		  p += l;
+		  break;
+
+	       case 0xF2:                       /* song position */
+	       case 0xF3:                       /* song select */
+		  n = (status == 0xF2) ? 2 : 1;
+		  for (i=0; i<n; i++) {
+		     if (reader_getc(r) == EOF)
+			goto corrupt;
+		     *(p++) = 0;
+		  }
+		  break;
+
+	       default:
+		  /* the other special events don't have any data bytes */
+		  break;
+	    }
+	    break;
       }
-   }
 
-   /* drum sound? */
-   if (channel == 9) {
-      inst = 128+note;
-      corrected_note = 60;
-      bend = 0;
-   }
-   else {
-      inst = midi_channel[channel].patch;
-      corrected_note = note;
-      bend = midi_channel[channel].pitch_bend;
-      sort_out_pitch_bend(&bend, &corrected_note);
+      s->size = p - s->data;
+      s->num_events++;
+
+      /* end of track? */
+      if (type == 0x2F)
+	 break;
+
+      continue;
+
+      corrupt:
+      s->size = start;
+      break;
    }
 
-   /* play the note */
-   midi_alloc_channel = channel;
-   midi_alloc_note = note;
-   midi_alloc_vol = vol;
+   /* skip whatever is left of the track */
+   if ((r->f) && (r->left > 0))
+      pack_fseek(r->f, r->left);
 
-   midi_driver->key_on(inst, corrected_note, bend, 
-		       sort_out_volume(channel, vol), 
-		       midi_channel[channel].pan);
-}
+   r->left = 0;
 
-END_OF_STATIC_FUNCTION(midi_note_on);
+   return 0;
+}
 
 
 
-/* all_notes_off:
- *  Turns off all active notes.
+/* merge_tracks:
+ *  Merges the events read from each track into a single stream sorted by
+ *  absolute time, and records checkpoints of the channel state along the
+ *  way, so that playing is just a matter of walking the stream and seeking
+ *  only has to replay a short run of it. Events at the same time keep the
+ *  order they would have had when playing the tracks one after another.
+ *  Returns the new timeline, or NULL on error.
  */
-static void all_notes_off(int channel)
+static MIDI_TIMELINE *merge_tracks(MIDI_STREAM *track, int num_tracks, int divisions)
 {
-   if (midi_driver->raw_midi) {
-      midi_driver->raw_midi(0xB0+channel);
-      midi_driver->raw_midi(123);
-      midi_driver->raw_midi(0);
-      return;
+   AL_CONST unsigned char *pos[MIDI_TRACKS], *end[MIDI_TRACKS], *start;
+   unsigned long tick[MIDI_TRACKS], last;
+   unsigned char running_status = 0;
+   MIDI_TIMELINE *tl, *tmp;
+   MIDI_CHECKPOINT state;
+   MIDI_EVENT ev;
+   unsigned char *out;
+   long n, num_checkpoints, data_size, size;
+   int c, best;
+
+   n = 0;
+   data_size = 0;
+
+   for (c=0; c<num_tracks; c++) {
+      n += track[c].num_events;
+      data_size += track[c].size;
    }
-   else {
-      int note, layer;
 
-      for (note=0; note<128; note++)
-	 for (layer=0; layer<MIDI_LAYERS; layer++)
-	    if (midi_channel[channel].note[note][layer] >= 0)
-	       midi_note_off(channel, note);
-   }
-}
+   /* merging can only make the times shorter, so this is plenty */
+   num_checkpoints = (n + MIDI_CHECKPOINT_EVENTS - 1) / MIDI_CHECKPOINT_EVENTS;
+   size = sizeof(MIDI_TIMELINE) + num_checkpoints * sizeof(MIDI_CHECKPOINT) + data_size;
 
-END_OF_STATIC_FUNCTION(all_notes_off);
+   tl = _AL_MALLOC(size);
+   if (!tl)
+      return NULL;
 
+   tl->num_events = n;
+   tl->num_checkpoints = num_checkpoints;
+   tl->checkpoint = (MIDI_CHECKPOINT *)(tl + 1);
+   tl->data = (unsigned char *)(tl->checkpoint + num_checkpoints);
 
+   for (c=0; c<num_tracks; c++) {
+      pos[c] = track[c].data;
+      end[c] = track[c].data + track[c].size;
+      tick[c] = (pos[c] < end[c]) ? parse_var_len(&pos[c], end[c]) : 0;
+   }
 
-/* all_sound_off:
- *  Turns off sound.
- */
-static void all_sound_off(int channel)
-{
-   if (midi_driver->raw_midi) {
-      midi_driver->raw_midi(0xB0+channel);
-      midi_driver->raw_midi(120);
-      midi_driver->raw_midi(0);
-      return;
+   state.tick = 0;
+   state.timers = 0;
+   state.speed = TIMERS_PER_SECOND / 2 / divisions;   /* 120 bpm */
+
+   for (c=0; c<16; c++) {
+      state.patch[c] = 0;
+      state.volume[c] = 128;
+      state.pan[c] = default_pan(c);
+      state.pitch_bend[c] = 0x2000;
    }
-}
 
-END_OF_STATIC_FUNCTION(all_sound_off);
+   out = tl->data;
+   last = 0;
+
+   for (n=0; n<tl->num_events; n++) {
+      best = -1;
+      for (c=0; c<num_tracks; c++)
+	 if ((pos[c] < end[c]) && ((best < 0) || (tick[c] < tick[best])))
+	    best = c;
 
+      if (n % MIDI_CHECKPOINT_EVENTS == 0) {
+	 state.offset = out - tl->data;
+	 tl->checkpoint[n / MIDI_CHECKPOINT_EVENTS] = state;
+      }
 
+      out += put_var_len(out, tick[best] - last);
+      last = tick[best];
 
-/* reset_controllers:
- *  Resets volume, pan, pitch bend, etc, to default positions.
- */
-static void reset_controllers(int channel)
-{
-   midi_channel[channel].new_volume = 128;
-   midi_channel[channel].new_pitch_bend = 0x2000;
+      start = pos[best];
+      read_midi_event(&pos[best], end[best], &running_status, &ev);
+      memcpy(out, start, pos[best] - start);
+      out += pos[best] - start;
 
-   if (midi_driver->raw_midi) {
-      midi_driver->raw_midi(0xB0+channel);
-      midi_driver->raw_midi(121);
-      midi_driver->raw_midi(0);
-   }
+      chase_midi_event(&state, &ev, tick[best], divisions);
 
-   switch (channel % 3) {
-      case 0:  midi_channel[channel].pan = ((channel/3) & 1) ? 60 : 68; break;
-      case 1:  midi_channel[channel].pan = 104; break;
-      case 2:  midi_channel[channel].pan = 24; break;
+      if (pos[best] < end[best])
+	 tick[best] += parse_var_len(&pos[best], end[best]);
    }
 
-   if (midi_driver->raw_midi) {
-      midi_driver->raw_midi(0xB0+channel);
-      midi_driver->raw_midi(10);
-      midi_driver->raw_midi(midi_channel[channel].pan);
+   tl->last_tick = last;
+   tl->length = state.timers;
+   tl->data_size = out - tl->data;
+   tl->size = size - data_size + tl->data_size;
+
+   /* give back what the shorter times saved */
+   tmp = _AL_REALLOC(tl, tl->size);
+   if (tmp) {
+      tl = tmp;
+      tl->checkpoint = (MIDI_CHECKPOINT *)(tl + 1);
+      tl->data = (unsigned char *)(tl->checkpoint + num_checkpoints);
    }
-}
+   else
+      tl->size = size;
 
-END_OF_STATIC_FUNCTION(reset_controllers);
+   return tl;
+}
 
 
 
-/* update_controllers:
- *  Checks cached controller information and updates active voices.
+/* free_tracks:
+ *  Frees the streams that the tracks of a MIDI file were read into.
  */
-static void update_controllers(void)
+static void free_tracks(MIDI_STREAM *track, int num_tracks)
 {
-   int c, c2, vol, bend, note;
+   int c;
 
-   for (c=0; c<16; c++) {
-      /* check for volume controller change */
-      if ((midi_channel[c].volume != midi_channel[c].new_volume) || (old_midi_volume != _midi_volume)) {
-	 midi_channel[c].volume = midi_channel[c].new_volume;
-	 if (midi_driver->raw_midi) {
-	    midi_driver->raw_midi(0xB0+c);
-	    midi_driver->raw_midi(7);
-	    midi_driver->raw_midi(global_volume_fix(midi_channel[c].volume-1));
-	 }
-	 else {
-	    for (c2=0; c2<MIDI_VOICES; c2++) {
-	       if ((midi_voice[c2].channel == c) && (midi_voice[c2].note >= 0)) {
-		  vol = sort_out_volume(c, midi_voice[c2].volume);
-		  midi_driver->set_volume(c2 + midi_driver->basevoice, vol);
-	       }
-	    }
-	 }
-      }
+   for (c=0; c<num_tracks; c++) {
+      if (track[c].data)
+	 _AL_FREE(track[c].data);
 
-      /* check for pitch bend change */
-      if (midi_channel[c].pitch_bend != midi_channel[c].new_pitch_bend) {
-	 midi_channel[c].pitch_bend = midi_channel[c].new_pitch_bend;
-	 if (midi_driver->raw_midi) {
-	    midi_driver->raw_midi(0xE0+c);
-	    midi_driver->raw_midi(midi_channel[c].pitch_bend & 0x7F);
-	    midi_driver->raw_midi(midi_channel[c].pitch_bend >> 7);
-	 }
-	 else {
-	    for (c2=0; c2<MIDI_VOICES; c2++) {
-	       if ((midi_voice[c2].channel == c) && (midi_voice[c2].note >= 0)) {
-		  bend = midi_channel[c].pitch_bend;
-		  note = midi_voice[c2].note;
-		  sort_out_pitch_bend(&bend, &note);
-		  midi_driver->set_pitch(c2 + midi_driver->basevoice, note, bend);
-	       }
-	    }
-	 }
-      }
+      track[c].data = NULL;
+      track[c].size = track[c].max = track[c].num_events = 0;
    }
-
-   old_midi_volume = _midi_volume;
 }
 
-END_OF_STATIC_FUNCTION(update_controllers);
-
 
 
-/* process_controller:
- *  Deals with a MIDI controller message on the specified channel.
+/* build_timeline:
+ *  Merges the tracks that have been read into the timeline of a MIDI file,
+ *  and frees them. Returns zero on success.
  */
-static void process_controller(int channel, int ctrl, int data)
+static int build_timeline(MIDI *midi, MIDI_STREAM *track, int num_tracks)
 {
-   switch (ctrl) {
-
-      case 7:                                   /* main volume */
-	 midi_channel[channel].new_volume = data+1;
-	 break;
-
-      case 10:                                  /* pan */
-	 midi_channel[channel].pan = data;
-	 if (midi_driver->raw_midi) {
-	    midi_driver->raw_midi(0xB0+channel);
-	    midi_driver->raw_midi(10);
-	    midi_driver->raw_midi(data);
-	 }
-	 break;
+   MIDI_TIMELINE *tl;
 
-      case 120:                                 /* all sound off */
-	 all_sound_off(channel);
-	 break;
+   tl = merge_tracks(track, num_tracks, midi->divisions);
+   free_tracks(track, num_tracks);
 
-      case 121:                                 /* reset all controllers */
-	 reset_controllers(channel);
-	 break;
+   if (!tl)
+      return -1;
 
-      case 123:                                 /* all notes off */
-      case 124:                                 /* omni mode off */
-      case 125:                                 /* omni mode on */
-      case 126:                                 /* poly mode off */
-      case 127:                                 /* poly mode on */
-	 all_notes_off(channel);
-	 break;
+   if (midi->timeline)
+      _AL_FREE(midi->timeline);
 
-      default:
-	 if (midi_driver->raw_midi) {
-	    midi_driver->raw_midi(0xB0+channel);
-	    midi_driver->raw_midi(ctrl);
-	    midi_driver->raw_midi(data);
-	 }
-	 break;
-   }
+   midi->timeline = tl;
+   return 0;
 }
 
-END_OF_STATIC_FUNCTION(process_controller);
-
 
 
-/* process_meta_event:
- *  Processes the next meta-event on the specified track.
+/* compile_midi:
+ *  Builds the timeline of a MIDI file from the raw track data in the MIDI
+ *  structure. Returns the new timeline, or NULL on error.
  */
-static void process_meta_event(AL_CONST unsigned char **pos, long *timer)
+static MIDI_TIMELINE *compile_midi(MIDI *midi)
 {
-   unsigned char metatype = *((*pos)++);
-   long length = parse_var_len(pos);
-   long tempo;
+   MIDI_STREAM track[MIDI_TRACKS];
+   MIDI_READER r;
+   int c;
+   ASSERT(midi);
 
-   if (midi_meta_callback)
-      midi_meta_callback(metatype, *pos, length);
+   if (midi->divisions <= 0)
+      return NULL;
 
-   if (metatype == 0x2F) {                      /* end of track */
-      *pos = NULL;
-      *timer = LONG_MAX;
-      return;
-   }
+   memset(track, 0, sizeof(track));
+
+   for (c=0; c<MIDI_TRACKS; c++) {
+      r.f = NULL;
+      r.pos = midi->track[c].data;
+      r.left = (midi->track[c].data) ? midi->track[c].len : 0;
 
-   if (metatype == 0x51) {                      /* tempo change */
-      tempo = (*pos)[0] * 0x10000L + (*pos)[1] * 0x100 + (*pos)[2];
-      midi_new_speed = (tempo/1000) * (TIMERS_PER_SECOND/1000);
-      midi_new_speed /= midifile->divisions;
+      if (read_track(&r, track+c) != 0) {
+	 free_tracks(track, MIDI_TRACKS);
+	 return NULL;
+      }
    }
 
-   (*pos) += length;
-}
+   if (build_timeline(midi, track, MIDI_TRACKS) != 0)
+      return NULL;
 
-END_OF_STATIC_FUNCTION(process_meta_event);
+   return midi->timeline;
+}
 
 
 
-/* process_midi_event:
- *  Processes the next MIDI event on the specified track.
+/* _midi_read_tracks:
+ *  Reads the tracks of a MIDI file straight from a packfile into the
+ *  timeline of the MIDI structure, as chunks with an "MTrk" header if smf
+ *  is set, or in datafile format otherwise. Only the events are kept, not
+ *  the raw track data, unless _midi_keep_tracks is set for tools that need
+ *  to write it out again. Returns zero on success.
  */
-static void process_midi_event(AL_CONST unsigned char **pos, unsigned char *running_status, long *timer)
+int _midi_read_tracks(MIDI *midi, PACKFILE *f, int num_tracks, int smf)
 {
-   unsigned char byte1, byte2; 
-   int channel;
-   unsigned char event;
-   long l;
+   MIDI_STREAM track[MIDI_TRACKS];
+   MIDI_READER r;
+   char buf[4];
+   long len;
+   int c;
+   ASSERT(midi);
+   ASSERT(f);
+   ASSERT((num_tracks >= 0) && (num_tracks <= MIDI_TRACKS));
 
-   event = *((*pos)++); 
+   if (midi->divisions <= 0)
+      return -1;
 
-   if (event & 0x80) {                          /* regular message */
-      /* no running status for sysex and meta-events! */
-      if ((event != 0xF0) && (event != 0xF7) && (event != 0xFF))
-	 *running_status = event;
-      byte1 = (*pos)[0];
-      byte2 = (*pos)[1];
-   }
-   else {                                       /* use running status */
-      byte1 = event; 
-      byte2 = (*pos)[0];
-      event = *running_status; 
-      (*pos)--;
-   }
+   memset(track, 0, sizeof(track));
 
-   /* program callback? */
-   if ((midi_msg_callback) && 
-       (event != 0xF0) && (event != 0xF7) && (event != 0xFF))
-      midi_msg_callback(event, byte1, byte2);
+   for (c=0; c<num_tracks; c++) {
+      if (smf) {                                /* read track header */
+	 if ((pack_fread(buf, 4, f) != 4) || (memcmp(buf, "MTrk", 4)))
+	    goto error;
+      }
 
-   channel = event & 0x0F;
+      len = pack_mgetl(f);                      /* length of track chunk */
+      if (len < 0)
+	 goto error;
 
-   switch (event>>4) {
+      if (len == 0)
+	 continue;
 
-      case 0x08:                                /* note off */
-	 midi_note_off(channel, byte1);
-	 (*pos) += 2;
-	 break;
+      r.f = f;
+      r.pos = NULL;
+      r.left = len;
 
-      case 0x09:                                /* note on */
-	 midi_note_on(channel, byte1, byte2, 1);
-	 (*pos) += 2;
-	 break;
+      if (_midi_keep_tracks) {
+	 midi->track[c].len = len;
+	 midi->track[c].data = _AL_MALLOC_ATOMIC(len);
+	 if (!midi->track[c].data)
+	    goto error;
 
-      case 0x0A:                                /* note aftertouch */
-	 (*pos) += 2;
-	 break;
+	 if (pack_fread(midi->track[c].data, len, f) != len)
+	    goto error;
 
-      case 0x0B:                                /* control change */
-	 process_controller(channel, byte1, byte2);
-	 (*pos) += 2;
-	 break;
+	 r.f = NULL;
+	 r.pos = midi->track[c].data;
+      }
 
-      case 0x0C:                                /* program change */
-	 midi_channel[channel].patch = byte1;
-	 if (midi_driver->raw_midi)
-	    raw_program_change(channel, byte1);
-	 (*pos) += 1;
-	 break;
+      if ((read_track(&r, track+c) != 0) || (pack_ferror(f)))
+	 goto error;
+   }
 
-      case 0x0D:                                /* channel aftertouch */
-	 (*pos) += 1;
-	 break;
+   return build_timeline(midi, track, num_tracks);
 
-      case 0x0E:                                /* pitch bend */
-	 midi_channel[channel].new_pitch_bend = byte1 + (byte2<<7);
-	 (*pos) += 2;
-	 break;
+   error:
+   free_tracks(track, num_tracks);
+   return -1;
+}
 
-      case 0x0F:                                /* special event */
-	 switch (event) {
-	    case 0xF0:                          /* sysex */
-	    case 0xF7: 
-	       l = parse_var_len(pos);
-	       if (midi_sysex_callback)
-		  midi_sysex_callback(*pos, l);
-	       (*pos) += l;
-	       break;
 
-	    case 0xF2:                          /* song position */
-	       (*pos) += 2;
-	       break;
 
-	    case 0xF3:                          /* song select */
-	       (*pos)++;
-	       break;
+/* global_volume_fix:
+ *  Converts a note volume, adjusting it according to the global 
+ *  _midi_volume variable.
+ */
+static INLINE int global_volume_fix(int vol)
+{
+   if (_midi_volume >= 0)
+      return (vol * _midi_volume) / 256;
 
-	    case 0xFF:                          /* meta-event */
-	       process_meta_event(pos, timer);
-	       break;
+   return vol;
+}
 
-	    default:
-	       /* the other special events don't have any data bytes,
-		  so we don't need to bother skipping past them */
-	       break;
-	 }
+
+
+/* sort_out_volume:
+ *  Converts a note volume, adjusting it according to the channel volume
+ *  and the global _midi_volume variable.
+ */
+static INLINE int sort_out_volume(int c, int vol)
+{
+   return global_volume_fix((vol * midi_channel[c].volume) / 128);
+}
+
+
+
+/* output_channel:
+ *  Maps a channel of the file a player is playing onto the channel of the
+ *  MIDI driver it goes to, or -1 if the channel is muted. Messages that
+ *  don't come from a player go straight through.
+ */
+static INLINE int output_channel(MIDI_PLAYER *p, int channel)
+{
+   return (p) ? p->channel[channel] : channel;
+}
+
+
+
+/* player_volume:
+ *  Scales a channel volume controller value (1-128) by the volume of the
+ *  player it comes from.
+ */
+static INLINE int player_volume(MIDI_PLAYER *p, int vol)
+{
+   if (p)
+      return (vol-1) * p->volume / 255 + 1;
+
+   return vol;
+}
+
+
+
+/* player_speed:
+ *  Scales the timer ticks per MIDI tick of a file by the player tempo.
+ */
+static INLINE int player_speed(MIDI_PLAYER *p, int speed)
+{
+   if (p->tempo != 100)
+      speed = MAX(1, (int)((LONG_LONG)speed * 100 / p->tempo));
+
+   return speed;
+}
+
+
+
+/* raw_program_change:
+ *  Sends a program change message to a device capable of handling raw
+ *  MIDI data, using patch mapping tables. Assumes that midi_driver->raw_midi
+ *  isn't NULL, so check before calling it!
+ */
+static void raw_program_change(int channel, int patch)
+{
+   if (channel != 9) {
+      /* bank change #1 */
+      if (patch_table[patch].bank1 >= 0) {
+	 midi_driver->raw_midi(0xB0+channel);
+	 midi_driver->raw_midi(0);
+	 midi_driver->raw_midi(patch_table[patch].bank1);
+      }
+
+      /* bank change #2 */
+      if (patch_table[patch].bank2 >= 0) {
+	 midi_driver->raw_midi(0xB0+channel);
+	 midi_driver->raw_midi(32);
+	 midi_driver->raw_midi(patch_table[patch].bank2);
+      }
+
+      /* program change */
+      midi_driver->raw_midi(0xC0+channel);
+      midi_driver->raw_midi(patch_table[patch].prog);
+
+      /* update volume */
+      midi_driver->raw_midi(0xB0+channel);
+      midi_driver->raw_midi(7);
+      midi_driver->raw_midi(global_volume_fix(midi_channel[channel].volume-1));
+   }
+}
+
+END_OF_STATIC_FUNCTION(raw_program_change);
+
+
+
+/* steal_before:
+ *  Decides which of two playing voices should be cut off first when a
+ *  voice is needed: the one on the lower priority channel, then the
+ *  quieter one, and then the one that has been playing for longer.
+ */
+static INLINE int steal_before(int a, int b)
+{
+   int pa = midi_channel[midi_voice[a].channel].priority;
+   int pb = midi_channel[midi_voice[b].channel].priority;
+
+   if (pa != pb)
+      return (pa < pb);
+
+   if (midi_voice[a].volume != midi_voice[b].volume)
+      return (midi_voice[a].volume < midi_voice[b].volume);
+
+   return (midi_voice[a].time < midi_voice[b].time);
+}
+
+
+
+/* heap_move_up:
+ *  Restores the steal heap order after the voice at pos became a better
+ *  candidate than its parents.
+ */
+static void heap_move_up(int pos)
+{
+   int voice = midi_steal_heap[pos];
+   int parent;
+
+   while (pos > 0) {
+      parent = (pos-1) / 2;
+      if (!steal_before(voice, midi_steal_heap[parent]))
 	 break;
+      midi_steal_heap[pos] = midi_steal_heap[parent];
+      midi_voice[midi_steal_heap[pos]].heap_pos = pos;
+      pos = parent;
+   }
 
-      default:
-	 /* something has gone badly wrong if we ever get to here */
+   midi_steal_heap[pos] = voice;
+   midi_voice[voice].heap_pos = pos;
+}
+
+END_OF_STATIC_FUNCTION(heap_move_up);
+
+
+
+/* heap_move_down:
+ *  Restores the steal heap order after the voice at pos became a worse
+ *  candidate than its children.
+ */
+static void heap_move_down(int pos)
+{
+   int voice = midi_steal_heap[pos];
+   int child;
+
+   for (;;) {
+      child = pos*2 + 1;
+      if (child >= midi_steal_count)
+	 break;
+      if ((child+1 < midi_steal_count) &&
+	  (steal_before(midi_steal_heap[child+1], midi_steal_heap[child])))
+	 child++;
+      if (!steal_before(midi_steal_heap[child], voice))
 	 break;
+      midi_steal_heap[pos] = midi_steal_heap[child];
+      midi_voice[midi_steal_heap[pos]].heap_pos = pos;
+      pos = child;
    }
+
+   midi_steal_heap[pos] = voice;
+   midi_voice[voice].heap_pos = pos;
 }
 
-END_OF_STATIC_FUNCTION(process_midi_event);
+END_OF_STATIC_FUNCTION(heap_move_down);
 
 
 
-/* midi_player:
- *  The core MIDI player: to be used as a timer callback.
+/* voice_started:
+ *  Moves a voice from the free list into the steal heap, once it has been
+ *  given a note to play.
  */
-static void midi_player(void)
+static void voice_started(int voice)
 {
-   int c;
-   long l;
-   int active;
+   MIDI_VOICE *v = midi_voice + voice;
 
-   if (!midifile)
-      return;
+   if (v->prev >= 0)
+      midi_voice[v->prev].next = v->next;
+   else
+      midi_free_first = v->next;
 
-   if (midi_semaphore) {
-      midi_timer_speed += BPS_TO_TIMER(MIDI_TIMER_FREQUENCY);
-      install_int_ex(midi_player, BPS_TO_TIMER(MIDI_TIMER_FREQUENCY));
+   if (v->next >= 0)
+      midi_voice[v->next].prev = v->prev;
+   else
+      midi_free_last = v->prev;
+
+   v->prev = v->next = -1;
+
+   midi_steal_heap[midi_steal_count] = voice;
+   heap_move_up(midi_steal_count++);
+
+   midi_channel[v->channel].voices++;
+
+   midi_stats.notes++;
+   midi_stats.active = midi_steal_count;
+   if (midi_stats.active > midi_stats.peak)
+      midi_stats.peak = midi_stats.active;
+}
+
+END_OF_STATIC_FUNCTION(voice_started);
+
+
+
+/* voice_released:
+ *  Moves a voice from the steal heap to the end of the free list, so the
+ *  voices that were released longest ago get reused first.
+ */
+static void voice_released(int voice)
+{
+   MIDI_VOICE *v = midi_voice + voice;
+   int pos = v->heap_pos;
+
+   if (pos < 0)
       return;
+
+   midi_steal_count--;
+   if (pos < midi_steal_count) {
+      midi_steal_heap[pos] = midi_steal_heap[midi_steal_count];
+      midi_voice[midi_steal_heap[pos]].heap_pos = pos;
+      heap_move_up(pos);
+      heap_move_down(midi_voice[midi_steal_heap[pos]].heap_pos);
    }
+   v->heap_pos = -1;
+
+   v->prev = midi_free_last;
+   v->next = -1;
+   if (midi_free_last >= 0)
+      midi_voice[midi_free_last].next = voice;
+   else
+      midi_free_first = voice;
+   midi_free_last = voice;
+
+   midi_channel[v->channel].voices--;
+   midi_stats.active = midi_steal_count;
+}
 
-   midi_semaphore = TRUE;
-   _midi_tick++;
+END_OF_STATIC_FUNCTION(voice_released);
 
-   midi_timers += midi_timer_speed;
-   midi_time = midi_timers / TIMERS_PER_SECOND;
 
-   do_it_all_again:
 
-   for (c=0; c<MIDI_VOICES; c++)
-      midi_waiting[c].note = -1;
+/* sync_voice_allocator:
+ *  Rebuilds the free list and steal heap from the voice table whenever
+ *  the driver or its number of voices has changed, or the channel
+ *  priorities have been altered. Voices in the driver's reserved range
+ *  are left out of both.
+ */
+static void sync_voice_allocator(void)
+{
+   int c, v;
 
-   /* deal with each track in turn... */
-   for (c=0; c<MIDI_TRACKS; c++) { 
-      if (midi_track[c].pos) {
-	 midi_track[c].timer -= midi_timer_speed;
-
-	 /* while events are waiting, process them */
-	 while (midi_track[c].timer <= 0) { 
-	    process_midi_event((AL_CONST unsigned char**) &midi_track[c].pos, 
-			       &midi_track[c].running_status,
-			       &midi_track[c].timer); 
-
-	    /* read next time offset */
-	    if (midi_track[c].pos) { 
-	       l = parse_var_len((AL_CONST unsigned char**) &midi_track[c].pos);
-	       l *= midi_speed;
-	       midi_track[c].timer += l;
-	    }
-	 }
+   if ((midi_alloc_driver == midi_driver) &&
+       (midi_alloc_voices == midi_driver->voices))
+      return;
+
+   midi_alloc_driver = midi_driver;
+   midi_alloc_voices = midi_driver->voices;
+
+   midi_free_first = midi_free_last = -1;
+   midi_steal_count = 0;
+
+   for (c=0; c<16; c++)
+      midi_channel[c].voices = 0;
+
+   for (c=0; c<MIDI_VOICES; c++) {
+      midi_voice[c].prev = midi_voice[c].next = -1;
+      midi_voice[c].heap_pos = -1;
+
+      if ((c >= midi_alloc_voices) ||
+	  ((c >= midi_driver->xmin) && (c <= midi_driver->xmax)))
+	 continue;
+
+      if (midi_voice[c].note >= 0) {
+	 midi_steal_heap[midi_steal_count] = c;
+	 heap_move_up(midi_steal_count++);
+	 midi_channel[midi_voice[c].channel].voices++;
+      }
+      else {
+	 /* keep the free list in release order */
+	 v = midi_free_last;
+	 while ((v >= 0) && (midi_voice[v].time > midi_voice[c].time))
+	    v = midi_voice[v].prev;
+
+	 midi_voice[c].prev = v;
+	 midi_voice[c].next = (v >= 0) ? midi_voice[v].next : midi_free_first;
+	 if (midi_voice[c].next >= 0)
+	    midi_voice[midi_voice[c].next].prev = c;
+	 else
+	    midi_free_last = c;
+	 if (v >= 0)
+	    midi_voice[v].next = c;
+	 else
+	    midi_free_first = c;
       }
    }
 
-   /* update global position value */
-   midi_pos_counter -= midi_timer_speed;
-   while (midi_pos_counter <= 0) {
-      midi_pos_counter += midi_pos_speed;
-      midi_pos++;
-   }
+   midi_stats.active = midi_steal_count;
+}
+
+END_OF_STATIC_FUNCTION(sync_voice_allocator);
+
 
-   /* tempo change? */
-   if (midi_new_speed > 0) {
-      for (c=0; c<MIDI_TRACKS; c++) {
-	 if (midi_track[c].pos) {
-	    midi_track[c].timer /= midi_speed;
-	    midi_track[c].timer *= midi_new_speed;
-	 }
-      }
-      midi_pos_counter /= midi_speed;
-      midi_pos_counter *= midi_new_speed;
 
-      midi_speed = midi_new_speed;
-      midi_pos_speed = midi_new_speed * midifile->divisions;
-      midi_new_speed = -1;
+/* midi_note_off:
+ *  Processes a MIDI note-off event.
+ */
+static void midi_note_off(int channel, int note)
+{
+   int done = FALSE;
+   int voice, layer;
+   int c;
+
+   /* can we send raw MIDI data? */
+   if (midi_driver->raw_midi) {
+      if (channel != 9)
+	 note += patch_table[midi_channel[channel].patch].pitch;
+
+      midi_driver->raw_midi(0x80+channel);
+      midi_driver->raw_midi(note);
+      midi_driver->raw_midi(0);
+      return;
    }
 
-   /* figure out how long until we need to be called again */
-   active = 0;
-   midi_timer_speed = LONG_MAX;
-   for (c=0; c<MIDI_TRACKS; c++) {
-      if (midi_track[c].pos) {
-	 active = 1;
-	 if (midi_track[c].timer < midi_timer_speed)
-	    midi_timer_speed = midi_track[c].timer;
+   /* oh well, have to do it the long way... */
+   for (layer=0; layer<MIDI_LAYERS; layer++) {
+      voice = midi_channel[channel].note[note][layer];
+      if (voice >= 0) {
+	 midi_driver->key_off(voice + midi_driver->basevoice);
+	 midi_voice[voice].note = -1;
+	 midi_voice[voice].time = _midi_tick;
+	 voice_released(voice);
+	 midi_channel[channel].note[note][layer] = -1; 
+	 done = TRUE;
       }
    }
 
-   /* end of the music? */
-   if ((!active) || ((midi_loop_end > 0) && (midi_pos >= midi_loop_end))) {
-      if ((midi_loop) && (!midi_looping)) {
-	 if (midi_loop_start > 0) {
-	    remove_int(midi_player);
-	    midi_semaphore = FALSE;
-	    midi_looping = TRUE;
-	    if (midi_seek(midi_loop_start) != 0) {
-	       midi_looping = FALSE;
-	       stop_midi(); 
-	       return;
-	    }
-	    midi_looping = FALSE;
-	    midi_semaphore = TRUE;
-	    goto do_it_all_again;
-	 }
-	 else {
-	    for (c=0; c<16; c++) {
-	       all_notes_off(c);
-	       all_sound_off(c);
-	    }
-	    prepare_to_play(midifile);
-	    goto do_it_all_again;
+   /* if the note isn't playing, it must still be in the waiting room */
+   if (!done) {
+      for (c=0; c<MIDI_VOICES; c++) {
+	 if ((midi_waiting[c].channel == channel) && 
+	     (midi_waiting[c].note == note)) {
+	    midi_waiting[c].note = -1;
+	    break;
 	 }
       }
-      else {
-	 stop_midi(); 
-	 midi_semaphore = FALSE;
-	 return;
-      }
    }
+}
+
+END_OF_STATIC_FUNCTION(midi_note_off);
+
+
+
+/* sort_out_pitch_bend:
+ *  MIDI pitch bend range is + or - two semitones. The low-level soundcard
+ *  drivers can only handle bends up to +1 semitone. This routine converts
+ *  pitch bends from MIDI format to our own format.
+ */
+static INLINE void sort_out_pitch_bend(int *bend, int *note)
+{
+   if (*bend == 0x2000) {
+      *bend = 0;
+      return;
+   }
+
+   (*bend) -= 0x2000;
+
+   while (*bend < 0) {
+      (*note)--;
+      (*bend) += 0x1000;
+   }
+
+   while (*bend >= 0x1000) {
+      (*note)++;
+      (*bend) -= 0x1000;
+   }
+}
+
+
+
+/* steal_voice:
+ *  Cuts off the note playing on a voice so it can be reused.
+ */
+static void steal_voice(int voice)
+{
+   midi_stats.steals++;
+   midi_stats.channel_steals[midi_voice[voice].channel]++;
+
+   midi_note_off(midi_voice[voice].channel, midi_voice[voice].note);
+}
+
+END_OF_STATIC_FUNCTION(steal_voice);
+
+
+
+/* _midi_allocate_voice:
+ *  Allocates a MIDI voice in the range min-max (inclusive). This is 
+ *  intended to be called by the key_on() handlers in the MIDI driver, 
+ *  and shouldn't be used by any other code.
+ *
+ *  Free voices are taken in the order they were released, so notes that
+ *  are still fading out get the longest time to do so. If there are
+ *  none, the playing note at the top of the steal heap is cut off,
+ *  unless the channel has reached its polyphony limit, in which case one
+ *  of its own notes goes instead.
+ */
+int _midi_allocate_voice(int min, int max)
+{
+   MIDI_CHANNEL *ch = midi_channel + midi_alloc_channel;
+   int c;
+   int layer;
+   int voice = -1;
+
+   if (min < 0)
+      min = 0;
+
+   if (max < 0)
+      max = midi_driver->voices-1;
+
+   /* which layer can we use? */
+   for (layer=0; layer<MIDI_LAYERS; layer++)
+      if (ch->note[midi_alloc_note][layer] < 0)
+	 break; 
+
+   if (layer >= MIDI_LAYERS)
+      return -1;
+
+   sync_voice_allocator();
+
+   if (ch->voices >= ch->max_voices) {
+      /* the channel is at its limit, so make room among its own notes */
+      for (c=min; c<=max; c++) {
+	 if ((midi_voice[c].heap_pos >= 0) &&
+	     (midi_voice[c].channel == midi_alloc_channel) &&
+	     ((voice < 0) || (steal_before(c, voice))))
+	    voice = c;
+      }
+
+      if (voice < 0) {
+	 midi_stats.dropped++;
+	 return -1;
+      }
+
+      midi_stats.cap_steals++;
+      steal_voice(voice);
+   }
+   else {
+      /* find a free voice */
+      for (c=midi_free_first; c>=0; c=midi_voice[c].next) {
+	 if ((c >= min) && (c <= max)) {
+	    voice = c;
+	    break;
+	 }
+      }
+
+      /* if there are no free voices, kill a note to make room */
+      if (voice < 0) {
+	 if ((midi_steal_count > 0) &&
+	     (midi_steal_heap[0] >= min) && (midi_steal_heap[0] <= max)) {
+	    voice = midi_steal_heap[0];
+	 }
+	 else {
+	    for (c=0; c<midi_steal_count; c++) {
+	       if ((midi_steal_heap[c] >= min) && (midi_steal_heap[c] <= max) &&
+		   ((voice < 0) || (steal_before(midi_steal_heap[c], voice))))
+		  voice = midi_steal_heap[c];
+	    }
+	 }
+
+	 /* don't cut off a note that matters more than the new one */
+	 if ((voice < 0) ||
+	     (midi_channel[midi_voice[voice].channel].priority > ch->priority)) {
+	    midi_stats.dropped++;
+	    return -1;
+	 }
+
+	 steal_voice(voice);
+      }
+   }
+
+   /* the note table should always lead back to the voice, but never hand
+      out one that is still playing if it somehow didn't */
+   if (midi_voice[voice].heap_pos >= 0) {
+      midi_stats.dropped++;
+      return -1;
+   }
+
+   /* ok, we got it... */
+   midi_voice[voice].channel = midi_alloc_channel;
+   midi_voice[voice].note = midi_alloc_note;
+   midi_voice[voice].volume = midi_alloc_vol;
+   midi_voice[voice].time = _midi_tick;
+   ch->note[midi_alloc_note][layer] = voice; 
+
+   voice_started(voice);
+
+   return voice + midi_driver->basevoice;
+}
+
+END_OF_FUNCTION(_midi_allocate_voice);
+
+
+
+/* midi_note_on:
+ *  Processes a MIDI note-on event. Tries to find a free soundcard voice,
+ *  and if it can't either cuts off an existing note, or if 'polite' is
+ *  set, just stores the channel, note and volume in the waiting list.
+ */
+static void midi_note_on(int channel, int note, int vol, int polite)
+{
+   int c, layer, inst, bend, corrected_note;
+
+   /* it's easy if the driver can handle raw MIDI data */
+   if (midi_driver->raw_midi) {
+      if (channel != 9)
+	 note += patch_table[midi_channel[channel].patch].pitch;
+
+      midi_driver->raw_midi(0x90+channel);
+      midi_driver->raw_midi(note);
+      midi_driver->raw_midi(vol);
+      return;
+   }
+
+   /* if the note is already on, turn it off */
+   for (layer=0; layer<MIDI_LAYERS; layer++) {
+      if (midi_channel[channel].note[note][layer] >= 0) {
+	 midi_note_off(channel, note);
+	 return;
+      }
+   }
+
+   /* if zero volume and the note isn't playing, we can just ignore it */
+   if (vol == 0)
+      return;
+
+   if (channel != 9) {
+      sync_voice_allocator();
+
+      /* if there are no free voices, remember the note for later */
+      if ((midi_free_first < 0) && (polite)) {
+	 for (c=0; c<MIDI_VOICES; c++) {
+	    if (midi_waiting[c].note < 0) {
+	       midi_waiting[c].channel = channel;
+	       midi_waiting[c].note = note;
+	       midi_waiting[c].volume = vol;
+	       break;
+	    }
+	 }
+	 return;
+      }
+   }
+
+   /* drum sound? */
+   if (channel == 9) {
+      inst = 128+note;
+      corrected_note = 60;
+      bend = 0;
+   }
+   else {
+      inst = midi_channel[channel].patch;
+      corrected_note = note;
+      bend = midi_channel[channel].pitch_bend;
+      sort_out_pitch_bend(&bend, &corrected_note);
+   }
+
+   /* play the note */
+   midi_alloc_channel = channel;
+   midi_alloc_note = note;
+   midi_alloc_vol = vol;
+
+   midi_driver->key_on(inst, corrected_note, bend, 
+		       sort_out_volume(channel, vol), 
+		       midi_channel[channel].pan);
+}
+
+END_OF_STATIC_FUNCTION(midi_note_on);
+
+
+
+/* all_notes_off:
+ *  Turns off all active notes.
+ */
+static void all_notes_off(int channel)
+{
+   if (midi_driver->raw_midi) {
+      midi_driver->raw_midi(0xB0+channel);
+      midi_driver->raw_midi(123);
+      midi_driver->raw_midi(0);
+      return;
+   }
+   else {
+      int note, layer;
+
+      for (note=0; note<128; note++)
+	 for (layer=0; layer<MIDI_LAYERS; layer++)
+	    if (midi_channel[channel].note[note][layer] >= 0)
+	       midi_note_off(channel, note);
+   }
+}
+
+END_OF_STATIC_FUNCTION(all_notes_off);
+
+
+
+/* all_sound_off:
+ *  Turns off sound.
+ */
+static void all_sound_off(int channel)
+{
+   if (midi_driver->raw_midi) {
+      midi_driver->raw_midi(0xB0+channel);
+      midi_driver->raw_midi(120);
+      midi_driver->raw_midi(0);
+      return;
+   }
+}
+
+END_OF_STATIC_FUNCTION(all_sound_off);
+
+
+
+/* reset_controllers:
+ *  Resets volume, pan, pitch bend, etc, to default positions.
+ */
+static void reset_controllers(MIDI_PLAYER *p, int c)
+{
+   int channel = output_channel(p, c);
+
+   if (channel < 0)
+      return;
+
+   if (p)
+      p->controller_volume[c] = 128;
+
+   midi_channel[channel].new_volume = player_volume(p, 128);
+   midi_channel[channel].new_pitch_bend = 0x2000;
+
+   if (midi_driver->raw_midi) {
+      midi_driver->raw_midi(0xB0+channel);
+      midi_driver->raw_midi(121);
+      midi_driver->raw_midi(0);
+   }
+
+   midi_channel[channel].pan = default_pan(channel);
+
+   if (midi_driver->raw_midi) {
+      midi_driver->raw_midi(0xB0+channel);
+      midi_driver->raw_midi(10);
+      midi_driver->raw_midi(midi_channel[channel].pan);
+   }
+}
+
+END_OF_STATIC_FUNCTION(reset_controllers);
+
+
+
+/* update_controllers:
+ *  Checks cached controller information and updates active voices.
+ */
+static void update_controllers(void)
+{
+   int c, c2, vol, bend, note;
+
+   for (c=0; c<16; c++) {
+      /* check for volume controller change */
+      if ((midi_channel[c].volume != midi_channel[c].new_volume) || (old_midi_volume != _midi_volume)) {
+	 midi_channel[c].volume = midi_channel[c].new_volume;
+	 if (midi_driver->raw_midi) {
+	    midi_driver->raw_midi(0xB0+c);
+	    midi_driver->raw_midi(7);
+	    midi_driver->raw_midi(global_volume_fix(midi_channel[c].volume-1));
+	 }
+	 else {
+	    for (c2=0; c2<MIDI_VOICES; c2++) {
+	       if ((midi_voice[c2].channel == c) && (midi_voice[c2].note >= 0)) {
+		  vol = sort_out_volume(c, midi_voice[c2].volume);
+		  midi_driver->set_volume(c2 + midi_driver->basevoice, vol);
+	       }
+	    }
+	 }
+      }
+
+      /* check for pitch bend change */
+      if (midi_channel[c].pitch_bend != midi_channel[c].new_pitch_bend) {
+	 midi_channel[c].pitch_bend = midi_channel[c].new_pitch_bend;
+	 if (midi_driver->raw_midi) {
+	    midi_driver->raw_midi(0xE0+c);
+	    midi_driver->raw_midi(midi_channel[c].pitch_bend & 0x7F);
+	    midi_driver->raw_midi(midi_channel[c].pitch_bend >> 7);
+	 }
+	 else {
+	    for (c2=0; c2<MIDI_VOICES; c2++) {
+	       if ((midi_voice[c2].channel == c) && (midi_voice[c2].note >= 0)) {
+		  bend = midi_channel[c].pitch_bend;
+		  note = midi_voice[c2].note;
+		  sort_out_pitch_bend(&bend, &note);
+		  midi_driver->set_pitch(c2 + midi_driver->basevoice, note, bend);
+	       }
+	    }
+	 }
+      }
+   }
+
+   old_midi_volume = _midi_volume;
+}
+
+END_OF_STATIC_FUNCTION(update_controllers);
+
+
+
+/* process_controller:
+ *  Deals with a MIDI controller message on the specified channel of the
+ *  file a player is playing.
+ */
+static void process_controller(MIDI_PLAYER *p, int c, int ctrl, int data)
+{
+   int channel = output_channel(p, c);
+
+   switch (ctrl) {
+
+      case 7:                                   /* main volume */
+	 if (p)
+	    p->controller_volume[c] = data+1;
+	 midi_channel[channel].new_volume = player_volume(p, data+1);
+	 break;
+
+      case 10:                                  /* pan */
+	 midi_channel[channel].pan = data;
+	 if (midi_driver->raw_midi) {
+	    midi_driver->raw_midi(0xB0+channel);
+	    midi_driver->raw_midi(10);
+	    midi_driver->raw_midi(data);
+	 }
+	 break;
+
+      case 120:                                 /* all sound off */
+	 all_sound_off(channel);
+	 break;
+
+      case 121:                                 /* reset all controllers */
+	 reset_controllers(p, c);
+	 break;
+
+      case 123:                                 /* all notes off */
+      case 124:                                 /* omni mode off */
+      case 125:                                 /* omni mode on */
+      case 126:                                 /* poly mode off */
+      case 127:                                 /* poly mode on */
+	 all_notes_off(channel);
+	 break;
+
+      default:
+	 if (midi_driver->raw_midi) {
+	    midi_driver->raw_midi(0xB0+channel);
+	    midi_driver->raw_midi(ctrl);
+	    midi_driver->raw_midi(data);
+	 }
+	 break;
+   }
+}
+
+END_OF_STATIC_FUNCTION(process_controller);
+
+
+
+/* process_meta_event:
+ *  Processes a meta-event. Tempo changes sent with midi_out() go to the
+ *  file that play_midi() is playing.
+ */
+static void process_meta_event(MIDI_PLAYER *p, AL_CONST MIDI_EVENT *ev)
+{
+   int speed;
+
+   if (midi_meta_callback)
+      midi_meta_callback(ev->byte1, ev->data, ev->length);
+
+   if (!p)
+      p = &midi_default_player;
+
+   if ((ev->byte1 == 0x51) && (ev->length >= 3) && (p->midi)) {
+      speed = tempo_speed(ev->data, p->midi->divisions);   /* tempo change */
+      if (speed > 0) {
+	 p->file_speed = speed;
+	 p->new_speed = player_speed(p, speed);
+      }
+   }
+}
+
+END_OF_STATIC_FUNCTION(process_meta_event);
+
+
+
+/* process_midi_event:
+ *  Processes a MIDI event, either from the file a player is playing, or
+ *  from midi_out() if p is NULL.
+ */
+static void process_midi_event(MIDI_PLAYER *p, AL_CONST MIDI_EVENT *ev)
+{
+   int channel = output_channel(p, ev->status & 0x0F);
+
+   /* program callback? */
+   if ((midi_msg_callback) && 
+       (ev->status != 0xF0) && (ev->status != 0xF7) && (ev->status != 0xFF))
+      midi_msg_callback(ev->status, ev->byte1, ev->byte2);
+
+   /* muted channel? */
+   if ((channel < 0) && (ev->status < 0xF0))
+      return;
+
+   switch (ev->status>>4) {
+
+      case 0x08:                                /* note off */
+	 midi_note_off(channel, ev->byte1);
+	 break;
+
+      case 0x09:                                /* note on */
+	 midi_note_on(channel, ev->byte1, ev->byte2, 1);
+	 break;
+
+      case 0x0B:                                /* control change */
+	 process_controller(p, ev->status & 0x0F, ev->byte1, ev->byte2);
+	 break;
+
+      case 0x0C:                                /* program change */
+	 midi_channel[channel].patch = ev->byte1;
+	 if (midi_driver->raw_midi)
+	    raw_program_change(channel, ev->byte1);
+	 break;
+
+      case 0x0E:                                /* pitch bend */
+	 midi_channel[channel].new_pitch_bend = ev->byte1 + (ev->byte2<<7);
+	 break;
+
+      case 0x0F:                                /* special event */
+	 if (ev->status == 0xFF)
+	    process_meta_event(p, ev);
+	 else if (((ev->status == 0xF0) || (ev->status == 0xF7)) && (midi_sysex_callback))
+	    midi_sysex_callback(ev->data, ev->length);
+	 break;
+
+      default:
+	 /* aftertouch is ignored */
+	 break;
+   }
+}
+
+END_OF_STATIC_FUNCTION(process_midi_event);
+
+
+
+/* tap_clock:
+ *  Returns the time in seconds that the MIDI tap measures events against:
+ *  the sample position of the mixer when the player runs from it, or the
+ *  real time otherwise.
+ */
+static double tap_clock(void)
+{
+   if (midi_sample_accurate)
+      return (double)midi_sample_pos / midi_sample_freq;
+
+   return al_get_time();
+}
+
+END_OF_STATIC_FUNCTION(tap_clock);
+
+
+
+/* tap_event:
+ *  Records when an event that a player is about to dispatch was due, and
+ *  when it actually goes to the driver.
+ */
+static void tap_event(MIDI_PLAYER *p, AL_CONST MIDI_EVENT *ev)
+{
+   MIDI_JITTER_STATS *stats = NULL;
+   MIDI_TAP_EVENT *t;
+   double scheduled, dispatched, late, bin;
+   int i, next;
+
+   scheduled = p->tap_anchor + (double)(p->timers + p->event_timer) / TIMERS_PER_SECOND;
+   dispatched = tap_clock();
+
+   /* the ring drops new events rather than overwrite ones being read */
+   next = (midi_tap_head + 1) % midi_tap_size;
+   if (next != midi_tap_tail) {
+      t = midi_tap + midi_tap_head;
+      t->scheduled = scheduled;
+      t->dispatched = dispatched;
+      t->driver = midi_driver->id;
+      t->status = ev->status;
+      t->byte1 = ev->byte1;
+      t->byte2 = ev->byte2;
+      midi_tap_head = next;
+   }
+
+   for (i=0; i<MIDI_TAP_DRIVERS; i++) {
+      if ((midi_jitter[i].count == 0) || (midi_jitter[i].driver == midi_driver->id)) {
+	 stats = midi_jitter + i;
+	 break;
+      }
+   }
+
+   if (!stats)
+      return;
+
+   late = dispatched - scheduled;
+
+   stats->driver = midi_driver->id;
+   stats->count++;
+   midi_jitter_sum[i] += late;
+
+   if (late < 0)
+      late = -late;
+
+   if (late > stats->max)
+      stats->max = late;
+
+   /* bin n holds events that are out by less than 2^n / 8 milliseconds */
+   for (i=0, bin=0.000125; (i < MIDI_JITTER_BINS-1) && (late >= bin); i++)
+      bin *= 2;
+
+   stats->histogram[i]++;
+}
+
+END_OF_STATIC_FUNCTION(tap_event);
+
+
+
+/* lock_players:
+ *  Keeps the MIDI clock from running the players, whether it is a timer
+ *  or the mixer in sample accurate mode, while their state is changed.
+ *  The mixer is always locked first, since it calls the players with its
+ *  own lock held. Timers mustn't be installed or removed while the lock is
+ *  held, except by the clock itself: some timer threads hold a lock of
+ *  their own while they wait for this one.
+ */
+static void lock_players(void)
+{
+   _mixer_lock();
+
+   if (midi_mutex)
+      _al_lock_mutex(midi_mutex);
+}
+
+END_OF_STATIC_FUNCTION(lock_players);
+
+
+
+/* unlock_players:
+ *  Lets the MIDI clock run the players again, starting the timer if a
+ *  player was handed to a stopped clock while they were locked.
+ */
+static void unlock_players(void)
+{
+   long start = midi_clock_start;
+
+   midi_clock_start = 0;
+
+   if (midi_mutex)
+      _al_unlock_mutex(midi_mutex);
+
+   _mixer_unlock();
+
+   if (start > 0)
+      install_int_ex(midi_player, start);
+}
+
+END_OF_STATIC_FUNCTION(unlock_players);
+
+
+
+/* schedule_midi_clock:
+ *  Arranges for midi_player() to be called again after the given number of
+ *  timer ticks, either from a timer or from the mixer at the exact sample.
+ */
+static void schedule_midi_clock(long speed)
+{
+   if (midi_sample_accurate)
+      midi_sample_due = (LONG_LONG)speed * midi_sample_freq;
+   else
+      install_int_ex(midi_player, speed);
+
+   midi_clock_running = TRUE;
+}
+
+END_OF_STATIC_FUNCTION(schedule_midi_clock);
+
+
+
+/* stop_midi_clock:
+ *  Stops calling midi_player().
+ */
+static void stop_midi_clock(void)
+{
+   midi_clock_running = FALSE;
+
+   if (!midi_sample_accurate)
+      remove_int(midi_player);
+}
+
+END_OF_STATIC_FUNCTION(stop_midi_clock);
+
+
+
+/* activate_player:
+ *  Hands a player over to the MIDI clock. Its first tick mustn't count the
+ *  time that had already passed since the last one, so it is skipped for
+ *  that. A timer is started at an arbitrary speed that the players will
+ *  adjust, once unlock_players() has let go of the lock, while the mixer
+ *  runs them right away, working out how far the other players have got
+ *  so far. A running timer is never left waiting for long, so the new
+ *  player simply joins in on its next tick.
+ */
+static void activate_player(MIDI_PLAYER *p)
+{
+   long elapsed;
+
+   p->joining = TRUE;
+   p->tap_sync = TRUE;
+   p->active = TRUE;
+
+   if (!midi_clock_running) {
+      midi_timer_speed = 0;
+
+      if (midi_sample_accurate)
+	 schedule_midi_clock(0);
+      else {
+	 midi_clock_running = TRUE;
+	 midi_clock_start = MSEC_TO_TIMER(20);
+      }
+   }
+   else if (midi_sample_accurate) {
+      elapsed = midi_timer_speed - (long)(midi_sample_due / midi_sample_freq);
+      midi_timer_speed = MAX(elapsed, 0);
+      midi_sample_due = 0;
+   }
+}
+
+END_OF_STATIC_FUNCTION(activate_player);
+
+
+
+/* flush_midi_output:
+ *  Lets a driver that batches up raw MIDI output send whatever it has
+ *  collected, once all the messages for a tick have been generated.
+ */
+static void flush_midi_output(void)
+{
+   if (_midi_flush_output)
+      _midi_flush_output();
+}
+
+END_OF_STATIC_FUNCTION(flush_midi_output);
+
+
+
+/* sync_player_globals:
+ *  Copies the position of the default player into midi_pos and midi_time.
+ */
+static INLINE void sync_player_globals(MIDI_PLAYER *p)
+{
+   if (p == &midi_default_player) {
+      midi_pos = p->pos;
+      midi_time = p->time;
+   }
+}
+
+
+
+/* player_notes_off:
+ *  Turns off all the notes on the channels that a player uses.
+ */
+static void player_notes_off(MIDI_PLAYER *p)
+{
+   int c;
+
+   for (c=0; c<16; c++) {
+      if (p->channel[c] >= 0) {
+	 all_notes_off(p->channel[c]);
+	 all_sound_off(p->channel[c]);
+      }
+   }
+}
+
+END_OF_STATIC_FUNCTION(player_notes_off);
+
+
+
+/* stop_player:
+ *  Stops a player, leaving a negative position behind to show it.
+ */
+static void stop_player(MIDI_PLAYER *p)
+{
+   p->active = FALSE;
+
+   if (p->midi)
+      player_notes_off(p);
+
+   p->midi = NULL;
+
+   if (p->pos > 0)
+      p->pos = -p->pos;
+   else if (p->pos == 0)
+      p->pos = -1;
+
+   sync_player_globals(p);
+}
+
+END_OF_STATIC_FUNCTION(stop_player);
+
+
+
+/* run_player:
+ *  Advances a player by the given number of timer ticks, playing whatever
+ *  events are due and dealing with the end of the file. Returns how long
+ *  until it needs to run again, or LONG_MAX if it has stopped.
+ */
+static long run_player(MIDI_PLAYER *p, long elapsed)
+{
+   AL_CONST unsigned char *pos, *end;
+   unsigned char running_status = 0;
+   MIDI_EVENT ev;
+   long old_timers;
+   int restarted = FALSE;
+
+   /* the global loop points belong to the default player */
+   if (p == &midi_default_player) {
+      p->loop_start = midi_loop_start;
+      p->loop_end = midi_loop_end;
+   }
+
+   p->timers += elapsed;
+   p->time = p->timers / TIMERS_PER_SECOND;
+
+   if ((midi_tap) && (p->tap_sync)) {
+      p->tap_anchor = tap_clock() - (double)p->timers / TIMERS_PER_SECOND;
+      p->tap_sync = FALSE;
+   }
+
+   for (;;) {
+      /* play every event that is now due */
+      if (p->cursor < p->timeline->data_size) {
+	 p->event_timer -= elapsed;
+
+	 while (p->event_timer <= 0) {
+	    pos = p->timeline->data + p->cursor;
+	    end = p->timeline->data + p->timeline->data_size;
+
+	    if (read_midi_event(&pos, end, &running_status, &ev) != 0)
+	       pos = end;
+	    else {
+	       if (midi_tap)
+		  tap_event(p, &ev);
+	       process_midi_event(p, &ev);
+	    }
+
+	    if (pos >= end) {
+	       p->cursor = p->timeline->data_size;
+	       break;
+	    }
+
+	    p->event_timer += (long)parse_var_len(&pos, end) * p->speed;
+	    p->cursor = pos - p->timeline->data;
+	 }
+      }
+
+      /* update the position value */
+      p->pos_counter -= elapsed;
+      while (p->pos_counter <= 0) {
+	 p->pos_counter += p->pos_speed;
+	 p->pos++;
+      }
+
+      /* tempo change? */
+      if (p->new_speed > 0) {
+	 p->event_timer /= p->speed;
+	 p->event_timer *= p->new_speed;
+
+	 p->pos_counter /= p->speed;
+	 p->pos_counter *= p->new_speed;
+
+	 p->speed = p->new_speed;
+	 p->pos_speed = p->new_speed * p->midi->divisions;
+	 p->new_speed = -1;
+      }
+
+      /* carry on unless this is the end of the music */
+      if ((p->cursor < p->timeline->data_size) &&
+	  ((p->loop_end <= 0) || (p->pos < p->loop_end)))
+	 break;
+
+      /* a loop that ends where it starts would never get anywhere */
+      if ((!p->loop) || (restarted) || (p->timeline->num_events == 0)) {
+	 stop_player(p);
+	 return LONG_MAX;
+      }
+
+      old_timers = p->timers;
+
+      if (p->loop_start > 0) {
+	 if (seek_player(p, p->loop_start) != 0) {
+	    stop_player(p);
+	    return LONG_MAX;
+	 }
+      }
+      else {
+	 player_notes_off(p);
+	 prepare_to_play(p, p->midi);
+      }
+
+      /* the loop doesn't change when anything is due */
+      p->tap_anchor += (double)(old_timers - p->timers) / TIMERS_PER_SECOND;
+
+      restarted = TRUE;
+      elapsed = 0;
+   }
+
+   sync_player_globals(p);
+
+   return p->event_timer;
+}
+
+END_OF_STATIC_FUNCTION(run_player);
+
+
+
+/* run_midi_players:
+ *  The core MIDI player, called with the players locked by the timer or
+ *  by midi_mixer_sequencer(). Runs every active player on the same tick,
+ *  and waits until the next one of them has something to do.
+ */
+static void run_midi_players(void)
+{
+   MIDI_PLAYER *p;
+   long elapsed, next, min, max;
+   int c;
+
+   if (!midi_clock_running)
+      return;
+
+   if (midi_semaphore) {
+      midi_timer_speed += BPS_TO_TIMER(midi_timer_frequency);
+      schedule_midi_clock(BPS_TO_TIMER(midi_timer_frequency));
+      return;
+   }
+
+   midi_semaphore = TRUE;
+   _midi_tick++;
+
+   for (c=0; c<MIDI_VOICES; c++)
+      midi_waiting[c].note = -1;
+
+   elapsed = midi_timer_speed;
+   midi_timer_speed = LONG_MAX;
+
+   for (p=midi_players; p; p=p->next) {
+      if (p->active) {
+	 next = run_player(p, (p->joining) ? 0 : elapsed);
+	 p->joining = FALSE;
+	 if (next < midi_timer_speed)
+	    midi_timer_speed = next;
+      }
+   }
+
+   /* reprogram the timer, which only has to be throttled when it is a
+      real one: the mixer can call us as often as the events need. A timer
+      also mustn't wait too long, in case another player is started, but
+      that limit can't be allowed to undercut the throttle */
+   if (midi_timer_speed == LONG_MAX)
+      stop_midi_clock();
+   else {
+      if (midi_sample_accurate) {
+	 if (midi_timer_speed < 1)
+	    midi_timer_speed = 1;
+      }
+      else {
+	 min = BPS_TO_TIMER(midi_timer_frequency);
+	 max = MAX(MSEC_TO_TIMER(100), min);
+	 midi_timer_speed = MID(min, midi_timer_speed, max);
+      }
+
+      schedule_midi_clock(midi_timer_speed);
+   }
+
+   /* controller changes are cached and only processed here, so we can 
+      condense streams of controller data into just a few voice updates */ 
+   update_controllers();
+
+   /* and deal with any notes that are still waiting to be played */
+   for (c=0; c<MIDI_VOICES; c++)
+      if (midi_waiting[c].note >= 0)
+	 midi_note_on(midi_waiting[c].channel, midi_waiting[c].note,
+		      midi_waiting[c].volume, 0);
+
+   flush_midi_output();
+
+   midi_semaphore = FALSE;
+}
+
+END_OF_STATIC_FUNCTION(run_midi_players);
+
+
+
+/* midi_player:
+ *  Timer callback that runs the players when they aren't being run from
+ *  the mixer. A tick that was already on its way when the clock stopped
+ *  just removes the timer again.
+ */
+static void midi_player(void)
+{
+   lock_players();
+
+   if ((midi_clock_running) && (!midi_sample_accurate))
+      run_midi_players();
+   else
+      remove_int(midi_player);
+
+   unlock_players();
+}
+
+END_OF_STATIC_FUNCTION(midi_player);
+
+
+
+/* midi_mixer_sequencer:
+ *  Mixer callback used in sample accurate mode. Runs the players if they
+ *  are due at the current sample, and returns how many samples can be
+ *  mixed before they are due again. Timings are kept in timer ticks
+ *  multiplied by the sample rate, so the rounding to whole samples never
+ *  accumulates.
+ */
+static int midi_mixer_sequencer(int samples)
+{
+   LONG_LONG late;
+   LONG_LONG n;
+
+   lock_players();
+
+   while ((midi_clock_running) && (midi_sample_due <= 0)) {
+      late = midi_sample_due;
+      run_midi_players();
+      midi_sample_due += late;
+   }
+
+   if (!midi_clock_running) {
+      midi_sample_pos += samples;
+      unlock_players();
+      return samples;
+   }
+
+   n = (midi_sample_due + TIMERS_PER_SECOND - 1) / TIMERS_PER_SECOND;
+   if (n > samples)
+      n = samples;
+
+   midi_sample_due -= n * TIMERS_PER_SECOND;
+   midi_sample_pos += n;
+
+   unlock_players();
+
+   return (int)n;
+}
+
+END_OF_STATIC_FUNCTION(midi_mixer_sequencer);
+
+
+
+/* destroy_midi_mutex:
+ *  Destroys the lock of the players when Allegro shuts down, after
+ *  remove_sound() has stopped them.
+ */
+static void destroy_midi_mutex(void)
+{
+   _al_destroy_mutex(midi_mutex);
+   midi_mutex = NULL;
+
+   _remove_exit_func(destroy_midi_mutex);
+}
+
+
+
+/* midi_init:
+ *  Sets up the MIDI player ready for use. Returns non-zero on failure.
+ */
+static int midi_init(void)
+{
+   int c, c2, c3;
+   char **argv;
+   int argc;
+   char buf[32], tmp[64];
+
+   midi_loaded_patches = FALSE;
+
+   midi_lock_mem();
+
+   if (!midi_mutex) {
+      midi_mutex = _al_create_mutex();
+      if (midi_mutex)
+	 _add_exit_func(destroy_midi_mutex, "destroy_midi_mutex");
+   }
+
+   for (c=0; c<16; c++) {
+      midi_channel[c].volume = midi_channel[c].new_volume = 128;
+      midi_channel[c].pitch_bend = midi_channel[c].new_pitch_bend = 0x2000;
+
+      for (c2=0; c2<128; c2++)
+	 for (c3=0; c3<MIDI_LAYERS; c3++)
+	    midi_channel[c].note[c2][c3] = -1;
+   }
+
+   for (c=0; c<16; c++) {
+      midi_channel[c].max_voices = MIDI_VOICES;
+      midi_channel[c].priority = 0;
+   }
+
+   for (c=0; c<MIDI_VOICES; c++) {
+      midi_voice[c].note = -1;
+      midi_voice[c].time = 0;
+   }
+
+   midi_alloc_driver = NULL;
+   memset(&midi_stats, 0, sizeof(midi_stats));
+
+   midi_timer_frequency = get_config_int(uconvert_ascii("sound", tmp), uconvert_ascii("midi_timer_frequency", buf), MIDI_TIMER_FREQUENCY);
+   midi_timer_frequency = MID(10, midi_timer_frequency, 1000);
+
+   for (c=0; c<128; c++) {
+      uszprintf(buf, sizeof(buf), uconvert_ascii("p%d", tmp), c+1);
+      argv = get_config_argv(uconvert_ascii("midimap", tmp), buf, &argc);
+
+      if ((argv) && (argc == 4)) {
+	 patch_table[c].bank1 = ustrtol(argv[0], NULL, 0);
+	 patch_table[c].bank2 = ustrtol(argv[1], NULL, 0);
+	 patch_table[c].prog  = ustrtol(argv[2], NULL, 0);
+	 patch_table[c].pitch = ustrtol(argv[3], NULL, 0);
+      }
+      else {
+	 patch_table[c].bank1 = -1;
+	 patch_table[c].bank2 = -1;
+	 patch_table[c].prog = c;
+	 patch_table[c].pitch = 0;
+      }
+   }
+
+   register_datafile_object(DAT_MIDI, NULL, (void (*)(void *))destroy_midi);
+
+   return 0;
+}
+
+
+
+/* midi_exit:
+ *  Turns off all active notes and removes the timer handler.
+ */
+static void midi_exit(void)
+{
+   MIDI_PLAYER *p;
+
+   for (p=midi_players; p; p=p->next)
+      midi_player_stop(p);
+
+   set_midi_sample_accurate(FALSE);
+   remove_midi_tap();
+
+   /* the driver is about to go, so the clock can't wait for the players
+      to notice that they have nothing left to do */
+   lock_players();
+   midi_clock_running = FALSE;
+   midi_clock_start = 0;
+   unlock_players();
+
+   remove_int(midi_player);
+}
+
+
+
+/* find_patches:
+ *  Scans through a MIDI file and flags which patches and drums it uses.
+ */
+static void find_patches(MIDI *midi, char *patches, char *drums)
+{
+   AL_CONST unsigned char *pos, *end;
+   unsigned char running_status = 0;
+   MIDI_EVENT ev;
+   int c;
+   ASSERT(midi);
+   ASSERT(midi->timeline);
+
+   for (c=0; c<128; c++)                        /* initialise to unused */
+      patches[c] = drums[c] = FALSE;
+
+   patches[0] = TRUE;                           /* always load the piano */
+
+   pos = midi->timeline->data;
+   end = pos + midi->timeline->data_size;
+
+   while (pos < end) {
+      parse_var_len(&pos, end);
+      if (read_midi_event(&pos, end, &running_status, &ev) != 0)
+	 break;
+
+      switch (ev.status>>4) {
+
+	 case 0x0C:                             /* program change! */
+	    patches[ev.byte1] = TRUE;
+	    break;
+
+	 case 0x09:                             /* note on, is it a drum? */
+	    if ((ev.status & 0x0F) == 9)
+	       drums[ev.byte1] = TRUE;
+	    break;
+      }
+   }
+}
+
+
+
+/* load_patches:
+ *  Identifies which patches a MIDI file uses, passing them to the
+ *  soundcard driver so it can load whatever samples are neccessary. The
+ *  patches of whatever the other players are playing are kept as well.
+ */
+static int load_patches(MIDI_PLAYER *player, MIDI *midi)
+{
+   char patches[128], drums[128];
+   char other_patches[128], other_drums[128];
+   MIDI_PLAYER *p;
+   int c;
+
+   find_patches(midi, patches, drums);
+
+   for (p=midi_players; p; p=p->next) {
+      if ((p != player) && (p->midi) && (p->midi != midi)) {
+	 find_patches(p->midi, other_patches, other_drums);
+	 for (c=0; c<128; c++) {
+	    patches[c] |= other_patches[c];
+	    drums[c] |= other_drums[c];
+	 }
+      }
+   }
+
+   /* tell the driver to do its stuff */ 
+   return midi_driver->load_patches(patches, drums);
+}
+
+
+
+/* prepare_to_play:
+ *  Sets up a player to play the specified file from the start.
+ */
+static void prepare_to_play(MIDI_PLAYER *p, MIDI *midi)
+{
+   AL_CONST unsigned char *pos;
+   int c;
+   ASSERT(midi);
+
+   for (c=0; c<16; c++)
+      reset_controllers(p, c);
+
+   update_controllers();
+
+   p->midi = midi;
+   p->pos = 0;
+   p->timers = 0;
+   p->time = 0;
+   p->pos_counter = 0;
+   p->file_speed = TIMERS_PER_SECOND / 2 / midi->divisions;   /* 120 bpm */
+   p->speed = player_speed(p, p->file_speed);
+   p->new_speed = -1;
+   p->pos_speed = p->speed * midi->divisions;
+
+   for (c=0; c<16; c++) {
+      if (p->channel[c] >= 0) {
+	 midi_channel[p->channel[c]].patch = 0;
+	 if (midi_driver->raw_midi)
+	    raw_program_change(p->channel[c], 0);
+      }
+   }
+
+   p->timeline = midi->timeline;
+   p->cursor = 0;
+
+   if (p->timeline->data_size > 0) {
+      pos = p->timeline->data;
+      p->event_timer = (long)parse_var_len(&pos, pos + p->timeline->data_size) * p->speed;
+      p->cursor = pos - p->timeline->data;
+   }
+   else
+      p->event_timer = LONG_MAX;
+
+   sync_player_globals(p);
+}
+
+END_OF_STATIC_FUNCTION(prepare_to_play);
+
+
+
+/* seek_player:
+ *  Moves a player to the given position in its file, without starting or
+ *  stopping it. The checkpoints are binary searched for the target, and
+ *  the channel state there is rebuilt by replaying the events since the
+ *  one before it, so this takes the same time wherever in the file the
+ *  target is. Returns zero if successful, or 1 if the target is past the
+ *  end of the file.
+ */
+static int seek_player(MIDI_PLAYER *p, int target)
+{
+   MIDI_TIMELINE *tl = p->timeline;
+   MIDI_CHECKPOINT state;
+   AL_CONST unsigned char *pos, *end;
+   unsigned char running_status = 0;
+   unsigned long target_tick, tick;
+   MIDI_EVENT ev;
+   int old_patch[16];
+   int old_volume[16];
+   int old_pan[16];
+   int old_pitch_bend[16];
+   long lo, hi, mid;
+   int c, channel;
+
+   player_notes_off(p);
+
+   target_tick = (target > 1) ? (unsigned long)(target-1) * p->midi->divisions : 0;
+
+   /* seeking past the end of the file? */
+   if ((tl->num_events == 0) || (target_tick > tl->last_tick)) {
+      p->timers = (long)((LONG_LONG)tl->length * 100 / p->tempo);
+      p->time = p->timers / TIMERS_PER_SECOND;
+      if (tl->num_events > 0)
+	 p->pos = tl->last_tick / p->midi->divisions + 1;
+      sync_player_globals(p);
+      return 1;
+   }
+
+   /* find the last checkpoint that comes before the target */
+   lo = 0;
+   hi = tl->num_checkpoints - 1;
+   while (lo < hi) {
+      mid = lo + (hi - lo + 1) / 2;
+      if (tl->checkpoint[mid].tick < target_tick)
+	 lo = mid;
+      else
+	 hi = mid - 1;
+   }
+
+   /* and replay from there up to the first event at or after the target */
+   state = tl->checkpoint[lo];
+   pos = tl->data + state.offset;
+   end = tl->data + tl->data_size;
+
+   for (;;) {
+      tick = state.tick + parse_var_len(&pos, end);
+      if (tick >= target_tick)
+	 break;
+
+      read_midi_event(&pos, end, &running_status, &ev);
+      chase_midi_event(&state, &ev, tick, p->midi->divisions);
+   }
+
+   state.timers += (long)(target_tick - state.tick) * state.speed;
+
+   for (c=0; c<16; c++) {
+      channel = p->channel[c];
+      p->controller_volume[c] = state.volume[c];
+      if (channel < 0)
+	 continue;
+
+      old_patch[c] = midi_channel[channel].patch;
+      old_volume[c] = midi_channel[channel].volume;
+      old_pan[c] = midi_channel[channel].pan;
+      old_pitch_bend[c] = midi_channel[channel].pitch_bend;
+
+      midi_channel[channel].patch = state.patch[c];
+      midi_channel[channel].volume = midi_channel[channel].new_volume = player_volume(p, state.volume[c]);
+      midi_channel[channel].pan = state.pan[c];
+      midi_channel[channel].pitch_bend = midi_channel[channel].new_pitch_bend = state.pitch_bend[c];
+   }
+
+   p->cursor = pos - tl->data;
+   p->file_speed = state.speed;
+   p->speed = player_speed(p, state.speed);
+   p->pos_speed = p->speed * p->midi->divisions;
+   p->new_speed = -1;
+   p->event_timer = (long)(tick - target_tick) * p->speed;
+   p->timers = (long)((LONG_LONG)state.timers * 100 / p->tempo);
+   p->time = p->timers / TIMERS_PER_SECOND;
+   p->pos = (target > 1) ? target-1 : 0;
+   p->pos_counter = 0;
+
+   /* refresh the driver with any changed parameters */
+   if (midi_driver->raw_midi) {
+      for (c=0; c<16; c++) {
+	 channel = p->channel[c];
+	 if (channel < 0)
+	    continue;
+
+	 /* program change (this sets the volume as well) */
+	 if ((midi_channel[channel].patch != old_patch[c]) ||
+	     (midi_channel[channel].volume != old_volume[c]))
+	    raw_program_change(channel, midi_channel[channel].patch);
+
+	 /* pan */
+	 if (midi_channel[channel].pan != old_pan[c]) {
+	    midi_driver->raw_midi(0xB0+channel);
+	    midi_driver->raw_midi(10);
+	    midi_driver->raw_midi(midi_channel[channel].pan);
+	 }
+
+	 /* pitch bend */
+	 if (midi_channel[channel].pitch_bend != old_pitch_bend[c]) {
+	    midi_driver->raw_midi(0xE0+channel);
+	    midi_driver->raw_midi(midi_channel[channel].pitch_bend & 0x7F);
+	    midi_driver->raw_midi(midi_channel[channel].pitch_bend >> 7);
+	 }
+      }
+   }
+
+   sync_player_globals(p);
+
+   return 0;
+}
+
+END_OF_STATIC_FUNCTION(seek_player);
+
+
+
+/* init_player:
+ *  Sets up a player that isn't playing anything, at full volume and the
+ *  normal tempo, with every channel going to the same output channel.
+ */
+static void init_player(MIDI_PLAYER *p)
+{
+   int c;
+
+   memset(p, 0, sizeof(MIDI_PLAYER));
+   p->pos = -1;
+   p->loop_start = p->loop_end = -1;
+   p->volume = 255;
+   p->tempo = 100;
+
+   for (c=0; c<16; c++) {
+      p->channel[c] = c;
+      p->controller_volume[c] = 128;
+   }
+}
+
+
+
+/* default_player:
+ *  Returns the player that play_midi() and friends use, which is set up
+ *  the first time it is needed.
+ */
+static MIDI_PLAYER *default_player(void)
+{
+   MIDI_PLAYER *p = &midi_default_player;
+
+   if (!midi_default_ready) {
+      lock_players();
+      init_player(p);
+      p->next = midi_players;
+      midi_players = p;
+      midi_default_ready = TRUE;
+      unlock_players();
+   }
+
+   return p;
+}
+
+
+
+/* create_midi_player:
+ *  Creates a new MIDI player, which can play a MIDI file at the same time
+ *  as play_midi() and any other players. Returns NULL on error.
+ */
+MIDI_PLAYER *create_midi_player(void)
+{
+   MIDI_PLAYER *p;
+
+   p = _AL_MALLOC(sizeof(MIDI_PLAYER));
+   if (!p) {
+      *allegro_errno = ENOMEM;
+      return NULL;
+   }
+
+   init_player(p);
+   LOCK_DATA(p, sizeof(MIDI_PLAYER));
+
+   default_player();
+
+   lock_players();
+   p->next = midi_players;
+   midi_players = p;
+   unlock_players();
+
+   return p;
+}
+
+
+
+/* destroy_midi_player:
+ *  Stops a MIDI player and frees it, taking it out of the list in the
+ *  same go so that the clock can't run it in between.
+ */
+void destroy_midi_player(MIDI_PLAYER *player)
+{
+   MIDI_PLAYER **p;
+
+   if (!player)
+      return;
+
+   lock_players();
+
+   player->active = FALSE;
+
+   if (player->midi)
+      player_notes_off(player);
+
+   stop_player(player);
+   flush_midi_output();
+
+   for (p=&midi_players; *p; p=&(*p)->next) {
+      if (*p == player) {
+	 *p = player->next;
+	 break;
+      }
+   }
+
+   unlock_players();
+
+   UNLOCK_DATA(player, sizeof(MIDI_PLAYER));
+   _AL_FREE(player);
+}
+
+
+
+/* midi_player_play:
+ *  Starts a player playing the specified MIDI file, replacing whatever it
+ *  was playing before. If loop is set, the file will be repeated until it
+ *  is replaced with something else, otherwise the player stops at the end
+ *  of it. Passing a NULL MIDI file just stops the player. Returns non-zero
+ *  if an error occurs.
+ */
+int midi_player_play(MIDI_PLAYER *player, MIDI *midi, int loop)
+{
+   char patches[128], drums[128];
+   int ret = 0;
+   ASSERT(player);
+
+   if (midi) {
+      /* MIDI files that didn't come from load_midi() get compiled here */
+      if (!midi->timeline) {
+	 if (!compile_midi(midi))
+	    return -1;
+	 LOCK_DATA(midi->timeline, midi->timeline->size);
+      }
+
+      /* read the patches in while the other players carry on, so that
+	 handing them over below doesn't hold the clock up */
+      if ((!midi_loaded_patches) && (midi_driver->id == MIDI_DIGMID)) {
+	 find_patches(midi, patches, drums);
+	 _digmid_precache_patches(patches, drums);
+      }
+   }
+
+   lock_players();
+
+   player->active = FALSE;
+
+   if (player->midi)
+      player_notes_off(player);
+
+   if (midi) {
+      if ((midi_loaded_patches) || (load_patches(player, midi) == 0)) {
+	 player->loop = loop;
+
+	 prepare_to_play(player, midi);
+	 activate_player(player);
+      }
+      else
+	 ret = -1;
+   }
+   else
+      stop_player(player);
+
+   flush_midi_output();
+
+   unlock_players();
+
+   return ret;
+}
+
+END_OF_FUNCTION(midi_player_play);
+
+
+
+/* midi_player_stop:
+ *  Stops whatever a player is playing.
+ */
+void midi_player_stop(MIDI_PLAYER *player)
+{
+   midi_player_play(player, NULL, FALSE);
+}
+
+END_OF_FUNCTION(midi_player_stop);
+
+
+
+/* midi_player_pause:
+ *  Pauses the file a player is playing.
+ */
+void midi_player_pause(MIDI_PLAYER *player)
+{
+   ASSERT(player);
+
+   lock_players();
+
+   if ((player->midi) && (player->active)) {
+      player->active = FALSE;
+      player_notes_off(player);
+      flush_midi_output();
+   }
+
+   unlock_players();
+}
+
+END_OF_FUNCTION(midi_player_pause);
+
+
+
+/* midi_player_resume:
+ *  Resumes a paused player.
+ */
+void midi_player_resume(MIDI_PLAYER *player)
+{
+   ASSERT(player);
+
+   lock_players();
+
+   if ((player->midi) && (!player->active))
+      activate_player(player);
+
+   unlock_players();
+}
+
+END_OF_FUNCTION(midi_player_resume);
+
+
+
+/* midi_player_seek:
+ *  Seeks to the given position, in beats, in the file a player is playing,
+ *  and carries on playing from there. Returns zero if successful, non-zero
+ *  if it hit the end of the file (1 means it stopped playing, 2 means it
+ *  looped back to the start), or negative if nothing is being played.
+ */
+int midi_player_seek(MIDI_PLAYER *player, int target)
+{
+   int ret = 0;
+   ASSERT(player);
+
+   lock_players();
+
+   if (!player->midi) {
+      unlock_players();
+      return -1;
+   }
+
+   player->active = FALSE;
+
+   if (seek_player(player, target) != 0) {
+      if (player->loop) {
+	 prepare_to_play(player, player->midi);
+	 activate_player(player);
+	 ret = 2;                            /* seek past EOF => file restarted */
+      }
+      else {
+	 stop_player(player);
+	 ret = 1;                            /* seek past EOF => file stopped */
+      }
+   }
+   else
+      activate_player(player);
+
+   flush_midi_output();
+
+   unlock_players();
+
+   return ret;
+}
+
+END_OF_FUNCTION(midi_player_seek);
+
+
+
+/* midi_player_set_loop:
+ *  Makes a player repeat the section of its file between the start and end
+ *  positions, in beats. The end position can be -1 to loop at the end of
+ *  the file, and a start position of -1 loops back to the beginning.
+ */
+void midi_player_set_loop(MIDI_PLAYER *player, int loop_start, int loop_end)
+{
+   ASSERT(player);
+
+   lock_players();
+   player->loop_start = loop_start;
+   player->loop_end = loop_end;
+   player->loop = TRUE;
+   unlock_players();
+}
+
+
+
+/* midi_player_set_volume:
+ *  Sets the volume of a player, from 0 to 255. This scales the channel
+ *  volume that the file itself sets. Returns the old volume.
+ */
+int midi_player_set_volume(MIDI_PLAYER *player, int volume)
+{
+   int old, c;
+   ASSERT(player);
+
+   lock_players();
+
+   old = player->volume;
+   player->volume = MID(0, volume, 255);
+
+   if (player->midi) {
+      for (c=0; c<16; c++)
+	 if (player->channel[c] >= 0)
+	    midi_channel[player->channel[c]].new_volume = player_volume(player, player->controller_volume[c]);
+   }
+
+   unlock_players();
+
+   return old;
+}
+
+
+
+/* midi_player_set_tempo:
+ *  Speeds up or slows down a player, as a percentage of the tempo that its
+ *  file asks for. Returns the old tempo.
+ */
+int midi_player_set_tempo(MIDI_PLAYER *player, int percent)
+{
+   int old;
+   ASSERT(player);
+
+   lock_players();
+
+   old = player->tempo;
+   player->tempo = MID(1, percent, 10000);
+
+   if (player->midi)
+      player->new_speed = player_speed(player, player->file_speed);
+
+   unlock_players();
+
+   return old;
+}
+
+
+
+/* midi_player_map_channel:
+ *  Sends one channel of the file a player is playing to a different MIDI
+ *  channel, so that several players can share the 16 channels of the
+ *  driver between them. A negative output channel mutes it. Returns the
+ *  old output channel.
+ */
+int midi_player_map_channel(MIDI_PLAYER *player, int channel, int output)
+{
+   int old;
+   ASSERT(player);
+   ASSERT((channel >= 0) && (channel < 16));
+   ASSERT(output < 16);
+
+   lock_players();
+
+   old = player->channel[channel];
+
+   if ((player->midi) && (old >= 0) && (old != output)) {
+      all_notes_off(old);
+      all_sound_off(old);
+   }
+
+   player->channel[channel] = (output >= 0) ? output : -1;
+
+   unlock_players();
+
+   return old;
+}
+
+
+
+/* midi_player_get_pos:
+ *  Returns the position of a player in beats, or a negative number if it
+ *  isn't playing anything.
+ */
+long midi_player_get_pos(MIDI_PLAYER *player)
+{
+   ASSERT(player);
+
+   return player->pos;
+}
+
+
+
+/* midi_player_get_time:
+ *  Returns the position of a player in seconds.
+ */
+long midi_player_get_time(MIDI_PLAYER *player)
+{
+   ASSERT(player);
+
+   return player->time;
+}
+
+
+
+/* play_midi:
+ *  Starts playing the specified MIDI file. If loop is set, the MIDI file 
+ *  will be repeated until replaced with something else, otherwise it will 
+ *  stop at the end of the file. Passing a NULL MIDI file will stop whatever 
+ *  music is currently playing: allegro.h defines the macro stop_midi() to 
+ *  be play_midi(NULL, FALSE); Returns non-zero if an error occurs (this
+ *  may happen if a patch-caching wavetable driver is unable to load the
+ *  required samples).
+ */
+int play_midi(MIDI *midi, int loop)
+{
+   if (midi) {
+      midi_loop_start = -1;
+      midi_loop_end = -1;
+   }
+
+   return midi_player_play(default_player(), midi, loop);
+}
+
+END_OF_FUNCTION(play_midi);
+
+
+
+/* play_looped_midi:
+ *  Like play_midi(), but the file loops from the specified end position
+ *  back to the specified start position (the end position can be -1 to 
+ *  indicate the end of the file).
+ */
+int play_looped_midi(MIDI *midi, int loop_start, int loop_end)
+{
+   if (play_midi(midi, TRUE) != 0)
+      return -1;
+
+   midi_loop_start = loop_start;
+   midi_loop_end = loop_end;
+
+   return 0;
+}
+
+
+
+/* stop_midi:
+ *  Stops whatever MIDI file is currently playing.
+ */
+void stop_midi(void)
+{
+   play_midi(NULL, FALSE);
+}
+
+END_OF_FUNCTION(stop_midi);
+
+
+
+/* midi_pause:
+ *  Pauses the currently playing MIDI file.
+ */
+void midi_pause(void)
+{
+   midi_player_pause(default_player());
+}
+
+END_OF_FUNCTION(midi_pause);
+
+
+
+/* midi_resume:
+ *  Resumes playing a paused MIDI file.
+ */
+void midi_resume(void)
+{
+   midi_player_resume(default_player());
+}
+
+END_OF_FUNCTION(midi_resume);
+
+
+
+/* midi_seek:
+ *  Seeks to the given midi_pos in the current MIDI file. Returns zero if
+ *  successful, non-zero if it hit the end of the file (1 means it stopped
+ *  playing, 2 means it looped back to the start).
+ */
+int midi_seek(int target)
+{
+   MIDI_PLAYER *p = default_player();
+
+   lock_players();
+   p->loop_start = midi_loop_start;
+   p->loop_end = midi_loop_end;
+   unlock_players();
+
+   return midi_player_seek(p, target);
+}
+
+END_OF_FUNCTION(midi_seek);
+
+
+
+/* get_midi_length:
+ *  Returns the length, in seconds, of the specified midi. This will stop any
+ *  currently playing midi. Don't call it too often, since it simulates playing
+ *  all of the midi to get the time even if the midi contains tempo changes.
+ */
+int get_midi_length(MIDI *midi)
+{
+    play_midi(midi, 0);
+    while (midi_pos < 0); /* Without this, midi_seek won't work. */
+    midi_seek(INT_MAX);
+    return midi_time;
+}
+
+
+
+/* midi_out:
+ *  Inserts MIDI command bytes into the output stream, in realtime.
+ */
+void midi_out(unsigned char *data, int length)
+{
+   AL_CONST unsigned char *pos = data;
+   unsigned char running_status = 0;
+   MIDI_EVENT ev;
+   ASSERT(data);
+
+   lock_players();
+   midi_semaphore = TRUE;
+   _midi_tick++;
+
+   while (read_midi_event(&pos, data+length, &running_status, &ev) == 0)
+      process_midi_event(NULL, &ev);
+
+   update_controllers();
+   flush_midi_output();
+
+   midi_semaphore = FALSE;
+   unlock_players();
+}
+
+
+
+/* precache_midi_patches:
+ *  Gets the patches a MIDI file uses ready in the driver's patch cache, so
+ *  that a later play_midi() of it doesn't have to load them. Whatever is
+ *  playing carries on using its own patches.
+ */
+int precache_midi_patches(MIDI *midi)
+{
+   char patches[128], drums[128];
+   int ret;
+   ASSERT(midi);
+
+   if (midi_driver->id != MIDI_DIGMID)
+      return 0;
+
+   if (!midi->timeline) {
+      if (!compile_midi(midi))
+	 return -1;
+      LOCK_DATA(midi->timeline, midi->timeline->size);
+   }
+
+   find_patches(midi, patches, drums);
+
+   /* the patches are loaded while the players carry on, but the ones that
+      this pushes out of the cache may still be sounding */
+   ret = _digmid_precache_patches(patches, drums);
+
+   lock_players();
+   _digmid_trim_patches();
+   unlock_players();
+
+   return ret;
+}
+
+
+
+/* load_midi_patches:
+ *  Tells the MIDI driver to preload the entire sample set.
+ */
+int load_midi_patches(void)
+{
+   char patches[128], drums[128];
+   int c, ret;
 
-   /* reprogram the timer */
-   if (midi_timer_speed < BPS_TO_TIMER(MIDI_TIMER_FREQUENCY))
-      midi_timer_speed = BPS_TO_TIMER(MIDI_TIMER_FREQUENCY);
+   for (c=0; c<128; c++)
+      patches[c] = drums[c] = TRUE;
 
-   if (!midi_seeking) 
-      install_int_ex(midi_player, midi_timer_speed);
+   /* read them in first, so that the players aren't held up for it */
+   if (midi_driver->id == MIDI_DIGMID)
+      _digmid_precache_patches(patches, drums);
 
-   /* controller changes are cached and only processed here, so we can 
-      condense streams of controller data into just a few voice updates */ 
-   update_controllers();
+   lock_players();
+   midi_semaphore = TRUE;
+   ret = midi_driver->load_patches(patches, drums);
+   midi_semaphore = FALSE;
+   unlock_players();
 
-   /* and deal with any notes that are still waiting to be played */
-   for (c=0; c<MIDI_VOICES; c++)
-      if (midi_waiting[c].note >= 0)
-	 midi_note_on(midi_waiting[c].channel, midi_waiting[c].note,
-		      midi_waiting[c].volume, 0);
+   midi_loaded_patches = TRUE;
 
-   midi_semaphore = FALSE;
+   return ret;
 }
 
-END_OF_STATIC_FUNCTION(midi_player);
 
 
+/* resync_midi_tap:
+ *  Makes every player work out its timing baseline again the next time
+ *  it runs, after the clock the tap measures against has changed.
+ */
+static void resync_midi_tap(void)
+{
+   MIDI_PLAYER *p;
 
-/* midi_init:
- *  Sets up the MIDI player ready for use. Returns non-zero on failure.
+   for (p=midi_players; p; p=p->next)
+      p->tap_sync = TRUE;
+}
+
+
+
+/* set_midi_sample_accurate:
+ *  Switches between running the MIDI player from a timer, and running it
+ *  from inside the sample mixer so that notes start on the exact sample
+ *  the MIDI clock says they should. The latter only works for the DIGMID
+ *  driver with a digital driver that uses the Allegro mixer. Returns zero
+ *  on success, or non-zero if sample accurate playback isn't possible.
  */
-static int midi_init(void)
+int set_midi_sample_accurate(int enable)
 {
-   int c, c2, c3;
-   char **argv;
-   int argc;
-   char buf[32], tmp[64];
+   int running;
 
-   midi_loaded_patches = FALSE;
+   if ((enable) && ((midi_driver->id != MIDI_DIGMID) ||
+		    (digi_driver->init_voice != _mixer_init_voice) ||
+		    (get_mixer_frequency() <= 0)))
+      return -1;
 
-   midi_lock_mem();
+   enable = (enable ? TRUE : FALSE);
+   if (enable == midi_sample_accurate)
+      return 0;
 
-   for (c=0; c<16; c++) {
-      midi_channel[c].volume = midi_channel[c].new_volume = 128;
-      midi_channel[c].pitch_bend = midi_channel[c].new_pitch_bend = 0x2000;
+   lock_players();
 
-      for (c2=0; c2<128; c2++)
-	 for (c3=0; c3<MIDI_LAYERS; c3++)
-	    midi_channel[c].note[c2][c3] = -1;
-   }
+   running = midi_clock_running;
+   midi_clock_running = FALSE;
 
-   for (c=0; c<MIDI_VOICES; c++) {
-      midi_voice[c].note = -1;
-      midi_voice[c].time = 0;
+   if (enable) {
+      midi_sample_freq = get_mixer_frequency();
+      midi_sample_accurate = TRUE;
+      _mixer_set_sequencer(midi_mixer_sequencer);
+   }
+   else {
+      _mixer_set_sequencer(NULL);
+      midi_sample_accurate = FALSE;
    }
 
-   for (c=0; c<128; c++) {
-      uszprintf(buf, sizeof(buf), uconvert_ascii("p%d", tmp), c+1);
-      argv = get_config_argv(uconvert_ascii("midimap", tmp), buf, &argc);
+   resync_midi_tap();
 
-      if ((argv) && (argc == 4)) {
-	 patch_table[c].bank1 = ustrtol(argv[0], NULL, 0);
-	 patch_table[c].bank2 = ustrtol(argv[1], NULL, 0);
-	 patch_table[c].prog  = ustrtol(argv[2], NULL, 0);
-	 patch_table[c].pitch = ustrtol(argv[3], NULL, 0);
-      }
+   if (running) {
+      if (enable)
+	 schedule_midi_clock(midi_timer_speed);
       else {
-	 patch_table[c].bank1 = -1;
-	 patch_table[c].bank2 = -1;
-	 patch_table[c].prog = c;
-	 patch_table[c].pitch = 0;
+	 midi_clock_running = TRUE;
+	 midi_clock_start = MAX(midi_timer_speed, 1);
       }
    }
 
-   register_datafile_object(DAT_MIDI, NULL, (void (*)(void *))destroy_midi);
+   unlock_players();
+
+   /* a tick that is already waiting for the lock removes the timer
+      itself, once it finds the mixer in charge */
+   if (enable)
+      remove_int(midi_player);
 
    return 0;
 }
 
 
 
-/* midi_exit:
- *  Turns off all active notes and removes the timer handler.
+/* get_midi_sample_accurate:
+ *  Returns TRUE if the MIDI player is being run from the sample mixer.
  */
-static void midi_exit(void)
+int get_midi_sample_accurate(void)
 {
-   stop_midi();
+   return midi_sample_accurate;
 }
 
 
 
-/* load_patches:
- *  Scans through a MIDI file and identifies which patches it uses, passing
- *  them to the soundcard driver so it can load whatever samples are
- *  neccessary.
+/* set_midi_channel_polyphony:
+ *  Limits how many voices the notes on a MIDI channel can use at once,
+ *  for drivers that allocate their own voices. Returns the old limit.
  */
-static int load_patches(MIDI *midi)
+int set_midi_channel_polyphony(int channel, int voices)
 {
-   char patches[128], drums[128];
-   unsigned char *p, *end;
-   unsigned char running_status, event;
-   long l;
-   int c;
-   ASSERT(midi);
+   int old;
+   ASSERT((channel >= 0) && (channel < 16));
 
-   for (c=0; c<128; c++)                        /* initialise to unused */
-      patches[c] = drums[c] = FALSE;
+   lock_players();
 
-   patches[0] = TRUE;                           /* always load the piano */
+   old = midi_channel[channel].max_voices;
 
-   for (c=0; c<MIDI_TRACKS; c++) {              /* for each track... */
-      p = midi->track[c].data;
-      end = p + midi->track[c].len;
-      running_status = 0;
+   if (voices >= 0)
+      midi_channel[channel].max_voices = MIN(voices, MIDI_VOICES);
 
-      while (p < end) {                         /* work through data stream */
-#if defined ALLEGRO_LEGACY_BEOS || defined ALLEGRO_LEGACY_HAIKU
-         /* Is there a bug in this routine, or in gcc under BeOS/x86? --PW */
-         { int i; for (i=1; i; i--); }
-#endif
-	 event = *p; 
-	 if (event & 0x80) {                    /* regular message */
-	    p++;
-	    if ((event != 0xF0) && (event != 0xF7) && (event != 0xFF))
-	       running_status = event;
-	 }
-	 else                                   /* use running status */
-	    event = running_status; 
+   unlock_players();
 
-	 switch (event>>4) {
+   return old;
+}
 
-	    case 0x0C:                          /* program change! */
-	       patches[*p] = TRUE;
-	       p++;
-	       break;
 
-	    case 0x09:                          /* note on, is it a drum? */
-	       if ((event & 0x0F) == 9)
-		  drums[*p] = TRUE;
-	       p += 2;
-	       break;
 
-	    case 0x08:                          /* note off */
-	    case 0x0A:                          /* note aftertouch */
-	    case 0x0B:                          /* control change */
-	    case 0x0E:                          /* pitch bend */
-	       p += 2;
-	       break;
+/* set_midi_channel_priority:
+ *  Sets how important the notes on a channel are when voices have to be
+ *  stolen: lower priority notes are always cut off first, and a note
+ *  never cuts off one of higher priority. Returns the old priority.
+ */
+int set_midi_channel_priority(int channel, int priority)
+{
+   int old;
+   ASSERT((channel >= 0) && (channel < 16));
 
-	    case 0x0D:                          /* channel aftertouch */
-	       p += 1;
-	       break;
+   lock_players();
 
-	    case 0x0F:                          /* special event */
-	       switch (event) {
-		  case 0xF0:                    /* sysex */
-		  case 0xF7: 
-		     l = parse_var_len((AL_CONST unsigned char**) &p);
-		     p += l;
-		     break;
-
-		  case 0xF2:                    /* song position */
-		     p += 2;
-		     break;
-
-		  case 0xF3:                    /* song select */
-		     p++;
-		     break;
-
-		  case 0xFF:                    /* meta-event */
-		     p++;
-		     l = parse_var_len((AL_CONST unsigned char**) &p);
-		     p += l;
-		     break;
-
-		  default:
-		     /* the other special events don't have any data bytes,
-			so we don't need to bother skipping past them */
-		     break;
-	       }
-	       break;
+   old = midi_channel[channel].priority;
+   midi_channel[channel].priority = priority;
 
-	    default:
-	       /* something has gone badly wrong if we ever get to here */
-	       break;
-	 }
+   /* the steal heap is ordered by priority, so it has to be rebuilt */
+   if (priority != old)
+      midi_alloc_driver = NULL;
 
-	 if (p < end)                           /* skip time offset */
-	    parse_var_len((AL_CONST unsigned char**) &p);
-      }
-   }
+   unlock_players();
 
-   /* tell the driver to do its stuff */ 
-   return midi_driver->load_patches(patches, drums);
+   return old;
 }
 
 
 
-/* prepare_to_play:
- *  Sets up all the global variables needed to play the specified file.
+/* get_midi_voice_stats:
+ *  Copies the voice allocation statistics into stats.
  */
-static void prepare_to_play(MIDI *midi)
+void get_midi_voice_stats(MIDI_VOICE_STATS *stats)
 {
-   int c;
-   ASSERT(midi);
+   ASSERT(stats);
 
-   for (c=0; c<16; c++)
-      reset_controllers(c);
+   lock_players();
+   *stats = midi_stats;
+   unlock_players();
+}
 
-   update_controllers();
 
-   midifile = midi;
-   midi_pos = 0;
-   midi_timers = 0;
-   midi_time = 0;
-   midi_pos_counter = 0;
-   midi_speed = TIMERS_PER_SECOND / 2 / midifile->divisions;   /* 120 bpm */
-   midi_new_speed = -1;
-   midi_pos_speed = midi_speed * midifile->divisions;
-   midi_timer_speed = 0;
-   midi_seeking = 0;
-   midi_looping = 0;
 
-   for (c=0; c<16; c++) {
-      midi_channel[c].patch = 0;
-      if (midi_driver->raw_midi)
-	 raw_program_change(c, 0);
-   }
+/* reset_midi_voice_stats:
+ *  Clears the voice allocation statistics, apart from the count of voices
+ *  that are playing right now.
+ */
+void reset_midi_voice_stats(void)
+{
+   int active;
 
-   for (c=0; c<MIDI_TRACKS; c++) {
-      if (midi->track[c].data) {
-	 midi_track[c].pos = midi->track[c].data;
-	 midi_track[c].timer = parse_var_len((AL_CONST unsigned char**) &midi_track[c].pos);
-	 midi_track[c].timer *= midi_speed;
-      }
-      else {
-	 midi_track[c].pos = NULL;
-	 midi_track[c].timer = LONG_MAX;
-      }
-      midi_track[c].running_status = 0;
-   }
-}
+   lock_players();
 
-END_OF_STATIC_FUNCTION(prepare_to_play);
+   active = midi_stats.active;
+   memset(&midi_stats, 0, sizeof(midi_stats));
+   midi_stats.active = midi_stats.peak = active;
 
+   unlock_players();
+}
 
 
-/* play_midi:
- *  Starts playing the specified MIDI file. If loop is set, the MIDI file 
- *  will be repeated until replaced with something else, otherwise it will 
- *  stop at the end of the file. Passing a NULL MIDI file will stop whatever 
- *  music is currently playing: allegro.h defines the macro stop_midi() to 
- *  be play_midi(NULL, FALSE); Returns non-zero if an error occurs (this
- *  may happen if a patch-caching wavetable driver is unable to load the
- *  required samples).
+
+/* install_midi_tap:
+ *  Starts recording when each event played by a MIDI player was due and
+ *  when it was actually dispatched, keeping the last size events for
+ *  read_midi_tap() and adding them all to the jitter statistics. Returns
+ *  zero on success.
  */
-int play_midi(MIDI *midi, int loop)
+int install_midi_tap(int size)
 {
-   int c;
-
-   remove_int(midi_player);
+   MIDI_TAP_EVENT *tap;
+   ASSERT(size > 0);
 
-   for (c=0; c<16; c++) {
-      all_notes_off(c);
-      all_sound_off(c);
+   tap = _AL_MALLOC((size+1) * sizeof(MIDI_TAP_EVENT));
+   if (!tap) {
+      *allegro_errno = ENOMEM;
+      return -1;
    }
 
-   if (midi) {
-      if (!midi_loaded_patches)
-	 if (load_patches(midi) != 0)
-	    return -1;
-
-      midi_loop = loop;
-      midi_loop_start = -1;
-      midi_loop_end = -1;
-
-      prepare_to_play(midi);
+   LOCK_DATA(tap, (size+1) * sizeof(MIDI_TAP_EVENT));
 
-      /* arbitrary speed, midi_player() will adjust it */
-      install_int(midi_player, 20);
-   }
-   else {
-      midifile = NULL;
+   remove_midi_tap();
 
-      if (midi_pos > 0)
-	 midi_pos = -midi_pos;
-      else if (midi_pos == 0)
-	 midi_pos = -1;
-   }
+   lock_players();
+   midi_tap_head = midi_tap_tail = 0;
+   midi_tap_size = size+1;
+   resync_midi_tap();
+   midi_tap = tap;
+   unlock_players();
 
    return 0;
 }
 
-END_OF_FUNCTION(play_midi);
-
 
 
-/* play_looped_midi:
- *  Like play_midi(), but the file loops from the specified end position
- *  back to the specified start position (the end position can be -1 to 
- *  indicate the end of the file).
+/* remove_midi_tap:
+ *  Stops recording event timings. The jitter statistics are kept.
  */
-int play_looped_midi(MIDI *midi, int loop_start, int loop_end)
+void remove_midi_tap(void)
 {
-   if (play_midi(midi, TRUE) != 0)
-      return -1;
+   MIDI_TAP_EVENT *tap = midi_tap;
 
-   midi_loop_start = loop_start;
-   midi_loop_end = loop_end;
+   if (!tap)
+      return;
 
-   return 0;
+   lock_players();
+   midi_tap = NULL;
+   unlock_players();
+
+   _AL_FREE(tap);
 }
 
 
 
-/* stop_midi:
- *  Stops whatever MIDI file is currently playing.
+/* read_midi_tap:
+ *  Copies up to max of the oldest recorded events into events, removing
+ *  them from the tap. Returns how many were copied.
  */
-void stop_midi(void)
+int read_midi_tap(MIDI_TAP_EVENT *events, int max)
 {
-   play_midi(NULL, FALSE);
-}
+   int n = 0;
+   ASSERT(events);
 
-END_OF_FUNCTION(stop_midi);
+   if (!midi_tap)
+      return 0;
 
+   while ((n < max) && (midi_tap_tail != midi_tap_head)) {
+      events[n++] = midi_tap[midi_tap_tail];
+      midi_tap_tail = (midi_tap_tail + 1) % midi_tap_size;
+   }
 
+   return n;
+}
 
-/* midi_pause:
- *  Pauses the currently playing MIDI file.
+
+
+/* get_midi_jitter_stats:
+ *  Copies the timing statistics for the events dispatched through the
+ *  MIDI driver with the given ID into stats. Returns zero on success, or
+ *  non-zero if no events have gone through that driver.
  */
-void midi_pause(void)
+int get_midi_jitter_stats(int driver, MIDI_JITTER_STATS *stats)
 {
-   int c;
+   int i, ret = -1;
+   ASSERT(stats);
 
-   if (!midifile)
-      return;
-
-   remove_int(midi_player);
+   lock_players();
 
-   for (c=0; c<16; c++) {
-      all_notes_off(c);
-      all_sound_off(c);
+   for (i=0; (i<MIDI_TAP_DRIVERS) && (midi_jitter[i].count > 0); i++) {
+      if (midi_jitter[i].driver == driver) {
+	 *stats = midi_jitter[i];
+	 stats->mean = midi_jitter_sum[i] / stats->count;
+	 ret = 0;
+	 break;
+      }
    }
-}
 
-END_OF_FUNCTION(midi_pause);
+   unlock_players();
 
+   return ret;
+}
 
 
-/* midi_resume:
- *  Resumes playing a paused MIDI file.
+
+/* reset_midi_jitter_stats:
+ *  Clears the timing statistics for all drivers.
  */
-void midi_resume(void)
+void reset_midi_jitter_stats(void)
 {
-   if (!midifile)
-      return;
-
-   install_int_ex(midi_player, midi_timer_speed);
+   lock_players();
+   memset(midi_jitter, 0, sizeof(midi_jitter));
+   memset(midi_jitter_sum, 0, sizeof(midi_jitter_sum));
+   unlock_players();
 }
 
-END_OF_FUNCTION(midi_resume);
-
 
 
-/* midi_seek:
- *  Seeks to the given midi_pos in the current MIDI file. If the target 
- *  is earlier in the file than the current midi_pos it seeks from the 
- *  beginning; otherwise it seeks from the current position. Returns zero 
- *  if successful, non-zero if it hit the end of the file (1 means it 
- *  stopped playing, 2 means it looped back to the start).
+/* render_midi_to:
+ *  Helper for render_midi() and render_midi_wav_pf(). Plays the MIDI file
+ *  through the DIGMID voices as fast as the mixer can go, passing each
+ *  buffer of PCM data to either the sample or the WAV file. Returns zero
+ *  on success.
  */
-int midi_seek(int target)
+static int render_midi_to(MIDI *midi, int tail, SAMPLE **spl, PACKFILE *f)
 {
-   int old_midi_loop;
-   MIDI *old_midifile;
-   MIDI_DRIVER *old_driver;
-   int old_patch[16];
-   int old_volume[16];
-   int old_pan[16];
-   int old_pitch_bend[16];
-   int c;
+   int freq, bits, channels, buf_size, old_accurate, n, i, ret;
+   LONG_LONG len, done;
+   unsigned char *buf;
+   ASSERT(midi);
 
-   if (!midifile)
+   if ((midi_driver->id != MIDI_DIGMID) ||
+       (digi_driver->init_voice != _mixer_init_voice)) {
+      ustrzcpy(allegro_error, ALLEGRO_LEGACY_ERROR_SIZE, get_config_text("MIDI rendering needs the DIGMID driver"));
       return -1;
+   }
 
-   /* first stop the player */
-   midi_pause();
+   freq = get_mixer_frequency();
+   bits = get_mixer_bits();
+   channels = get_mixer_channels();
+   buf_size = get_mixer_buffer_length() * channels * bits / 8;
 
-   /* store current settings */
-   for (c=0; c<16; c++) {
-      old_patch[c] = midi_channel[c].patch;
-      old_volume[c] = midi_channel[c].volume;
-      old_pan[c] = midi_channel[c].pan;
-      old_pitch_bend[c] = midi_channel[c].pitch_bend;
-   }
-
-   /* save some variables and give temporary values */
-   old_driver = midi_driver;
-   midi_driver = &_midi_none;
-   old_midi_loop = midi_loop;
-   midi_loop = 0;
-   old_midifile = midifile;
-
-   /* set flag to tell midi_player not to reinstall itself */
-   midi_seeking = 1;
-
-   /* are we seeking backwards? If so, skip back to the start of the file */
-   if (target <= midi_pos)
-      prepare_to_play(midifile);
-
-   /* now sit back and let midi_player get to the position */
-   while ((midi_pos < target) && (midi_pos >= 0)) {
-      int mmpc = midi_pos_counter;
-      int mmp = midi_pos;
-
-      mmpc -= midi_timer_speed;
-      while (mmpc <= 0) {
-	 mmpc += midi_pos_speed;
-	 mmp++;
-      }
+   buf = _AL_MALLOC_ATOMIC(buf_size);
+   if (!buf)
+      return -1;
 
-      if (mmp >= target)
-	 break;
+   stop_midi();
 
-      midi_player();
-   }
+   /* take the mixer away from the sound driver */
+   _mixer_hold(TRUE);
 
-   /* restore previously saved variables */
-   midi_loop = old_midi_loop;
-   midi_driver = old_driver;
-   midi_seeking = 0;
+   old_accurate = midi_sample_accurate;
+   set_midi_sample_accurate(TRUE);
 
-   if (midi_pos >= 0) {
-      /* refresh the driver with any changed parameters */
-      if (midi_driver->raw_midi) {
-	 for (c=0; c<16; c++) {
-	    /* program change (this sets the volume as well) */
-	    if ((midi_channel[c].patch != old_patch[c]) ||
-		(midi_channel[c].volume != old_volume[c]))
-	       raw_program_change(c, midi_channel[c].patch);
+   ret = -1;
 
-	    /* pan */
-	    if (midi_channel[c].pan != old_pan[c]) {
-	       midi_driver->raw_midi(0xB0+c);
-	       midi_driver->raw_midi(10);
-	       midi_driver->raw_midi(midi_channel[c].pan);
-	    }
+   if (play_midi(midi, FALSE) != 0)
+      goto getout;
 
-	    /* pitch bend */
-	    if (midi_channel[c].pitch_bend != old_pitch_bend[c]) {
-	       midi_driver->raw_midi(0xE0+c);
-	       midi_driver->raw_midi(midi_channel[c].pitch_bend & 0x7F);
-	       midi_driver->raw_midi(midi_channel[c].pitch_bend >> 7);
-	    }
-	 }
-      }
+   len = ((LONG_LONG)midi->timeline->length * freq + TIMERS_PER_SECOND - 1) / TIMERS_PER_SECOND;
+   len += (LONG_LONG)MAX(tail, 0) * freq / 1000;
 
-      /* if we didn't hit the end of the file, continue playing */
-      if (!midi_looping)
-	 install_int(midi_player, 20);
+   if (len > INT_MAX / channels / (bits / 8) - 44)
+      goto getout;
 
-      return 0;
+   if (spl) {
+      *spl = create_sample(bits, (channels == 2), freq, (int)len);
+      if (!*spl)
+	 goto getout;
+   }
+   else {
+      /* RIFF WAVE header */
+      pack_fwrite("RIFF", 4, f);
+      pack_iputl(36 + (long)len * channels * bits / 8, f);
+      pack_fwrite("WAVEfmt ", 8, f);
+      pack_iputl(16, f);
+      pack_iputw(1, f);
+      pack_iputw(channels, f);
+      pack_iputl(freq, f);
+      pack_iputl(freq * channels * bits / 8, f);
+      pack_iputw(channels * bits / 8, f);
+      pack_iputw(bits, f);
+      pack_fwrite("data", 4, f);
+      pack_iputl((long)len * channels * bits / 8, f);
    }
 
-   if ((midi_loop) && (!midi_looping)) {  /* was file looped? */
-      prepare_to_play(old_midifile);
-      install_int(midi_player, 20);
-      return 2;                           /* seek past EOF => file restarted */
+   for (done=0; done<len; done+=n) {
+      /* DIGMID owns the physical voices above the digital ones, and WAV
+	 files are signed at 16 bits while samples are always unsigned */
+      _mixer_render(buf, ((!spl) && (bits == 16)), digi_driver->voices, midi_driver->voices);
+      n = (int)MIN(len - done, get_mixer_buffer_length());
+
+      if (spl) {
+	 memcpy((unsigned char *)(*spl)->data + done * channels * bits / 8,
+		buf, n * channels * bits / 8);
+      }
+      else if (bits == 16) {
+	 for (i=0; i<n*channels; i++)
+	    pack_iputw(((unsigned short *)buf)[i], f);
+      }
+      else
+	 pack_fwrite(buf, n * channels, f);
    }
 
-   return 1;                              /* seek past EOF => file stopped */
-}
+   if ((!f) || (!pack_ferror(f)))
+      ret = 0;
 
-END_OF_FUNCTION(midi_seek);
+   getout:
+   stop_midi();
 
+   set_midi_sample_accurate(old_accurate);
+   _mixer_hold(FALSE);
 
+   _AL_FREE(buf);
 
-/* get_midi_length:
- *  Returns the length, in seconds, of the specified midi. This will stop any
- *  currently playing midi. Don't call it too often, since it simulates playing
- *  all of the midi to get the time even if the midi contains tempo changes.
- */
-int get_midi_length(MIDI *midi)
-{
-    play_midi(midi, 0);
-    while (midi_pos < 0); /* Without this, midi_seek won't work. */
-    midi_seek(INT_MAX);
-    return midi_time;
+   if ((ret != 0) && (spl) && (*spl)) {
+      destroy_sample(*spl);
+      *spl = NULL;
+   }
+
+   return ret;
 }
 
 
 
-/* midi_out:
- *  Inserts MIDI command bytes into the output stream, in realtime.
+/* render_midi:
+ *  Renders the MIDI file into a new sample, at the current mixer frequency
+ *  and format, faster than real time. The tail parameter is how many
+ *  milliseconds to carry on for after the last event, so that releasing
+ *  notes can die away. Returns NULL on error.
  */
-void midi_out(unsigned char *data, int length)
+SAMPLE *render_midi(MIDI *midi, int tail)
 {
-   unsigned char *pos = data;
-   unsigned char running_status = 0;
-   long timer = 0;
-   ASSERT(data);
-
-   midi_semaphore = TRUE;
-   _midi_tick++;
-
-   while (pos < data+length)
-      process_midi_event((AL_CONST unsigned char**) &pos, &running_status, &timer);
+   SAMPLE *spl = NULL;
 
-   update_controllers();
+   if (render_midi_to(midi, tail, &spl, NULL) != 0)
+      return NULL;
 
-   midi_semaphore = FALSE;
+   return spl;
 }
 
 
 
-/* load_midi_patches:
- *  Tells the MIDI driver to preload the entire sample set.
+/* render_midi_wav_pf:
+ *  Like render_midi(), but streams the result to a WAV file, without
+ *  holding the whole rendering in memory. Returns zero on success.
  */
-int load_midi_patches(void)
+int render_midi_wav_pf(MIDI *midi, int tail, PACKFILE *f)
 {
-   char patches[128], drums[128];
-   int c, ret;
-
-   for (c=0; c<128; c++)
-      patches[c] = drums[c] = TRUE;
-
-   midi_semaphore = TRUE;
-   ret = midi_driver->load_patches(patches, drums);
-   midi_semaphore = FALSE;
-
-   midi_loaded_patches = TRUE;
+   ASSERT(f);
 
-   return ret;
+   return render_midi_to(midi, tail, NULL, f);
 }
 
 
@@ -1551,23 +3787,25 @@ static void midi_lock_mem(void)
 {
    LOCK_VARIABLE(midi_pos);
    LOCK_VARIABLE(midi_time);
-   LOCK_VARIABLE(midi_timers);
-   LOCK_VARIABLE(midi_pos_counter);
    LOCK_VARIABLE(_midi_tick);
-   LOCK_VARIABLE(midifile);
+   LOCK_VARIABLE(_midi_flush_output);
+   LOCK_VARIABLE(midi_alloc_driver);
+   LOCK_VARIABLE(midi_alloc_voices);
+   LOCK_VARIABLE(midi_free_first);
+   LOCK_VARIABLE(midi_free_last);
+   LOCK_VARIABLE(midi_steal_heap);
+   LOCK_VARIABLE(midi_steal_count);
+   LOCK_VARIABLE(midi_stats);
+   LOCK_VARIABLE(midi_default_player);
+   LOCK_VARIABLE(midi_players);
    LOCK_VARIABLE(midi_semaphore);
-   LOCK_VARIABLE(midi_loop);
    LOCK_VARIABLE(midi_loop_start);
    LOCK_VARIABLE(midi_loop_end);
    LOCK_VARIABLE(midi_timer_speed);
-   LOCK_VARIABLE(midi_pos_speed);
-   LOCK_VARIABLE(midi_speed);
-   LOCK_VARIABLE(midi_new_speed);
    LOCK_VARIABLE(old_midi_volume);
    LOCK_VARIABLE(midi_alloc_channel);
    LOCK_VARIABLE(midi_alloc_note);
    LOCK_VARIABLE(midi_alloc_vol);
-   LOCK_VARIABLE(midi_track);
    LOCK_VARIABLE(midi_voice);
    LOCK_VARIABLE(midi_channel);
    LOCK_VARIABLE(midi_waiting);
@@ -1575,12 +3813,30 @@ static void midi_lock_mem(void)
    LOCK_VARIABLE(midi_msg_callback);
    LOCK_VARIABLE(midi_meta_callback);
    LOCK_VARIABLE(midi_sysex_callback);
-   LOCK_VARIABLE(midi_seeking);
-   LOCK_VARIABLE(midi_looping);
+   LOCK_VARIABLE(midi_sample_accurate);
+   LOCK_VARIABLE(midi_clock_running);
+   LOCK_VARIABLE(midi_sample_freq);
+   LOCK_VARIABLE(midi_sample_due);
+   LOCK_VARIABLE(midi_sample_pos);
+   LOCK_VARIABLE(midi_timer_frequency);
+   LOCK_VARIABLE(midi_tap);
+   LOCK_VARIABLE(midi_tap_size);
+   LOCK_VARIABLE(midi_tap_head);
+   LOCK_VARIABLE(midi_tap_tail);
+   LOCK_VARIABLE(midi_jitter);
+   LOCK_VARIABLE(midi_jitter_sum);
    LOCK_FUNCTION(parse_var_len);
+   LOCK_FUNCTION(read_midi_event);
+   LOCK_FUNCTION(chase_midi_event);
    LOCK_FUNCTION(raw_program_change);
    LOCK_FUNCTION(midi_note_off);
    LOCK_FUNCTION(_midi_allocate_voice);
+   LOCK_FUNCTION(heap_move_up);
+   LOCK_FUNCTION(heap_move_down);
+   LOCK_FUNCTION(voice_started);
+   LOCK_FUNCTION(voice_released);
+   LOCK_FUNCTION(sync_voice_allocator);
+   LOCK_FUNCTION(steal_voice);
    LOCK_FUNCTION(midi_note_on);
    LOCK_FUNCTION(all_notes_off);
    LOCK_FUNCTION(all_sound_off);
@@ -1589,8 +3845,27 @@ static void midi_lock_mem(void)
    LOCK_FUNCTION(process_controller);
    LOCK_FUNCTION(process_meta_event);
    LOCK_FUNCTION(process_midi_event);
+   LOCK_FUNCTION(tap_clock);
+   LOCK_FUNCTION(tap_event);
+   LOCK_FUNCTION(lock_players);
+   LOCK_FUNCTION(unlock_players);
+   LOCK_FUNCTION(schedule_midi_clock);
+   LOCK_FUNCTION(stop_midi_clock);
+   LOCK_FUNCTION(activate_player);
+   LOCK_FUNCTION(flush_midi_output);
+   LOCK_FUNCTION(player_notes_off);
+   LOCK_FUNCTION(stop_player);
+   LOCK_FUNCTION(run_player);
+   LOCK_FUNCTION(run_midi_players);
    LOCK_FUNCTION(midi_player);
+   LOCK_FUNCTION(midi_mixer_sequencer);
    LOCK_FUNCTION(prepare_to_play);
+   LOCK_FUNCTION(seek_player);
+   LOCK_FUNCTION(midi_player_play);
+   LOCK_FUNCTION(midi_player_stop);
+   LOCK_FUNCTION(midi_player_pause);
+   LOCK_FUNCTION(midi_player_resume);
+   LOCK_FUNCTION(midi_player_seek);
    LOCK_FUNCTION(play_midi);
    LOCK_FUNCTION(stop_midi);
    LOCK_FUNCTION(midi_pause);
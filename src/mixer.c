@@ -29,6 +29,7 @@
 
 
 #include <string.h>
+#include <math.h>
 
 #include "allegro.h"
 #include "allegro/internal/aintern.h"
@@ -52,9 +53,32 @@ typedef struct MIXER_VOICE
    long loop_end;             /* fixed point loop end position */
    int lvol;                  /* left channel volume */
    int rvol;                  /* right channel volume */
+   int bus;                   /* submix bus this voice is routed to */
 } MIXER_VOICE;
 
 
+#define REVERB_COMBS          4
+
+typedef struct MIXER_BUS
+{
+   int used;                  /* has this bus been created? */
+   char name[32];             /* name given to create_mixer_bus() */
+   signed int *buf;           /* submix buffer (NULL for the master bus) */
+   int vol;                   /* current volume (fixed point .12) */
+   int dvol;                  /* volume delta per sample, for ramps */
+   int target_vol;            /* target volume, for ramps */
+   int gain;                  /* gain applied at the end of the last block */
+   int lowpass;               /* one-pole low-pass coefficient, 0 = off */
+   signed int lowpass_state[2];
+   int reverb_wet;            /* reverb return level, 0 = off */
+   int reverb_feedback;       /* comb filter feedback (fixed point .16) */
+   signed int *reverb_buf;    /* comb filter delay lines */
+   int reverb_len[2][REVERB_COMBS];
+   int reverb_pos[2][REVERB_COMBS];
+   signed int reverb_store[2][REVERB_COMBS];
+} MIXER_BUS;
+
+
 /* MIX_FIX_SHIFT must be <= (sizeof(int)*8)-24 */
 #define MIX_FIX_SHIFT         8
 #define MIX_FIX_SCALE         (1<<MIX_FIX_SHIFT)
@@ -74,6 +98,30 @@ static signed int *mix_buffer = NULL;
 typedef signed int MIXER_VOL_TABLE[256];
 static MIXER_VOL_TABLE mix_vol_table[MIX_VOLUME_LEVELS];
 
+/* polyphase windowed-sinc filter tables for the quality 3 resampler: one
+ * row of SINC_TAPS coefficients per fractional position, and one table per
+ * cutoff so that voices pitched well above the mixer rate are band-limited
+ * before they are decimated.
+ */
+#define SINC_TAPS             8
+#define SINC_PHASES           MIX_FIX_SCALE
+#define SINC_TABLES           3
+#define SINC_COEF_SHIFT       14
+typedef signed int MIXER_SINC_TABLE[SINC_PHASES][SINC_TAPS];
+static MIXER_SINC_TABLE mix_sinc_table[SINC_TABLES];
+static int mix_sinc_ready = FALSE;
+
+/* submix buses: bus 0 is the master bus, which mixes straight into
+ * mix_buffer, and every other bus is summed into it in index order
+ * once its own DSP chain has run.
+ */
+static MIXER_BUS mixer_bus[MIXER_MAX_BUSES];
+
+/* Freeverb comb lengths at 44.1kHz, plus the right channel spread */
+static AL_CONST int reverb_comb_tuning[REVERB_COMBS] = { 1116, 1188, 1277, 1356 };
+#define REVERB_SPREAD         23
+#define REVERB_DAMP           13107    /* 0.2 in fixed point .16 */
+
 /* stats for the mixing code */
 static int mix_voices;
 static int mix_size;
@@ -84,6 +132,15 @@ static int mix_bits;
 /* shift factor for volume per voice */
 static int voice_volume_scale = 1;
 
+/* callback that splits each buffer at sample accurate event times */
+static int (*mix_sequencer)(int samples) = NULL;
+
+/* samples left in the buffer after the current slice, mod UPDATE_FREQ */
+static int mix_phase = 0;
+
+/* set while _mixer_render() has the mixer to itself */
+static volatile int mix_held = FALSE;
+
 static void mixer_lock_mem(void);
 
 #ifdef ALLEGRO_LEGACY_MULTITHREADED
@@ -99,7 +156,7 @@ static void *mixer_mutex = NULL;
  */
 void set_mixer_quality(int quality)
 {
-   if((quality < 0) || (quality > 2))
+   if((quality < 0) || (quality > 3))
       quality = 2;
    if(mix_channels == 1)
       quality = 0;
@@ -247,6 +304,56 @@ END_OF_FUNCTION(set_volume_per_voice);
 
 
 
+/* init_sinc_tables:
+ *  Builds the polyphase filter tables used by the quality 3 resampler. Each
+ *  row is a Blackman windowed sinc evaluated at one fractional position and
+ *  normalised to unity gain, so that a constant input stays constant.
+ */
+static void init_sinc_tables(void)
+{
+   static AL_CONST double cutoff[SINC_TABLES] = { 1.0, 0.5, 0.25 };
+   double h[SINC_TAPS], x, t, sum;
+   int i, j, k, total, peak;
+
+   for (i=0; i<SINC_TABLES; i++) {
+      for (j=0; j<SINC_PHASES; j++) {
+         sum = 0;
+
+         for (k=0; k<SINC_TAPS; k++) {
+            x = (k - (SINC_TAPS/2 - 1)) - (double)j / SINC_PHASES;
+            t = x / (SINC_TAPS/2);
+
+            if (fabs(t) >= 1.0)
+               h[k] = 0;
+            else {
+               h[k] = 0.42 + 0.5 * cos(AL_PI * t) + 0.08 * cos(2 * AL_PI * t);
+               if (x != 0)
+                  h[k] *= sin(AL_PI * x * cutoff[i]) / (AL_PI * x * cutoff[i]);
+            }
+
+            sum += h[k];
+         }
+
+         total = 0;
+         peak = 0;
+
+         for (k=0; k<SINC_TAPS; k++) {
+            mix_sinc_table[i][j][k] = (int)floor(h[k] / sum * (1<<SINC_COEF_SHIFT) + 0.5);
+            total += mix_sinc_table[i][j][k];
+            if (mix_sinc_table[i][j][k] > mix_sinc_table[i][j][peak])
+               peak = k;
+         }
+
+         /* put any rounding error on the centre tap */
+         mix_sinc_table[i][j][peak] += (1<<SINC_COEF_SHIFT) - total;
+      }
+   }
+
+   mix_sinc_ready = TRUE;
+}
+
+
+
 /* _mixer_init:
  *  Initialises the sample mixing code, returning 0 on success. You should
  *  pass it the number of samples you want it to mix each time the refill
@@ -261,7 +368,7 @@ int _mixer_init(int bufsize, int freq, int stereo, int is16bit, int *voices)
 {
    int i, j;
 
-   if((_sound_hq < 0) || (_sound_hq > 2))
+   if((_sound_hq < 0) || (_sound_hq > 3))
       _sound_hq = 2;
 
    mix_voices = *voices;
@@ -276,8 +383,15 @@ int _mixer_init(int bufsize, int freq, int stereo, int is16bit, int *voices)
    for (i=0; i<MIXER_MAX_SFX; i++) {
       mixer_voice[i].playing = FALSE;
       mixer_voice[i].data.buffer = NULL;
+      mixer_voice[i].bus = 0;
    }
 
+   memset(mixer_bus, 0, sizeof(mixer_bus));
+   mixer_bus[0].used = TRUE;
+   ustrzcpy(mixer_bus[0].name, sizeof(mixer_bus[0].name), uconvert_ascii("master", NULL));
+   mixer_bus[0].vol = mixer_bus[0].target_vol = 255 << 12;
+   mixer_bus[0].gain = 1 << 16;
+
    /* temporary buffer for sample mixing */
    mix_buffer = _AL_MALLOC_ATOMIC(mix_size*mix_channels * sizeof(*mix_buffer));
    if (!mix_buffer) {
@@ -294,9 +408,18 @@ int _mixer_init(int bufsize, int freq, int stereo, int is16bit, int *voices)
       for (i=0; i<256; i++)
 	 mix_vol_table[j][i] = ((i-128) * 256 * j / MIX_VOLUME_LEVELS) << 8;
 
+   if (!mix_sinc_ready)
+      init_sinc_tables();
+
    mixer_lock_mem();
 
 #ifdef ALLEGRO_LEGACY_MULTITHREADED
+   /* SYSTEM_NONE has no mutexes, and no drivers to mix from another
+    * thread either, so the mixer can do without one there.
+    */
+   if (!system_driver->create_mutex)
+      return 0;
+
    /* Woops. Forgot to clean up incase this fails. :) */
    mixer_mutex = system_driver->create_mutex();
    if (!mixer_mutex) {
@@ -320,11 +443,22 @@ int _mixer_init(int bufsize, int freq, int stereo, int is16bit, int *voices)
  */
 void _mixer_exit(void)
 {
+   int i;
+
 #ifdef ALLEGRO_LEGACY_MULTITHREADED
-   system_driver->destroy_mutex(mixer_mutex);
+   if (mixer_mutex)
+      system_driver->destroy_mutex(mixer_mutex);
    mixer_mutex = NULL;
 #endif
 
+   for (i=0; i<MIXER_MAX_BUSES; i++) {
+      if (mixer_bus[i].buf)
+         _AL_FREE(mixer_bus[i].buf);
+      if (mixer_bus[i].reverb_buf)
+         _AL_FREE(mixer_bus[i].reverb_buf);
+   }
+   memset(mixer_bus, 0, sizeof(mixer_bus));
+
    if (mix_buffer)
       _AL_FREE(mix_buffer);
    mix_buffer = NULL;
@@ -334,6 +468,329 @@ void _mixer_exit(void)
    mix_channels = 0;
    mix_bits = 0;
    mix_voices = 0;
+   mix_sequencer = NULL;
+}
+
+
+
+/* _mixer_set_sequencer:
+ *  Installs a callback which is run from inside _mix_some_samples(), so
+ *  that voices can be started and stopped at exact sample positions
+ *  rather than only on buffer boundaries. Each time it is called, the
+ *  callback may change any voice parameters it likes, and returns how
+ *  many samples (at most the value it is passed) should be mixed before
+ *  it is called again. Pass NULL to remove it.
+ */
+void _mixer_set_sequencer(int (*proc)(int samples))
+{
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->lock_mutex(mixer_mutex);
+#endif
+
+   mix_sequencer = proc;
+
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->unlock_mutex(mixer_mutex);
+#endif
+}
+
+
+
+/* _mixer_lock:
+ *  Keeps the mixer from running, so that the state a sequencer shares
+ *  with other threads can be changed without it looking on. Must be taken
+ *  before any lock of the sequencer's own.
+ */
+void _mixer_lock(void)
+{
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->lock_mutex(mixer_mutex);
+#endif
+}
+
+
+
+/* _mixer_unlock:
+ *  Lets the mixer run again after _mixer_lock().
+ */
+void _mixer_unlock(void)
+{
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->unlock_mutex(mixer_mutex);
+#endif
+}
+
+
+
+/* create_mixer_bus:
+ *  Creates a named submix bus, returning its index, or the index of the
+ *  existing bus if one with that name has already been created. Returns
+ *  -1 if the mixer is not running or all the buses are in use.
+ */
+int create_mixer_bus(AL_CONST char *name)
+{
+   signed int *buf;
+   int bus;
+
+   ASSERT(name);
+
+   if (!mix_buffer)
+      return -1;
+
+   bus = find_mixer_bus(name);
+   if (bus >= 0)
+      return bus;
+
+   for (bus=1; bus<MIXER_MAX_BUSES; bus++)
+      if (!mixer_bus[bus].used)
+	 break;
+
+   if (bus >= MIXER_MAX_BUSES)
+      return -1;
+
+   buf = _AL_MALLOC_ATOMIC(mix_size*mix_channels * sizeof(*buf));
+   if (!buf)
+      return -1;
+
+   LOCK_DATA(buf, mix_size*mix_channels * sizeof(*buf));
+
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->lock_mutex(mixer_mutex);
+#endif
+
+   memset(mixer_bus+bus, 0, sizeof(MIXER_BUS));
+   ustrzcpy(mixer_bus[bus].name, sizeof(mixer_bus[bus].name), name);
+   mixer_bus[bus].buf = buf;
+   mixer_bus[bus].vol = mixer_bus[bus].target_vol = 255 << 12;
+   mixer_bus[bus].gain = 1 << 16;
+   mixer_bus[bus].used = TRUE;
+
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->unlock_mutex(mixer_mutex);
+#endif
+
+   return bus;
+}
+
+
+
+/* destroy_mixer_bus:
+ *  Destroys a submix bus. Any voices routed to it go back to the master
+ *  bus. The master bus itself cannot be destroyed.
+ */
+void destroy_mixer_bus(int bus)
+{
+   signed int *buf, *reverb_buf;
+   int i;
+
+   if ((bus <= 0) || (bus >= MIXER_MAX_BUSES) || (!mixer_bus[bus].used))
+      return;
+
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->lock_mutex(mixer_mutex);
+#endif
+
+   for (i=0; i<MIXER_MAX_SFX; i++)
+      if (mixer_voice[i].bus == bus)
+	 mixer_voice[i].bus = 0;
+
+   buf = mixer_bus[bus].buf;
+   reverb_buf = mixer_bus[bus].reverb_buf;
+   memset(mixer_bus+bus, 0, sizeof(MIXER_BUS));
+
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->unlock_mutex(mixer_mutex);
+#endif
+
+   _AL_FREE(buf);
+   if (reverb_buf)
+      _AL_FREE(reverb_buf);
+}
+
+
+
+/* find_mixer_bus:
+ *  Looks up a submix bus by name, returning -1 if there is no such bus.
+ *  The master bus is called "master".
+ */
+int find_mixer_bus(AL_CONST char *name)
+{
+   int bus;
+
+   ASSERT(name);
+
+   for (bus=0; bus<MIXER_MAX_BUSES; bus++)
+      if ((mixer_bus[bus].used) && (ustricmp(mixer_bus[bus].name, name) == 0))
+	 return bus;
+
+   return -1;
+}
+
+
+
+/* set_mixer_bus_volume:
+ *  Sets the volume (0-255) of a submix bus. The change is ramped across
+ *  the next mixing buffer so that it doesn't click.
+ */
+void set_mixer_bus_volume(int bus, int volume)
+{
+   ASSERT(volume >= 0 && volume <= 255);
+
+   if ((bus < 0) || (bus >= MIXER_MAX_BUSES) || (!mixer_bus[bus].used))
+      return;
+
+   mixer_bus[bus].target_vol = volume << 12;
+   mixer_bus[bus].vol = volume << 12;
+   mixer_bus[bus].dvol = 0;
+}
+
+END_OF_FUNCTION(set_mixer_bus_volume);
+
+
+
+/* ramp_mixer_bus_volume:
+ *  Fades a submix bus to a new volume over the specified number of
+ *  milliseconds, eg. to duck the music while somebody is talking.
+ */
+void ramp_mixer_bus_volume(int bus, int time, int endvol)
+{
+   int d, len;
+
+   ASSERT(endvol >= 0 && endvol <= 255);
+   ASSERT(time >= 0);
+
+   if ((bus < 0) || (bus >= MIXER_MAX_BUSES) || (!mixer_bus[bus].used))
+      return;
+
+   len = (int)((LONG_LONG)time * mix_freq / 1000);
+   if (len <= 0) {
+      set_mixer_bus_volume(bus, endvol);
+      return;
+   }
+
+   d = (endvol << 12) - mixer_bus[bus].vol;
+   mixer_bus[bus].target_vol = endvol << 12;
+   mixer_bus[bus].dvol = (d / len) ? (d / len) : ((d < 0) ? -1 : 1);
+}
+
+END_OF_FUNCTION(ramp_mixer_bus_volume);
+
+
+
+/* get_mixer_bus_volume:
+ *  Returns the current volume of a submix bus, or -1 if it doesn't exist.
+ */
+int get_mixer_bus_volume(int bus)
+{
+   if ((bus < 0) || (bus >= MIXER_MAX_BUSES) || (!mixer_bus[bus].used))
+      return -1;
+
+   return mixer_bus[bus].vol >> 12;
+}
+
+END_OF_FUNCTION(get_mixer_bus_volume);
+
+
+
+/* set_mixer_bus_lowpass:
+ *  Enables a one-pole low-pass filter on a submix bus, with the given
+ *  cutoff frequency in Hz. Passing zero switches the filter off.
+ */
+void set_mixer_bus_lowpass(int bus, int cutoff)
+{
+   int coef;
+
+   if ((bus < 0) || (bus >= MIXER_MAX_BUSES) || (!mixer_bus[bus].used))
+      return;
+
+   if ((cutoff <= 0) || (cutoff >= mix_freq / 2))
+      coef = 0;
+   else
+      coef = (int)((1.0 - exp(-2.0 * AL_PI * cutoff / mix_freq)) * 65536.0);
+
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->lock_mutex(mixer_mutex);
+#endif
+
+   if (!mixer_bus[bus].lowpass)
+      mixer_bus[bus].lowpass_state[0] = mixer_bus[bus].lowpass_state[1] = 0;
+
+   mixer_bus[bus].lowpass = coef;
+
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->unlock_mutex(mixer_mutex);
+#endif
+}
+
+
+
+/* set_mixer_bus_reverb:
+ *  Adds a reverb to a submix bus. The wet parameter (0-255) sets how much
+ *  of the reverberated signal is mixed back in, zero switching the effect
+ *  off, and room (0-255) sets how long the tail rings on for.
+ */
+void set_mixer_bus_reverb(int bus, int wet, int room)
+{
+   MIXER_BUS *b;
+   signed int *reverb_buf = NULL;
+   int i, c, size;
+
+   ASSERT(wet >= 0 && wet <= 255);
+   ASSERT(room >= 0 && room <= 255);
+
+   if ((bus < 0) || (bus >= MIXER_MAX_BUSES) || (!mixer_bus[bus].used))
+      return;
+
+   b = mixer_bus + bus;
+
+   /* delay lines are allocated the first time the reverb is switched on */
+   if ((wet > 0) && (!b->reverb_buf)) {
+      size = 0;
+      for (i=0; i<REVERB_COMBS; i++)
+	 size += (int)((LONG_LONG)(reverb_comb_tuning[i] + REVERB_SPREAD) * mix_freq / 44100) + 1;
+      size *= mix_channels;
+
+      reverb_buf = _AL_MALLOC_ATOMIC(size * sizeof(*reverb_buf));
+      if (!reverb_buf)
+	 return;
+
+      memset(reverb_buf, 0, size * sizeof(*reverb_buf));
+      LOCK_DATA(reverb_buf, size * sizeof(*reverb_buf));
+   }
+
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->lock_mutex(mixer_mutex);
+#endif
+
+   if (reverb_buf) {
+      b->reverb_buf = reverb_buf;
+      for (c=0; c<mix_channels; c++) {
+	 for (i=0; i<REVERB_COMBS; i++) {
+	    b->reverb_len[c][i] = (int)((LONG_LONG)(reverb_comb_tuning[i] + c * REVERB_SPREAD) * mix_freq / 44100) + 1;
+	    b->reverb_pos[c][i] = 0;
+	    b->reverb_store[c][i] = 0;
+	 }
+      }
+   }
+
+   b->reverb_feedback = 45875 + (18350 * room / 255);   /* 0.7 to 0.98 */
+   b->reverb_wet = wet;
+
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->unlock_mutex(mixer_mutex);
+#endif
 }
 
 
@@ -433,11 +890,12 @@ END_OF_STATIC_FUNCTION(update_mixer);
  *  Another helper for updating the volume ramp and pitch/pan sweep status.
  *  This version is designed for the silent mixer, and it is called just once
  *  per buffer. The len parameter is used to work out how much the values
- *  must be adjusted.
+ *  must be adjusted, counting updates at the same buffer positions as
+ *  update_mixer() would.
  */
 static void update_silent_mixer(MIXER_VOICE *spl, PHYS_VOICE *voice, int len)
 {
-   len >>= UPDATE_FREQ_SHIFT;
+   len = (len + mix_phase) >> UPDATE_FREQ_SHIFT;
 
    /* update pan sweep */
    if (voice->dpan) {
@@ -469,6 +927,8 @@ END_OF_STATIC_FUNCTION(update_silent_mixer);
 /* helper for constructing the body of a sample mixing routine */
 #define MIXER()                                                              \
 {                                                                            \
+   int phase = mix_phase;                                                    \
+                                                                             \
    if ((voice->playmode & PLAYMODE_LOOP) &&                                  \
        (spl->loop_start < spl->loop_end)) {                                  \
                                                                              \
@@ -488,7 +948,7 @@ END_OF_STATIC_FUNCTION(update_silent_mixer);
                else                                                          \
                   spl->pos += (spl->loop_end - spl->loop_start);             \
             }                                                                \
-            if ((len & (UPDATE_FREQ-1)) == 0)                                \
+            if (((len + phase) & (UPDATE_FREQ-1)) == 0)                      \
                update_mixer(spl, voice, len);                                \
          }                                                                   \
       }                                                                      \
@@ -508,7 +968,7 @@ END_OF_STATIC_FUNCTION(update_silent_mixer);
                else                                                          \
                   spl->pos -= (spl->loop_end - spl->loop_start);             \
             }                                                                \
-            if ((len & (UPDATE_FREQ-1)) == 0)                                \
+            if (((len + phase) & (UPDATE_FREQ-1)) == 0)                      \
                update_mixer(spl, voice, len);                                \
          }                                                                   \
       }                                                                      \
@@ -524,7 +984,7 @@ END_OF_STATIC_FUNCTION(update_silent_mixer);
             spl->playing = FALSE;                                            \
             return;                                                          \
          }                                                                   \
-         if ((len & (UPDATE_FREQ-1)) == 0)                                   \
+         if (((len + phase) & (UPDATE_FREQ-1)) == 0)                         \
             update_mixer(spl, voice, len);                                   \
       }                                                                      \
    }                                                                         \
@@ -1062,44 +1522,337 @@ END_OF_STATIC_FUNCTION(mix_hq2_16x2_samples);
 
 
 
-#define MAX_24 (0x00FFFFFF)
+/* sinc_fetch:
+ *  Gathers the SINC_TAPS signed 16 bit source values of one channel centred
+ *  on frame idx. Frames outside the sample read as silence, except that a
+ *  voice looping forward across the end of its data wraps to the loop start.
+ */
+static INLINE void sinc_fetch(MIXER_VOICE *spl, PHYS_VOICE *voice, long idx, int ch, int bits, int *s)
+{
+   long frames = spl->len >> MIX_FIX_SHIFT;
+   long first = idx - (SINC_TAPS/2 - 1);
+   long i, loop_start;
+   int stride = spl->channels;
+   int wrap, k;
+
+   if ((first >= 0) && (first + SINC_TAPS <= frames)) {
+      if (bits == 8) {
+         unsigned char *d = spl->data.u8 + first*stride + ch;
+         for (k=0; k<SINC_TAPS; k++)
+            s[k] = (d[k*stride] << 8) - 0x8000;
+      }
+      else {
+         unsigned short *d = spl->data.u16 + first*stride + ch;
+         for (k=0; k<SINC_TAPS; k++)
+            s[k] = d[k*stride] - 0x8000;
+      }
+      return;
+   }
 
-/* _mix_some_samples:
- *  Mixes samples into a buffer in memory (the buf parameter should be a
- *  linear offset into the specified segment), using the buffer size, sample
- *  frequency, etc, set when you called _mixer_init(). This should be called
- *  by the audio driver to get the next buffer full of samples.
+   wrap = ((voice->playmode & (PLAYMODE_LOOP | PLAYMODE_BIDIR)) == PLAYMODE_LOOP &&
+           spl->loop_start < spl->loop_end && spl->loop_end == spl->len);
+   loop_start = spl->loop_start >> MIX_FIX_SHIFT;
+
+   for (k=0; k<SINC_TAPS; k++) {
+      i = first + k;
+      if ((i >= frames) && (wrap))
+         i = loop_start + (i - frames) % (frames - loop_start);
+
+      if ((i < 0) || (i >= frames))
+         s[k] = 0;
+      else if (bits == 8)
+         s[k] = (spl->data.u8[i*stride + ch] << 8) - 0x8000;
+      else
+         s[k] = spl->data.u16[i*stride + ch] - 0x8000;
+   }
+}
+
+
+
+/* sinc_filter:
+ *  Applies one row of a polyphase table to the gathered source values,
+ *  returning a 24 bit result. This is a fixed length integer dot product
+ *  which the compiler can keep in vector registers.
  */
-void _mix_some_samples(uintptr_t buf, unsigned short seg, int issigned)
+static INLINE int sinc_filter(AL_CONST signed int *coef, AL_CONST int *s)
 {
-   signed int *p = mix_buffer;
-   int i;
+   int k, v = 0;
+
+   for (k=0; k<SINC_TAPS; k++)
+      v += coef[k] * s[k];
+
+   return v >> (SINC_COEF_SHIFT + 16 - 24);
+}
 
-   /* clear mixing buffer */
-   memset(p, 0, mix_size*mix_channels * sizeof(*p));
 
-#ifdef ALLEGRO_LEGACY_MULTITHREADED
-   system_driver->lock_mutex(mixer_mutex);
-#endif
 
-   for (i=0; i<mix_voices; i++) {
+/* sinc_table:
+ *  Picks the filter table whose cutoff suits the current playback speed.
+ */
+static INLINE MIXER_SINC_TABLE *sinc_table(MIXER_VOICE *spl)
+{
+   long d = ABS(spl->diff);
+
+   if (d <= MIX_FIX_SCALE)
+      return mix_sinc_table;
+   else if (d <= MIX_FIX_SCALE*2)
+      return mix_sinc_table + 1;
+   else
+      return mix_sinc_table + 2;
+}
+
+
+
+/* mix_hq3_8x1_samples:
+ *  Mixes from a mono 8 bit sample into a sinc interpolated stereo buffer,
+ *  until either len samples have been mixed or until the end of the
+ *  sample is reached.
+ */
+static void mix_hq3_8x1_samples(MIXER_VOICE *spl, PHYS_VOICE *voice, signed int *buf, int len)
+{
+   MIXER_SINC_TABLE *coef = sinc_table(spl);
+   int lvol = spl->lvol;
+   int rvol = spl->rvol;
+   int s[SINC_TAPS];
+   int v;
+
+   #define MIX()                                                             \
+      sinc_fetch(spl, voice, spl->pos>>MIX_FIX_SHIFT, 0, 8, s);              \
+      v = sinc_filter((*coef)[spl->pos & (MIX_FIX_SCALE-1)], s);             \
+                                                                             \
+      *(buf++) += MULSC(v, lvol);                                            \
+      *(buf++) += MULSC(v, rvol);
+
+   MIXER();
+
+   #undef MIX
+}
+
+END_OF_STATIC_FUNCTION(mix_hq3_8x1_samples);
+
+
+
+/* mix_hq3_8x2_samples:
+ *  Mixes from a stereo 8 bit sample into a sinc interpolated stereo buffer,
+ *  until either len samples have been mixed or until the end of the
+ *  sample is reached.
+ */
+static void mix_hq3_8x2_samples(MIXER_VOICE *spl, PHYS_VOICE *voice, signed int *buf, int len)
+{
+   MIXER_SINC_TABLE *coef = sinc_table(spl);
+   int lvol = spl->lvol;
+   int rvol = spl->rvol;
+   int s[SINC_TAPS];
+   int va, vb;
+
+   #define MIX()                                                             \
+      sinc_fetch(spl, voice, spl->pos>>MIX_FIX_SHIFT, 0, 8, s);              \
+      va = sinc_filter((*coef)[spl->pos & (MIX_FIX_SCALE-1)], s);            \
+      sinc_fetch(spl, voice, spl->pos>>MIX_FIX_SHIFT, 1, 8, s);              \
+      vb = sinc_filter((*coef)[spl->pos & (MIX_FIX_SCALE-1)], s);            \
+                                                                             \
+      *(buf++) += MULSC(va, lvol);                                           \
+      *(buf++) += MULSC(vb, rvol);
+
+   MIXER();
+
+   #undef MIX
+}
+
+END_OF_STATIC_FUNCTION(mix_hq3_8x2_samples);
+
+
+
+/* mix_hq3_16x1_samples:
+ *  Mixes from a mono 16 bit sample into a sinc interpolated stereo buffer,
+ *  until either len samples have been mixed or until the end of the sample
+ *  is reached.
+ */
+static void mix_hq3_16x1_samples(MIXER_VOICE *spl, PHYS_VOICE *voice, signed int *buf, int len)
+{
+   MIXER_SINC_TABLE *coef = sinc_table(spl);
+   int lvol = spl->lvol;
+   int rvol = spl->rvol;
+   int s[SINC_TAPS];
+   int v;
+
+   #define MIX()                                                             \
+      sinc_fetch(spl, voice, spl->pos>>MIX_FIX_SHIFT, 0, 16, s);             \
+      v = sinc_filter((*coef)[spl->pos & (MIX_FIX_SCALE-1)], s);             \
+                                                                             \
+      *(buf++) += MULSC(v, lvol);                                            \
+      *(buf++) += MULSC(v, rvol);
+
+   MIXER();
+
+   #undef MIX
+}
+
+END_OF_STATIC_FUNCTION(mix_hq3_16x1_samples);
+
+
+
+/* mix_hq3_16x2_samples:
+ *  Mixes from a stereo 16 bit sample into a sinc interpolated stereo buffer,
+ *  until either len samples have been mixed or until the end of the sample
+ *  is reached.
+ */
+static void mix_hq3_16x2_samples(MIXER_VOICE *spl, PHYS_VOICE *voice, signed int *buf, int len)
+{
+   MIXER_SINC_TABLE *coef = sinc_table(spl);
+   int lvol = spl->lvol;
+   int rvol = spl->rvol;
+   int s[SINC_TAPS];
+   int va, vb;
+
+   #define MIX()                                                             \
+      sinc_fetch(spl, voice, spl->pos>>MIX_FIX_SHIFT, 0, 16, s);             \
+      va = sinc_filter((*coef)[spl->pos & (MIX_FIX_SCALE-1)], s);            \
+      sinc_fetch(spl, voice, spl->pos>>MIX_FIX_SHIFT, 1, 16, s);             \
+      vb = sinc_filter((*coef)[spl->pos & (MIX_FIX_SCALE-1)], s);            \
+                                                                             \
+      *(buf++) += MULSC(va, lvol);                                           \
+      *(buf++) += MULSC(vb, rvol);
+
+   MIXER();
+
+   #undef MIX
+}
+
+END_OF_STATIC_FUNCTION(mix_hq3_16x2_samples);
+
+
+
+/* process_mixer_bus:
+ *  Runs the DSP chain of a submix bus over a block of mixed samples:
+ *  low-pass, then reverb, then the bus volume, which is interpolated
+ *  across the block so that volume changes and ramps don't click.
+ */
+static void process_mixer_bus(MIXER_BUS *bus, signed int *buf, int len)
+{
+   int n = len * mix_channels;
+   int i, j, c, x, y, sum, out;
+   int g, g0, g1, dg;
+
+   /* low-pass filter */
+   if (bus->lowpass) {
+      for (c=0; c<mix_channels; c++) {
+	 y = bus->lowpass_state[c];
+	 for (i=c; i<n; i+=mix_channels) {
+	    y += (int)(((LONG_LONG)(buf[i] - y) * bus->lowpass) >> 16);
+	    buf[i] = y;
+	 }
+	 bus->lowpass_state[c] = y;
+      }
+   }
+
+   /* reverb: a bank of damped feedback comb filters per channel */
+   if ((bus->reverb_wet) && (bus->reverb_buf)) {
+      signed int *line[REVERB_COMBS];
+      signed int *next = bus->reverb_buf;
+
+      for (c=0; c<mix_channels; c++) {
+	 for (j=0; j<REVERB_COMBS; j++) {
+	    line[j] = next;
+	    next += bus->reverb_len[c][j];
+	 }
+
+	 for (i=c; i<n; i+=mix_channels) {
+	    x = buf[i] >> 2;
+	    sum = 0;
+	    for (j=0; j<REVERB_COMBS; j++) {
+	       out = line[j][bus->reverb_pos[c][j]];
+	       bus->reverb_store[c][j] = out + (int)(((LONG_LONG)(bus->reverb_store[c][j] - out) * REVERB_DAMP) >> 16);
+	       line[j][bus->reverb_pos[c][j]] = x + (int)(((LONG_LONG)bus->reverb_store[c][j] * bus->reverb_feedback) >> 16);
+	       if (++bus->reverb_pos[c][j] >= bus->reverb_len[c][j])
+		  bus->reverb_pos[c][j] = 0;
+	       sum += out;
+	    }
+	    buf[i] += (int)(((LONG_LONG)sum * bus->reverb_wet) >> 10);
+	 }
+      }
+   }
+
+   /* bus volume */
+   if (bus->dvol) {
+      bus->vol += bus->dvol * len;
+      if (((bus->dvol > 0) && (bus->vol >= bus->target_vol)) ||
+	  ((bus->dvol < 0) && (bus->vol <= bus->target_vol))) {
+	 bus->vol = bus->target_vol;
+	 bus->dvol = 0;
+      }
+   }
+
+   g0 = bus->gain;
+   g1 = (int)(((LONG_LONG)bus->vol << 4) / 255);
+   bus->gain = g1;
+
+   if ((g0 == 1 << 16) && (g1 == 1 << 16))
+      return;
+
+   g = g0;
+   dg = (g1 - g0) / len;
+
+   for (i=0; i<n; i+=mix_channels) {
+      for (c=0; c<mix_channels; c++)
+	 buf[i+c] = (int)(((LONG_LONG)buf[i+c] * g) >> 16);
+      g += dg;
+   }
+}
+
+END_OF_STATIC_FUNCTION(process_mixer_bus);
+
+
+
+/* mix_voice_slice:
+ *  Mixes len samples of the playing voices from first up to last into
+ *  their buses, starting offset samples into the buffer.
+ */
+static void mix_voice_slice(int offset, int len, int first, int last)
+{
+   signed int *dest;
+   int i;
+
+   mix_phase = (mix_size - offset - len) & (UPDATE_FREQ-1);
+
+   for (i=first; i<last; i++) {
       if (mixer_voice[i].playing) {
+         dest = (mixer_voice[i].bus ? mixer_bus[mixer_voice[i].bus].buf : mix_buffer);
+         dest += offset * mix_channels;
+
          if ((_phys_voice[i].vol > 0) || (_phys_voice[i].dvol > 0)) {
+            /* Sinc interpolated mixing */
+            if (_sound_hq >= 3) {
+               /* stereo input -> sinc interpolated output */
+               if (mixer_voice[i].channels != 1) {
+                  if (mixer_voice[i].bits == 8)
+                     mix_hq3_8x2_samples(mixer_voice+i, _phys_voice+i, dest, len);
+                  else
+                     mix_hq3_16x2_samples(mixer_voice+i, _phys_voice+i, dest, len);
+               }
+               /* mono input -> sinc interpolated output */
+               else {
+                  if (mixer_voice[i].bits == 8)
+                     mix_hq3_8x1_samples(mixer_voice+i, _phys_voice+i, dest, len);
+                  else
+                     mix_hq3_16x1_samples(mixer_voice+i, _phys_voice+i, dest, len);
+               }
+            }
             /* Interpolated mixing */
-            if (_sound_hq >= 2) {
+            else if (_sound_hq >= 2) {
                /* stereo input -> interpolated output */
                if (mixer_voice[i].channels != 1) {
                   if (mixer_voice[i].bits == 8)
-                     mix_hq2_8x2_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_hq2_8x2_samples(mixer_voice+i, _phys_voice+i, dest, len);
                   else
-                     mix_hq2_16x2_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_hq2_16x2_samples(mixer_voice+i, _phys_voice+i, dest, len);
                }
                /* mono input -> interpolated output */
                else {
                   if (mixer_voice[i].bits == 8)
-                     mix_hq2_8x1_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_hq2_8x1_samples(mixer_voice+i, _phys_voice+i, dest, len);
                   else
-                     mix_hq2_16x1_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_hq2_16x1_samples(mixer_voice+i, _phys_voice+i, dest, len);
                }
             }
             /* high quality mixing */
@@ -1107,16 +1860,16 @@ void _mix_some_samples(uintptr_t buf, unsigned short seg, int issigned)
                /* stereo input -> high quality output */
                if (mixer_voice[i].channels != 1) {
                   if (mixer_voice[i].bits == 8)
-                     mix_hq1_8x2_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_hq1_8x2_samples(mixer_voice+i, _phys_voice+i, dest, len);
                   else
-                     mix_hq1_16x2_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_hq1_16x2_samples(mixer_voice+i, _phys_voice+i, dest, len);
                }
                /* mono input -> high quality output */
                else {
                   if (mixer_voice[i].bits == 8)
-                     mix_hq1_8x1_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_hq1_8x1_samples(mixer_voice+i, _phys_voice+i, dest, len);
                   else
-                     mix_hq1_16x1_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_hq1_16x1_samples(mixer_voice+i, _phys_voice+i, dest, len);
                }
             }
             /* low quality (fast?) stereo mixing */
@@ -1124,16 +1877,16 @@ void _mix_some_samples(uintptr_t buf, unsigned short seg, int issigned)
                /* stereo input -> stereo output */
                if (mixer_voice[i].channels != 1) {
                   if (mixer_voice[i].bits == 8)
-                     mix_stereo_8x2_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_stereo_8x2_samples(mixer_voice+i, _phys_voice+i, dest, len);
                   else
-                     mix_stereo_16x2_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_stereo_16x2_samples(mixer_voice+i, _phys_voice+i, dest, len);
                }
                /* mono input -> stereo output */
                else {
                   if (mixer_voice[i].bits == 8)
-                     mix_stereo_8x1_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_stereo_8x1_samples(mixer_voice+i, _phys_voice+i, dest, len);
                   else
-                     mix_stereo_16x1_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_stereo_16x1_samples(mixer_voice+i, _phys_voice+i, dest, len);
                }
             }
             /* low quality (fast?) mono mixing */
@@ -1141,27 +1894,69 @@ void _mix_some_samples(uintptr_t buf, unsigned short seg, int issigned)
                /* stereo input -> mono output */
                if (mixer_voice[i].channels != 1) {
                   if (mixer_voice[i].bits == 8)
-                     mix_mono_8x2_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_mono_8x2_samples(mixer_voice+i, _phys_voice+i, dest, len);
                   else
-                     mix_mono_16x2_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_mono_16x2_samples(mixer_voice+i, _phys_voice+i, dest, len);
                }
                /* mono input -> mono output */
                else {
                   if (mixer_voice[i].bits == 8)
-                     mix_mono_8x1_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_mono_8x1_samples(mixer_voice+i, _phys_voice+i, dest, len);
                   else
-                     mix_mono_16x1_samples(mixer_voice+i, _phys_voice+i, p, mix_size);
+                     mix_mono_16x1_samples(mixer_voice+i, _phys_voice+i, dest, len);
                }
             }
          }
          else
-            mix_silent_samples(mixer_voice+i, _phys_voice+i, mix_size);
+            mix_silent_samples(mixer_voice+i, _phys_voice+i, len);
       }
    }
+}
 
-#ifdef ALLEGRO_LEGACY_MULTITHREADED
-   system_driver->unlock_mutex(mixer_mutex);
-#endif
+END_OF_STATIC_FUNCTION(mix_voice_slice);
+
+
+
+#define MAX_24 (0x00FFFFFF)
+
+/* mix_samples:
+ *  Helper for _mix_some_samples() and _mixer_render(), which mixes the
+ *  voices from first up to last. Called with the mixer mutex held, since
+ *  the mixing buffer is shared by both.
+ */
+static void mix_samples(uintptr_t buf, unsigned short seg, int issigned, int first, int last)
+{
+   signed int *p = mix_buffer;
+   int i, j, pos, n;
+
+   /* clear mixing buffer */
+   memset(p, 0, mix_size*mix_channels * sizeof(*p));
+
+   for (i=1; i<MIXER_MAX_BUSES; i++)
+      if (mixer_bus[i].used)
+         memset(mixer_bus[i].buf, 0, mix_size*mix_channels * sizeof(*p));
+
+   if (mix_sequencer) {
+      /* let the sequencer start and stop voices between slices */
+      for (pos=0; pos<mix_size; pos+=n) {
+         n = mix_sequencer(mix_size - pos);
+         n = MID(1, n, mix_size - pos);
+         mix_voice_slice(pos, n, first, last);
+      }
+   }
+   else
+      mix_voice_slice(0, mix_size, first, last);
+
+   /* run the submix buses into the master bus, then the master bus itself */
+   for (i=1; i<MIXER_MAX_BUSES; i++) {
+      if (mixer_bus[i].used) {
+         process_mixer_bus(mixer_bus+i, mixer_bus[i].buf, mix_size);
+         for (j=0; j<mix_size*mix_channels; j++)
+            p[j] += mixer_bus[i].buf[j];
+      }
+   }
+
+   process_mixer_bus(mixer_bus, p, mix_size);
 
    _farsetsel(seg);
 
@@ -1200,10 +1995,107 @@ void _mix_some_samples(uintptr_t buf, unsigned short seg, int issigned)
    }
 }
 
+END_OF_STATIC_FUNCTION(mix_samples);
+
+
+
+/* _mix_some_samples:
+ *  Mixes samples into a buffer in memory (the buf parameter should be a
+ *  linear offset into the specified segment), using the buffer size, sample
+ *  frequency, etc, set when you called _mixer_init(). This should be called
+ *  by the audio driver to get the next buffer full of samples.
+ */
+void _mix_some_samples(uintptr_t buf, unsigned short seg, int issigned)
+{
+   int i;
+
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->lock_mutex(mixer_mutex);
+#endif
+
+   if (!mix_held) {
+      mix_samples(buf, seg, issigned, 0, mix_voices);
+   }
+   else {
+      /* the mixer is busy rendering offline, so the driver gets silence */
+      _farsetsel(seg);
+
+      if (mix_bits == 16) {
+         for (i=mix_size*mix_channels; i>0; i--) {
+            _farnspokew(buf, (issigned ? 0 : 0x8000));
+            buf += 2;
+         }
+      }
+      else {
+         for (i=mix_size*mix_channels; i>0; i--) {
+            _farnspokeb(buf, (issigned ? 0 : 0x80));
+            buf++;
+         }
+      }
+   }
+
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->unlock_mutex(mixer_mutex);
+#endif
+}
+
 END_OF_FUNCTION(_mix_some_samples);
 
 
 
+/* _mixer_hold:
+ *  Takes the mixer away from the audio driver, which will only get silence
+ *  from _mix_some_samples() until it is given back, so that _mixer_render()
+ *  can run the voices faster than real time. Voices that aren't rendered
+ *  stay where they were while the mixer is held. Since the flag is set
+ *  under the mixer mutex, a buffer that the driver is already mixing is
+ *  finished before this returns.
+ */
+void _mixer_hold(int hold)
+{
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->lock_mutex(mixer_mutex);
+#endif
+
+   mix_held = hold;
+
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->unlock_mutex(mixer_mutex);
+#endif
+}
+
+
+
+/* _mixer_render:
+ *  Mixes the next buffer of num voices starting at first into buf, for
+ *  offline rendering while the mixer is held. The buffer size and format
+ *  are the same as for _mix_some_samples().
+ */
+void _mixer_render(void *buf, int issigned, int first, int num)
+{
+   first = MID(0, first, mix_voices);
+   num = MID(0, num, mix_voices - first);
+
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->lock_mutex(mixer_mutex);
+#endif
+
+   ASSERT(mix_held);
+   mix_samples((uintptr_t)buf, _default_ds(), issigned, first, first+num);
+
+#ifdef ALLEGRO_LEGACY_MULTITHREADED
+   if (mixer_mutex)
+      system_driver->unlock_mutex(mixer_mutex);
+#endif
+}
+
+
+
 /* _mixer_init_voice:
  *  Initialises the specificed voice ready for playing a sample.
  */
@@ -1218,6 +2110,7 @@ void _mixer_init_voice(int voice, AL_CONST SAMPLE *sample)
    mixer_voice[voice].loop_end = sample->loop_end << MIX_FIX_SHIFT;
 
    mixer_voice[voice].data.buffer = sample->data;
+   mixer_voice[voice].bus = 0;
 
    update_mixer_volume(mixer_voice+voice, _phys_voice+voice);
    update_mixer_freq(mixer_voice+voice, _phys_voice+voice);
@@ -1233,14 +2126,16 @@ END_OF_FUNCTION(_mixer_init_voice);
 void _mixer_release_voice(int voice)
 {
 #ifdef ALLEGRO_LEGACY_MULTITHREADED
-   system_driver->lock_mutex(mixer_mutex);
+   if (mixer_mutex)
+      system_driver->lock_mutex(mixer_mutex);
 #endif
 
    mixer_voice[voice].playing = FALSE;
    mixer_voice[voice].data.buffer = NULL;
 
 #ifdef ALLEGRO_LEGACY_MULTITHREADED
-   system_driver->unlock_mutex(mixer_mutex);
+   if (mixer_mutex)
+      system_driver->unlock_mutex(mixer_mutex);
 #endif
 }
 
@@ -1512,6 +2407,33 @@ END_OF_FUNCTION(_mixer_set_vibrato);
 
 
 
+/* _mixer_set_bus:
+ *  Routes a voice to one of the submix buses.
+ */
+void _mixer_set_bus(int voice, int bus)
+{
+   if ((bus < 0) || (bus >= MIXER_MAX_BUSES) || (!mixer_bus[bus].used))
+      bus = 0;
+
+   mixer_voice[voice].bus = bus;
+}
+
+END_OF_FUNCTION(_mixer_set_bus);
+
+
+
+/* _mixer_get_bus:
+ *  Returns the submix bus a voice is routed to.
+ */
+int _mixer_get_bus(int voice)
+{
+   return mixer_voice[voice].bus;
+}
+
+END_OF_FUNCTION(_mixer_get_bus);
+
+
+
 /* mixer_lock_mem:
  *  Locks memory used by the functions in this file.
  */
@@ -1520,11 +2442,16 @@ static void mixer_lock_mem(void)
    LOCK_VARIABLE(mixer_voice);
    LOCK_VARIABLE(mix_buffer);
    LOCK_VARIABLE(mix_vol_table);
+   LOCK_VARIABLE(mix_sinc_table);
+   LOCK_VARIABLE(mixer_bus);
    LOCK_VARIABLE(mix_voices);
    LOCK_VARIABLE(mix_size);
    LOCK_VARIABLE(mix_freq);
    LOCK_VARIABLE(mix_channels);
    LOCK_VARIABLE(mix_bits);
+   LOCK_VARIABLE(mix_sequencer);
+   LOCK_VARIABLE(mix_phase);
+   LOCK_VARIABLE(mix_held);
    LOCK_FUNCTION(set_mixer_quality);
    LOCK_FUNCTION(get_mixer_quality);
    LOCK_FUNCTION(get_mixer_buffer_length);
@@ -1534,6 +2461,8 @@ static void mixer_lock_mem(void)
    LOCK_FUNCTION(get_mixer_voices);
    LOCK_FUNCTION(set_volume_per_voice);
    LOCK_FUNCTION(mix_silent_samples);
+   LOCK_FUNCTION(mix_voice_slice);
+   LOCK_FUNCTION(mix_samples);
    LOCK_FUNCTION(mix_mono_8x1_samples);
    LOCK_FUNCTION(mix_mono_8x2_samples);
    LOCK_FUNCTION(mix_mono_16x1_samples);
@@ -1550,6 +2479,10 @@ static void mixer_lock_mem(void)
    LOCK_FUNCTION(mix_hq2_8x2_samples);
    LOCK_FUNCTION(mix_hq2_16x1_samples);
    LOCK_FUNCTION(mix_hq2_16x2_samples);
+   LOCK_FUNCTION(mix_hq3_8x1_samples);
+   LOCK_FUNCTION(mix_hq3_8x2_samples);
+   LOCK_FUNCTION(mix_hq3_16x1_samples);
+   LOCK_FUNCTION(mix_hq3_16x2_samples);
    LOCK_FUNCTION(update_mixer_volume);
    LOCK_FUNCTION(update_mixer);
    LOCK_FUNCTION(update_silent_mixer);
@@ -1576,4 +2509,10 @@ static void mixer_lock_mem(void)
    LOCK_FUNCTION(_mixer_set_echo);
    LOCK_FUNCTION(_mixer_set_tremolo);
    LOCK_FUNCTION(_mixer_set_vibrato);
+   LOCK_FUNCTION(_mixer_set_bus);
+   LOCK_FUNCTION(_mixer_get_bus);
+   LOCK_FUNCTION(set_mixer_bus_volume);
+   LOCK_FUNCTION(ramp_mixer_bus_volume);
+   LOCK_FUNCTION(get_mixer_bus_volume);
+   LOCK_FUNCTION(process_mixer_bus);
 }
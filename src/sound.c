@@ -846,66 +846,444 @@ void lock_sample(SAMPLE *spl)
 
 
 
-/* load_voc:
- *  Reads a mono VOC format sample file, returning a SAMPLE structure, 
- *  or NULL on error.
+/* LAZY_SAMPLE:
+ *  A sample whose data stays on disk until it is first played. The SAMPLE
+ *  must come first, so that the SAMPLE pointer handed to the user is also
+ *  the address of the whole record.
  */
-SAMPLE *load_voc(AL_CONST char *filename)
+typedef struct LAZY_SAMPLE
+{
+   SAMPLE spl;
+   char *filename;                     /* where to reload the data from */
+   long offset;                        /* start of the data in the file */
+   long time;                          /* last played, for eviction */
+   int voices;                         /* voices using it, kept resident */
+   struct LAZY_SAMPLE *next;           /* hash chain */
+} LAZY_SAMPLE;
+
+#define LAZY_HASH_SIZE     257
+
+static void *lazy_mutex = NULL;       /* protects everything below */
+static LAZY_SAMPLE *lazy_hash[LAZY_HASH_SIZE];
+static int lazy_count = 0;
+static int lazy_loading = FALSE;
+static long lazy_budget = 0;
+static long lazy_resident = 0;
+static long lazy_clock = 0;
+
+
+
+/* lock_lazy_samples:
+ *  Locks the lazy sample records, which are reached from the loading
+ *  threads and from voices started by the timer and mixer threads.
+ */
+static INLINE void lock_lazy_samples(void)
+{
+   if (lazy_mutex)
+      _al_lock_mutex(lazy_mutex);
+}
+
+
+
+/* unlock_lazy_samples:
+ *  Unlocks the lazy sample records.
+ */
+static INLINE void unlock_lazy_samples(void)
+{
+   if (lazy_mutex)
+      _al_unlock_mutex(lazy_mutex);
+}
+
+
+
+/* sample_data_size:
+ *  Returns the number of bytes of data held by a sample.
+ */
+static INLINE long sample_data_size(AL_CONST SAMPLE *spl)
 {
+   return spl->len * ((spl->bits==8) ? 1 : sizeof(short)) * ((spl->stereo) ? 2 : 1);
+}
+
+
+
+/* lazy_slot:
+ *  Returns the hash chain a sample belongs on.
+ */
+static INLINE LAZY_SAMPLE **lazy_slot(AL_CONST SAMPLE *spl)
+{
+   return lazy_hash + ((uintptr_t)spl >> 4) % LAZY_HASH_SIZE;
+}
+
+
+
+/* find_lazy_sample:
+ *  Returns the lazy record for a sample, or NULL if it was loaded normally.
+ */
+static LAZY_SAMPLE *find_lazy_sample(AL_CONST SAMPLE *spl)
+{
+   LAZY_SAMPLE *iter;
+
+   if (!lazy_count)
+      return NULL;
+
+   for (iter = *lazy_slot(spl); iter; iter = iter->next)
+      if (&iter->spl == spl)
+	 return iter;
+
+   return NULL;
+}
+
+
+
+/* evict_lazy_samples:
+ *  Drops the data of the least recently played lazy samples until the
+ *  resident total fits the budget. Samples that are pinned by a voice
+ *  are never dropped, nor is the one given as keep.
+ */
+static void evict_lazy_samples(LAZY_SAMPLE *keep)
+{
+   LAZY_SAMPLE *iter, *oldest;
+   int c;
+
+   while ((lazy_budget > 0) && (lazy_resident > lazy_budget)) {
+      oldest = NULL;
+
+      for (c=0; c<LAZY_HASH_SIZE; c++) {
+	 for (iter = lazy_hash[c]; iter; iter = iter->next) {
+	    if ((iter == keep) || (!iter->spl.data) || (iter->voices))
+	       continue;
+	    if ((!oldest) || (iter->time < oldest->time))
+	       oldest = iter;
+	 }
+      }
+
+      if (!oldest)
+	 break;
+
+      lazy_resident -= sample_data_size(&oldest->spl);
+      _AL_FREE(oldest->spl.data);
+      oldest->spl.data = NULL;
+   }
+}
+
+
+
+/* read_sample_data:
+ *  Reads raw little-endian PCM into a sample, converting 16 bit data from
+ *  signed to Allegro's unsigned format. Returns zero on success.
+ */
+static int read_sample_data(PACKFILE *f, SAMPLE *spl, long size)
+{
+   unsigned char *src = spl->data;
+   unsigned short *dst = spl->data;
+   long i;
+
+   if (pack_fread(spl->data, size, f) < size)
+      return -1;
+
+   if (spl->bits == 16) {
+      for (i=0; i<size/2; i++)
+	 dst[i] = (src[i*2] | (src[i*2+1] << 8)) ^ 0x8000;
+   }
+
+   return 0;
+}
+
+
+
+/* load_lazy_sample:
+ *  Brings the data of a lazy sample into memory. Called with the records
+ *  locked, but unlocks them while reading the file, so that voices can
+ *  still be started meanwhile. Returns zero on success.
+ */
+static int load_lazy_sample(LAZY_SAMPLE *lazy)
+{
+   SAMPLE spl;
    PACKFILE *f;
-   SAMPLE *spl;
-   ASSERT(filename);
+   long size;
+   int ret = -1;
 
-   f = pack_fopen(filename, F_READ);
-   if (!f) 
+   lazy->time = ++lazy_clock;
+
+   if (lazy->spl.data)
+      return 0;
+
+   spl = lazy->spl;
+   size = sample_data_size(&spl);
+
+   unlock_lazy_samples();
+
+   spl.data = _AL_MALLOC_ATOMIC(size);
+
+   if (spl.data) {
+      f = pack_fopen(lazy->filename, F_READ);
+      if (f) {
+	 if ((pack_fseek(f, lazy->offset) == 0) && (read_sample_data(f, &spl, size) == 0))
+	    ret = 0;
+	 pack_fclose(f);
+      }
+   }
+
+   lock_lazy_samples();
+
+   if (ret != 0) {
+      if (spl.data)
+	 _AL_FREE(spl.data);
+      return -1;
+   }
+
+   /* another thread may have read it while we were */
+   if (lazy->spl.data) {
+      _AL_FREE(spl.data);
+      return 0;
+   }
+
+   lazy->spl.data = spl.data;
+
+   lazy_resident += size;
+   evict_lazy_samples(lazy);
+
+   return 0;
+}
+
+
+
+/* create_lazy_sample:
+ *  Creates a sample whose data will be read from the given file offset
+ *  the first time it is played.
+ */
+static SAMPLE *create_lazy_sample(AL_CONST char *filename, long offset, int bits, int stereo, int freq, int len)
+{
+   LAZY_SAMPLE *lazy, **slot;
+
+   lazy = _AL_MALLOC(sizeof(LAZY_SAMPLE));
+   if (!lazy)
       return NULL;
 
-   spl = load_voc_pf(f);
+   lazy->filename = _al_strdup(filename);
+   if (!lazy->filename) {
+      _AL_FREE(lazy);
+      return NULL;
+   }
 
-   pack_fclose(f);
+   lazy->spl.bits = bits;
+   lazy->spl.stereo = stereo;
+   lazy->spl.freq = freq;
+   lazy->spl.priority = 128;
+   lazy->spl.len = len;
+   lazy->spl.loop_start = 0;
+   lazy->spl.loop_end = len;
+   lazy->spl.param = 0;
+   lazy->spl.data = NULL;
+   lazy->offset = offset;
+   lazy->time = 0;
+   lazy->voices = 0;
+
+   lock_lazy_samples();
+
+   slot = lazy_slot(&lazy->spl);
+   lazy->next = *slot;
+   *slot = lazy;
+   lazy_count++;
+
+   unlock_lazy_samples();
+
+   return &lazy->spl;
+}
 
-   return spl;
+
+
+/* pin_lazy_sample:
+ *  Makes sure the data of a sample is in memory before a voice is set to
+ *  play it, reading it in if the sample was loaded lazily. The data is
+ *  loaded and pinned under the same lock, so that it can't be evicted
+ *  before the voice refers to it. Returns zero on success.
+ */
+static int pin_lazy_sample(AL_CONST SAMPLE *spl)
+{
+   LAZY_SAMPLE *lazy;
+   int ret = 0;
+
+   lock_lazy_samples();
+
+   lazy = find_lazy_sample(spl);
+   if (lazy) {
+      if (load_lazy_sample(lazy) == 0)
+	 lazy->voices++;
+      else
+	 ret = -1;
+   }
+
+   unlock_lazy_samples();
+
+   return ret;
 }
 
 
 
-/* load_voc_pf:
- *  Reads a mono VOC format sample from the packfile given, returning a
- *  SAMPLE structure, or NULL on error. If successful the offset into the
- *  file will be left just after the sample data. If unsuccessful the offset
- *  into the file is unspecified, i.e. you must either reset the offset to
- *  some known place or close the packfile. The packfile is not closed by
- *  this function.
+/* unpin_lazy_sample:
+ *  Lets the data of a lazy sample be evicted again once a voice that was
+ *  pinning it no longer refers to it.
  */
-SAMPLE *load_voc_pf(PACKFILE *f)
+static void unpin_lazy_sample(AL_CONST SAMPLE *spl)
+{
+   LAZY_SAMPLE *lazy;
+
+   if (!spl)
+      return;
+
+   lock_lazy_samples();
+
+   lazy = find_lazy_sample(spl);
+   if ((lazy) && (lazy->voices > 0))
+      lazy->voices--;
+
+   unlock_lazy_samples();
+}
+
+
+
+/* clear_voice_sample:
+ *  Detaches a virtual voice from its sample.
+ */
+static void clear_voice_sample(VOICE *voice)
+{
+   unpin_lazy_sample(voice->sample);
+   voice->sample = NULL;
+}
+
+
+
+/* destroy_lazy_sample:
+ *  Unlinks a lazy sample as it is destroyed, returning TRUE if it was one.
+ */
+static int destroy_lazy_sample(SAMPLE *spl)
+{
+   LAZY_SAMPLE **slot, *lazy;
+   int ret = FALSE;
+
+   lock_lazy_samples();
+
+   if (lazy_count) {
+      for (slot = lazy_slot(spl); *slot; slot = &(*slot)->next) {
+	 if (&(*slot)->spl == spl) {
+	    lazy = *slot;
+	    *slot = lazy->next;
+	    lazy_count--;
+
+	    if (spl->data)
+	       lazy_resident -= sample_data_size(spl);
+
+	    _AL_FREE(lazy->filename);
+	    ret = TRUE;
+	    break;
+	 }
+      }
+   }
+
+   unlock_lazy_samples();
+
+   return ret;
+}
+
+
+
+/* set_lazy_sample_loading:
+ *  Turns lazy loading on or off for load_wav() and load_voc(). Samples
+ *  loaded while it is on only read their headers; the data is read the
+ *  first time they are played. Whenever the data of lazy samples exceeds
+ *  budget bytes (zero meaning no limit), the least recently played ones
+ *  that aren't attached to a voice are dropped again.
+ */
+void set_lazy_sample_loading(int enable, long budget)
+{
+   lock_lazy_samples();
+
+   lazy_loading = enable;
+   lazy_budget = MAX(budget, 0);
+   evict_lazy_samples(NULL);
+
+   unlock_lazy_samples();
+}
+
+
+
+/* get_lazy_sample_memory:
+ *  Returns the number of bytes of lazy sample data currently in memory.
+ */
+long get_lazy_sample_memory(void)
+{
+   long size;
+
+   lock_lazy_samples();
+   size = lazy_resident;
+   unlock_lazy_samples();
+
+   return size;
+}
+
+
+
+/* exit_lazy_samples:
+ *  Destroys the lock of the lazy sample records when Allegro shuts down.
+ */
+static void exit_lazy_samples(void)
+{
+   _al_destroy_mutex(lazy_mutex);
+   lazy_mutex = NULL;
+
+   _remove_exit_func(exit_lazy_samples);
+}
+
+
+
+/* _init_lazy_samples:
+ *  Creates the lock of the lazy sample records. Called by allegro_init(),
+ *  before any other thread can get at them.
+ */
+void _init_lazy_samples(void)
+{
+   if (lazy_mutex)
+      return;
+
+   lazy_mutex = _al_create_mutex();
+   if (lazy_mutex)
+      _add_exit_func(exit_lazy_samples, "exit_lazy_samples");
+}
+
+
+
+/* read_voc_header:
+ *  Reads the header of a mono VOC file, up to the start of its sample data.
+ *  Returns the length of the data in bytes, or -1 on error.
+ */
+static long read_voc_header(PACKFILE *f, int *bits, int *freq, long *offset)
 {
    char buffer[30];
-   int freq = 22050;
-   int bits = 8;
-   SAMPLE *spl = NULL;
-   int len;
+   long len;
    int x, ver;
-   int s;
-   ASSERT(f);
+
+   *bits = 8;
+   *freq = 22050;
 
    memset(buffer, 0, sizeof buffer);
 
    pack_fread(buffer, 0x16, f);
 
    if (memcmp(buffer, "Creative Voice File", 0x13))
-      goto getout;
+      return -1;
 
    ver = pack_igetw(f);
    if (ver != 0x010A && ver != 0x0114) /* version: should be 0x010A or 0x0114 */
-      goto getout;
+      return -1;
 
    ver = pack_igetw(f);
    if (ver != 0x1129 && ver != 0x111f) /* subversion: should be 0x1129 or 0x111f */
-      goto getout;
+      return -1;
 
    ver = pack_getc(f);
    if (ver != 0x01 && ver != 0x09)     /* sound data: should be 0x01 or 0x09 */
-      goto getout;
+      return -1;
 
    len = pack_igetw(f);                /* length is three bytes long: two */
    x = pack_getc(f);                   /* .. and one byte */
@@ -915,79 +1293,58 @@ SAMPLE *load_voc_pf(PACKFILE *f)
    if (ver == 0x01) {                  /* block type 1 */
       len -= 2;                        /* sub. size of the rest of block header */
       x = pack_getc(f);                /* one byte of frequency */
-      freq = 1000000 / (256-x);
+      *freq = 1000000 / (256-x);
 
       x = pack_getc(f);                /* skip one byte */
 
-      spl = create_sample(8, FALSE, freq, len);
-
-      if (spl) {
-	 if (pack_fread(spl->data, len, f) < len) {
-	    destroy_sample(spl);
-	    spl = NULL;
-	 }
-      }
+      *offset = 0x20;
    }
    else {                              /* block type 9 */
       len -= 12;                       /* sub. size of the rest of block header */
-      freq = pack_igetw(f);            /* two bytes of frequency */
+      *freq = pack_igetw(f);           /* two bytes of frequency */
 
       x = pack_igetw(f);               /* skip two bytes */
 
-      bits = pack_getc(f);             /* # of bits per sample */
-      if (bits != 8 && bits != 16)
-	 goto getout;
+      *bits = pack_getc(f);            /* # of bits per sample */
+      if (*bits != 8 && *bits != 16)
+	 return -1;
 
       x = pack_getc(f);
       if (x != 1)                      /* # of channels: should be mono */
-	 goto getout;
+	 return -1;
 
       pack_fread(buffer, 0x6, f);      /* skip 6 bytes of unknown data */
 
-      spl = create_sample(bits, FALSE, freq, len*8/bits);
-
-      if (spl) {
-	 if (bits == 8) {
-	    if (pack_fread(spl->data, len, f) < len) {
-	       destroy_sample(spl);
-	       spl = NULL;
-	    }
-	 }
-	 else {
-	    len /= 2;
-	    for (x=0; x<len; x++) {
-	       if ((s = pack_igetw(f)) == EOF) {
-		  destroy_sample(spl);
-		  spl = NULL;
-		  break;
-	       }
-	       ((signed short *)spl->data)[x] = (signed short)s^0x8000;
-	    }
-	 }
-      }
+      *offset = 0x2A;
    }
 
-   getout: 
-   return spl;
+   return len;
 }
 
 
 
-/* load_wav:
- *  Reads a RIFF WAV format sample file, returning a SAMPLE structure, 
+/* load_voc:
+ *  Reads a mono VOC format sample file, returning a SAMPLE structure, 
  *  or NULL on error.
  */
-SAMPLE *load_wav(AL_CONST char *filename)
+SAMPLE *load_voc(AL_CONST char *filename)
 {
    PACKFILE *f;
    SAMPLE *spl;
+   long len, offset;
+   int bits, freq;
    ASSERT(filename);
 
    f = pack_fopen(filename, F_READ);
-   if (!f)
+   if (!f) 
       return NULL;
 
-   spl = load_wav_pf(f);
+   if (lazy_loading) {
+      len = read_voc_header(f, &bits, &freq, &offset);
+      spl = (len > 0) ? create_lazy_sample(filename, offset, bits, FALSE, freq, len*8/bits) : NULL;
+   }
+   else
+      spl = load_voc_pf(f);
 
    pack_fclose(f);
 
@@ -996,104 +1353,201 @@ SAMPLE *load_wav(AL_CONST char *filename)
 
 
 
-/* load_wav_pf:
- *  Reads a RIFF WAV format sample from the packfile given, returning a
- *  SAMPLE structure, or NULL on error.
- *
- *  Note that the loader does not stop reading bytes from the PACKFILE until
- *  it sees the EOF. If you want to embed a WAV file into another file, you
- *  will have to implement your own chunking system that stops reading at the
- *  end of the chunk.
- *
- *  If unsuccessful the offset into the file is unspecified, i.e. you must
- *  either reset the offset to some known place or close the packfile. The
- *  packfile is not closed by this function.
+/* load_voc_pf:
+ *  Reads a mono VOC format sample from the packfile given, returning a
+ *  SAMPLE structure, or NULL on error. If successful the offset into the
+ *  file will be left just after the sample data. If unsuccessful the offset
+ *  into the file is unspecified, i.e. you must either reset the offset to
+ *  some known place or close the packfile. The packfile is not closed by
+ *  this function.
  */
-SAMPLE *load_wav_pf(PACKFILE *f)
+SAMPLE *load_voc_pf(PACKFILE *f)
+{
+   SAMPLE *spl;
+   long len, offset;
+   int bits, freq;
+   ASSERT(f);
+
+   len = read_voc_header(f, &bits, &freq, &offset);
+   if (len <= 0)
+      return NULL;
+
+   spl = create_sample(bits, FALSE, freq, len*8/bits);
+
+   if ((spl) && (read_sample_data(f, spl, sample_data_size(spl)) != 0)) {
+      destroy_sample(spl);
+      spl = NULL;
+   }
+
+   return spl;
+}
+
+
+
+/* read_wav_header:
+ *  Reads RIFF WAV chunks up to the start of the PCM data. Returns the length
+ *  of the data chunk in bytes, or -1 on error.
+ */
+static long read_wav_header(PACKFILE *f, int *bits, int *stereo, int *freq, long *offset)
 {
    char buffer[25];
    int i;
-   int length, len;
-   int freq = 22050;
-   int bits = 8;
+   long length;
    int channels = 1;
-   int s;
-   SAMPLE *spl = NULL;
-   ASSERT(f);
+
+   *bits = 8;
+   *freq = 22050;
+   *offset = 12;
 
    memset(buffer, 0, sizeof buffer);
 
    pack_fread(buffer, 12, f);          /* check RIFF header */
    if (memcmp(buffer, "RIFF", 4) || memcmp(buffer+8, "WAVE", 4))
-      goto getout;
+      return -1;
 
    while (TRUE) {
       if (pack_fread(buffer, 4, f) != 4)
-	 break;
+	 return -1;
 
       length = pack_igetl(f);          /* read chunk length */
+      *offset += 8;
 
       if (memcmp(buffer, "fmt ", 4) == 0) {
 	 i = pack_igetw(f);            /* should be 1 for PCM data */
 	 length -= 2;
 	 if (i != 1) 
-	    goto getout;
+	    return -1;
 
 	 channels = pack_igetw(f);     /* mono or stereo data */
 	 length -= 2;
 	 if ((channels != 1) && (channels != 2))
-	    goto getout;
+	    return -1;
 
-	 freq = pack_igetl(f);         /* sample frequency */
+	 *freq = pack_igetl(f);        /* sample frequency */
 	 length -= 4;
 
 	 pack_igetl(f);                /* skip six bytes */
 	 pack_igetw(f);
 	 length -= 6;
 
-	 bits = pack_igetw(f);         /* 8 or 16 bit data? */
+	 *bits = pack_igetw(f);        /* 8 or 16 bit data? */
 	 length -= 2;
-	 if ((bits != 8) && (bits != 16))
-	    goto getout;
+	 if ((*bits != 8) && (*bits != 16))
+	    return -1;
+
+	 *offset += 16;
       }
       else if (memcmp(buffer, "data", 4) == 0) {
-	 if (channels == 2) {
-	    /* allocate enough space even if length is odd for some reason */
-	    len = (length + 1) / 2;
-	 }
-	 else {
-	    ASSERT(channels == 1);
-	    len = length;
-	 }
+	 *stereo = (channels == 2);
+	 return length;
+      }
 
-	 if (bits == 16)
-	    len /= 2;
+      while (length > 0) {             /* skip the remainder of the chunk */
+	 if (pack_getc(f) == EOF)
+	    break;
 
-	 spl = create_sample(bits, ((channels == 2) ? TRUE : FALSE), freq, len);
+	 length--;
+	 (*offset)++;
+      }
+   }
+}
 
-	 if (spl) {
-	    if (bits == 8) {
-	       if (pack_fread(spl->data, length, f) < length) {
-		  destroy_sample(spl);
-		  spl = NULL;
-	       }
-	    }
-	    else {
-	       for (i=0; i<len*channels; i++) {
-		  if ((s = pack_igetw(f)) == EOF) {
-		     destroy_sample(spl);
-		     spl = NULL;
-		     break;
-		  }
-		  ((signed short *)spl->data)[i] = (signed short)s^0x8000;
-	       }
-	    }
 
-	    length = 0;
-	 }
-      }
 
-      while (length > 0) {             /* skip the remainder of the chunk */
+/* wav_sample_len:
+ *  Works out how many sample frames a WAV data chunk holds.
+ */
+static int wav_sample_len(long length, int bits, int stereo)
+{
+   int len;
+
+   if (stereo) {
+      /* allocate enough space even if length is odd for some reason */
+      len = (length + 1) / 2;
+   }
+   else
+      len = length;
+
+   if (bits == 16)
+      len /= 2;
+
+   return len;
+}
+
+
+
+/* load_wav:
+ *  Reads a RIFF WAV format sample file, returning a SAMPLE structure, 
+ *  or NULL on error.
+ */
+SAMPLE *load_wav(AL_CONST char *filename)
+{
+   PACKFILE *f;
+   SAMPLE *spl;
+   long length, offset;
+   int bits, stereo, freq;
+   ASSERT(filename);
+
+   f = pack_fopen(filename, F_READ);
+   if (!f)
+      return NULL;
+
+   if (lazy_loading) {
+      length = read_wav_header(f, &bits, &stereo, &freq, &offset);
+      if (length > 0)
+	 spl = create_lazy_sample(filename, offset, bits, stereo, freq, wav_sample_len(length, bits, stereo));
+      else
+	 spl = NULL;
+   }
+   else
+      spl = load_wav_pf(f);
+
+   pack_fclose(f);
+
+   return spl;
+}
+
+
+
+/* load_wav_pf:
+ *  Reads a RIFF WAV format sample from the packfile given, returning a
+ *  SAMPLE structure, or NULL on error.
+ *
+ *  Note that the loader does not stop reading bytes from the PACKFILE until
+ *  it sees the EOF. If you want to embed a WAV file into another file, you
+ *  will have to implement your own chunking system that stops reading at the
+ *  end of the chunk.
+ *
+ *  If unsuccessful the offset into the file is unspecified, i.e. you must
+ *  either reset the offset to some known place or close the packfile. The
+ *  packfile is not closed by this function.
+ */
+SAMPLE *load_wav_pf(PACKFILE *f)
+{
+   char buffer[4];
+   long length, offset;
+   int bits, stereo, freq;
+   SAMPLE *spl;
+   ASSERT(f);
+
+   length = read_wav_header(f, &bits, &stereo, &freq, &offset);
+   if (length < 0)
+      return NULL;
+
+   spl = create_sample(bits, stereo, freq, wav_sample_len(length, bits, stereo));
+   if (!spl)
+      return NULL;
+
+   if (read_sample_data(f, spl, MIN(length, sample_data_size(spl))) != 0) {
+      destroy_sample(spl);
+      return NULL;
+   }
+
+   /* skip any chunks after the data */
+   while (pack_fread(buffer, 4, f) == 4) {
+      length = pack_igetl(f);
+
+      while (length > 0) {
 	 if (pack_getc(f) == EOF)
 	    break;
 
@@ -1101,7 +1555,6 @@ SAMPLE *load_wav_pf(PACKFILE *f)
       }
    }
 
-   getout:
    return spl;
 }
 
@@ -1150,6 +1603,8 @@ void destroy_sample(SAMPLE *spl)
    if (spl) {
       stop_sample(spl);
 
+      destroy_lazy_sample(spl);
+
       if (spl->data) {
 	 UNLOCK_DATA(spl->data, spl->len * ((spl->bits==8) ? 1 : sizeof(short)) * ((spl->stereo) ? 2 : 1));
 	 _AL_FREE(spl->data);
@@ -1282,7 +1737,7 @@ static INLINE int allocate_physical_voice(int priority)
       voice = virt_voice + _phys_voice[c].num;
       if ((voice->autokill) && (digi_driver->get_position(c) < 0)) {
 	 digi_driver->release_voice(c);
-	 voice->sample = NULL;
+	 clear_voice_sample(voice);
 	 voice->num = -1;
 	 _phys_voice[c].num = -1;
 	 return c;
@@ -1347,14 +1802,14 @@ static INLINE int allocate_virtual_voice(void)
    for (c=0; c<num_virt_voices; c++) {
       if (virt_voice[c].autokill) {
 	 if (virt_voice[c].num < 0) {
-	    virt_voice[c].sample = NULL;
+	    clear_voice_sample(virt_voice+c);
 	    return c;
 	 }
 	 else {
 	    if (digi_driver->get_position(virt_voice[c].num) < 0) {
 	       digi_driver->release_voice(virt_voice[c].num);
 	       _phys_voice[virt_voice[c].num].num = -1;
-	       virt_voice[c].sample = NULL;
+	       clear_voice_sample(virt_voice+c);
 	       virt_voice[c].num = -1;
 	       return c;
 	    }
@@ -1380,11 +1835,17 @@ int allocate_voice(AL_CONST SAMPLE *spl)
 {
    int phys, virt;
    ASSERT(spl);
-   
+
+   /* bring in the data of a lazily loaded sample */
+   if (pin_lazy_sample(spl) != 0)
+      return -1;
+
    phys = allocate_physical_voice(spl->priority);
    virt = allocate_virtual_voice();
 
-   if (virt >= 0) {
+   if (virt < 0)
+      unpin_lazy_sample(spl);
+   else {
       virt_voice[virt].sample = spl;
       virt_voice[virt].num = phys;
       virt_voice[virt].autokill = FALSE;
@@ -1426,7 +1887,7 @@ void deallocate_voice(int voice)
       virt_voice[voice].num = -1;
    }
 
-   virt_voice[voice].sample = NULL;
+   clear_voice_sample(virt_voice+voice);
 }
 
 END_OF_FUNCTION(deallocate_voice);
@@ -1442,6 +1903,11 @@ void reallocate_voice(int voice, AL_CONST SAMPLE *spl)
    ASSERT(spl);
    ASSERT(voice >= 0 && voice < VIRTUAL_VOICES);
 
+   /* bring in the data of a lazily loaded sample, leaving the voice as it
+      was if that can't be done */
+   if (pin_lazy_sample(spl) != 0)
+      return;
+
    phys =  virt_voice[voice].num;
 
    if (phys >= 0) {
@@ -1449,6 +1915,7 @@ void reallocate_voice(int voice, AL_CONST SAMPLE *spl)
       digi_driver->release_voice(phys);
    }
 
+   unpin_lazy_sample(virt_voice[voice].sample);
    virt_voice[voice].sample = spl;
    virt_voice[voice].autokill = FALSE;
    virt_voice[voice].time = retrace_count;
@@ -1922,6 +2389,38 @@ END_OF_FUNCTION(voice_set_vibrato);
 
 
 
+/* voice_set_bus:
+ *  Routes a voice to one of the mixer's submix buses. This only does
+ *  anything with drivers that use the software mixer.
+ */
+void voice_set_bus(int voice, int bus)
+{
+   ASSERT(voice >= 0 && voice < VIRTUAL_VOICES);
+   if ((virt_voice[voice].num >= 0) && (digi_driver->init_voice == _mixer_init_voice))
+      _mixer_set_bus(virt_voice[voice].num, bus);
+}
+
+END_OF_FUNCTION(voice_set_bus);
+
+
+
+/* voice_get_bus:
+ *  Returns the submix bus a voice is routed to, or -1 if the voice has
+ *  been deallocated or the driver doesn't use the software mixer.
+ */
+int voice_get_bus(int voice)
+{
+   ASSERT(voice >= 0 && voice < VIRTUAL_VOICES);
+   if ((virt_voice[voice].num >= 0) && (digi_driver->init_voice == _mixer_init_voice))
+      return _mixer_get_bus(virt_voice[voice].num);
+
+   return -1;
+}
+
+END_OF_FUNCTION(voice_get_bus);
+
+
+
 /* update_sweeps:
  *  Timer callback routine used to implement volume/frequency/pan sweep 
  *  effects, for those drivers that can't do them directly.
@@ -2128,6 +2627,8 @@ static void sound_lock_mem(void)
    LOCK_FUNCTION(voice_set_echo);
    LOCK_FUNCTION(voice_set_tremolo);
    LOCK_FUNCTION(voice_set_vibrato);
+   LOCK_FUNCTION(voice_set_bus);
+   LOCK_FUNCTION(voice_get_bus);
    LOCK_FUNCTION(update_sweeps);
    LOCK_FUNCTION(read_sound_input);
 }
@@ -16,6 +16,8 @@
  */
 
 
+#include <string.h>
+
 #include "allegro.h"
 #include "allegro/internal/aintern.h"
 
@@ -194,3 +196,668 @@ void free_audio_stream_buffer(AUDIOSTREAM *stream)
    if (voice_get_position(stream->voice) == -1)
       voice_start(stream->voice);
 }
+
+
+
+#define SAMPLE_STREAM_AHEAD   4
+
+
+
+typedef struct SAMPLE_STREAM_TYPE_INFO
+{
+   char *ext;
+   AL_CONST SAMPLE_STREAM_VTABLE *vtable;
+   struct SAMPLE_STREAM_TYPE_INFO *next;
+} SAMPLE_STREAM_TYPE_INFO;
+
+static SAMPLE_STREAM_TYPE_INFO *sample_stream_type_list = NULL;
+
+
+
+static SAMPLE_STREAM *sample_stream_list = NULL;
+static void *stream_mutex = NULL;         /* protects the list above */
+
+
+
+/* exit_sample_streams:
+ *  Destroys the lock of the playing stream list when Allegro shuts down.
+ */
+static void exit_sample_streams(void)
+{
+   _al_destroy_mutex(stream_mutex);
+   stream_mutex = NULL;
+
+   _remove_exit_func(exit_sample_streams);
+}
+
+
+
+/* _init_sample_streams:
+ *  Creates the lock of the playing stream list. Called by allegro_init(),
+ *  before any timer can get at it.
+ */
+void _init_sample_streams(void)
+{
+   if (stream_mutex)
+      return;
+
+   stream_mutex = _al_create_mutex();
+   if (stream_mutex)
+      _add_exit_func(exit_sample_streams, "exit_sample_streams");
+}
+
+
+
+/* sample_stream_type_exit:
+ *  Frees the list of registered sample stream types.
+ */
+static void sample_stream_type_exit(void)
+{
+   SAMPLE_STREAM_TYPE_INFO *iter = sample_stream_type_list, *next;
+
+   while (iter) {
+      next = iter->next;
+      _AL_FREE(iter->ext);
+      _AL_FREE(iter);
+      iter = next;
+   }
+
+   sample_stream_type_list = NULL;
+
+   _remove_exit_func(sample_stream_type_exit);
+}
+
+
+
+/* register_sample_stream_type:
+ *  Informs Allegro of a new streamable sample file type, telling it which
+ *  decoder to use for files with the given extension. Later registrations
+ *  take precedence over earlier ones.
+ */
+void register_sample_stream_type(AL_CONST char *ext, AL_CONST SAMPLE_STREAM_VTABLE *vtable)
+{
+   char tmp[32], *aext;
+   SAMPLE_STREAM_TYPE_INFO *iter;
+   ASSERT(ext);
+   ASSERT(vtable);
+
+   aext = uconvert_toascii(ext, tmp);
+   if (strlen(aext) == 0)
+      return;
+
+   iter = _AL_MALLOC(sizeof(SAMPLE_STREAM_TYPE_INFO));
+   if (!iter)
+      return;
+
+   if (!sample_stream_type_list)
+      _add_exit_func(sample_stream_type_exit, "sample_stream_type_exit");
+
+   iter->ext = _al_strdup(aext);
+   iter->vtable = vtable;
+   iter->next = sample_stream_type_list;
+   sample_stream_type_list = iter;
+}
+
+
+
+/* find_sample_stream_type:
+ *  Looks up the decoder for a filename, registering the built-in types
+ *  the first time it is needed.
+ */
+static AL_CONST SAMPLE_STREAM_VTABLE *find_sample_stream_type(AL_CONST char *filename)
+{
+   char tmp[32], *aext;
+   SAMPLE_STREAM_TYPE_INFO *iter;
+
+   if (!sample_stream_type_list)
+      register_sample_stream_type(uconvert_ascii("wav", tmp), &sample_stream_wav);
+
+   aext = uconvert_toascii(get_extension(filename), tmp);
+
+   for (iter = sample_stream_type_list; iter; iter = iter->next) {
+      if (stricmp(iter->ext, aext) == 0)
+	 return iter->vtable;
+   }
+
+   return NULL;
+}
+
+
+
+/* fill_silence:
+ *  Fills a number of sample frames with silence.
+ */
+static void fill_silence(void *buf, int bits, int stereo, long len)
+{
+   long i;
+
+   len *= (stereo) ? 2 : 1;
+
+   if (bits == 16) {
+      unsigned short *p = buf;
+      for (i=0; i<len; i++)
+	 p[i] = 0x8000;
+   }
+   else
+      memset(buf, 0x80, len);
+}
+
+
+
+/* sample_stream_reopen:
+ *  Moves the decoder to the given frame. If the decoder can't get there by
+ *  itself (most can only skip forwards) and we know the filename, the file
+ *  is opened again and decoding starts over. Returns zero on success.
+ */
+static int sample_stream_reopen(SAMPLE_STREAM *s, long pos)
+{
+   int bits, stereo, freq;
+
+   if ((s->data) && (s->vtable->seek) && (s->vtable->seek(s->data, pos) == 0))
+      return 0;
+
+   if (!s->filename)
+      return -1;
+
+   if (s->data)
+      s->vtable->close(s->data);
+   s->data = NULL;
+
+   if (s->f)
+      pack_fclose(s->f);
+
+   s->f = pack_fopen(s->filename, F_READ);
+   if (!s->f)
+      return -1;
+
+   s->data = s->vtable->open(s->f, &bits, &stereo, &freq);
+   if (!s->data)
+      return -1;
+
+   if ((bits != s->bits) || (stereo != s->stereo))
+      return -1;
+
+   if ((pos > 0) && ((!s->vtable->seek) || (s->vtable->seek(s->data, pos) != 0)))
+      return -1;
+
+   return 0;
+}
+
+
+
+/* sample_stream_decode:
+ *  Decodes one buffer of frames into the read-ahead ring, looping back to
+ *  the start of the file if requested. Frames past the end of the data are
+ *  filled with silence.
+ */
+static void sample_stream_decode(SAMPLE_STREAM *s, unsigned char *buf)
+{
+   int frame = ((s->bits == 8) ? 1 : sizeof(short)) * ((s->stereo) ? 2 : 1);
+   long got = 0, n;
+
+   while ((got < s->len) && (!s->eof)) {
+      n = (s->data) ? s->vtable->read(s->data, buf + got*frame, s->len - got) : 0;
+
+      if (n > 0) {
+	 got += n;
+	 s->decode_pos += n;
+      }
+      else if ((s->loop) && (s->decode_pos > 0) && (sample_stream_reopen(s, 0) == 0))
+	 s->decode_pos = 0;
+      else
+	 s->eof = TRUE;
+   }
+
+   if (got < s->len)
+      fill_silence(buf + got*frame, s->bits, s->stereo, s->len - got);
+}
+
+
+
+/* sample_stream_fill:
+ *  Does the decoding in the background: keeps the read-ahead ring full and
+ *  hands decoded buffers to the audio stream as it asks for them.
+ */
+static void sample_stream_fill(SAMPLE_STREAM *s)
+{
+   int frame = ((s->bits == 8) ? 1 : sizeof(short)) * ((s->stereo) ? 2 : 1);
+   int slot;
+   void *p;
+
+   if (s->mutex)
+      system_driver->lock_mutex(s->mutex);
+
+   if (s->seek_to >= 0) {
+      s->ahead_fill = 0;
+      s->eof = (sample_stream_reopen(s, s->seek_to) != 0);
+      s->done = FALSE;
+      s->silent = 0;
+      s->pos = s->decode_pos = s->seek_to;
+      s->seek_to = -1;
+   }
+
+   /* decode ahead of the player */
+   while ((s->ahead_fill < s->ahead_count) && (!s->eof)) {
+      slot = (s->ahead_head + s->ahead_fill) % s->ahead_count;
+      sample_stream_decode(s, s->ahead + slot*s->len*frame);
+      s->ahead_pos[slot] = s->decode_pos;
+      s->ahead_fill++;
+   }
+
+   /* feed the audio stream */
+   while ((p = get_audio_stream_buffer(s->stream)) != NULL) {
+      if (s->ahead_fill > 0) {
+	 memcpy(p, s->ahead + s->ahead_head*s->len*frame, s->len*frame);
+	 s->pos = s->ahead_pos[s->ahead_head];
+	 s->ahead_head = (s->ahead_head + 1) % s->ahead_count;
+	 s->ahead_fill--;
+      }
+      else {
+	 /* once the stream has cycled through silence, we're finished */
+	 fill_silence(p, s->bits, s->stereo, s->len);
+	 if (++s->silent >= s->stream->bufcount*2)
+	    s->done = TRUE;
+      }
+
+      free_audio_stream_buffer(s->stream);
+   }
+
+   if (s->mutex)
+      system_driver->unlock_mutex(s->mutex);
+}
+
+
+
+/* sample_stream_update:
+ *  Timer callback. The timer thread can call it with a stream that has
+ *  just been stopped, so it only touches streams still in the list, and
+ *  marks them busy so stop_sample_stream() knows to wait for it.
+ */
+static void sample_stream_update(void *param)
+{
+   SAMPLE_STREAM *s;
+
+   if (stream_mutex)
+      _al_lock_mutex(stream_mutex);
+
+   for (s = sample_stream_list; s; s = s->next) {
+      if (s == param) {
+	 s->busy++;
+	 break;
+      }
+   }
+
+   if (stream_mutex)
+      _al_unlock_mutex(stream_mutex);
+
+   if (!s)
+      return;
+
+   sample_stream_fill(s);
+
+   if (stream_mutex)
+      _al_lock_mutex(stream_mutex);
+
+   s->busy--;
+
+   if (stream_mutex)
+      _al_unlock_mutex(stream_mutex);
+}
+
+
+
+/* unlink_sample_stream:
+ *  Takes a stream out of the list, so that no timer callback can start
+ *  working on it any more. Returns TRUE while one is still running.
+ */
+static int unlink_sample_stream(SAMPLE_STREAM *s)
+{
+   SAMPLE_STREAM **iter;
+   int busy;
+
+   if (stream_mutex)
+      _al_lock_mutex(stream_mutex);
+
+   for (iter = &sample_stream_list; *iter; iter = &(*iter)->next) {
+      if (*iter == s) {
+	 *iter = s->next;
+	 break;
+      }
+   }
+
+   busy = s->busy;
+
+   if (stream_mutex)
+      _al_unlock_mutex(stream_mutex);
+
+   return busy;
+}
+
+
+
+/* play_sample_stream:
+ *  Opens a sample file with a registered stream decoder, and starts playing
+ *  it through an audio stream. The file is decoded in the background, len
+ *  frames at a time, so it never has to be held in memory as a whole.
+ */
+SAMPLE_STREAM *play_sample_stream(AL_CONST char *filename, int len, int vol, int pan, int loop)
+{
+   AL_CONST SAMPLE_STREAM_VTABLE *vtable;
+   SAMPLE_STREAM *s;
+   PACKFILE *f;
+   ASSERT(filename);
+
+   vtable = find_sample_stream_type(filename);
+   if (!vtable)
+      return NULL;
+
+   f = pack_fopen(filename, F_READ);
+   if (!f)
+      return NULL;
+
+   s = play_sample_stream_pf(f, vtable, len, vol, pan, loop);
+   if (!s) {
+      pack_fclose(f);
+      return NULL;
+   }
+
+   s->filename = _al_strdup(filename);
+
+   return s;
+}
+
+
+
+/* play_sample_stream_pf:
+ *  Like play_sample_stream(), but decodes from an already open packfile
+ *  using the given decoder. The stream takes ownership of the packfile and
+ *  closes it when stopped. Without a filename to reopen, looping and seeking
+ *  backwards only work if the decoder can seek by itself.
+ */
+SAMPLE_STREAM *play_sample_stream_pf(PACKFILE *f, AL_CONST SAMPLE_STREAM_VTABLE *vtable, int len, int vol, int pan, int loop)
+{
+   SAMPLE_STREAM *s;
+   int frame;
+   ASSERT(f);
+   ASSERT(vtable);
+   ASSERT(len > 0);
+
+   s = _AL_MALLOC(sizeof(SAMPLE_STREAM));
+   if (!s)
+      return NULL;
+
+   memset(s, 0, sizeof(SAMPLE_STREAM));
+
+   s->vtable = vtable;
+   s->f = f;
+   s->len = len;
+   s->loop = loop;
+   s->seek_to = -1;
+   s->ahead_count = SAMPLE_STREAM_AHEAD;
+
+   s->data = vtable->open(f, &s->bits, &s->stereo, &s->freq);
+   if (!s->data)
+      goto error;
+
+   frame = ((s->bits == 8) ? 1 : sizeof(short)) * ((s->stereo) ? 2 : 1);
+
+   s->ahead = _AL_MALLOC_ATOMIC(s->ahead_count * len * frame);
+   s->ahead_pos = _AL_MALLOC_ATOMIC(s->ahead_count * sizeof(long));
+   if ((!s->ahead) || (!s->ahead_pos))
+      goto error;
+
+   if (system_driver->create_mutex)
+      s->mutex = system_driver->create_mutex();
+
+   /* prime the stream before it starts playing */
+   s->stream = play_audio_stream(len, s->bits, s->stereo, s->freq, vol, pan);
+   if (!s->stream)
+      goto error;
+
+   sample_stream_fill(s);
+
+   if (stream_mutex)
+      _al_lock_mutex(stream_mutex);
+
+   s->next = sample_stream_list;
+   sample_stream_list = s;
+
+   if (stream_mutex)
+      _al_unlock_mutex(stream_mutex);
+
+   /* poll twice per buffer */
+   if (install_param_int_ex(sample_stream_update, s, BPS_TO_TIMER(MAX(s->freq * 2 / len, 1))) != 0) {
+      unlink_sample_stream(s);
+      goto error;
+   }
+
+   return s;
+
+   error:
+   if (s->stream)
+      stop_audio_stream(s->stream);
+   if (s->mutex)
+      system_driver->destroy_mutex(s->mutex);
+   if (s->data)
+      vtable->close(s->data);
+   if (s->ahead)
+      _AL_FREE(s->ahead);
+   if (s->ahead_pos)
+      _AL_FREE(s->ahead_pos);
+   _AL_FREE(s);
+   return NULL;
+}
+
+
+
+/* stop_sample_stream:
+ *  Stops a sample stream, closing its file and freeing its decoder.
+ */
+void stop_sample_stream(SAMPLE_STREAM *s)
+{
+   ASSERT(s);
+
+   remove_param_int(sample_stream_update, s);
+
+   /* wait for a decode in progress to finish */
+   while (unlink_sample_stream(s))
+      rest(1);
+
+   if (s->mutex)
+      system_driver->destroy_mutex(s->mutex);
+
+   stop_audio_stream(s->stream);
+
+   if (s->data)
+      s->vtable->close(s->data);
+   if (s->f)
+      pack_fclose(s->f);
+   if (s->filename)
+      _AL_FREE(s->filename);
+
+   _AL_FREE(s->ahead);
+   _AL_FREE(s->ahead_pos);
+   _AL_FREE(s);
+}
+
+
+
+/* seek_sample_stream:
+ *  Asks the background decoder to continue from the given frame. Audio that
+ *  has already been handed to the audio stream still plays out first.
+ */
+void seek_sample_stream(SAMPLE_STREAM *s, long pos)
+{
+   ASSERT(s);
+   ASSERT(pos >= 0);
+
+   if (s->mutex)
+      system_driver->lock_mutex(s->mutex);
+
+   s->seek_to = pos;
+
+   if (s->mutex)
+      system_driver->unlock_mutex(s->mutex);
+}
+
+
+
+/* sample_stream_position:
+ *  Returns the frame that follows the last one handed to the audio stream.
+ */
+long sample_stream_position(SAMPLE_STREAM *s)
+{
+   ASSERT(s);
+   return s->pos;
+}
+
+
+
+/* sample_stream_done:
+ *  Returns TRUE once a non-looping stream has played to the end.
+ */
+int sample_stream_done(SAMPLE_STREAM *s)
+{
+   ASSERT(s);
+   return s->done;
+}
+
+
+
+typedef struct WAV_STREAM
+{
+   PACKFILE *f;
+   int bits;
+   int channels;
+   long pos;                           /* current frame */
+   long len;                           /* total frames */
+} WAV_STREAM;
+
+
+
+/* wav_stream_open:
+ *  Reads RIFF WAV headers up to the start of the PCM data.
+ */
+static void *wav_stream_open(PACKFILE *f, int *bits, int *stereo, int *freq)
+{
+   char buffer[12];
+   WAV_STREAM *wav;
+   int channels = 1;
+   int length;
+
+   *bits = 8;
+   *freq = 22050;
+
+   if ((pack_fread(buffer, 12, f) != 12) ||
+       (memcmp(buffer, "RIFF", 4)) || (memcmp(buffer+8, "WAVE", 4)))
+      return NULL;
+
+   while (pack_fread(buffer, 4, f) == 4) {
+      length = pack_igetl(f);
+
+      if (memcmp(buffer, "fmt ", 4) == 0) {
+	 if (pack_igetw(f) != 1)       /* PCM only */
+	    return NULL;
+
+	 channels = pack_igetw(f);
+	 *freq = pack_igetl(f);
+	 pack_igetl(f);
+	 pack_igetw(f);
+	 *bits = pack_igetw(f);
+	 length -= 16;
+
+	 if (((channels != 1) && (channels != 2)) ||
+	     ((*bits != 8) && (*bits != 16)))
+	    return NULL;
+      }
+      else if (memcmp(buffer, "data", 4) == 0) {
+	 wav = _AL_MALLOC(sizeof(WAV_STREAM));
+	 if (!wav)
+	    return NULL;
+
+	 wav->f = f;
+	 wav->bits = *bits;
+	 wav->channels = channels;
+	 wav->pos = 0;
+	 wav->len = length / (channels * *bits / 8);
+	 *stereo = (channels == 2);
+	 return wav;
+      }
+
+      if ((length > 0) && (pack_fseek(f, length) != 0))
+	 break;
+   }
+
+   return NULL;
+}
+
+
+
+/* wav_stream_read:
+ *  Reads up to len frames of PCM data, converting to Allegro's unsigned
+ *  sample format.
+ */
+static long wav_stream_read(void *data, void *buf, long len)
+{
+   WAV_STREAM *wav = data;
+   long n, i;
+
+   len = MIN(len, wav->len - wav->pos);
+   if (len <= 0)
+      return 0;
+
+   n = pack_fread(buf, len * wav->channels * wav->bits / 8, wav->f);
+   n /= wav->channels * wav->bits / 8;
+
+   if (wav->bits == 16) {
+      unsigned char *src = buf;
+      unsigned short *dst = buf;
+      for (i=0; i<n*wav->channels; i++)
+	 dst[i] = (src[i*2] | (src[i*2+1] << 8)) ^ 0x8000;
+   }
+
+   wav->pos += n;
+   return n;
+}
+
+
+
+/* wav_stream_seek:
+ *  Skips forward to the given frame. Going backwards is not possible on a
+ *  packfile, so that fails and the file gets reopened instead.
+ */
+static int wav_stream_seek(void *data, long pos)
+{
+   WAV_STREAM *wav = data;
+
+   if (pos < wav->pos)
+      return -1;
+
+   pos = MIN(pos, wav->len);
+
+   if (pack_fseek(wav->f, (pos - wav->pos) * wav->channels * wav->bits / 8) != 0)
+      return -1;
+
+   wav->pos = pos;
+   return 0;
+}
+
+
+
+/* wav_stream_close:
+ *  Frees the WAV decoder state.
+ */
+static void wav_stream_close(void *data)
+{
+   _AL_FREE(data);
+}
+
+
+
+AL_CONST SAMPLE_STREAM_VTABLE sample_stream_wav =
+{
+   wav_stream_open,
+   wav_stream_read,
+   wav_stream_seek,
+   wav_stream_close
+};
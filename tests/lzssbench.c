@@ -0,0 +1,601 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      LZSS compression benchmark for the Allegro library.
+ *
+ *      Packs text, image and random data into memory with lzss_write(),
+ *      using one or more threads, and with a copy of the binary tree
+ *      coder that lzss_write() used to be built on. Reports megabytes
+ *      packed per second of real time and the packed size as a percentage
+ *      of the original. Everything is unpacked again with lzss_read() and
+ *      checked, so a broken coder can't win.
+ *
+ *      Run with -csv to get comma separated output for regression
+ *      tracking, -size <mb> to change the amount of data, and give a file
+ *      name to also pack that file, eg. a datafile saved with -c0.
+ *
+ *      See readme.txt for copyright information.
+ */
+
+#define ALLEGRO_USE_CONSOLE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allegro.h"
+
+
+#define MIN_TIME        0.25
+
+#define N               4096        /* same as in src/lzss.c */
+#define F               18
+#define THRESHOLD       2
+
+#define TREE            0
+#define HASH            1
+
+static AL_CONST char *coder_names[] = { "tree", "hash" };
+
+static long data_size = 16 * 1024 * 1024;
+static int csv = FALSE;
+
+
+
+/* memory packfiles, for lzss_write() and lzss_read() to work on */
+typedef struct MEMFILE
+{
+   unsigned char *data;
+   long size;
+   long pos;
+} MEMFILE;
+
+
+static int mem_fclose(void *userdata) { (void)userdata; return 0; }
+static int mem_ungetc(int c, void *userdata) { (void)c; (void)userdata; return EOF; }
+static int mem_fseek(void *userdata, int offset) { (void)userdata; (void)offset; return -1; }
+static int mem_ferror(void *userdata) { (void)userdata; return 0; }
+
+
+static int mem_getc(void *userdata)
+{
+   MEMFILE *m = userdata;
+
+   return (m->pos < m->size) ? m->data[m->pos++] : EOF;
+}
+
+
+static long mem_fread(void *p, long n, void *userdata)
+{
+   MEMFILE *m = userdata;
+
+   n = MIN(n, m->size - m->pos);
+   memcpy(p, m->data + m->pos, n);
+   m->pos += n;
+
+   return n;
+}
+
+
+static int mem_putc(int c, void *userdata)
+{
+   MEMFILE *m = userdata;
+
+   m->data[m->pos++] = c;
+   return c;
+}
+
+
+static long mem_fwrite(AL_CONST void *p, long n, void *userdata)
+{
+   MEMFILE *m = userdata;
+
+   memcpy(m->data + m->pos, p, n);
+   m->pos += n;
+
+   return n;
+}
+
+
+static int mem_feof(void *userdata)
+{
+   MEMFILE *m = userdata;
+
+   return m->pos >= m->size;
+}
+
+
+static PACKFILE_VTABLE mem_vtable =
+{
+   mem_fclose, mem_getc, mem_ungetc, mem_fread, mem_putc,
+   mem_fwrite, mem_fseek, mem_feof, mem_ferror
+};
+
+
+
+/* The binary tree coder from before lzss_write() used hash chains, cut
+ * down to pack a whole buffer in one go. Original code by Haruhiko Okumura.
+ */
+static int lson[N+1], rson[N+257], dad[N+1];
+static unsigned char text_buf[N+F-1];
+static int match_position, match_length;
+
+
+
+static void tree_insertnode(int r)
+{
+   int i, p, cmp;
+   unsigned char *key;
+
+   cmp = 1;
+   key = &text_buf[r];
+   p = N + 1 + key[0];
+   rson[r] = lson[r] = N;
+   match_length = 0;
+
+   for (;;) {
+      if (cmp >= 0) {
+	 if (rson[p] != N)
+	    p = rson[p];
+	 else {
+	    rson[p] = r;
+	    dad[r] = p;
+	    return;
+	 }
+      }
+      else {
+	 if (lson[p] != N)
+	    p = lson[p];
+	 else {
+	    lson[p] = r;
+	    dad[r] = p;
+	    return;
+	 }
+      }
+
+      for (i = 1; i < F; i++)
+	 if ((cmp = key[i] - text_buf[p + i]) != 0)
+	    break;
+
+      if (i > match_length) {
+	 match_position = p;
+	 if ((match_length = i) >= F)
+	    break;
+      }
+   }
+
+   dad[r] = dad[p];
+   lson[r] = lson[p];
+   rson[r] = rson[p];
+   dad[lson[p]] = r;
+   dad[rson[p]] = r;
+   if (rson[dad[p]] == p)
+      rson[dad[p]] = r;
+   else
+      lson[dad[p]] = r;
+   dad[p] = N;
+}
+
+
+
+static void tree_deletenode(int p)
+{
+   int q;
+
+   if (dad[p] == N)
+      return;
+
+   if (rson[p] == N)
+      q = lson[p];
+   else if (lson[p] == N)
+      q = rson[p];
+   else {
+      q = lson[p];
+      if (rson[q] != N) {
+	 do {
+	    q = rson[q];
+	 } while (rson[q] != N);
+	 rson[dad[q]] = lson[q];
+	 dad[lson[q]] = dad[q];
+	 lson[q] = lson[p];
+	 dad[lson[p]] = q;
+      }
+      rson[q] = rson[p];
+      dad[rson[p]] = q;
+   }
+
+   dad[q] = dad[p];
+   if (rson[dad[p]] == p)
+      rson[dad[p]] = q;
+   else
+      lson[dad[p]] = q;
+
+   dad[p] = N;
+}
+
+
+
+/* tree_pack:
+ *  Packs size bytes from in to out, returning the packed size.
+ */
+static long tree_pack(AL_CONST unsigned char *in, long size, unsigned char *out)
+{
+   unsigned char code_buf[17], mask;
+   int i, c, len, r, s, last_match_length, code_buf_ptr;
+   long n = 0;
+
+   for (i=N+1; i<=N+256; i++)
+      rson[i] = N;
+   for (i=0; i<N; i++)
+      dad[i] = N;
+
+   code_buf[0] = 0;
+   code_buf_ptr = mask = 1;
+   s = 0;
+   r = N - F;
+   memset(text_buf, 0, r);
+
+   for (len=0; (len < F) && (size > 0); len++, size--)
+      text_buf[r+len] = *(in++);
+
+   if (len == 0)
+      return 0;
+
+   for (i=1; i <= F; i++)
+      tree_insertnode(r-i);
+   tree_insertnode(r);
+
+   do {
+      if (match_length > len)
+	 match_length = len;
+
+      if (match_length <= THRESHOLD) {
+	 match_length = 1;
+	 code_buf[0] |= mask;
+	 code_buf[code_buf_ptr++] = text_buf[r];
+      }
+      else {
+	 code_buf[code_buf_ptr++] = (unsigned char)match_position;
+	 code_buf[code_buf_ptr++] = (unsigned char)(((match_position >> 4) & 0xF0) |
+						    (match_length - (THRESHOLD + 1)));
+      }
+
+      if ((mask <<= 1) == 0) {
+	 for (i=0; i<code_buf_ptr; i++)
+	    out[n++] = code_buf[i];
+	 code_buf[0] = 0;
+	 code_buf_ptr = mask = 1;
+      }
+
+      last_match_length = match_length;
+
+      for (i=0; (i < last_match_length) && (size > 0); i++, size--) {
+	 c = *(in++);
+	 tree_deletenode(s);
+	 text_buf[s] = c;
+	 if (s < F-1)
+	    text_buf[s+N] = c;
+	 s = (s+1) & (N-1);
+	 r = (r+1) & (N-1);
+	 tree_insertnode(r);
+      }
+
+      while (i++ < last_match_length) {
+	 tree_deletenode(s);
+	 s = (s+1) & (N-1);
+	 r = (r+1) & (N-1);
+	 if (--len)
+	    tree_insertnode(r);
+      }
+   } while (len > 0);
+
+   for (i=0; (i<code_buf_ptr) && (code_buf_ptr > 1); i++)
+      out[n++] = code_buf[i];
+
+   return n;
+}
+
+
+
+/* hash_pack:
+ *  Packs size bytes from in to out with lzss_write(), returning the packed
+ *  size or -1 on error.
+ */
+static long hash_pack(AL_CONST unsigned char *in, long size, unsigned char *out, LZSS_PACK_DATA *dat)
+{
+   MEMFILE m;
+   PACKFILE *f;
+   long i, n;
+
+   m.data = out;
+   m.size = 0;
+   m.pos = 0;
+
+   f = pack_fopen_vtable(&mem_vtable, &m);
+   if (!f)
+      return -1;
+
+   for (i=0; i<size; i+=n) {
+      n = MIN(1024*1024, size - i);
+      if (lzss_write(f, dat, n, (unsigned char *)in + i, i+n >= size) != 0) {
+	 pack_fclose(f);
+	 return -1;
+      }
+   }
+
+   pack_fclose(f);
+
+   return m.pos;
+}
+
+
+
+/* check_unpack:
+ *  Unpacks the packed data with lzss_read() and compares it with the
+ *  original. Returns zero if they match.
+ */
+static int check_unpack(AL_CONST unsigned char *in, long size, unsigned char *packed, long packed_size, unsigned char *buf)
+{
+   LZSS_UNPACK_DATA *dat;
+   MEMFILE m;
+   PACKFILE *f;
+   long n, total = 0;
+
+   m.data = packed;
+   m.size = packed_size;
+   m.pos = 0;
+
+   dat = create_lzss_unpack_data();
+   f = pack_fopen_vtable(&mem_vtable, &m);
+   if ((!dat) || (!f))
+      return -1;
+
+   while ((n = lzss_read(f, dat, 65536, buf + total)) > 0) {
+      total += n;
+      if (total > size)
+	 break;
+   }
+
+   pack_fclose(f);
+   free_lzss_unpack_data(dat);
+
+   return (total != size) || (memcmp(in, buf, size) != 0);
+}
+
+
+
+/* run_case:
+ *  Packs the data until at least MIN_TIME has passed, returning the
+ *  throughput in megabytes per second and storing the packed size as a
+ *  percentage in ratio. Returns a negative value on error.
+ */
+static double run_case(AL_CONST unsigned char *in, long size, unsigned char *out, unsigned char *buf, int coder, int threads, double *ratio)
+{
+   LZSS_PACK_DATA *dat = NULL;
+   double start, elapsed;
+   double bytes = 0;
+   long n;
+
+   if (coder == HASH) {
+      set_lzss_pack_threads(threads);
+      dat = create_lzss_pack_data();
+      if (!dat)
+	 return -1;
+   }
+
+   start = al_get_time();
+
+   do {
+      n = (coder == TREE) ? tree_pack(in, size, out) : hash_pack(in, size, out, dat);
+      if (n < 0)
+	 break;
+      bytes += size;
+      elapsed = al_get_time() - start;
+   } while (elapsed < MIN_TIME);
+
+   if (dat)
+      free_lzss_pack_data(dat);
+
+   if ((n < 0) || (check_unpack(in, size, out, n, buf) != 0))
+      return -1;
+
+   *ratio = 100.0 * n / MAX(size, 1);
+
+   return bytes / (1024.0 * 1024.0) / MAX(elapsed, 0.001);
+}
+
+
+
+/* make_text:
+ *  Fills the buffer with words, spaces and line breaks.
+ */
+static void make_text(unsigned char *p, long size)
+{
+   static AL_CONST char *words[] = {
+      "the", "sprite", "of", "a", "bitmap", "is", "drawn", "to", "screen",
+      "and", "palette", "with", "sample", "datafile", "object", "grabber",
+      "font", "in", "from", "color", "mode", "for", "each", "frame"
+   };
+   AL_CONST char *w;
+   long i = 0;
+
+   while (i < size) {
+      w = words[rand() % (int)(sizeof(words)/sizeof(words[0]))];
+      while ((*w) && (i < size))
+	 p[i++] = *(w++);
+      if (i < size)
+	 p[i++] = (rand() % 12) ? ' ' : '\n';
+   }
+}
+
+
+
+/* make_image:
+ *  Fills the buffer with 256 pixel wide rows of gradients and a little
+ *  noise, like an 8 bit bitmap.
+ */
+static void make_image(unsigned char *p, long size)
+{
+   long i;
+   int x, y;
+
+   for (i=0; i<size; i++) {
+      x = i & 255;
+      y = (i >> 8) & 255;
+      p[i] = ((x >> 3) + (y >> 2) + (((x ^ y) & 64) ? 96 : 0)) & 0xFF;
+      if ((rand() & 15) == 0)
+	 p[i] ^= rand() & 3;
+   }
+}
+
+
+
+/* make_random:
+ *  Fills the buffer with noise, which doesn't pack at all.
+ */
+static void make_random(unsigned char *p, long size)
+{
+   long i;
+
+   for (i=0; i<size; i++)
+      p[i] = rand();
+}
+
+
+
+/* load_data:
+ *  Reads a whole file into a new buffer, storing its size.
+ */
+static unsigned char *load_data(AL_CONST char *filename, long *size)
+{
+   unsigned char *p;
+   PACKFILE *f;
+
+   *size = (long)file_size_ex(filename);
+   if (*size <= 0)
+      return NULL;
+
+   p = malloc(*size);
+   f = pack_fopen(filename, F_READ);
+   if ((!p) || (!f) || (pack_fread(p, *size, f) != *size)) {
+      if (f)
+	 pack_fclose(f);
+      free(p);
+      return NULL;
+   }
+
+   pack_fclose(f);
+
+   return p;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+   static AL_CONST int thread_counts[] = { 1, 2, 4, 8 };
+   static AL_CONST char *data_names[] = { "text", "image", "random", "file" };
+   AL_CONST char *filename = NULL;
+   unsigned char *in, *out, *buf;
+   double mbs, ratio;
+   long size, max_size;
+   int data, t, i;
+
+   for (i=1; i<argc; i++) {
+      if (strcmp(argv[i], "-csv") == 0)
+	 csv = TRUE;
+      else if ((strcmp(argv[i], "-size") == 0) && (i+1 < argc)) {
+	 data_size = atol(argv[++i]) * 1024 * 1024;
+	 if (data_size < 1024*1024)
+	    data_size = 1024*1024;
+      }
+      else if ((argv[i][0] != '-') && (!filename))
+	 filename = argv[i];
+      else {
+	 fprintf(stderr, "Usage: lzssbench [-csv] [-size mb] [file]\n");
+	 return 1;
+      }
+   }
+
+   if (install_allegro(SYSTEM_NONE, &errno, atexit) != 0)
+      return 1;
+
+   max_size = data_size;
+   if (filename) {
+      size = (long)file_size_ex(filename);
+      max_size = MAX(max_size, size);
+      if (size <= 0) {
+	 fprintf(stderr, "Error reading %s\n", filename);
+	 return 1;
+      }
+   }
+
+   out = malloc(max_size + max_size/8 + 16);
+   buf = malloc(max_size + 65536);
+   if ((!out) || (!buf)) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+
+   if (csv)
+      printf("data,coder,threads,mb_per_sec,ratio\n");
+   else
+      printf("%ld MB of generated data\n\n   data  coder  threads      MB/s   ratio\n", data_size / (1024*1024));
+
+   srand(1);
+
+   for (data=0; data<4; data++) {
+      if (data == 3) {
+	 if (!filename)
+	    break;
+	 in = load_data(filename, &size);
+	 if (!in) {
+	    fprintf(stderr, "Error reading %s\n", filename);
+	    return 1;
+	 }
+      }
+      else {
+	 size = data_size;
+	 in = malloc(size);
+	 if (!in) {
+	    fprintf(stderr, "Out of memory\n");
+	    return 1;
+	 }
+	 if (data == 0)
+	    make_text(in, size);
+	 else if (data == 1)
+	    make_image(in, size);
+	 else
+	    make_random(in, size);
+      }
+
+      for (t=-1; t<(int)(sizeof(thread_counts)/sizeof(thread_counts[0])); t++) {
+	 mbs = run_case(in, size, out, buf, (t < 0) ? TREE : HASH, (t < 0) ? 1 : thread_counts[t], &ratio);
+	 if (mbs < 0) {
+	    fprintf(stderr, "Error packing %s data\n", data_names[data]);
+	    return 1;
+	 }
+
+	 printf(csv ? "%s,%s,%d,%.1f,%.1f\n" : "%7s  %5s  %7d  %8.1f  %5.1f%%\n",
+		data_names[data], coder_names[(t < 0) ? TREE : HASH],
+		(t < 0) ? 1 : thread_counts[t], mbs, ratio);
+      }
+
+      free(in);
+   }
+
+   free(out);
+   free(buf);
+
+   return 0;
+}
+
+END_OF_MAIN()
@@ -0,0 +1,161 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      MIDI timing jitter test for the Allegro library.
+ *
+ *      Plays a MIDI file through each MIDI driver in turn with the MIDI
+ *      tap installed, and prints a histogram of how far from their
+ *      scheduled time the events were dispatched to each driver.
+ *
+ *      Run with -sample to run the player from the mixer where the driver
+ *      allows it, -freq <hz> to change how often the timer driven player
+ *      runs, and -time <s> to limit how long each driver plays for.
+ *
+ *      See readme.txt for copyright information.
+ */
+
+#define ALLEGRO_USE_CONSOLE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allegro.h"
+
+
+#define MAX_DRIVERS     16
+
+static int sample_accurate = FALSE;
+static int play_time = 30;
+
+
+
+/* play_through:
+ *  Plays the MIDI file through the given driver until it ends or the time
+ *  limit runs out. Returns zero on success.
+ */
+static int play_through(AL_CONST char *filename, int driver)
+{
+   MIDI *midi;
+   int t;
+
+   if (install_sound(DIGI_AUTODETECT, driver, NULL) != 0)
+      return -1;
+
+   midi = load_midi(filename);
+   if ((!midi) || (install_midi_tap(1) != 0)) {
+      destroy_midi(midi);
+      remove_sound();
+      return -1;
+   }
+
+   if ((sample_accurate) && (set_midi_sample_accurate(TRUE) == 0))
+      printf("%s: running from the mixer\n", midi_driver->name);
+   else
+      printf("%s: running from a timer\n", midi_driver->name);
+
+   play_midi(midi, FALSE);
+
+   for (t=0; (t < play_time*10) && (midi_pos >= 0); t++)
+      rest(100);
+
+   stop_midi();
+   destroy_midi(midi);
+   remove_sound();
+
+   return 0;
+}
+
+
+
+/* print_stats:
+ *  Shows the timing statistics for one driver.
+ */
+static void print_stats(int driver)
+{
+   MIDI_JITTER_STATS stats;
+   double bin = 0.125;
+   int i;
+
+   if (get_midi_jitter_stats(driver, &stats) != 0)
+      return;
+
+   printf("\n%c%c%c%c: %ld events, mean lateness %.3f ms, worst %.3f ms\n",
+          (driver >> 24) & 0xFF, (driver >> 16) & 0xFF,
+          (driver >> 8) & 0xFF, driver & 0xFF,
+          stats.count, stats.mean * 1000, stats.max * 1000);
+
+   for (i=0; i<MIDI_JITTER_BINS; i++) {
+      if (i < MIDI_JITTER_BINS-1)
+         printf("  < %8.3f ms  %8ld  %5.1f%%\n", bin, stats.histogram[i],
+                stats.histogram[i] * 100.0 / stats.count);
+      else
+         printf("  >=%8.3f ms  %8ld  %5.1f%%\n", bin / 2, stats.histogram[i],
+                stats.histogram[i] * 100.0 / stats.count);
+      bin *= 2;
+   }
+}
+
+
+
+int main(int argc, char *argv[])
+{
+   AL_CONST char *filename = NULL;
+   _DRIVER_INFO *list;
+   int drivers[MAX_DRIVERS];
+   int num_drivers = 0;
+   int i;
+
+   if (install_allegro(SYSTEM_AUTODETECT, &errno, atexit) != 0)
+      return 1;
+
+   for (i=1; i<argc; i++) {
+      if (strcmp(argv[i], "-sample") == 0)
+         sample_accurate = TRUE;
+      else if ((strcmp(argv[i], "-freq") == 0) && (i+1 < argc))
+         set_config_int("sound", "midi_timer_frequency", atoi(argv[++i]));
+      else if ((strcmp(argv[i], "-time") == 0) && (i+1 < argc))
+         play_time = MAX(atoi(argv[++i]), 1);
+      else if ((argv[i][0] != '-') && (!filename))
+         filename = argv[i];
+      else
+         break;
+   }
+
+   if ((i < argc) || (!filename)) {
+      allegro_message("Usage: midijit [-sample] [-freq hz] [-time s] file.mid\n");
+      return 1;
+   }
+
+   install_timer();
+
+   if (system_driver->midi_drivers)
+      list = system_driver->midi_drivers();
+   else
+      list = _midi_driver_list;
+
+   for (i=0; (list[i].id) && (num_drivers < MAX_DRIVERS); i++) {
+      if (play_through(filename, list[i].id) == 0)
+         drivers[num_drivers++] = list[i].id;
+   }
+
+   if (!num_drivers) {
+      allegro_message("Error playing %s through any MIDI driver\n", filename);
+      return 1;
+   }
+
+   for (i=0; i<num_drivers; i++)
+      print_stats(drivers[i]);
+
+   return 0;
+}
+
+END_OF_MAIN()
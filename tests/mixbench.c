@@ -0,0 +1,225 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      Sample mixer benchmark for the Allegro library.
+ *
+ *      Drives the software mixer directly, without a sound driver, for
+ *      every combination of output rate, output bits, output channels,
+ *      mixing quality and source format, with volume ramps and frequency
+ *      sweeps running on every voice. Reports the CPU time spent per
+ *      output sample per voice, and how many voices one core could keep
+ *      up with in real time.
+ *
+ *      Run with -csv to get comma separated output for regression
+ *      tracking, and -time <ms> to change how long each case runs for.
+ *
+ *      It runs under SYSTEM_NONE, which has no mutexes, so the mixer
+ *      goes without its lock and the times don't include locking it.
+ *
+ *      See readme.txt for copyright information.
+ */
+
+#define ALLEGRO_USE_CONSOLE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "allegro.h"
+#include "allegro/internal/aintern.h"
+
+
+#define MIX_SIZE        1024
+#define MIX_VOICES      32
+#define SAMPLE_FREQ     22050
+#define SAMPLE_LEN      (SAMPLE_FREQ * 2)
+#define RAMP_TIME       50
+
+static int run_time = 250;
+static int csv = FALSE;
+
+
+
+/* make_sample:
+ *  Creates a looping sawtooth in the given format to mix from.
+ */
+static SAMPLE *make_sample(int bits, int stereo)
+{
+   int n = SAMPLE_LEN * (stereo ? 2 : 1);
+   SAMPLE *spl = create_sample(bits, stereo, SAMPLE_FREQ, SAMPLE_LEN);
+   int i;
+
+   if (!spl)
+      return NULL;
+
+   if (bits == 8) {
+      unsigned char *p = spl->data;
+      for (i=0; i<n; i++)
+         p[i] = (i * 3) & 0xFF;
+   }
+   else {
+      unsigned short *p = spl->data;
+      for (i=0; i<n; i++)
+         p[i] = (i * 397) & 0xFFFF;
+   }
+
+   spl->loop_start = 0;
+   spl->loop_end = SAMPLE_LEN;
+
+   return spl;
+}
+
+
+
+/* keep_sweeping:
+ *  Restarts the volume ramp and frequency sweep on any voice that has
+ *  finished one, bouncing between two levels so that the mixer never
+ *  gets to take its constant parameter path.
+ */
+static void keep_sweeping(int voices)
+{
+   int i;
+
+   for (i=0; i<voices; i++) {
+      if (!_phys_voice[i].dvol)
+         _mixer_ramp_volume(i, RAMP_TIME, (_phys_voice[i].vol >> 12) > 128 ? 64 : 255);
+
+      if (!_phys_voice[i].dfreq)
+         _mixer_sweep_frequency(i, RAMP_TIME + i, (_phys_voice[i].freq >> 12) > SAMPLE_FREQ ? 11025 : 48000);
+   }
+}
+
+
+
+/* run_case:
+ *  Mixes MIX_VOICES looping voices with the given settings for at least
+ *  run_time milliseconds, and returns the CPU time in nanoseconds spent
+ *  per output sample per voice, or a negative value on error.
+ */
+static double run_case(SAMPLE *spl, int rate, int bits, int stereo, int quality)
+{
+   static unsigned short out[MIX_SIZE * 2];
+   int voices = MIX_VOICES;
+   clock_t start, elapsed, min_time;
+   long buffers = 0;
+   int i;
+
+   _sound_hq = quality;
+
+   if (_mixer_init(MIX_SIZE * (stereo ? 2 : 1), rate, stereo, (bits == 16), &voices) != 0)
+      return -1;
+
+   set_volume_per_voice(-1);
+
+   for (i=0; i<voices; i++) {
+      _phys_voice[i].num = i;
+      _phys_voice[i].playmode = PLAYMODE_LOOP;
+      _phys_voice[i].vol = 255 << 12;
+      _phys_voice[i].pan = (i * 255 / voices) << 12;
+      _phys_voice[i].freq = (SAMPLE_FREQ + i * 37) << 12;
+      _phys_voice[i].dvol = _phys_voice[i].dpan = _phys_voice[i].dfreq = 0;
+      _mixer_init_voice(i, spl);
+      _mixer_start_voice(i);
+   }
+
+   min_time = (clock_t)((double)run_time * CLOCKS_PER_SEC / 1000);
+   start = clock();
+
+   do {
+      keep_sweeping(voices);
+      _mix_some_samples((uintptr_t)out, 0, TRUE);
+      buffers++;
+      elapsed = clock() - start;
+   } while (elapsed < min_time);
+
+   for (i=0; i<voices; i++)
+      _mixer_release_voice(i);
+
+   _mixer_exit();
+
+   return (double)elapsed * 1e9 / CLOCKS_PER_SEC / ((double)buffers * MIX_SIZE * voices);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+   static AL_CONST int rates[] = { 44100, 48000 };
+   SAMPLE *spl[4];
+   double ns;
+   int r, bits, stereo, quality, s, i;
+
+   for (i=1; i<argc; i++) {
+      if (strcmp(argv[i], "-csv") == 0)
+         csv = TRUE;
+      else if ((strcmp(argv[i], "-time") == 0) && (i+1 < argc)) {
+         run_time = atoi(argv[++i]);
+         if (run_time < 1)
+            run_time = 1;
+      }
+      else {
+         fprintf(stderr, "Usage: mixbench [-csv] [-time ms]\n");
+         return 1;
+      }
+   }
+
+   if (install_allegro(SYSTEM_NONE, &errno, atexit) != 0)
+      return 1;
+
+   for (s=0; s<4; s++) {
+      spl[s] = make_sample((s & 1) ? 16 : 8, (s & 2) ? TRUE : FALSE);
+      if (!spl[s]) {
+         fprintf(stderr, "Error creating sample\n");
+         return 1;
+      }
+   }
+
+   if (csv) {
+      printf("rate,out_bits,out_channels,quality,src_bits,src_channels,"
+             "ns_per_sample_voice,voices_per_core\n");
+   }
+   else {
+      printf("%d voices, volume ramps and frequency sweeps on, "
+             "%d ms per case\n\n", MIX_VOICES, run_time);
+      printf(" rate  out  ch  quality  src  ch  ns/sample/voice  voices/core\n");
+   }
+
+   for (r=0; r<(int)(sizeof(rates)/sizeof(rates[0])); r++) {
+      for (bits=8; bits<=16; bits+=8) {
+         for (stereo=0; stereo<=1; stereo++) {
+            /* the interpolating mixers only work in stereo */
+            for (quality=0; quality<=(stereo ? 3 : 0); quality++) {
+               for (s=0; s<4; s++) {
+                  ns = run_case(spl[s], rates[r], bits, stereo, quality);
+                  if (ns <= 0) {
+                     fprintf(stderr, "Error initialising the mixer\n");
+                     return 1;
+                  }
+
+                  printf(csv ? "%d,%d,%d,%d,%d,%d,%.3f,%.1f\n"
+                             : "%5d  %3d  %2d  %7d  %3d  %2d  %15.3f  %11.1f\n",
+                         rates[r], bits, stereo ? 2 : 1, quality,
+                         spl[s]->bits, spl[s]->stereo ? 2 : 1,
+                         ns, 1e9 / (ns * rates[r]));
+               }
+            }
+         }
+      }
+   }
+
+   for (s=0; s<4; s++)
+      destroy_sample(spl[s]);
+
+   return 0;
+}
+
+END_OF_MAIN()
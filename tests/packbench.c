@@ -0,0 +1,219 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      Packfile read throughput benchmark for the Allegro library.
+ *
+ *      Writes a scratch file, then reads it back with pack_fread() in
+ *      requests of various sizes, as a plain file, as a chunk inside a
+ *      file and as a compressed file, with the default buffer and a
+ *      larger one set with pack_set_buffer_size(). Reports megabytes read
+ *      per second of CPU time. The file is read once before timing, so
+ *      the numbers measure the library rather than the disk.
+ *
+ *      Run with -csv to get comma separated output for regression
+ *      tracking, and -size <mb> to change the size of the scratch file.
+ *
+ *      See readme.txt for copyright information.
+ */
+
+#define ALLEGRO_USE_CONSOLE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "allegro.h"
+
+
+#define SCRATCH_FILE    "packbench.tmp"
+#define MIN_TIME        (CLOCKS_PER_SEC / 4)
+
+#define PLAIN           0
+#define CHUNK           1
+#define PACKED          2
+
+static AL_CONST char *layout_names[] = { "plain", "chunk", "packed" };
+
+static long scratch_size = 16 * 1024 * 1024;
+static int csv = FALSE;
+static unsigned char *buffer;
+
+
+
+/* write_scratch:
+ *  Writes the scratch file in the given layout. Returns zero on success.
+ */
+static int write_scratch(int layout)
+{
+   PACKFILE *f;
+   long i, n;
+
+   for (i=0; i<1024*1024; i++)
+      buffer[i] = (i * 7 + (i >> 9)) & 0xFF;
+
+   f = pack_fopen(SCRATCH_FILE, (layout == PACKED) ? F_WRITE_PACKED : F_WRITE);
+   if (!f)
+      return -1;
+
+   if (layout == CHUNK) {
+      pack_mputl(DAT_ID('T','E','S','T'), f);
+      f = pack_fopen_chunk(f, FALSE);
+   }
+
+   for (i=0; i<scratch_size; i+=n) {
+      n = MIN(1024*1024, scratch_size - i);
+      pack_fwrite(buffer, n, f);
+   }
+
+   if (layout == CHUNK)
+      f = pack_fclose_chunk(f);
+
+   pack_fclose(f);
+
+   return 0;
+}
+
+
+
+/* read_scratch:
+ *  Reads the whole scratch file in requests of the given size, returning
+ *  the number of bytes read, or -1 on error.
+ */
+static long read_scratch(int layout, int request, int buf_size)
+{
+   PACKFILE *f;
+   long total = 0;
+   long n;
+
+   f = pack_fopen(SCRATCH_FILE, (layout == PACKED) ? F_READ_PACKED : F_READ);
+   if (!f)
+      return -1;
+
+   if (layout == CHUNK) {
+      pack_mgetl(f);
+      f = pack_fopen_chunk(f, FALSE);
+   }
+
+   if ((buf_size) && (pack_set_buffer_size(f, buf_size) != 0)) {
+      pack_fclose(f);
+      return -1;
+   }
+
+   if (request == 1) {
+      while (pack_getc(f) != EOF)
+         total++;
+   }
+   else {
+      while ((n = pack_fread(buffer, request, f)) > 0)
+         total += n;
+   }
+
+   if (layout == CHUNK)
+      f = pack_fclose_chunk(f);
+
+   pack_fclose(f);
+
+   return total;
+}
+
+
+
+/* run_case:
+ *  Reads the scratch file until at least MIN_TIME has passed, and returns
+ *  the throughput in megabytes per second, or a negative value on error.
+ */
+static double run_case(int layout, int request, int buf_size)
+{
+   clock_t start, elapsed;
+   double bytes = 0;
+   long n;
+
+   start = clock();
+
+   do {
+      n = read_scratch(layout, request, buf_size);
+      if (n != scratch_size)
+         return -1;
+      bytes += n;
+      elapsed = clock() - start;
+   } while (elapsed < MIN_TIME);
+
+   return bytes / (1024.0 * 1024.0) * CLOCKS_PER_SEC / MAX(elapsed, 1);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+   static AL_CONST int requests[] = { 1, 16, 256, 4096, 65536, 1024*1024 };
+   static AL_CONST int buf_sizes[] = { 0, 64*1024 };
+   double mbs;
+   int layout, r, b, i;
+
+   for (i=1; i<argc; i++) {
+      if (strcmp(argv[i], "-csv") == 0)
+         csv = TRUE;
+      else if ((strcmp(argv[i], "-size") == 0) && (i+1 < argc)) {
+         scratch_size = atol(argv[++i]) * 1024 * 1024;
+         if (scratch_size < 1024*1024)
+            scratch_size = 1024*1024;
+      }
+      else {
+         fprintf(stderr, "Usage: packbench [-csv] [-size mb]\n");
+         return 1;
+      }
+   }
+
+   if (install_allegro(SYSTEM_NONE, &errno, atexit) != 0)
+      return 1;
+
+   buffer = malloc(1024*1024);
+   if (!buffer) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+
+   if (csv)
+      printf("layout,request,buffer,mb_per_sec\n");
+   else
+      printf("%ld MB scratch file\n\n layout  request   buffer      MB/s\n", scratch_size / (1024*1024));
+
+   for (layout=PLAIN; layout<=PACKED; layout++) {
+      if ((write_scratch(layout) != 0) || (read_scratch(layout, 65536, 0) != scratch_size)) {
+         fprintf(stderr, "Error writing %s\n", SCRATCH_FILE);
+         delete_file(SCRATCH_FILE);
+         return 1;
+      }
+
+      for (r=0; r<(int)(sizeof(requests)/sizeof(requests[0])); r++) {
+         for (b=0; b<(int)(sizeof(buf_sizes)/sizeof(buf_sizes[0])); b++) {
+            mbs = run_case(layout, requests[r], buf_sizes[b]);
+            if (mbs < 0) {
+               fprintf(stderr, "Error reading %s\n", SCRATCH_FILE);
+               delete_file(SCRATCH_FILE);
+               return 1;
+            }
+
+            printf(csv ? "%s,%d,%d,%.1f\n" : "%7s  %7d  %7d  %8.1f\n",
+                   layout_names[layout], requests[r],
+                   buf_sizes[b] ? buf_sizes[b] : F_BUF_SIZE, mbs);
+         }
+      }
+   }
+
+   delete_file(SCRATCH_FILE);
+   free(buffer);
+
+   return 0;
+}
+
+END_OF_MAIN()
@@ -41,6 +41,9 @@ static int opt_command = 0;
 static int opt_compression = -1;
 static int opt_strip = -1;
 static int opt_sort = -1;
+static int opt_index = -1;
+static int opt_threads = -1;
+static int opt_chacha20 = FALSE;
 static int opt_relf = FALSE;
 static int opt_verbose = FALSE;
 static int opt_keepnames = FALSE;
@@ -101,12 +104,20 @@ static void usage(void)
    printf("\t'-c0' no compression\n");
    printf("\t'-c1' compress objects individually\n");
    printf("\t'-c2' global compression on the entire datafile\n");
+   printf("\t'-c3' compress objects individually with the faster LZ4\n");
+   printf("\t'-c4' global LZ4 compression on the entire datafile\n");
+   printf("\t'-c5' like -c1, with a table of object offsets for fast indexing\n");
+   printf("\t'-c6' like -c3, with a table of object offsets for fast indexing\n");
+   printf("\t'-chacha20' encrypts with ChaCha20 rather than XOR (with -007)\n");
    printf("\t'-d' deletes the named objects from the datafile\n");
    printf("\t'-dither' dithers when reducing color depths\n");
    printf("\t'-e' extracts the named objects from the datafile\n");
    printf("\t'-f' store references to original files as relative filenames\n");
    printf("\t'-g x y w h' grabs bitmap data from a specific grid location\n");
    printf("\t'-h outputfile.h' sets the output header file\n");
+   printf("\t'-i0' no name index\n");
+   printf("\t'-i1' store a hash index of the object names in the datafile\n");
+   printf("\t'-j threads' packs on this many threads (default: one per processor)\n");
    printf("\t'-k' keeps the original filenames when grabbing objects\n");
    printf("\t'-l' lists the contents of the datafile\n");
    printf("\t'-m dependencyfile' outputs makefile dependencies\n");
@@ -785,6 +796,9 @@ static int do_save_dependencies(DATAFILE *dat, char *srcname, char *depname)
       if (opt_password)
 	 fprintf(f, " -007 %s", opt_password);
 
+      if (opt_chacha20)
+	 fprintf(f, " -chacha20");
+
       fprintf(f, "\n");
       fclose(f);
    }
@@ -851,8 +865,13 @@ int main(int argc, char *argv[])
 	       break;
 
 	    case 'c':
+	       if (stricmp(argv[c]+2, "hacha20") == 0) {
+		  opt_chacha20 = TRUE;
+		  break;
+	       }
+
 	       if ((opt_compression >= 0) || 
-		   (argv[c][2] < '0') || (argv[c][2] > '2')) {
+		   (argv[c][2] < '0') || (argv[c][2] > '6')) {
 		  usage();
 		  return 1;
 	       }
@@ -887,6 +906,27 @@ int main(int argc, char *argv[])
 	       opt_headername = argv[++c];
 	       break;
 
+	    case 'i':
+	       if ((opt_index >= 0) ||
+		   (argv[c][2] < '0') || (argv[c][2] > '1')) {
+		  usage();
+		  return 1;
+	       }
+	       opt_index = argv[c][2] - '0';
+	       break;
+
+	    case 'j':
+	       if ((opt_threads >= 0) || (c >= argc-1)) {
+		  usage();
+		  return 1;
+	       }
+	       opt_threads = atoi(argv[++c]);
+	       if (opt_threads < 1) {
+		  usage();
+		  return 1;
+	       }
+	       break;
+
 	    case 'k':
 	       opt_keepnames = TRUE;
 	       break;
@@ -1018,6 +1058,7 @@ int main(int argc, char *argv[])
 	(opt_compression < 0) && 
 	(opt_strip < 0) && 
 	(opt_sort < 0) &&
+	(opt_index < 0) &&
 	(!opt_numprops) &&
 	(!opt_headername) &&
 	(!opt_dependencyfile))) {
@@ -1027,6 +1068,12 @@ int main(int argc, char *argv[])
 
    canonicalize_filename(canonical_datafilename, opt_datafilename, sizeof(canonical_datafilename));
 
+   /* the packed output is the same whatever the number of threads */
+   set_lzss_pack_threads((opt_threads > 0) ? opt_threads : 0);
+
+   if (opt_chacha20)
+      packfile_crypt(F_CRYPT_CHACHA20);
+
    if (colorconv_mode)
       set_color_conversion(colorconv_mode);
    else
@@ -1139,12 +1186,13 @@ int main(int argc, char *argv[])
 	 }
       }
 
-      if ((!err) && ((changed) || (opt_compression >= 0) || (opt_strip >= 0) || (opt_sort >= 0))) {
+      if ((!err) && ((changed) || (opt_compression >= 0) || (opt_strip >= 0) || (opt_sort >= 0) || (opt_index >= 0))) {
 	 DATEDIT_SAVE_DATAFILE_OPTIONS options;
 
 	 options.pack = opt_compression;
 	 options.strip = opt_strip;
 	 options.sort = opt_sort;
+	 options.index = opt_index;
 	 options.verbose = opt_verbose;
 	 options.write_msg = TRUE;
 	 options.backup = FALSE;
@@ -405,6 +405,10 @@ static int setup_allegro(void)
       them as bitmaps instead. */
    _compile_sprites = 0;
 
+   /* _midi_keep_tracks is another one, which makes load_datafile() keep
+      the raw track data of MIDI files so that it can be written out. */
+   _midi_keep_tracks = TRUE;
+
    return 0;
 }
 
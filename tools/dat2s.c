@@ -211,6 +211,7 @@ static void output_midi(MIDI *midi, char *name)
       else
 	 fprintf(outfile, "\t.long 0, 0\n");
 
+   fprintf(outfile, "\t.long 0                # timeline\n");
    fprintf(outfile, "\n");
 }
 
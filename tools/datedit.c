@@ -34,6 +34,7 @@ static char info_msg[] = "For internal use by the grabber";
 DATAFILE datedit_info = { info_msg, DAT_INFO, sizeof(info_msg), NULL };
 
 static int file_datasize;
+static int file_name_index;
 
 static DATAFILE_PROPERTY *builtin_prop = NULL;
 
@@ -109,6 +110,9 @@ void datedit_init(void)
 
    #include "plugins.h"
 
+   /* MIDI files have to keep their raw track data to be written out again */
+   _midi_keep_tracks = TRUE;
+
    do {
       done = TRUE;
 
@@ -224,6 +228,7 @@ static int export_datafile(AL_CONST DATAFILE *dat, AL_CONST char *filename)
    DATEDIT_SAVE_DATAFILE_OPTIONS options = {-1,    /* pack      */
 					    -1,    /* strip     */
 					    -1,    /* sort      */
+					    -1,    /* index     */
 					    FALSE, /* verbose   */
 					    FALSE, /* write_msg */
 					    FALSE, /* backup    */
@@ -361,6 +366,8 @@ static DATAFILE *grab_datafile(int type, AL_CONST char *filename, DATAFILE_PROPE
    DATAFILE *dat = load_datafile(filename);
 
    if (dat) {
+      /* the arrays get edited, which would leave the index stale */
+      destroy_datafile_name_index(dat);
       load_header(dat, datedit_pretty_name(filename, "h", TRUE));
       generate_names(dat, 0);
       dat = extract_info(dat, FALSE);
@@ -435,7 +442,7 @@ static int save_object(DATAFILE *dat, AL_CONST int *fixed_prop, int pack, int pa
       datedit_startmsg("%-28s", get_datafile_property(dat, DAT_NAME));
 
    pack_mputl(dat->type, f);
-   fchunk = pack_fopen_chunk(f, ((!pack) && (pack_kids) && (dat->type != DAT_FILE)));
+   fchunk = pack_fopen_chunk(f, ((!pack) && (dat->type != DAT_FILE)) ? pack_kids : FALSE);
    if (!fchunk) {
       return FALSE;
    }
@@ -488,10 +495,43 @@ static int save_object(DATAFILE *dat, AL_CONST int *fixed_prop, int pack, int pa
 
 
 
+/* saves the hashes of the object names, for find_datafile_object() */
+static int save_name_index(AL_CONST DATAFILE *dat, AL_CONST char *extra_name, PACKFILE *f)
+{
+   PACKFILE *fchunk;
+   int c, size;
+
+   ASSERT(f);
+
+   size = 0;
+   while (dat[size].type != DAT_END)
+      size++;
+
+   pack_mputl(DAT_NAME_INDEX, f);
+   fchunk = pack_fopen_chunk(f, FALSE);
+   if (!fchunk)
+      return FALSE;
+
+   pack_mputl(extra_name ? size+1 : size, fchunk);
+
+   for (c=0; c<size; c++)
+      pack_mputl(_datafile_name_hash(get_datafile_property(dat+c, DAT_NAME)), fchunk);
+
+   if (extra_name)
+      pack_mputl(_datafile_name_hash(extra_name), fchunk);
+
+   pack_fclose_chunk(fchunk);
+   file_datasize += 12 + _packfile_datasize;
+
+   return TRUE;
+}
+
+
+
 /* saves a datafile */
 static int save_datafile(DATAFILE *dat, AL_CONST int *fixed_prop, int pack, int pack_kids, int strip, int sort, int verbose, int extra, PACKFILE *f)
 {
-   int c, size;
+   int c, size, index;
 
    ASSERT(f);
 
@@ -502,13 +542,20 @@ static int save_datafile(DATAFILE *dat, AL_CONST int *fixed_prop, int pack, int
    while (dat[size].type != DAT_END)
       size++;
 
-   pack_mputl(extra ? size+1 : size, f);
+   /* there is no point in an index of stripped names */
+   index = ((file_name_index) && (should_save_prop(DAT_NAME, fixed_prop, strip)));
+
+   pack_mputl(size + (extra ? 1 : 0) + (index ? 1 : 0), f);
 
    for (c=0; c<size; c++) {
       if (!save_object(dat+c, fixed_prop, pack, pack_kids, strip, sort, verbose, f))
 	 return FALSE;
    }
 
+   /* the extra object is the GrabberInfo, which the index comes after */
+   if ((index) && (!extra))
+      return save_name_index(dat, NULL, f);
+
    return TRUE;
 }
 
@@ -952,6 +999,7 @@ DATAFILE *datedit_load_datafile(AL_CONST char *name, int compile_sprites, AL_CON
 	 return NULL;
       }
       else {
+	 destroy_datafile_name_index(datafile);
 	 load_header(datafile, datedit_pretty_name(name, "h", TRUE));
 	 generate_names(datafile, 0);
       }
@@ -1154,12 +1202,95 @@ int datedit_sorttype(int sort)
 
 
 
+/* fixup function for the name index options */
+int datedit_indextype(int index)
+{
+   if (index >= 0) {
+      index = (index == 1 ? TRUE : FALSE);
+      datedit_set_property(&datedit_info, DAT_HASH, index ? "y" : "n");
+
+      return index;
+   }
+   else {
+      AL_CONST char *p = get_datafile_property(&datedit_info, DAT_HASH);
+
+      return (utolower(*p)=='y');  /* no index if HASH property not present */
+   }
+}
+
+
+
+/* copies a datafile, putting the offsets of its objects at the start */
+static int save_offset_table(AL_CONST char *src_name, AL_CONST char *dest_name)
+{
+   DATAFILE_INDEX *index;
+   PACKFILE *src, *dest;
+   char buf[4096];
+   int objects, count, c, n, ret;
+
+   /* the index is counted from the start of the file, and the object
+    * count of this one comes after its two magic numbers. It leaves out
+    * the name index, so the table can be shorter than the count.
+    */
+   index = _create_datafile_index(src_name, &objects);
+   if (!index)
+      return FALSE;
+
+   src = pack_fopen(src_name, F_READ_PACKED);
+   if (!src) {
+      destroy_datafile_index(index);
+      return FALSE;
+   }
+
+   pack_mgetl(src);
+   count = pack_mgetl(src);
+
+   dest = pack_fopen(dest_name, F_WRITE_NOPACK);
+   if (!dest) {
+      pack_fclose(src);
+      destroy_datafile_index(index);
+      return FALSE;
+   }
+
+   pack_mputl(DAT_MAGIC_SEEK, dest);
+   pack_mputl(objects, dest);
+
+   for (c=0; c<objects; c++)
+      pack_mputl(index->offset[c] - 8, dest);
+
+   pack_mputl(count, dest);
+
+   ret = TRUE;
+
+   while ((n = pack_fread(buf, sizeof(buf), src)) > 0) {
+      if (pack_fwrite(buf, n, dest) < n) {
+	 ret = FALSE;
+	 break;
+      }
+   }
+
+   if (pack_ferror(src))
+      ret = FALSE;
+
+   pack_fclose(src);
+
+   if (pack_fclose(dest) != 0)
+      ret = FALSE;
+
+   destroy_datafile_index(index);
+
+   return ret;
+}
+
+
+
 /* saves a datafile */
 int datedit_save_datafile(DATAFILE *dat, AL_CONST char *name, AL_CONST int *fixed_prop, AL_CONST DATEDIT_SAVE_DATAFILE_OPTIONS *options, AL_CONST char *password)
 {
    char *pretty_name;
    char backup_name[256];
-   int pack, strip, sort;
+   char temp_name[256];
+   int pack, strip, sort, seekable;
    PACKFILE *f;
    int ret;
 
@@ -1168,8 +1299,10 @@ int datedit_save_datafile(DATAFILE *dat, AL_CONST char *name, AL_CONST int *fixe
    pack = datedit_packtype(options->pack);
    strip = datedit_striptype(options->strip);
    sort = datedit_sorttype(options->sort);
+   file_name_index = datedit_indextype(options->index);
 
    strcpy(backup_name, datedit_pretty_name(name, "bak", TRUE));
+   strcpy(temp_name, datedit_pretty_name(name, "$$$", TRUE));
    pretty_name = datedit_pretty_name(name, "dat", FALSE);
 
    if (options->write_msg)
@@ -1178,20 +1311,45 @@ int datedit_save_datafile(DATAFILE *dat, AL_CONST char *name, AL_CONST int *fixe
    delete_file(backup_name);
    rename(pretty_name, backup_name);
 
-   f = pack_fopen(pretty_name, (pack >= 2) ? F_WRITE_PACKED : F_WRITE_NOPACK);
+   /* 0 = none, 1 = individual, 2 = global, 3 = individual LZ4, 4 = global LZ4,
+    * 5 = individual with an offset table, 6 = individual LZ4 with an offset
+    * table. The last two are written like 1 and 3 to a temporary file, which
+    * is then copied with the table in front.
+    */
+   seekable = (pack >= 5);
+   if (seekable)
+      pack = (pack == 6) ? 3 : 1;
+
+   if (pack == 4)
+      f = pack_fopen(pretty_name, F_WRITE_LZ4);
+   else if (seekable)
+      f = pack_fopen(temp_name, F_WRITE_NOPACK);
+   else
+      f = pack_fopen(pretty_name, (pack == 2) ? F_WRITE_PACKED : F_WRITE_NOPACK);
 
    if (f) {
-      pack_mputl(DAT_MAGIC, f);
+      /* LZ4 objects get a new magic so that older readers refuse them */
+      pack_mputl((pack == 3) ? DAT_MAGIC_LZ4 : DAT_MAGIC, f);
       file_datasize = 12;
 
-      ret = save_datafile(dat, fixed_prop, (pack >= 2), (pack >= 1), strip, sort, options->verbose, (strip <= 0), f);
+      ret = save_datafile(dat, fixed_prop, ((pack == 2) || (pack == 4)), ((pack == 3) ? F_PACK_LZ4 : (pack >= 1)), strip, sort, options->verbose, (strip <= 0), f);
 
       if ((ret == TRUE) && (strip <= 0)) {
 	 datedit_set_property(&datedit_info, DAT_NAME, "GrabberInfo");
 	 ret = save_object(&datedit_info, NULL, FALSE, FALSE, FALSE, FALSE, FALSE, f);
+
+	 if ((ret == TRUE) && (file_name_index))
+	    ret = save_name_index(dat, "GrabberInfo", f);
       }
 
       pack_fclose(f); 
+
+      if (seekable) {
+	 if (ret == TRUE)
+	    ret = save_offset_table(temp_name, pretty_name);
+
+	 delete_file(temp_name);
+      }
    }
    else
       ret = FALSE;
@@ -43,6 +43,7 @@
 #define DAT_XCRP  DAT_ID('X','C','R','P')
 #define DAT_YCRP  DAT_ID('Y','C','R','P')
 #define DAT_RELF  DAT_ID('R','E','L','F')
+#define DAT_HASH  DAT_ID('H','A','S','H')
 
 
 
@@ -137,6 +138,7 @@ typedef struct DATEDIT_SAVE_DATAFILE_OPTIONS {
    int pack;
    int strip;
    int sort;
+   int index;
    int verbose;
    int write_msg;
    int backup;
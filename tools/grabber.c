@@ -1799,14 +1799,22 @@ static char *pack_getter(int index, int *list_size)
    {
       "No compression",
       "Individual compression",
-      "Global compression"
+      "Global compression",
+      "Individual LZ4 packing",
+      "Global LZ4 packing",
+      "Seekable compression",
+      "Seekable LZ4 packing"
    };
 
    static char *s2[] =
    {
       "Unpacked",
       "Per-object",
-      "Compressed"
+      "Compressed",
+      "Per-object LZ4",
+      "LZ4 packed",
+      "Seekable",
+      "Seekable LZ4"
    };
 
    ASSERT(sizeof(s) / sizeof(s[0]) == sizeof(s2) / sizeof(s2[0]));
@@ -2102,6 +2110,7 @@ static int save(int strip)
       options.pack = -1;
       options.strip = strip;
       options.sort = -1;
+      options.index = -1;
       options.verbose = TRUE;
       options.write_msg = FALSE;
       options.backup = (opt_menu[MENU_BACKUP].flags & D_SELECTED);
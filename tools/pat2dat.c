@@ -2472,6 +2472,7 @@ int main(int argc, char *argv[])
 	 options.pack = opt_compression;
 	 options.strip = 1;
 	 options.sort = 1;
+	 options.index = -1;
 	 options.verbose = (opt_veryverbose || (opt_verbose && opt_compression));
 	 options.write_msg = TRUE;
 	 options.backup = FALSE;
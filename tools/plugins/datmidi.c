@@ -38,6 +38,8 @@ static void *makenew_midi(long *size)
       mid->track[c].len = 0;
    }
 
+   mid->timeline = NULL;
+
    return mid;
 }
 